@@ -130,6 +130,29 @@ CREATE FUNCTION pinecone_delete_unused_indexes() RETURNS int4
 CREATE FUNCTION pinecone_print_index(text) RETURNS int4
 	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
 
+CREATE FUNCTION pinecone_network_stats(OUT requests int8, OUT request_bytes int8, OUT request_bytes_sent int8,
+	OUT response_bytes_received int8, OUT response_bytes int8) RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION pinecone_index_activity(regclass, OUT tuples_appended int8, OUT vectors_flushed int8) RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pinecone_remote_stats(regclass, refresh bool DEFAULT false, OUT vector_count int8, OUT index_fullness float8,
+	OUT refreshed_at timestamptz) RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION pinecone_vector_id(tid, compact bool DEFAULT false) RETURNS text
+	AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION pinecone_vector_tid(text) RETURNS tid
+	AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- pg_stat_progress_create_index with the upload counters of pinecone builds (progress parameters 17 and 18)
+CREATE VIEW pinecone_stat_progress_create_index AS
+	SELECT p.*, s.param18 AS bytes_uploaded, s.param19 AS requests_in_flight
+	FROM pg_stat_progress_create_index p
+	JOIN pg_stat_get_progress_info('CREATE INDEX') s USING (pid);
+
 -- CREATE FUNCTION pinecone_print_index_stats(text) RETURNS int4
 	-- AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
 
@@ -367,6 +390,15 @@ CREATE OPERATOR CLASS text_pinecone_ops
 	OPERATOR 3 = (text, text),
 	OPERATOR 6 != (text, text);
 
+-- sparse indices and values for pinecone, uploaded as sparseValues rather than metadata
+CREATE OPERATOR CLASS int4_array_pinecone_ops
+	DEFAULT FOR TYPE int4[] USING pinecone AS
+	STORAGE int4[];
+
+CREATE OPERATOR CLASS float4_array_pinecone_ops
+	DEFAULT FOR TYPE float4[] USING pinecone AS
+	STORAGE float4[];
+
 -- float opclass for pinecone
 CREATE OPERATOR CLASS float_pinecone_ops
 	DEFAULT FOR TYPE float8 USING pinecone AS
@@ -1,6 +1,10 @@
 #include "pinecone.h"
 
+#include "commands/progress.h"
+#include "optimizer/cost.h"
+#include "postmaster/postmaster.h"
 #include "utils/guc.h"
+#include "utils/memutils.h"
 #include <access/reloptions.h>
 
 
@@ -9,11 +13,27 @@
 #endif
 
 char* pinecone_api_key = NULL;
-int pinecone_top_k = 1000;
+char* pinecone_base_url = NULL;
+int pinecone_top_k = -1; // -1 uses the index's setting
 int pinecone_vectors_per_request = 100;
 int pinecone_requests_per_batch = 40;
-int pinecone_max_buffer_scan = 10000; // maximum number of tuples to search in the buffer
-int pinecone_max_fetched_vectors_for_liveness_check = 10;
+int pinecone_max_buffer_scan = -1; // maximum number of tuples to search in the buffer, -1 uses the index's setting
+int pinecone_max_fetched_vectors_for_liveness_check = -1;
+bool pinecone_buffer_graph = false; // search the unready buffer through an in-memory hnsw graph
+int pinecone_buffer_graph_ef_search = 40;
+int pinecone_buffer_graph_mem = 65536; // kB per index in each backend
+char* pinecone_sparse_query = NULL; // sparse half of hybrid queries as pinecone's sparse vector json, dense queries if empty
+bool pinecone_compress_requests = false;
+bool pinecone_broker = false; // send remote requests through a shared background worker
+int pinecone_broker_max_clients = 100;
+int pinecone_broker_connections = 4; // per host
+char* pinecone_flusher_database = NULL; // database of the background flusher, none if empty
+int pinecone_flusher_naptime = 1; // seconds
+int pinecone_index_slots = PINECONE_DEFAULT_INDEX_SLOTS;
+int pinecone_backpressure = PINECONE_BACKPRESSURE_OFF;
+int pinecone_buffer_soft_limit = 10000; // tuples not yet uploaded
+int pinecone_buffer_hard_limit = 100000;
+int pinecone_backpressure_max_delay = 1000; // ms per insert
 #ifdef PINECONE_MOCK
 bool pinecone_use_mock_response = false;
 #endif
@@ -21,9 +41,34 @@ bool pinecone_use_mock_response = false;
 // todo: principled batch sizes. Do we ever want the buffer to be bigger than a multi-insert? Possibly if we want to let the buffer fill up when the remote index is down.
 static relopt_kind pinecone_relopt_kind;
 
+static const struct config_enum_entry pinecone_backpressure_options[] = {
+    {"off", PINECONE_BACKPRESSURE_OFF, false},
+    {"throttle", PINECONE_BACKPRESSURE_THROTTLE, false},
+    {"reject", PINECONE_BACKPRESSURE_REJECT, false},
+    {NULL, 0, false}
+};
+
+
+/*
+ * cJSON allocates in the current memory context, so resetting the per-scan, per-flush or per-batch context reclaims
+ * every object, printed string and response buffer. Running out of memory raises an ERROR like any palloc, since
+ * cJSON would otherwise silently drop the items it cannot allocate from requests and responses.
+ */
+static void* pinecone_cjson_malloc(size_t size)
+{
+    return MemoryContextAllocExtended(CurrentMemoryContext, size, MCXT_ALLOC_HUGE);
+}
+
+static void pinecone_cjson_free(void* ptr)
+{
+    if (ptr != NULL) pfree(ptr);
+}
 
 void PineconeInit(void)
 {
+    cJSON_Hooks hooks = {pinecone_cjson_malloc, pinecone_cjson_free};
+    cJSON_InitHooks(&hooks);
+
     pinecone_relopt_kind = add_reloption_kind();
     // N.B. The default values are validated when the extension is created, so we have to provide a valid json default
     add_string_reloption(pinecone_relopt_kind, "spec",
@@ -39,40 +84,154 @@ void PineconeInit(void)
     add_bool_reloption(pinecone_relopt_kind, "overwrite",
                             "Delete all vectors in existing index. Host must be specified",
                             false, AccessExclusiveLock);
+    add_bool_reloption(pinecone_relopt_kind, "track_updates",
+                            "Delete the remote vectors of dead rows when the table is vacuumed",
+                            false, AccessExclusiveLock);
     add_bool_reloption(pinecone_relopt_kind, "skip_build",
                             "Do not upload vectors from the base table.",
                             false, AccessExclusiveLock);
+    add_int_reloption(pinecone_relopt_kind, "shards",
+                            "Number of remote indexes or namespaces to spread the vectors across",
+                            1, 1, PINECONE_MAX_SHARDS, AccessExclusiveLock);
+    add_bool_reloption(pinecone_relopt_kind, "namespace_per_partition",
+                            "Store the partitions of a partitioned table in namespaces of a single remote index",
+                            false, AccessExclusiveLock);
+    add_bool_reloption(pinecone_relopt_kind, "async_provisioning",
+                            "Buffer the table instead of waiting for a new remote index to be ready",
+                            false, AccessExclusiveLock);
+    add_bool_reloption(pinecone_relopt_kind, "resume",
+                            "Continue a failed build of this table from its last acknowledged upload",
+                            false, AccessExclusiveLock);
+    add_int_reloption(pinecone_relopt_kind, "flush_interval",
+                            "Seconds after which the background flusher uploads a partial batch, 0 to only upload full batches",
+                            0, 0, 86400, ShareUpdateExclusiveLock);
+    // tuning, stored in the static meta page when the index is built
+    add_int_reloption(pinecone_relopt_kind, "top_k",
+                            "Number of matches requested from the remote index",
+                            PINECONE_DEFAULT_TOP_K, 1, 10000, AccessExclusiveLock);
+    add_int_reloption(pinecone_relopt_kind, "vectors_per_request",
+                            "Number of vectors per upsert request, -1 to use pinecone.vectors_per_request",
+                            -1, -1, 1000, AccessExclusiveLock);
+    add_int_reloption(pinecone_relopt_kind, "requests_per_batch",
+                            "Number of upsert requests per batch, -1 to use pinecone.requests_per_batch",
+                            -1, -1, 100, AccessExclusiveLock);
+    add_int_reloption(pinecone_relopt_kind, "max_buffer_scan",
+                            "Maximum number of buffered tuples searched locally",
+                            PINECONE_DEFAULT_MAX_BUFFER_SCAN, 0, 100000, AccessExclusiveLock);
+    add_int_reloption(pinecone_relopt_kind, "max_fetched_vectors_for_liveness_check",
+                            "Maximum number of checkpoints fetched to find out which batches the remote index has made searchable",
+                            PINECONE_DEFAULT_MAX_FETCHED_VECTORS_FOR_LIVENESS_CHECK, 0, 1000, AccessExclusiveLock);
+    add_bool_reloption(pinecone_relopt_kind, "compact_ids",
+                            "Use 8-character base64url vector ids instead of 12-character hexadecimal ones",
+                            false, AccessExclusiveLock);
     // todo: allow for specifying a hostname instead of asking to create it
     // todo: you can have a relopts_validator which validates the whole relopt set. This could be used to check that exactly one of spec or host is set
     DefineCustomStringVariable("pinecone.api_key", "Pinecone API key", "Pinecone API key",
                               &pinecone_api_key, "", 
                               PGC_SUSET, // restrict to superusers, takes immediate effect and is not saved in the configuration file 
                               0, NULL, NULL, NULL); // todo: you can have a check_hook that checks that the api key is valid.
-    DefineCustomIntVariable("pinecone.top_k", "Pinecone top k", "Pinecone top k",
+    DefineCustomStringVariable("pinecone.base_url", "Pinecone API base url", "Index hosts are reached with the scheme of this url, so an http:// url lets a local server stand in for pinecone",
+                              &pinecone_base_url, "https://api.pinecone.io",
+                              PGC_SUSET, // the api key is sent to it
+                              0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.top_k", "Pinecone top k", "-1 uses the top_k of the index",
                             &pinecone_top_k,
-                            10000, 1, 10000,
+                            -1, -1, 10000,
                             PGC_USERSET,
                             0, NULL, NULL, NULL);
-    DefineCustomIntVariable("pinecone.vectors_per_request", "Pinecone vectors per request", "Pinecone vectors per request",
+    DefineCustomIntVariable("pinecone.vectors_per_request", "Pinecone vectors per request", "Used by indexes built without the vectors_per_request option, and by the request broker",
                             &pinecone_vectors_per_request,
                             100, 1, 1000,
                             PGC_USERSET,
                             0, NULL, NULL, NULL);
-    DefineCustomIntVariable("pinecone.requests_per_batch", "Pinecone requests per batch", "Pinecone requests per batch",
+    DefineCustomIntVariable("pinecone.requests_per_batch", "Pinecone requests per batch", "Used by indexes built without the requests_per_batch option",
                             &pinecone_requests_per_batch,
                             40, 1, 100,
                             PGC_USERSET,
                             0, NULL, NULL, NULL);
-    DefineCustomIntVariable("pinecone.max_buffer_scan", "Pinecone max buffer search", "Pinecone max buffer search",
+    DefineCustomIntVariable("pinecone.max_buffer_scan", "Pinecone max buffer search", "-1 uses the max_buffer_scan of the index",
                             &pinecone_max_buffer_scan,
-                            10000, 0, 100000,
+                            -1, -1, 100000,
                             PGC_USERSET,
                             0, NULL, NULL, NULL);
-    DefineCustomIntVariable("pinecone.max_fetched_vectors_for_liveness_check", "Pinecone max fetched vectors for liveness check", "Pinecone max fetched vectors for liveness check",
+    DefineCustomIntVariable("pinecone.max_fetched_vectors_for_liveness_check", "Pinecone max fetched vectors for liveness check", "-1 uses the max_fetched_vectors_for_liveness_check of the index",
                             &pinecone_max_fetched_vectors_for_liveness_check,
-                            10, 0, 100, // more than 100 is useless and won't fit in the 2048 chars allotted for the URL
+                            -1, -1, 1000, // ids per fetch request, each of which adds about 20 chars to the URL
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("pinecone.buffer_graph", "Search the unflushed buffer with an in-memory HNSW graph", "Search the unflushed buffer with an in-memory HNSW graph",
+                            &pinecone_buffer_graph,
+                            false,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.buffer_graph_ef_search", "Size of the dynamic candidate list for buffer graph search", "Size of the dynamic candidate list for buffer graph search",
+                            &pinecone_buffer_graph_ef_search,
+                            40, 1, 1000,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.buffer_graph_mem", "Maximum memory of the buffer graphs of an index in each backend", "Each backend keeps its own graphs until it exits, so the total is this times the indexes searched times the backends",
+                            &pinecone_buffer_graph_mem,
+                            65536, 1024, MAX_KILOBYTES,
+                            PGC_USERSET,
+                            GUC_UNIT_KB, NULL, NULL, NULL);
+    DefineCustomBoolVariable("pinecone.compress_requests", "Gzip the bodies of upsert requests", "Gzip the bodies of upsert requests",
+                            &pinecone_compress_requests,
+                            false,
                             PGC_USERSET,
                             0, NULL, NULL, NULL);
+    DefineCustomStringVariable("pinecone.sparse_query", "Sparse values of hybrid queries", "Pinecone sparse vector json such as {\"indices\": [1, 7], \"values\": [0.5, 0.2]}. Empty for dense queries",
+                              &pinecone_sparse_query, "",
+                              PGC_USERSET,
+                              0, NULL, NULL, NULL);
+    DefineCustomBoolVariable("pinecone.broker", "Send remote requests through a shared request broker", "Requires the library in shared_preload_libraries",
+                            &pinecone_broker,
+                            false,
+                            PGC_POSTMASTER,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.broker_max_clients", "Maximum number of backends connected to the request broker", "Other backends send their own requests",
+                            &pinecone_broker_max_clients,
+                            100, 1, MAX_BACKENDS,
+                            PGC_POSTMASTER,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.broker_connections", "Maximum number of connections the request broker opens per host", "Requests to the same host are multiplexed over these connections",
+                            &pinecone_broker_connections,
+                            4, 1, 100,
+                            PGC_SIGHUP,
+                            0, NULL, NULL, NULL);
+    DefineCustomStringVariable("pinecone.flusher_database", "Database whose pinecone indexes are flushed by a background worker", "Requires the library in shared_preload_libraries. Empty disables the flusher",
+                              &pinecone_flusher_database, "",
+                              PGC_POSTMASTER,
+                              0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.flusher_naptime", "Seconds between two rounds of the background flusher", "Seconds between two rounds of the background flusher",
+                            &pinecone_flusher_naptime,
+                            1, 1, 3600,
+                            PGC_SIGHUP,
+                            GUC_UNIT_S, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.index_slots", "Number of pinecone indexes whose appends and flushes are coordinated in shared memory at a time", "Indexes beyond this take over the slot of an idle index, or wait for one",
+                            &pinecone_index_slots,
+                            PINECONE_DEFAULT_INDEX_SLOTS, 1, 100000,
+                            PGC_POSTMASTER,
+                            0, NULL, NULL, NULL);
+    DefineCustomEnumVariable("pinecone.backpressure", "What inserts do when the remote index falls behind", "off, throttle (delay inserts) or reject (delay inserts, and reject them past pinecone.buffer_hard_limit)",
+                            &pinecone_backpressure,
+                            PINECONE_BACKPRESSURE_OFF, pinecone_backpressure_options,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.buffer_soft_limit", "Number of buffered tuples not yet uploaded at which inserts start to be delayed", "Number of buffered tuples not yet uploaded at which inserts start to be delayed",
+                            &pinecone_buffer_soft_limit,
+                            10000, 0, INT_MAX,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.buffer_hard_limit", "Number of buffered tuples not yet uploaded at which inserts are throttled to the upsert rate or rejected", "Number of buffered tuples not yet uploaded at which inserts are throttled to the upsert rate or rejected",
+                            &pinecone_buffer_hard_limit,
+                            100000, 1, INT_MAX,
+                            PGC_USERSET,
+                            0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pinecone.backpressure_max_delay", "Maximum delay of a single insert", "Maximum delay of a single insert",
+                            &pinecone_backpressure_max_delay,
+                            1000, 0, 60000,
+                            PGC_USERSET,
+                            GUC_UNIT_MS, NULL, NULL, NULL);
     #ifdef PINECONE_MOCK
     DefineCustomBoolVariable("pinecone.use_mock_response", "Pinecone use mock response", "Pinecone use mock response",
                             &pinecone_use_mock_response,
@@ -81,6 +240,12 @@ void PineconeInit(void)
                             0, NULL, NULL, NULL);
     #endif
     MarkGUCPrefixReserved("pinecone");
+
+    PineconeShmemInit();
+    PineconeBrokerInit();
+    PineconeFlusherInit();
+    PineconeScanInit();
+    RegisterXactCallback(pinecone_xact_callback, NULL);
 }
 
 void no_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
@@ -88,12 +253,34 @@ void no_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 					Selectivity *indexSelectivity, double *indexCorrelation,
 					double *indexPages)
 {
+    // every scan returns the whole index in distance order, and the buffer pages decide how many workers a parallel
+    // scan gets
+    *indexStartupCost = 0;
+    *indexTotalCost = 0;
+    *indexSelectivity = 1.0;
+    *indexCorrelation = 0;
+    *indexPages = path->indexinfo->pages;
+
     // todo: consider running a health check on the remote index and return infinity if it is not healthy
     if (list_length(path->indexorderbycols) == 0 || linitial_int(path->indexorderbycols) != 0) {
         elog(DEBUG1, "Index must be ordered by the first column");
         *indexTotalCost = 1000000;
         return;
     }
+    // hybrid results are in the order of their score, not of the dense distance that merge append compares, so the
+    // children of partitioned and inherited tables and of UNION ALL are sorted by the dense distance instead
+    if (pinecone_sparse_query != NULL && pinecone_sparse_query[0] != '\0' && IS_OTHER_REL(path->indexinfo->rel)) {
+        *indexStartupCost = disable_cost;
+        *indexTotalCost = disable_cost;
+        return;
+    }
+    // a full remote index takes no more flushes, so every scan reads a buffer that only grows; prefer any other plan
+    // while the cached stats say so
+    if (PineconeGetRemoteStats(path->indexinfo->indexoid).index_fullness >= 1.0) {
+        elog(DEBUG1, "The remote index is full");
+        *indexStartupCost = 1000000;
+        *indexTotalCost = 1000000;
+    }
 };
 
 bytea * pinecone_options(Datum reloptions, bool validate)
@@ -102,7 +289,19 @@ bytea * pinecone_options(Datum reloptions, bool validate)
 		{"spec", RELOPT_TYPE_STRING, offsetof(PineconeOptions, spec)},
         {"host", RELOPT_TYPE_STRING, offsetof(PineconeOptions, host)},
         {"overwrite", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, overwrite)},
-        {"skip_build", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, skip_build)}
+        {"skip_build", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, skip_build)},
+        {"resume", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, resume)},
+        {"flush_interval", RELOPT_TYPE_INT, offsetof(PineconeOptions, flush_interval)},
+        {"top_k", RELOPT_TYPE_INT, offsetof(PineconeOptions, top_k)},
+        {"vectors_per_request", RELOPT_TYPE_INT, offsetof(PineconeOptions, vectors_per_request)},
+        {"requests_per_batch", RELOPT_TYPE_INT, offsetof(PineconeOptions, requests_per_batch)},
+        {"max_buffer_scan", RELOPT_TYPE_INT, offsetof(PineconeOptions, max_buffer_scan)},
+        {"max_fetched_vectors_for_liveness_check", RELOPT_TYPE_INT, offsetof(PineconeOptions, max_fetched_vectors_for_liveness_check)},
+        {"compact_ids", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, compact_ids)},
+        {"track_updates", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, track_updates)},
+        {"shards", RELOPT_TYPE_INT, offsetof(PineconeOptions, shards)},
+        {"namespace_per_partition", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, namespace_per_partition)},
+        {"async_provisioning", RELOPT_TYPE_BOOL, offsetof(PineconeOptions, async_provisioning)}
 
 	};
     static bool first_time = true;
@@ -130,6 +329,26 @@ bytea * pinecone_options(Datum reloptions, bool validate)
 	return (bytea *) opts;
 }
 
+/*
+ * Get the name of index build phase
+ */
+char* pinecone_buildphasename(int64 phasenum)
+{
+    switch (phasenum)
+    {
+        case PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE:
+            return "initializing";
+        case PROGRESS_PINECONE_PHASE_CREATE:
+            return "creating remote index";
+        case PROGRESS_PINECONE_PHASE_UPLOAD:
+            return "uploading vectors";
+        case PROGRESS_PINECONE_PHASE_FLUSH:
+            return "uploading final batch";
+        default:
+            return NULL;
+    }
+}
+
 /*
  * Define index handler
  *
@@ -156,7 +375,7 @@ Datum pineconehandler(PG_FUNCTION_ARGS)
     amroutine->amstorage = false;
     amroutine->amclusterable = false;
     amroutine->ampredlocks = false;
-    amroutine->amcanparallel = false;
+    amroutine->amcanparallel = true;
     amroutine->amcaninclude = false;
 #if PG_VERSION_NUM >= 130000
     amroutine->amusemaintenanceworkmem = false; /* not used during VACUUM */
@@ -176,7 +395,7 @@ Datum pineconehandler(PG_FUNCTION_ARGS)
     amroutine->amcostestimate = no_costestimate;
     amroutine->amoptions = pinecone_options;
     amroutine->amproperty = NULL;            /* TODO AMPROP_DISTANCE_ORDERABLE */
-    amroutine->ambuildphasename = NULL;      // maps build phase number to name
+    amroutine->ambuildphasename = pinecone_buildphasename;      // maps build phase number to name
     amroutine->amvalidate = no_validate; // check that the operator class is valid (provide the opclass's object id)
 #if PG_VERSION_NUM >= 140000
     amroutine->amadjustmembers = NULL;
@@ -185,14 +404,14 @@ Datum pineconehandler(PG_FUNCTION_ARGS)
     amroutine->amrescan = pinecone_rescan;
     amroutine->amgettuple = pinecone_gettuple;
     amroutine->amgetbitmap = NULL; // an alternative to amgettuple that returns a bitmap of matching tuples
-    amroutine->amendscan = no_endscan;
+    amroutine->amendscan = pinecone_endscan;
     amroutine->ammarkpos = NULL;
     amroutine->amrestrpos = NULL;
 
     /* Interface functions to support parallel index scans */
-    amroutine->amestimateparallelscan = NULL;
-    amroutine->aminitparallelscan = NULL;
-    amroutine->amparallelrescan = NULL;
+    amroutine->amestimateparallelscan = pinecone_estimateparallelscan;
+    amroutine->aminitparallelscan = pinecone_initparallelscan;
+    amroutine->amparallelrescan = pinecone_parallelrescan;
 
     PG_RETURN_POINTER(amroutine);
 }
@@ -13,6 +13,14 @@
 #include <utils/array.h>
 #include "access/relscan.h"
 #include "storage/block.h"
+#include "lib/binaryheap.h"
+#include "access/parallel.h"
+#include "port/atomics.h"
+#include "storage/condition_variable.h"
+#include "storage/spin.h"
+#include "storage/lwlock.h"
+#include "access/xact.h"
+#include "datatype/timestamp.h"
 
 #define PINECONE_DEFAULT_BUFFER_THRESHOLD 2000
 #define PINECONE_MIN_BUFFER_THRESHOLD 1
@@ -24,6 +32,23 @@
 
 #define INVALID_CHECKPOINT_NUMBER -1
 
+// what inserts do when the buffer that queries scan locally grows past pinecone.buffer_soft_limit
+typedef enum PineconeBackpressurePolicy
+{
+    PINECONE_BACKPRESSURE_OFF,
+    PINECONE_BACKPRESSURE_THROTTLE, // delay inserts, up to the upsert rate at the hard limit
+    PINECONE_BACKPRESSURE_REJECT // throttle up to the hard limit and reject inserts past it
+} PineconeBackpressurePolicy;
+#define PINECONE_UPSERT_RATE_WEIGHT 0.2 // weight of the latest sample in upsert_rate
+
+// build phases; PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1
+#define PROGRESS_PINECONE_PHASE_CREATE 2
+#define PROGRESS_PINECONE_PHASE_UPLOAD 3
+#define PROGRESS_PINECONE_PHASE_FLUSH 4
+// extra build progress parameters, in the slots CREATE INDEX leaves unused
+#define PROGRESS_PINECONE_BYTES_UPLOADED 17
+#define PROGRESS_PINECONE_REQUESTS_IN_FLIGHT 18
+
 #define PineconePageGetOpaque(page)	((PineconeBufferOpaque) PageGetSpecialPointer(page))
 #define PineconePageGetStaticMeta(page)	((PineconeStaticMetaPage) PageGetContents(page))
 #define PineconePageGetBufferMeta(page)    ((PineconeBufferMetaPage) PageGetContents(page))
@@ -32,6 +57,8 @@
 
 #define PINECONE_NAME_MAX_LENGTH 45
 #define PINECONE_HOST_MAX_LENGTH 100
+#define PINECONE_NAMESPACE_MAX_LENGTH 16
+#define PINECONE_MAX_SHARDS 8
 
 #define DEFAULT_SPEC "{}"
 #define DEFAULT_HOST ""
@@ -52,32 +79,142 @@ typedef struct PineconeScanOpaqueData
     char* bloom_filter;
     size_t bloom_filter_size;
 
+    // parallel scans: the shared state in the DSM, and whether this participant queries the remote index
+    struct PineconeParallelScanData* pscan;
+    bool remote_owner;
+    struct dsm_segment* bloom_segment; // of the bloom filter shared by the participants
+
     // support functions
     FmgrInfo *procinfo;
 
-    // results
-    cJSON* pinecone_results;
+    // hybrid queries: the sparse query of pinecone.sparse_query sorted by index, and the sparse columns of the index
+    bool hybrid;
+    int sparse_attno;
+    int n_sparse;
+    int32* sparse_indices;
+    float4* sparse_values;
+
+    // memory for the remote responses and the buffer scan, reset on every rescan
+    MemoryContext scan_ctx;
+
+    // buffer graph: the buffer tuples put into the sortstate, and what its fallback to an exhaustive scan needs
+    ItemPointerData* graph_tids;
+    int n_graph_tids;
+    int max_graph_tids;
+    bool graph_truncated; // a segment had more elements than ef_search
+    BlockNumber graph_start_blkno;
+    Datum graph_query;
+
+    // results: the next unreturned match of each shard, merged through a heap ordered by distance
+    int n_shards;
+    cJSON** shard_results;
+    double* shard_distances;
+    binaryheap* shard_heap;
 
 } PineconeScanOpaqueData;
 typedef PineconeScanOpaqueData *PineconeScanOpaque;
 
 extern const char* vector_metric_to_pinecone_metric[VECTOR_METRIC_COUNT];
 
+// tuning of an index, stored when it is built and changed by ALTER INDEX SET; the session's GUCs override the query-side settings
+typedef struct PineconeSettings
+{
+    int top_k;
+    int vectors_per_request;
+    int requests_per_batch;
+    int max_buffer_scan;
+    int max_fetched_vectors_for_liveness_check;
+    bool compact_ids; // base64url instead of hex vector ids
+    bool track_updates; // delete the vectors of dead rows when the table is vacuumed
+} PineconeSettings;
+#define PINECONE_HEX_ID_LENGTH 12
+#define PINECONE_COMPACT_ID_LENGTH 8
+#define PINECONE_ID_BUFFER_SIZE (PINECONE_HEX_ID_LENGTH + 1)
+
+#define PINECONE_DEFAULT_TOP_K 10000
+#define PINECONE_DEFAULT_VECTORS_PER_REQUEST 100
+#define PINECONE_DEFAULT_REQUESTS_PER_BATCH 40
+#define PINECONE_DEFAULT_MAX_BUFFER_SCAN 10000
+#define PINECONE_DEFAULT_MAX_FETCHED_VECTORS_FOR_LIVENESS_CHECK 10
+
 typedef struct PineconeStaticMetaPageData
 {
     int dimensions;
     char host[PINECONE_HOST_MAX_LENGTH + 1];
     char pinecone_index_name[PINECONE_NAME_MAX_LENGTH + 1];
     VectorMetric metric;
+    // sharding; n_shards is 0 for indexes built before sharding, which have a single shard on host
+    int n_shards;
+    bool shard_by_namespace; // all shards live on host, in namespaces shard-0, shard-1, ...
+    char shard_hosts[PINECONE_MAX_SHARDS][PINECONE_HOST_MAX_LENGTH + 1];
+    char partition_namespace[NAMEDATALEN]; // namespace of a partition in the remote index it shares with its siblings, empty if none
+    bool provisioning; // the remote index is not ready yet; the buffer holds every vector until a flush finds it ready
+    // settings; has_settings is false for indexes built before they were stored, which use the defaults
+    bool has_settings;
+    PineconeSettings settings;
 } PineconeStaticMetaPageData;
 typedef PineconeStaticMetaPageData *PineconeStaticMetaPage;
+// durable progress of a build, kept in a file outside the index so that it survives the rollback of a failed build
+typedef struct PineconeBuildProgress
+{
+    char path[MAXPGPATH];
+    char host[PINECONE_MAX_SHARDS * (PINECONE_HOST_MAX_LENGTH + 1)]; // the host reloption, or the host of the created index
+    char pinecone_index_name[PINECONE_NAME_MAX_LENGTH + 1];
+    BlockNumber next_blkno; // every heap block before this one has been upserted and acknowledged
+    int64 indtuples; // number of vectors in those blocks
+} PineconeBuildProgress;
+
 typedef struct PineconeBuildState
 {
     int64 indtuples; // total number of tuples indexed
     cJSON *json_vectors; // array of json vectors
-    char host[100];
+    PineconeShard *shards;
+    int n_shards;
+    MemoryContext tmpCtx; // holds the current batch of json vectors, reset after each upsert
+    PineconeBuildProgress *progress; // NULL unless this scan records resumable progress
+    BlockNumber current_blkno; // heap block of the last vector added to the batch
+    int64 current_block_tuples; // vectors of current_blkno, which a resumed build uploads again
+    int64 resumed_tuples; // vectors in the blocks that the build being resumed already uploaded
+    struct PineconeShared *pineconeshared; // NULL unless this is a participant of a parallel build
+    bool report_progress; // whether this backend reports the progress of the build
+    int64 bytes_uploaded;
+    PineconeSettings settings;
+    struct PineconeBufferTuple *buffer_tuples; // tuples not yet appended by a build that only fills the buffer
+    int n_buffer_tuples;
 } PineconeBuildState;
 
+// shared state of a parallel build; every participant uploads the part of the heap it scans
+typedef struct PineconeShared
+{
+    // immutable state
+    Oid heaprelid;
+    Oid indexrelid;
+    bool isconcurrent;
+    // worker progress
+    ConditionVariable workersdonecv;
+    // mutex for mutable state
+    slock_t mutex;
+    // mutable state
+    int nparticipantsdone;
+    double reltuples;
+    double indtuples;
+    // progress of all participants, reported by the leader
+    pg_atomic_uint64 tuplesdone;
+    pg_atomic_uint64 bytesuploaded;
+} PineconeShared;
+
+#define ParallelTableScanFromPineconeShared(shared) \
+    (ParallelTableScanDesc) ((char *) (shared) + BUFFERALIGN(sizeof(PineconeShared)))
+
+typedef struct PineconeLeader
+{
+    ParallelContext *pcxt;
+    int nparticipants;
+    PineconeShared *pineconeshared;
+    Snapshot snapshot;
+} PineconeLeader;
+
+
 typedef struct PineconeOptions
 {
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
@@ -85,6 +222,18 @@ typedef struct PineconeOptions
     int         host;
     bool        overwrite; // todo: should this be int?
     bool        skip_build;
+    int         shards;
+    bool        resume;
+    int         flush_interval; // seconds, 0 to flush only full batches
+    int         top_k;
+    int         vectors_per_request; // -1 to use pinecone.vectors_per_request
+    int         requests_per_batch; // -1 to use pinecone.requests_per_batch
+    int         max_buffer_scan;
+    int         max_fetched_vectors_for_liveness_check;
+    bool        compact_ids;
+    bool        track_updates;
+    bool        namespace_per_partition; // partitions share a remote index, each in its own namespace
+    bool        async_provisioning; // build without waiting for the remote index to be ready
 }			PineconeOptions;
 
 typedef struct PineconeCheckpoint
@@ -96,6 +245,49 @@ typedef struct PineconeCheckpoint
     bool is_checkpoint;
 } PineconeCheckpoint;
 
+// shared state of an index, see pinecone_shmem.c
+#define PINECONE_DEFAULT_INDEX_SLOTS 128
+// describe_index_stats of the remote index, summed over its shards
+#define PINECONE_STATS_REFRESH_INTERVAL 60 // seconds after which the flusher, or a flush where no flusher runs, refreshes the stats of an index
+#define PINECONE_PROVISIONING_CHECK_INTERVAL 10 // seconds between two describe_index calls for a remote index that is not ready
+typedef struct PineconeRemoteStats
+{
+    int64 vector_count;
+    double index_fullness; // of the fullest shard; always 0 for serverless indexes
+    TimestampTz refreshed_at; // 0 if the stats were never fetched
+} PineconeRemoteStats;
+
+typedef struct PineconeIndexSlot
+{
+    Oid dbid;
+    Oid indexid; // InvalidOid if the slot is free
+    LWLock append_lock;
+    pg_atomic_uint32 flush_owner; // pid of the backend flushing the index, 0 if none
+    // activity since the slot was taken
+    pg_atomic_uint64 tuples_appended;
+    pg_atomic_uint64 vectors_flushed;
+    slock_t mutex; // protects standby_ready_checkpoint, remote_stats and provisioning_checked_at
+    PineconeCheckpoint standby_ready_checkpoint; // liveness found by the scans of a standby, which cannot write the buffer meta page
+    PineconeRemoteStats remote_stats; // cached for the planner and the flushes, which leave the refresh to the flusher
+    TimestampTz provisioning_checked_at; // last describe_index of an async_provisioning index, 0 if none
+} PineconeIndexSlot;
+
+// search for the newest checkpoint that is searchable remotely, see liveness_search_begin
+#define PINECONE_LIVENESS_MAX_ROUNDS 8
+typedef struct PineconeLivenessSearch
+{
+    PineconeCheckpoint* checkpoints; // between the flush and the ready checkpoint, newest first
+    int n_checkpoints;
+    int lo; // the checkpoints before lo are not live
+    int hi; // the newest checkpoint known to be live, n_checkpoints if none
+    int max_probes;
+    int* probes; // positions fetched by the current round, newest first
+    int n_probes;
+    int rounds;
+    int n_shards;
+    ItemPointerData* markers; // n_shards per probe of the current round, see PineconeGetCheckpointMarkers
+} PineconeLivenessSearch;
+
 typedef struct PineconeBufferMetaPageData
 {
     // FIFO pointers
@@ -106,6 +298,8 @@ typedef struct PineconeBufferMetaPageData
     // INSERT PAGE
     BlockNumber insert_page;
     int n_tuples_since_last_checkpoint; // (does not include the tuples in the insert page)
+    TimestampTz uncheckpointed_since; // append time of the first tuple after the latest checkpoint, 0 if there is none
+    float4 upsert_rate; // vectors acknowledged per second by flushes, exponentially weighted; 0 until the first flush
 } PineconeBufferMetaPageData;
 typedef PineconeBufferMetaPageData *PineconeBufferMetaPage;
 
@@ -127,15 +321,34 @@ typedef struct PineconeBufferTuple
     int16 flags;
 } PineconeBufferTuple;
 #define PINECONE_BUFFER_TUPLE_VACUUMED 1 << 0
+#define PINECONE_BUFFER_TUPLE_MOVED 1 << 2 // a flush appended a copy to the end of the buffer, see MoveDeferredTuples
+// number of plain tuples that fit on a buffer page
+#define PINECONE_PAGE_TUPLES ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(PineconeBufferOpaqueData))) / (MAXALIGN(sizeof(PineconeBufferTuple)) + sizeof(ItemIdData)))
 
 // GUC variables
 extern char* pinecone_api_key;
+extern char* pinecone_base_url;
 extern int pinecone_top_k;
 extern int pinecone_vectors_per_request;
 extern int pinecone_requests_per_batch;
 extern int pinecone_max_buffer_scan;
 extern int pinecone_max_fetched_vectors_for_liveness_check;
-#define PINECONE_BATCH_SIZE pinecone_vectors_per_request * pinecone_requests_per_batch
+extern bool pinecone_buffer_graph;
+extern char* pinecone_sparse_query;
+extern int pinecone_buffer_graph_ef_search;
+extern int pinecone_buffer_graph_mem;
+extern bool pinecone_compress_requests;
+extern bool pinecone_broker;
+extern int pinecone_broker_max_clients;
+extern int pinecone_broker_connections;
+extern char* pinecone_flusher_database;
+extern int pinecone_backpressure;
+extern int pinecone_buffer_soft_limit;
+extern int pinecone_buffer_hard_limit;
+extern int pinecone_backpressure_max_delay;
+extern int pinecone_flusher_naptime;
+extern int pinecone_index_slots;
+#define PINECONE_BATCH_SIZE(settings) ((settings).vectors_per_request * (settings).requests_per_batch)
 // GUC variables for testing
 #ifdef PINECONE_MOCK
 extern bool pinecone_use_mock_response;
@@ -156,38 +369,83 @@ void no_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 void generateRandomAlphanumeric(char *s, const int length);
 char* get_pinecone_index_name(Relation index);
 IndexBuildResult *pinecone_build(Relation heap, Relation index, IndexInfo *indexInfo);
+char* pinecone_buildphasename(int64 phasenum);
 char* CreatePineconeIndexAndWait(Relation index, cJSON* spec_json, VectorMetric metric, char* pinecone_index_name, int dimensions);
-void InsertBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, char* host, IndexBuildResult *result);
+bool PineconeFinishProvisioning(Relation index);
+void InsertBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, PineconeBuildProgress *progress, IndexBuildResult *result);
 void pinecone_build_callback(Relation index, ItemPointer tid, Datum *values, bool *isnull, bool tupleIsAlive, void *state);
-void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *pinecone_index_name, char *host, int forkNum);
+PGDLLEXPORT void PineconeParallelBuildMain(dsm_segment *seg, shm_toc *toc);
+void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *pinecone_index_name, char **hosts, int n_shards, bool shard_by_namespace, const char *partition_namespace, bool provisioning, int forkNum);
 void pinecone_buildempty(Relation index);
 void no_buildempty(Relation index); // for some reason this is never called even when the base table is empty
 VectorMetric get_opclass_metric(Relation index);
 
 // insert
-bool AppendBufferTupleInCtx(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel, IndexUniqueCheck checkUnique, IndexInfo *indexInfo);
 void PineconePageInit(Page page, Size pageSize);
-bool AppendBufferTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel);
+PineconeBufferTuple PineconeMakeBufferTuple(ItemPointer heap_tid);
+bool AppendBufferTuples(Relation index, PineconeBufferTuple *tuples, int n_tuples);
+void PineconeAppendPendingTuples(Relation index);
 bool pinecone_insert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
                      Relation heap, IndexUniqueCheck checkUnique, 
 #if PG_VERSION_NUM >= 140000
                      bool indexUnchanged, 
 #endif
                      IndexInfo *indexInfo);
-void FlushToPinecone(Relation index);
+int FlushToPinecone(Relation index);
+void FlushToPineconeInCtx(Relation index, bool wait);
+void FlushAtCommit(Relation index);
+void pinecone_xact_callback(XactEvent event, void *arg);
+bool PineconeForceCheckpoint(Relation index);
 
 // scan
+void PineconeScanInit(void);
 IndexScanDesc pinecone_beginscan(Relation index, int nkeys, int norderbys);
 cJSON* pinecone_build_filter(Relation index, ScanKey keys, int nkeys);
 void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
 void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_datum, TupleDesc index_tupdesc);
+void pinecone_bloom_filter_add(PineconeScanOpaque so, ItemPointerData tid);
+bool pinecone_bloom_filter_contains(PineconeScanOpaque so, ItemPointerData tid);
 bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir);
-void no_endscan(IndexScanDesc scan);
-PineconeCheckpoint* get_checkpoints_to_fetch(Relation index);
-PineconeCheckpoint get_best_fetched_checkpoint(Relation index, PineconeCheckpoint* checkpoints, cJSON* fetch_results);
-cJSON *fetch_ids_from_checkpoints(PineconeCheckpoint *checkpoints);
+void pinecone_endscan(IndexScanDesc scan);
+Size pinecone_estimateparallelscan(void);
+void pinecone_initparallelscan(void *target);
+void pinecone_parallelrescan(IndexScanDesc scan);
+PineconeCheckpoint* get_checkpoints_to_fetch(Relation index, int* n_checkpoints);
+void liveness_search_begin(Relation index, PineconeLivenessSearch* search);
+bool liveness_search_done(PineconeLivenessSearch* search);
+cJSON* liveness_search_next_ids(Relation index, PineconeLivenessSearch* search);
+void liveness_search_update(PineconeLivenessSearch* search, cJSON* fetch_results);
+PineconeCheckpoint liveness_search_result(PineconeLivenessSearch* search);
 #define BUFFER_BLOOM_K 20 // bloom filter k 
 
+// request broker
+void PineconeBrokerInit(void);
+PGDLLEXPORT void PineconeBrokerMain(Datum main_arg);
+
+// shared state
+void PineconeShmemInit(void);
+PineconeIndexSlot* PineconeGetIndexSlot(Relation index);
+PineconeIndexSlot* PineconeLockAppend(Relation index);
+void PineconeUnlockAppend(PineconeIndexSlot *slot);
+PineconeIndexSlot* PineconeTryClaimFlush(Relation index);
+void PineconeReleaseFlush(PineconeIndexSlot *slot);
+PineconeCheckpoint PineconeGetStandbyReadyCheckpoint(Relation index);
+void PineconeSetStandbyReadyCheckpoint(Relation index, PineconeCheckpoint checkpoint);
+PineconeRemoteStats PineconeGetRemoteStats(Oid indexid);
+void PineconeSetRemoteStats(Relation index, PineconeRemoteStats stats);
+void PineconeGetIndexActivity(Oid indexid, int64 *tuples_appended, int64 *vectors_flushed);
+PineconeRemoteStats PineconeRefreshRemoteStats(Relation index);
+bool PineconeClaimProvisioningCheck(Relation index);
+
+// background flusher
+void PineconeFlusherInit(void);
+bool PineconeFlusherServesDatabase(void);
+PGDLLEXPORT void PineconeFlusherMain(Datum main_arg);
+
+// buffer graph
+void PineconeBufferGraphSearch(Relation index, PineconeScanOpaque so, Datum query_datum, PineconeBufferMetaPageData buffer_meta);
+bool PineconeBufferGraphFallback(Relation index, PineconeScanOpaque so);
+
 
 
 // vacuum
@@ -205,12 +463,17 @@ bool no_validate(Oid opclassoid);
 // utils
 // converting between postgres tuples and json vectors
 cJSON* tuple_get_pinecone_vector(TupleDesc tup_desc, Datum *values, bool *isnull, char *vector_id);
+int pinecone_sparse_attno(TupleDesc tup_desc);
+void pinecone_sparse_values(Datum indices_datum, Datum values_datum, int32 **indices, float4 **values, int *n);
 cJSON* index_tuple_get_pinecone_vector(Relation index, IndexTuple itup);
 cJSON* heap_tuple_get_pinecone_vector(Relation heap, HeapTuple htup);
 char* pinecone_id_from_heap_tid(ItemPointerData heap_tid);
 ItemPointerData pinecone_id_get_heap_tid(char *id);
+void pinecone_id_encode(ItemPointerData heap_tid, bool compact, char *buf);
+bool pinecone_id_decode(const char *id, ItemPointer heap_tid);
 // read and write meta pages
 PineconeStaticMetaPageData PineconeSnapshotStaticMeta(Relation index);
+PineconeSettings PineconeGetSettings(Relation index);
 PineconeBufferMetaPageData PineconeSnapshotBufferMeta(Relation index);
 PineconeBufferOpaqueData PineconeSnapshotBufferOpaque(Relation index, BlockNumber blkno);
 void set_buffer_meta_page(Relation index, PineconeCheckpoint* ready_checkpoint, PineconeCheckpoint* flush_checkpoint, PineconeCheckpoint* latest_checkpoint, BlockNumber* insert_page, int* n_tuples_since_last_checkpoint);
@@ -221,6 +484,11 @@ void pinecone_print_relation(Relation index);
 // hashing and bloom filters
 uint64 murmurhash64(uint64 data);
 uint32 hash_tid(ItemPointerData tid, int seed);
+// sharding
+PineconeShard* PineconeGetShards(PineconeStaticMetaPageData* static_meta, int* n_shards);
+int pinecone_shard_for_tid(ItemPointerData tid, int n_shards);
+int pinecone_shard_for_id(const char* id, int n_shards);
+void PineconeGetCheckpointMarkers(Relation index, PineconeCheckpoint checkpoint, int n_shards, ItemPointerData* markers);
 
 // helpers
 Oid get_index_oid_from_name(char* index_name);
@@ -1,6 +1,14 @@
 #include "pinecone_api.h"
 #include "pinecone.h"
 #include "postgres.h"
+#include "commands/progress.h"
+#include "pgstat.h"
+#include "lib/stringinfo.h"
+#include "utils/memutils.h"
+#if PG_VERSION_NUM >= 140000
+#include "utils/backend_progress.h"
+#include "utils/backend_status.h"
+#endif
 
 #include <stdio.h>
 #include <string.h>
@@ -10,30 +18,41 @@
 #include <time.h>
 
 #include <stdlib.h>
+#include <zlib.h>
 
+PineconeNetworkCounters pinecone_network_counters = {0, 0, 0, 0, 0};
 
 
 size_t write_callback(char *contents, size_t size, size_t nmemb, void *userdata) {
     size_t real_size = size * nmemb; // Size of the response
     ResponseData *response_data = (ResponseData *)userdata; // Cast the userdata to the specific structure
 
-    // Attempt to resize the buffer
-    char *new_data = realloc(response_data->data, response_data->length + real_size + 1);
-    if (new_data != NULL) {
+    // Grow the buffer geometrically. We must not ereport from inside curl, so a failed allocation aborts the transfer instead
+    if (response_data->length + real_size + 1 > response_data->capacity) {
+        size_t new_capacity = Max(response_data->capacity * 2, response_data->length + real_size + 1);
+        char *new_data = MemoryContextAllocExtended(CurrentMemoryContext, new_capacity, MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+        if (new_data == NULL) {
+            return 0; // curl fails the transfer with CURLE_WRITE_ERROR
+        }
+        if (response_data->data != NULL) {
+            memcpy(new_data, response_data->data, response_data->length);
+            pfree(response_data->data);
+        }
         response_data->data = new_data;
-        memcpy(response_data->data + response_data->length, contents, real_size); // Append new data
-        response_data->length += real_size;
-        response_data->data[response_data->length] = '\0'; // Null terminate the string
+        response_data->capacity = new_capacity;
     }
+    memcpy(response_data->data + response_data->length, contents, real_size); // Append new data
+    response_data->length += real_size;
+    response_data->data[response_data->length] = '\0'; // Null terminate the string
 
     if (response_data->request_body != NULL) {
         // free the request body
         elog(DEBUG1, "Freeing request body");
-        free(response_data->request_body);
+        pfree(response_data->request_body);
         response_data->request_body = NULL; // so that subsequent calls to write_callback don't free the request body again
     }
 
-    elog(DEBUG1, "Response (write_callback): %s", contents);
+    elog(DEBUG1, "Response (write_callback): %.*s", (int) real_size, contents);
 
     return real_size;
 }
@@ -48,21 +67,82 @@ struct curl_slist *create_common_headers(const char *api_key) {
 }
 
 void set_curl_options(CURL *hnd, const char *api_key, const char *url, const char *method, ResponseData *response_data) {
-    struct curl_slist *headers = create_common_headers(api_key);
-    curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, headers);
+    free_request_headers(response_data);
+    response_data->headers = create_common_headers(api_key);
+    curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, response_data->headers);
     curl_easy_setopt(hnd, CURLOPT_CUSTOMREQUEST, method);
     curl_easy_setopt(hnd, CURLOPT_URL, url);
     curl_easy_setopt(hnd, CURLOPT_WRITEDATA, response_data);
     curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(hnd, CURLOPT_ACCEPT_ENCODING, ""); // accept any compression curl supports; responses are decoded before write_callback
     strcpy(response_data->method, method); // save the method in the response_data
 }
 
+/*
+ * curl keeps using the header list until the handle is reset or cleaned up, so call this only afterwards
+ */
+void free_request_headers(ResponseData *response_data) {
+    curl_slist_free_all(response_data->headers);
+    response_data->headers = NULL;
+}
+
+static void count_request(size_t body_length, size_t sent_length) {
+    pinecone_network_counters.request_bytes += body_length;
+    pinecone_network_counters.request_bytes_sent += sent_length;
+}
+
+// call after the transfer and before the handle is reset
+static void count_response(CURL *hnd, ResponseData *response_data) {
+    curl_off_t received = 0;
+    curl_easy_getinfo(hnd, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    pinecone_network_counters.requests++;
+    pinecone_network_counters.response_bytes_received += received;
+    pinecone_network_counters.response_bytes += response_data->length;
+}
+
+/*
+ * Show the number of unfinished upserts of an index build in pg_stat_progress_create_index
+ */
+static void report_requests_in_flight(int running) {
+    if (MyBEEntry != NULL && MyBEEntry->st_progress_command == PROGRESS_COMMAND_CREATE_INDEX) {
+        pgstat_progress_update_param(PROGRESS_PINECONE_REQUESTS_IN_FLIGHT, running);
+    }
+}
+
+/*
+ * gzip a request body. The result is palloc'd like the cJSON_Print string it replaces.
+ */
+static char* gzip_body(const char *body, size_t body_length, size_t *compressed_length) {
+    z_stream stream;
+    uLong bound;
+    char *compressed;
+    memset(&stream, 0, sizeof(stream));
+    // windowBits 15 + 16 writes a gzip header instead of a zlib one; favor speed since we are bandwidth bound, not cpu bound
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        elog(ERROR, "Failed to initialize gzip compression");
+    }
+    bound = deflateBound(&stream, body_length);
+    compressed = palloc(bound);
+    stream.next_in = (Bytef *) body;
+    stream.avail_in = body_length;
+    stream.next_out = (Bytef *) compressed;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        pfree(compressed);
+        elog(ERROR, "Failed to compress request body");
+    }
+    *compressed_length = stream.total_out;
+    deflateEnd(&stream);
+    return compressed;
+}
+
 // Declare the CURL handle as a global variable
 CURL *hnd_t;
 
 cJSON* generic_pinecone_request(const char *api_key, const char *url, const char *method, cJSON *body) {
     // CURL *hnd = curl_easy_init();
-    ResponseData response_data = {"", NULL, NULL, 0, ""};
+    ResponseData response_data = {"", NULL, NULL, 0, 0, "", 0, false, 0, NULL};
     cJSON *response_json, *error;
     CURLcode ret;
 
@@ -79,7 +159,9 @@ cJSON* generic_pinecone_request(const char *api_key, const char *url, const char
     set_curl_options(hnd_t, api_key, url, method, &response_data);
     if (body != NULL) {
         char* body_str = cJSON_Print(body);
+        count_request(strlen(body_str), strlen(body_str));
         response_data.request_body = body_str;
+        response_data.request_length = strlen(body_str);
         curl_easy_setopt(hnd_t, CURLOPT_POSTFIELDS, body_str);
     }
 
@@ -91,13 +173,20 @@ cJSON* generic_pinecone_request(const char *api_key, const char *url, const char
         elog(DEBUG1, "Mock response ret: %d", ret);
     } else {
     #endif
-    ret = curl_easy_perform(hnd_t);
+    {
+        ResponseData *response_data_list[1] = {&response_data};
+        if (!PineconeBrokerPerform(api_key, 1, &hnd_t, response_data_list, &ret)) {
+            ret = curl_easy_perform(hnd_t);
+            count_response(hnd_t, &response_data);
+        }
+    }
     #ifdef PINECONE_MOCK
     }
     #endif
 
     // cleanup
     curl_easy_reset(hnd_t);
+    free_request_headers(&response_data);
 
 
     // TODO: We need check the ret code in the other endpoints as well
@@ -118,56 +207,135 @@ cJSON* generic_pinecone_request(const char *api_key, const char *url, const char
     return response_json;
 }
 
+/*
+ * The urls of the control plane and of index hosts. pinecone.base_url stands in for the control plane, and index
+ * hosts are reached with its scheme, so that a local server can stand in for pinecone over plain http.
+ */
+void pinecone_control_url(char *url, size_t size, const char *path) {
+    snprintf(url, size, "%s%s", pinecone_base_url, path);
+}
+
+void pinecone_host_url(char *url, size_t size, const char *host, const char *path) {
+    const char *scheme = strncmp(pinecone_base_url, "http://", strlen("http://")) == 0 ? "http://" : "https://";
+    snprintf(url, size, "%s%s%s", scheme, host, path);
+}
+
 /*
  * returns a json object with the index's metadata
  * https://docs.pinecone.io/reference/describe_index
  */
 cJSON* describe_index(const char *api_key, const char *index_name) {
-    char url[100] = "https://api.pinecone.io/indexes/"; strcat(url, index_name);
+    char url[PINECONE_URL_MAX_LENGTH];
+    char path[PINECONE_URL_MAX_LENGTH];
+    snprintf(path, sizeof(path), "/indexes/%s", index_name);
+    pinecone_control_url(url, sizeof(url), path);
     return generic_pinecone_request(api_key, url, "GET", NULL);
 }
 
 cJSON* pinecone_get_index_stats(const char *api_key, const char *index_host) {
     cJSON* resp;
-    char url[100] = "https://"; strcat(url, index_host); strcat(url, "/describe_index_stats");
+    char url[PINECONE_URL_MAX_LENGTH];
+    pinecone_host_url(url, sizeof(url), index_host, "/describe_index_stats");
     resp = generic_pinecone_request(api_key, url, "GET", NULL);
     return resp;
 }
 
 cJSON* list_indexes(const char *api_key) {
     cJSON* response_json;
-    response_json = generic_pinecone_request(api_key, "https://api.pinecone.io/indexes", "GET", NULL);
+    char url[PINECONE_URL_MAX_LENGTH];
+    pinecone_control_url(url, sizeof(url), "/indexes");
+    response_json = generic_pinecone_request(api_key, url, "GET", NULL);
     return cJSON_GetObjectItemCaseSensitive(response_json, "indexes");
 }
 
 cJSON* pinecone_delete_vectors(const char *api_key, const char *index_host, cJSON *ids) {
     cJSON *request = cJSON_CreateObject();
-    char url[300];
-    sprintf(url, "https://%s/vectors/delete", index_host);
+    char url[PINECONE_URL_MAX_LENGTH];
+    pinecone_host_url(url, sizeof(url), index_host, "/vectors/delete");
     cJSON_AddItemToObject(request, "ids", ids);
     return generic_pinecone_request(api_key, url, "POST", request);
 }
 
+/*
+ * Delete vectors by id from the shards that hold them, in requests of at most PINECONE_DELETE_MAX_IDS ids
+ */
+void pinecone_delete_from_shards(const char *api_key, PineconeShard *shards, int n_shards, cJSON *ids) {
+    cJSON** shard_ids = palloc(sizeof(cJSON*) * n_shards);
+    cJSON* id;
+    for (int s = 0; s < n_shards; s++) {
+        shard_ids[s] = cJSON_CreateArray();
+    }
+    cJSON_ArrayForEach(id, ids) {
+        cJSON_AddItemReferenceToArray(shard_ids[pinecone_shard_for_id(cJSON_GetStringValue(id), n_shards)], id);
+    }
+    for (int s = 0; s < n_shards; s++) {
+        cJSON *batches, *batch;
+        char url[PINECONE_URL_MAX_LENGTH];
+        if (cJSON_GetArraySize(shard_ids[s]) == 0) {
+            cJSON_Delete(shard_ids[s]);
+            continue;
+        }
+        pinecone_host_url(url, sizeof(url), shards[s].host, "/vectors/delete");
+        batches = batch_vectors(shard_ids[s], PINECONE_DELETE_MAX_IDS);
+        cJSON_Delete(shard_ids[s]); // only frees the references
+        cJSON_ArrayForEach(batch, batches) {
+            cJSON *request = cJSON_CreateObject();
+            cJSON_AddItemToObject(request, "ids", cJSON_Duplicate(batch, true));
+            if (shards[s].pinecone_namespace != NULL) {
+                cJSON_AddItemToObject(request, "namespace", cJSON_CreateString(shards[s].pinecone_namespace));
+            }
+            generic_pinecone_request(api_key, url, "POST", request);
+            cJSON_Delete(request);
+        }
+        cJSON_Delete(batches);
+    }
+    pfree(shard_ids);
+}
+
 cJSON* pinecone_delete_index(const char *api_key, const char *index_name) {
-    char url[100] = "https://api.pinecone.io/indexes/"; strcat(url, index_name);
+    char url[PINECONE_URL_MAX_LENGTH];
+    char path[PINECONE_URL_MAX_LENGTH];
+    snprintf(path, sizeof(path), "/indexes/%s", index_name);
+    pinecone_control_url(url, sizeof(url), path);
     return generic_pinecone_request(api_key, url, "DELETE", NULL);
 }
 
 // delete all vectors in an index
-cJSON* pinecone_delete_all(const char *api_key, const char *index_host) {
-    char url[300];
-    sprintf(url, "https://%s/vectors/delete", index_host);
-    return generic_pinecone_request(api_key, url, "POST", cJSON_Parse("{\"deleteAll\": true}"));
+cJSON* pinecone_delete_all(const char *api_key, const char *index_host, const char *pinecone_namespace) {
+    char url[PINECONE_URL_MAX_LENGTH];
+    cJSON *request = cJSON_Parse("{\"deleteAll\": true}");
+    pinecone_host_url(url, sizeof(url), index_host, "/vectors/delete");
+    // deleteAll only applies to one namespace
+    if (pinecone_namespace != NULL) {
+        cJSON_AddItemToObject(request, "namespace", cJSON_CreateString(pinecone_namespace));
+    }
+    return generic_pinecone_request(api_key, url, "POST", request);
 }
 
-cJSON* pinecone_list_vectors(const char *api_key, const char *index_host, int limit, char* pagination_token) {
-    char url[300];
+/*
+ * List a page of the ids of a shard's vectors. The response's pagination.next, if any, is the token of the next page.
+ */
+cJSON* pinecone_list_vectors(const char *api_key, PineconeShard shard, int limit, const char *pagination_token) {
+    StringInfoData url;
+    char base[PINECONE_URL_MAX_LENGTH];
+    cJSON* response;
+    pinecone_host_url(base, sizeof(base), shard.host, "/vectors/list");
+    initStringInfo(&url);
+    appendStringInfo(&url, "%s?limit=%d", base, limit);
+    if (shard.pinecone_namespace != NULL) {
+        appendStringInfo(&url, "&namespace=%s", shard.pinecone_namespace);
+    }
     if (pagination_token != NULL) {
-        sprintf(url, "https://%s/vectors/list?limit=%d&paginationToken=%s", index_host, limit, pagination_token);
-    } else {
-        sprintf(url, "https://%s/vectors/list?limit=%d", index_host, limit);
+        CURL* hnd = curl_easy_init();
+        char* escaped = hnd != NULL ? curl_easy_escape(hnd, pagination_token, 0) : NULL;
+        if (escaped == NULL) elog(ERROR, "Failed to escape the pagination token");
+        appendStringInfo(&url, "&paginationToken=%s", escaped);
+        curl_free(escaped);
+        curl_easy_cleanup(hnd);
     }
-    return cJSON_GetObjectItem(generic_pinecone_request(api_key, url, "GET", NULL), "vectors");
+    response = generic_pinecone_request(api_key, url.data, "GET", NULL);
+    pfree(url.data);
+    return response;
 }
 
 /* name, dimension, metric
@@ -177,19 +345,42 @@ cJSON* pinecone_list_vectors(const char *api_key, const char *index_host, int li
  */
 cJSON* pinecone_create_index(const char *api_key, const char *index_name, const int dimension, const char *metric, cJSON *spec) {
     cJSON *request = cJSON_CreateObject();
+    char url[PINECONE_URL_MAX_LENGTH];
+    pinecone_control_url(url, sizeof(url), "/indexes");
     cJSON_AddItemToObject(request, "name", cJSON_CreateString(index_name));
     cJSON_AddItemToObject(request, "dimension", cJSON_CreateNumber(dimension));
     cJSON_AddItemToObject(request, "metric", cJSON_CreateString(metric));
     cJSON_AddItemToObject(request, "spec", spec);
-    return generic_pinecone_request(api_key, "https://api.pinecone.io/indexes", "POST", request);
+    return generic_pinecone_request(api_key, url, "POST", request);
+}
+
+/*
+ * Send the query and fetch requests of every shard through the request broker, if it is running
+ */
+static bool pinecone_broker_perform_queries(const char *api_key, int n_shards, CURL **query_handles, ResponseData *query_response_data,
+                                            CURL **fetch_handles, ResponseData *fetch_response_data) {
+    CURL** handles = palloc(sizeof(CURL*) * 2 * n_shards);
+    ResponseData** response_data = palloc(sizeof(ResponseData*) * 2 * n_shards);
+    for (int i = 0; i < n_shards; i++) {
+        handles[i] = query_handles[i];
+        response_data[i] = &query_response_data[i];
+        handles[n_shards + i] = fetch_handles[i];
+        response_data[n_shards + i] = &fetch_response_data[i];
+    }
+    return PineconeBrokerPerform(api_key, 2 * n_shards, handles, response_data, NULL);
 }
 
 CURL* multi_hnd_for_query;
-cJSON** pinecone_query_with_fetch(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, bool with_fetch, cJSON* fetch_ids) {
-    CURL *query_handle, *fetch_handle;
-    cJSON** responses = palloc(2 * sizeof(cJSON*)); // allocate space to return two cJSON* pointers for the query and fetch responses
-    ResponseData query_response_data = {"", NULL, NULL, 0, ""};
-    ResponseData fetch_response_data = {"", NULL, NULL, 0, ""};
+/*
+ * Query every shard concurrently, along with a fetch of shard_fetch_ids[i] from each shard whose ids are not NULL.
+ * Takes ownership of the query and the fetch ids. The fetch response of a shard without ids is NULL.
+ */
+static void query_and_fetch_shards(const char *api_key, PineconeShard *shards, int n_shards, const int topK, cJSON *query_vector_values, cJSON *sparse_vector, cJSON *filter,
+                                   cJSON **shard_fetch_ids, cJSON **query_responses, cJSON **fetch_responses) {
+    CURL** query_handles = palloc(sizeof(CURL*) * n_shards);
+    CURL** fetch_handles = palloc0(sizeof(CURL*) * n_shards);
+    ResponseData* query_response_data = palloc(sizeof(ResponseData) * n_shards);
+    ResponseData* fetch_response_data = palloc(sizeof(ResponseData) * n_shards);
     clock_t start, stop;
     int running;
 
@@ -202,13 +393,20 @@ cJSON** pinecone_query_with_fetch(const char *api_key, const char *index_host, c
         }
     }
 
-    query_handle = get_pinecone_query_handle(api_key, index_host, topK, query_vector_values, filter, &query_response_data);
-    curl_multi_add_handle(multi_hnd_for_query, query_handle);
-
-    if (with_fetch) {
-        fetch_handle = get_pinecone_fetch_handle(api_key, index_host, fetch_ids, &fetch_response_data);
-        curl_multi_add_handle(multi_hnd_for_query, fetch_handle);
+    for (int i = 0; i < n_shards; i++) {
+        query_response_data[i] = (ResponseData) {"", NULL, NULL, 0, 0, "", 0, false, 0, NULL};
+        fetch_response_data[i] = (ResponseData) {"", NULL, NULL, 0, 0, "", 0, false, 0, NULL};
+        // the request body takes ownership of the vector and the filter, so each shard gets its own copy
+        query_handles[i] = get_pinecone_query_handle(api_key, shards[i], topK, cJSON_Duplicate(query_vector_values, true), sparse_vector != NULL ? cJSON_Duplicate(sparse_vector, true) : NULL, cJSON_Duplicate(filter, true), &query_response_data[i]);
+        curl_multi_add_handle(multi_hnd_for_query, query_handles[i]);
+        if (shard_fetch_ids[i] != NULL) {
+            fetch_handles[i] = get_pinecone_fetch_handle(api_key, shards[i], shard_fetch_ids[i], &fetch_response_data[i]);
+            curl_multi_add_handle(multi_hnd_for_query, fetch_handles[i]);
+        }
     }
+    cJSON_Delete(query_vector_values);
+    cJSON_Delete(sparse_vector);
+    cJSON_Delete(filter);
 
     // todo: does curl let you specify an allocator like cJSON?
 
@@ -216,33 +414,41 @@ cJSON** pinecone_query_with_fetch(const char *api_key, const char *index_host, c
     // perform the request
     #ifdef PINECONE_MOCK
     if (pinecone_use_mock_response) {
-        CURLcode query_ret, fetch_ret;
-        lookup_mock_response(query_handle, &query_response_data, &query_ret);
-        elog(DEBUG1, "Mock query response: %s", query_response_data.data);
-        if (with_fetch) {
-            lookup_mock_response(fetch_handle, &fetch_response_data, &fetch_ret);
-            elog(DEBUG1, "Mock fetch response: %s", fetch_response_data.data);
+        for (int i = 0; i < n_shards; i++) {
+            CURLcode query_ret, fetch_ret;
+            lookup_mock_response(query_handles[i], &query_response_data[i], &query_ret);
+            elog(DEBUG1, "Mock query response: %s", query_response_data[i].data);
+            if (fetch_handles[i] != NULL) {
+                lookup_mock_response(fetch_handles[i], &fetch_response_data[i], &fetch_ret);
+                elog(DEBUG1, "Mock fetch response: %s", fetch_response_data[i].data);
+            }
         }
     } else {
     #endif
 
     // start time
     start = clock();
-    // run the handles
-    curl_multi_perform(multi_hnd_for_query, &running);
-    while (running) {
-        CURLMcode mc;
-        int numfds;
-        mc = curl_multi_wait(multi_hnd_for_query, NULL, 0, 8000, &numfds);
-        if (mc != CURLM_OK) {
-            elog(DEBUG1, "curl_multi_wait() failed, code %d.", mc);
-            break;
-        }
+    if (pinecone_broker_perform_queries(api_key, n_shards, query_handles, query_response_data, fetch_handles, fetch_response_data)) {
+        // the broker answered the requests without touching the handles
+    } else {
+        // run the handles
         curl_multi_perform(multi_hnd_for_query, &running);
-    }
-    curl_easy_reset(query_handle);
-    if (with_fetch) {
-        curl_easy_reset(fetch_handle);
+        while (running) {
+            CURLMcode mc;
+            int numfds;
+            mc = curl_multi_wait(multi_hnd_for_query, NULL, 0, 8000, &numfds);
+            if (mc != CURLM_OK) {
+                elog(DEBUG1, "curl_multi_wait() failed, code %d.", mc);
+                break;
+            }
+            curl_multi_perform(multi_hnd_for_query, &running);
+        }
+        for (int i = 0; i < n_shards; i++) {
+            count_response(query_handles[i], &query_response_data[i]);
+            if (fetch_handles[i] != NULL) {
+                count_response(fetch_handles[i], &fetch_response_data[i]);
+            }
+        }
     }
     // TODO: figure out exactly what is necessary: deleting multi_cleanup or reusing the same multihandle
     // stop time
@@ -253,28 +459,106 @@ cJSON** pinecone_query_with_fetch(const char *api_key, const char *index_host, c
     }
     #endif
 
+    // the handles are created per request, so release them along with their header lists
+    for (int i = 0; i < n_shards; i++) {
+        curl_multi_remove_handle(multi_hnd_for_query, query_handles[i]);
+        curl_easy_cleanup(query_handles[i]);
+        free_request_headers(&query_response_data[i]);
+        if (fetch_handles[i] != NULL) {
+            curl_multi_remove_handle(multi_hnd_for_query, fetch_handles[i]);
+            curl_easy_cleanup(fetch_handles[i]);
+            free_request_headers(&fetch_response_data[i]);
+        }
+    }
 
     // parse the responses
     start = clock();
-    responses[0] = cJSON_Parse(query_response_data.data);
-    if (with_fetch) {
-        responses[1] = cJSON_Parse(fetch_response_data.data);
+    for (int i = 0; i < n_shards; i++) {
+        query_responses[i] = cJSON_Parse(query_response_data[i].data);
+        fetch_responses[i] = fetch_handles[i] != NULL ? cJSON_Parse(fetch_response_data[i].data) : NULL;
+        cJSON_Delete(shard_fetch_ids[i]);
     }
     stop = clock();
     elog(DEBUG2, "Parsing responses took %f seconds", (double)(stop - start) / CLOCKS_PER_SEC);
+}
+
+/*
+ * Query every shard concurrently and fetch each checkpoint id from the shard it was routed to.
+ * Returns n_shards query responses followed by one fetch response whose "vectors" holds the vectors fetched from all shards.
+ */
+cJSON** pinecone_query_with_fetch(const char *api_key, PineconeShard *shards, int n_shards, const int topK, cJSON *query_vector_values, cJSON *sparse_vector, cJSON *filter, bool with_fetch, cJSON* fetch_ids) {
+    cJSON** responses = palloc((n_shards + 1) * sizeof(cJSON*)); // allocate space to return a query response per shard and the fetch response
+    cJSON** fetch_responses = palloc(sizeof(cJSON*) * n_shards);
+    cJSON** shard_fetch_ids = palloc0(sizeof(cJSON*) * n_shards);
+    cJSON* fetch_id;
+
+    // group the fetch ids by the shard they were upserted to
+    if (with_fetch) {
+        for (int i = 0; i < n_shards; i++) {
+            shard_fetch_ids[i] = cJSON_CreateArray();
+        }
+        cJSON_ArrayForEach(fetch_id, fetch_ids) {
+            int shard = pinecone_shard_for_id(cJSON_GetStringValue(fetch_id), n_shards);
+            cJSON_AddItemToArray(shard_fetch_ids[shard], cJSON_CreateString(cJSON_GetStringValue(fetch_id)));
+        }
+        // a shard with no checkpoints to fetch is skipped, unless it is the only one
+        for (int i = 0; i < n_shards; i++) {
+            if (n_shards > 1 && cJSON_GetArraySize(shard_fetch_ids[i]) == 0) {
+                cJSON_Delete(shard_fetch_ids[i]);
+                shard_fetch_ids[i] = NULL;
+            }
+        }
+    }
+
+    query_and_fetch_shards(api_key, shards, n_shards, topK, query_vector_values, sparse_vector, filter, shard_fetch_ids, responses, fetch_responses);
+
+    responses[n_shards] = NULL;
+    if (with_fetch && n_shards == 1) {
+        responses[n_shards] = fetch_responses[0];
+    } else if (with_fetch) {
+        // merge the fetched vectors of every shard into a single response
+        cJSON* vectors = cJSON_CreateObject();
+        responses[n_shards] = cJSON_CreateObject();
+        cJSON_AddItemToObject(responses[n_shards], "vectors", vectors);
+        for (int i = 0; i < n_shards; i++) {
+            cJSON* shard_vectors = cJSON_GetObjectItemCaseSensitive(fetch_responses[i], "vectors");
+            while (shard_vectors != NULL && shard_vectors->child != NULL) {
+                cJSON* vector = cJSON_DetachItemViaPointer(shard_vectors, shard_vectors->child);
+                cJSON_AddItemToObject(vectors, vector->string, vector);
+            }
+            cJSON_Delete(fetch_responses[i]);
+        }
+    }
+    return responses;
+}
 
+/*
+ * Query the namespaces of the partitions that share a remote index concurrently, along with a fetch of fetch_ids[i]
+ * from each namespace whose ids are not NULL. Returns n query responses followed by n fetch responses, NULL for the
+ * namespaces without ids.
+ */
+cJSON** pinecone_query_namespaces(const char *api_key, PineconeShard *namespaces, int n, const int topK, cJSON *query_vector_values, cJSON *sparse_vector, cJSON *filter, cJSON **fetch_ids) {
+    cJSON** responses = palloc(sizeof(cJSON*) * 2 * n);
+    query_and_fetch_shards(api_key, namespaces, n, topK, query_vector_values, sparse_vector, filter, fetch_ids, responses, responses + n);
     return responses;
 }
 
 CURL* multi_handle;
-cJSON* pinecone_bulk_upsert(const char *api_key, const char *index_host, cJSON *vectors, int batch_size) {
-    cJSON *batches = batch_vectors(vectors, batch_size);
-    cJSON *batch;
+/*
+ * Upsert vectors in batches of batch_size, routing each vector to its shard by id.
+ * The batches of all shards are sent concurrently.
+ */
+cJSON* pinecone_bulk_upsert(const char *api_key, PineconeShard *shards, int n_shards, cJSON *vectors, int batch_size) {
+    cJSON** shard_batches = palloc(sizeof(cJSON*) * n_shards);
+    cJSON *batch, *vector;
     CURL* batch_handle;
-    int n_batches = cJSON_GetArraySize(batches);
-    ResponseData* response_data = palloc(sizeof(ResponseData) * n_batches);
-    CURL** handles = palloc(sizeof(CURL*) * n_batches);
+    int n_batches = 0;
+    ResponseData* response_data;
+    ResponseData** response_data_list;
+    CURL** handles;
     int running;
+    long failed_code = 200;
+    char* failed_response = NULL;
     if (multi_handle == NULL) {
         multi_handle = curl_multi_init();
         if (multi_handle == NULL) {
@@ -282,14 +566,42 @@ cJSON* pinecone_bulk_upsert(const char *api_key, const char *index_host, cJSON *
         }
     }
 
-    for (int i = 0; i < n_batches; i++) {
-        batch = cJSON_GetArrayItem(batches, i);
-        response_data[i] = (ResponseData) {"", NULL, NULL, 0, ""};
-        batch_handle = get_pinecone_upsert_handle(api_key, index_host, cJSON_Duplicate(batch, true), &response_data[i]); // TODO: figure out why i have to deepcopy // because batch goes out of scope
-        handles[i] = batch_handle;
-        curl_multi_add_handle(multi_handle, batch_handle);
+    // route the vectors to their shards and batch them
+    if (n_shards == 1) {
+        shard_batches[0] = batch_vectors(vectors, batch_size);
+    } else {
+        cJSON** shard_vectors = palloc(sizeof(cJSON*) * n_shards);
+        for (int s = 0; s < n_shards; s++) {
+            shard_vectors[s] = cJSON_CreateArray();
+        }
+        cJSON_ArrayForEach(vector, vectors) {
+            char* id = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(vector, "id"));
+            cJSON_AddItemReferenceToArray(shard_vectors[pinecone_shard_for_id(id, n_shards)], vector);
+        }
+        for (int s = 0; s < n_shards; s++) {
+            shard_batches[s] = batch_vectors(shard_vectors[s], batch_size);
+            cJSON_Delete(shard_vectors[s]); // only frees the references
+        }
+        pfree(shard_vectors);
+    }
+    for (int s = 0; s < n_shards; s++) {
+        n_batches += cJSON_GetArraySize(shard_batches[s]);
+    }
+    response_data = palloc(sizeof(ResponseData) * n_batches);
+    handles = palloc(sizeof(CURL*) * n_batches);
+
+    n_batches = 0;
+    for (int s = 0; s < n_shards; s++) {
+        cJSON_ArrayForEach(batch, shard_batches[s]) {
+            if (cJSON_GetArraySize(batch) == 0) continue; // a shard that received no vectors
+            response_data[n_batches] = (ResponseData) {"", NULL, NULL, 0, 0, "", 0, false, 0, NULL};
+            batch_handle = get_pinecone_upsert_handle(api_key, shards[s], cJSON_Duplicate(batch, true), &response_data[n_batches]); // TODO: figure out why i have to deepcopy // because batch goes out of scope
+            handles[n_batches] = batch_handle;
+            curl_multi_add_handle(multi_handle, batch_handle);
+            n_batches++;
+        }
+        cJSON_Delete(shard_batches[s]);
     }
-    cJSON_Delete(batches);
 
     #ifdef PINECONE_MOCK
     if (pinecone_use_mock_response) {
@@ -301,98 +613,196 @@ cJSON* pinecone_bulk_upsert(const char *api_key, const char *index_host, cJSON *
     } else {
     #endif
     
-    // run the handles
-    curl_multi_perform(multi_handle, &running);
-    while (running) {
-        CURLMcode mc;
-        int numfds;
-        mc = curl_multi_wait(multi_handle, NULL, 0, 8000, &numfds);
-        if (mc != CURLM_OK) {
-            elog(DEBUG1, "curl_multi_wait() failed, code %d.", mc);
-            break;
-        }
+    // the broker answers the requests without touching the handles
+    response_data_list = palloc(sizeof(ResponseData*) * n_batches);
+    for (int i = 0; i < n_batches; i++) {
+        response_data_list[i] = &response_data[i];
+    }
+    if (!PineconeBrokerPerform(api_key, n_batches, handles, response_data_list, NULL)) {
+        // run the handles
         curl_multi_perform(multi_handle, &running);
+        report_requests_in_flight(running);
+        while (running) {
+            CURLMcode mc;
+            int numfds;
+            mc = curl_multi_wait(multi_handle, NULL, 0, 8000, &numfds);
+            if (mc != CURLM_OK) {
+                elog(DEBUG1, "curl_multi_wait() failed, code %d.", mc);
+                break;
+            }
+            curl_multi_perform(multi_handle, &running);
+            report_requests_in_flight(running);
+        }
+        report_requests_in_flight(0);
+        for (int i = 0; i < n_batches; i++) {
+            count_response(handles[i], &response_data[i]);
+            curl_easy_getinfo(handles[i], CURLINFO_RESPONSE_CODE, &response_data[i].status);
+        }
     }
+    // an upsert is only confirmed once pinecone acknowledged it; callers rely on this to record build progress
     for (int i = 0; i < n_batches; i++) {
-        curl_easy_reset(handles[i]);
+        // detach every handle before reporting a failure so the multi handle stays usable
+        curl_multi_remove_handle(multi_handle, handles[i]);
+        curl_easy_cleanup(handles[i]);
+        free_request_headers(&response_data[i]);
+        if (response_data[i].status != 200 && failed_code == 200) {
+            failed_code = response_data[i].status;
+            failed_response = response_data[i].data;
+        }
+    }
+    if (failed_code != 200) {
+        ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+                        errmsg("Failed to upsert vectors to pinecone (HTTP status %ld)", failed_code),
+                        errdetail("Response: %s", failed_response != NULL ? failed_response : "")));
     }
     #ifdef PINECONE_MOCK
     }
     #endif
 
-    // todo: check the responses from upsert
-    // todo: free the response.data
     return NULL;
 }
 
 CURL* query_handle;
-CURL* get_pinecone_query_handle(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, ResponseData* response_data) {
+CURL* get_pinecone_query_handle(const char *api_key, PineconeShard shard, const int topK, cJSON *query_vector_values, cJSON *sparse_vector, cJSON *filter, ResponseData* response_data) {
     cJSON *body = cJSON_CreateObject();
     char* body_str;
-    char url[100] = "https://"; strcat(url, index_host); strcat(url, "/query"); // e.g. https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/query
-    if (query_handle == NULL) {
-        query_handle = curl_easy_init();
-        if (query_handle == NULL) {
-            elog(ERROR, "Failed to initialize CURL handle");
-        }
-    }
+    char url[PINECONE_URL_MAX_LENGTH];
+    pinecone_host_url(url, sizeof(url), shard.host, "/query"); // e.g. https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/query
     cJSON_AddItemToObject(body, "topK", cJSON_CreateNumber(topK));
     cJSON_AddItemToObject(body, "vector", query_vector_values);
+    if (sparse_vector != NULL) {
+        cJSON_AddItemToObject(body, "sparseVector", sparse_vector);
+    }
     cJSON_AddItemToObject(body, "filter", filter);
     cJSON_AddItemToObject(body, "includeValues", cJSON_CreateFalse());
     cJSON_AddItemToObject(body, "includeMetadata", cJSON_CreateFalse());
-    query_handle = curl_easy_init();
+    if (shard.pinecone_namespace != NULL) {
+        cJSON_AddItemToObject(body, "namespace", cJSON_CreateString(shard.pinecone_namespace));
+    }
+    query_handle = curl_easy_init(); // released by pinecone_query_with_fetch
+    if (query_handle == NULL) {
+        elog(ERROR, "Failed to initialize CURL handle");
+    }
     body_str = cJSON_Print(body);
-    elog(DEBUG1, "Querying index %s with payload: %s", index_host, body_str);
+    elog(DEBUG1, "Querying index %s with payload: %s", shard.host, body_str);
+    count_request(strlen(body_str), strlen(body_str));
     cJSON_Delete(body);
     // 
     strcpy(response_data->message, "querying index");
     response_data->request_body = body_str;
+    response_data->request_length = strlen(body_str);
     set_curl_options(query_handle, api_key, url, "POST", response_data);
     curl_easy_setopt(query_handle, CURLOPT_POSTFIELDS, body_str);
     return query_handle;
 }
 
-CURL* get_pinecone_upsert_handle(const char *api_key, const char *index_host, cJSON *vectors, ResponseData* response_data) {
+CURL* get_pinecone_upsert_handle(const char *api_key, PineconeShard shard, cJSON *vectors, ResponseData* response_data) {
     CURL *hnd = curl_easy_init();
     cJSON *body = cJSON_CreateObject();
     char *body_str;
-    // furthermore, we need to be sure to free the memory allocated for response_data.data (by the writeback) after we are done using it
-    char url[100] = "https://"; strcat(url, index_host); strcat(url, "/vectors/upsert"); // https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/vectors/upsert
+    size_t body_length;
+    char url[PINECONE_URL_MAX_LENGTH];
+    pinecone_host_url(url, sizeof(url), shard.host, "/vectors/upsert"); // https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/vectors/upsert
     cJSON_AddItemToObject(body, "vectors", vectors);
+    if (shard.pinecone_namespace != NULL) {
+        cJSON_AddItemToObject(body, "namespace", cJSON_CreateString(shard.pinecone_namespace));
+    }
     set_curl_options(hnd, api_key, url, "POST", response_data);
     body_str = cJSON_Print(body);
     cJSON_Delete(body); // free the cJSON object especially including the vectors
+    body_length = strlen(body_str);
+    if (pinecone_compress_requests) {
+        size_t compressed_length;
+        char *compressed = gzip_body(body_str, body_length, &compressed_length);
+        response_data->headers = curl_slist_append(response_data->headers, "content-encoding: gzip");
+        curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, response_data->headers);
+        curl_easy_setopt(hnd, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) compressed_length);
+        count_request(body_length, compressed_length);
+        pfree(body_str);
+        body_str = compressed;
+        body_length = compressed_length;
+        response_data->request_gzipped = true;
+    } else {
+        count_request(body_length, body_length);
+    }
     // save the body_str pointer in response_data so we can free it later in the write_callback
     strcpy(response_data->message, "upserting vectors");
     response_data->request_body = body_str;
+    response_data->request_length = body_length;
     curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, body_str);
     return hnd;
 }
 
 CURL* fetch_handle;
-CURL* get_pinecone_fetch_handle(const char *api_key, const char *index_host, cJSON* ids, ResponseData* response_data) {
-    char url[2048] = "https://"; // we fetch up to 100 vectors and have 12 chars per vector id + &ids= is 17chars/vec
-    strcat(url, index_host); strcat(url, "/vectors/fetch?"); // https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/vectors/upsert
-    if (fetch_handle == NULL) {
-        fetch_handle = curl_easy_init();
-        if (fetch_handle == NULL) {
-            elog(ERROR, "Failed to initialize CURL handle");
-        }
+/*
+ * Url of a fetch of the given ids, which grows with the number of ids
+ */
+static char* pinecone_fetch_url(PineconeShard shard, cJSON* ids) {
+    StringInfoData url;
+    char base[PINECONE_URL_MAX_LENGTH];
+    cJSON* id;
+    pinecone_host_url(base, sizeof(base), shard.host, "/vectors/fetch"); // https://t1-23kshha.svc.apw5-4e34-81fa.pinecone.io/vectors/fetch
+    initStringInfo(&url);
+    appendStringInfoString(&url, base);
+    appendStringInfoChar(&url, '?');
+    if (shard.pinecone_namespace != NULL) {
+        appendStringInfo(&url, "namespace=%s&", shard.pinecone_namespace);
+    }
+    cJSON_ArrayForEach(id, ids) {
+        appendStringInfo(&url, "ids=%s&", cJSON_GetStringValue(id));
     }
-    cJSON_ArrayForEach(ids, ids) {
-        strcat(url, "ids=");
-        strcat(url, cJSON_GetStringValue(ids));
-        strcat(url, "&");
+    url.data[--url.len] = '\0'; // remove the trailing & or ?
+    return url.data;
+}
+
+CURL* get_pinecone_fetch_handle(const char *api_key, PineconeShard shard, cJSON* ids, ResponseData* response_data) {
+    char* url = pinecone_fetch_url(shard, ids);
+    fetch_handle = curl_easy_init(); // released by pinecone_query_with_fetch
+    if (fetch_handle == NULL) {
+        elog(ERROR, "Failed to initialize CURL handle");
     }
-    url[strlen(url) - 1] = '\0'; // remove the trailing &
-    fetch_handle = curl_easy_init();
     strcpy(response_data->message, "fetching vectors");
     response_data->request_body = NULL;
-    set_curl_options(fetch_handle, api_key, url, "GET", response_data);
+    set_curl_options(fetch_handle, api_key, url, "GET", response_data); // curl copies the url
+    pfree(url);
     return fetch_handle;
 }
 
+/*
+ * Fetch ids from the shards they were routed to. Returns a fetch response whose "vectors" holds the vectors of all
+ * shards.
+ */
+cJSON* pinecone_fetch_from_shards(const char *api_key, PineconeShard *shards, int n_shards, cJSON *ids) {
+    cJSON* response = cJSON_CreateObject();
+    cJSON* vectors = cJSON_CreateObject();
+    cJSON_AddItemToObject(response, "vectors", vectors);
+    for (int s = 0; s < n_shards; s++) {
+        cJSON *shard_ids = cJSON_CreateArray();
+        cJSON *id, *shard_response, *shard_vectors;
+        char *url;
+        cJSON_ArrayForEach(id, ids) {
+            if (pinecone_shard_for_id(cJSON_GetStringValue(id), n_shards) == s) {
+                cJSON_AddItemToArray(shard_ids, cJSON_CreateString(cJSON_GetStringValue(id)));
+            }
+        }
+        if (cJSON_GetArraySize(shard_ids) == 0) {
+            cJSON_Delete(shard_ids);
+            continue;
+        }
+        url = pinecone_fetch_url(shards[s], shard_ids);
+        cJSON_Delete(shard_ids);
+        shard_response = generic_pinecone_request(api_key, url, "GET", NULL);
+        pfree(url);
+        shard_vectors = cJSON_GetObjectItemCaseSensitive(shard_response, "vectors");
+        while (shard_vectors != NULL && shard_vectors->child != NULL) {
+            cJSON* vector = cJSON_DetachItemViaPointer(shard_vectors, shard_vectors->child);
+            cJSON_AddItemToObject(vectors, vector->string, vector);
+        }
+        cJSON_Delete(shard_response);
+    }
+    return response;
+}
+
 cJSON* batch_vectors(cJSON *vectors, int batch_size) {
     // given a list of e.g. 1000 vectors, batch them into groups of 100
     cJSON *batches = cJSON_CreateArray();
@@ -6,34 +6,68 @@
 
 #define bool _Bool
 
+#define PINECONE_DELETE_MAX_IDS 1000 // ids per delete request accepted by pinecone
+#define PINECONE_LIST_MAX_IDS 100 // ids per page of a list request
+#define PINECONE_URL_MAX_LENGTH 512
+
 typedef CURL** CURLHandleList;
 
+// a remote index or a namespace within one; requests for a sharded index are routed by vector id
+typedef struct {
+    const char *host;
+    const char *pinecone_namespace; // NULL for the default namespace
+} PineconeShard;
+
 typedef struct {
     char message[256];
     char *request_body;
-    char *data;
+    char *data; // allocated in the memory context that is current during the request
     size_t length;
+    size_t capacity;
     char method[10]; // GET, POST, DELETE, etc.
+    size_t request_length; // length of request_body, which may be compressed
+    bool request_gzipped;
+    long status; // HTTP status of the response, once it is checked
+    struct curl_slist *headers; // set on the handle; freed with free_request_headers once the handle is done
 } ResponseData;
 
+// per-backend traffic counters, exposed through pinecone_network_stats()
+typedef struct {
+    curl_off_t requests;
+    curl_off_t request_bytes; // request bodies before compression
+    curl_off_t request_bytes_sent; // request bodies as sent
+    curl_off_t response_bytes_received; // response bodies as received
+    curl_off_t response_bytes; // response bodies after decompression
+} PineconeNetworkCounters;
+extern PineconeNetworkCounters pinecone_network_counters;
+
 size_t write_callback(char *contents, size_t size, size_t nmemb, void *userdata);
 struct curl_slist *create_common_headers(const char *api_key);
 void set_curl_options(CURL *hnd, const char *api_key, const char *url, const char *method, ResponseData *response_data);
+void free_request_headers(ResponseData *response_data);
 cJSON* generic_pinecone_request(const char *api_key, const char *url, const char *method, cJSON *body);
 cJSON* describe_index(const char *api_key, const char *index_name);
 cJSON* pinecone_get_index_stats(const char *api_key, const char *index_host);
 cJSON* list_indexes(const char *api_key);
+void pinecone_control_url(char *url, size_t size, const char *path);
+void pinecone_host_url(char *url, size_t size, const char *host, const char *path);
 cJSON* pinecone_delete_vectors(const char *api_key, const char *index_host, cJSON *ids);
+void pinecone_delete_from_shards(const char *api_key, PineconeShard *shards, int n_shards, cJSON *ids);
 cJSON* pinecone_delete_index(const char *api_key, const char *index_name);
-cJSON* pinecone_delete_all(const char *api_key, const char *index_host);
-cJSON* pinecone_list_vectors(const char *api_key, const char *index_host, int limit, char* pagination_token);
+cJSON* pinecone_delete_all(const char *api_key, const char *index_host, const char *pinecone_namespace);
+cJSON* pinecone_list_vectors(const char *api_key, PineconeShard shard, int limit, const char *pagination_token);
 cJSON* pinecone_create_index(const char *api_key, const char *index_name, const int dimension, const char *metric, cJSON *spec);
-cJSON** pinecone_query_with_fetch(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, bool with_fetch, cJSON* fetch_ids);
-cJSON* pinecone_bulk_upsert(const char *api_key, const char *index_host, cJSON *vectors, int batch_size);
-CURL* get_pinecone_query_handle(const char *api_key, const char *index_host, const int topK, cJSON *query_vector_values, cJSON *filter, ResponseData* response_data);
-CURL* get_pinecone_upsert_handle(const char *api_key, const char *index_host, cJSON *vectors, ResponseData* response_data);
-CURL* get_pinecone_fetch_handle(const char *api_key, const char *index_host, cJSON* ids, ResponseData* response_data);
+cJSON** pinecone_query_with_fetch(const char *api_key, PineconeShard *shards, int n_shards, const int topK, cJSON *query_vector_values, cJSON *sparse_vector, cJSON *filter, bool with_fetch, cJSON* fetch_ids);
+cJSON** pinecone_query_namespaces(const char *api_key, PineconeShard *namespaces, int n, const int topK, cJSON *query_vector_values, cJSON *sparse_vector, cJSON *filter, cJSON **fetch_ids);
+cJSON* pinecone_bulk_upsert(const char *api_key, PineconeShard *shards, int n_shards, cJSON *vectors, int batch_size);
+CURL* get_pinecone_query_handle(const char *api_key, PineconeShard shard, const int topK, cJSON *query_vector_values, cJSON *sparse_vector, cJSON *filter, ResponseData* response_data);
+CURL* get_pinecone_upsert_handle(const char *api_key, PineconeShard shard, cJSON *vectors, ResponseData* response_data);
+CURL* get_pinecone_fetch_handle(const char *api_key, PineconeShard shard, cJSON* ids, ResponseData* response_data);
+cJSON* pinecone_fetch_from_shards(const char *api_key, PineconeShard *shards, int n_shards, cJSON *ids);
 cJSON* batch_vectors(cJSON *vectors, int batch_size);
+// request broker
+bool PineconeBrokerPerform(const char *api_key, int n, CURL **handles, ResponseData **response_data, CURLcode *curl_codes);
+
 #ifdef PINECONE_MOCK
 void mock_netcall(const char *url, const char *method, cJSON *body, ResponseData *response_data, CURLcode *ret);
 #endif
@@ -0,0 +1,695 @@
+/*
+ * Request broker
+ *
+ * With pinecone.broker on (and the library in shared_preload_libraries) a background worker sends the remote
+ * requests of every backend. Each backend hands its requests to the broker through a pair of shm_mq's in a DSM
+ * segment of its own and waits on its latch for the responses. The broker multiplexes all requests over a few
+ * HTTP/2 connections per host, and merges upserts to the same index and namespace that arrive together into
+ * batches of up to pinecone.vectors_per_request vectors.
+ */
+#include "pinecone.h"
+#include "pinecone_api.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/pmsignal.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/wait_event.h"
+#endif
+
+#define PINECONE_BROKER_QUEUE_SIZE (256 * 1024) // per direction; larger messages are streamed through the ring
+#define PINECONE_BROKER_ATTACH_TIMEOUT_MS 5000
+
+typedef struct PineconeBrokerShared
+{
+    slock_t mutex;
+    PGPROC *broker; // NULL while the broker is not running
+    int n_slots;
+    dsm_handle slots[FLEXIBLE_ARRAY_MEMBER]; // queue segment of each connected backend, DSM_HANDLE_INVALID if free
+} PineconeBrokerShared;
+
+// a request, followed by its url, api key and body
+typedef struct PineconeBrokerRequest
+{
+    uint64 call_no; // the backend's PineconeBrokerPerform call, echoed in the response
+    uint32 request_no; // position of the request in the backend's batch
+    char method[10];
+    bool gzipped;
+    Size url_length;
+    Size api_key_length;
+    Size body_length;
+} PineconeBrokerRequest;
+
+// a response, followed by its body
+typedef struct PineconeBrokerResponse
+{
+    uint64 call_no;
+    uint32 request_no;
+    int curl_code;
+    long status;
+    int64 received; // response bytes as received, before decompression
+    Size body_length;
+} PineconeBrokerResponse;
+
+static PineconeBrokerShared *broker_shared = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+// backend side: the connection to the broker
+static dsm_segment *broker_seg = NULL;
+static shm_mq_handle *broker_requests = NULL;
+static shm_mq_handle *broker_responses = NULL;
+static int broker_slot = -1;
+static uint64 broker_call_no = 0; // of the latest PineconeBrokerPerform call
+
+static Size BrokerShmemSize(void) {
+    return add_size(offsetof(PineconeBrokerShared, slots), mul_size(sizeof(dsm_handle), pinecone_broker_max_clients));
+}
+
+#if PG_VERSION_NUM >= 150000
+static void broker_shmem_request(void) {
+    if (prev_shmem_request_hook) prev_shmem_request_hook();
+    RequestAddinShmemSpace(BrokerShmemSize());
+}
+#endif
+
+static void broker_shmem_startup(void) {
+    bool found;
+    if (prev_shmem_startup_hook) prev_shmem_startup_hook();
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    broker_shared = ShmemInitStruct("pinecone broker", BrokerShmemSize(), &found);
+    if (!found) {
+        SpinLockInit(&broker_shared->mutex);
+        broker_shared->broker = NULL;
+        broker_shared->n_slots = pinecone_broker_max_clients;
+        for (int i = 0; i < broker_shared->n_slots; i++) broker_shared->slots[i] = DSM_HANDLE_INVALID;
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Reserve shared memory for the broker and register it; called from _PG_init
+ */
+void PineconeBrokerInit(void) {
+    BackgroundWorker worker;
+    if (!process_shared_preload_libraries_in_progress || !pinecone_broker) return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = broker_shmem_request;
+#else
+    RequestAddinShmemSpace(BrokerShmemSize());
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = broker_shmem_startup;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = 10;
+    strlcpy(worker.bgw_library_name, "vector", BGW_MAXLEN);
+    strlcpy(worker.bgw_function_name, "PineconeBrokerMain", BGW_MAXLEN);
+    strlcpy(worker.bgw_name, "pinecone request broker", BGW_MAXLEN);
+    strlcpy(worker.bgw_type, "pinecone request broker", BGW_MAXLEN);
+    RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Backend side
+ */
+
+static void broker_disconnect(void) {
+    if (broker_slot >= 0) {
+        SpinLockAcquire(&broker_shared->mutex);
+        broker_shared->slots[broker_slot] = DSM_HANDLE_INVALID;
+        SpinLockRelease(&broker_shared->mutex);
+        broker_slot = -1;
+    }
+    if (broker_seg != NULL) dsm_detach(broker_seg); // also detaches the queues
+    broker_seg = NULL;
+    broker_requests = NULL;
+    broker_responses = NULL;
+}
+
+static void broker_before_shmem_exit(int code, Datum arg) {
+    broker_disconnect();
+}
+
+/*
+ * Set up this backend's queues and wait for the broker to attach to them
+ * Returns false if the broker is not running or has no free slot, in which case the backend sends its own requests
+ */
+static bool broker_connect(void) {
+    static bool exit_callback_registered = false;
+    MemoryContext oldCtx;
+    shm_mq *requests, *responses;
+    PGPROC *broker;
+    char *addr;
+    int waited_ms = 0;
+
+    if (broker_seg != NULL) return true;
+    if (broker_shared == NULL) return false;
+    SpinLockAcquire(&broker_shared->mutex);
+    broker = broker_shared->broker;
+    SpinLockRelease(&broker_shared->mutex);
+    if (broker == NULL) return false;
+
+    if (!exit_callback_registered) {
+        before_shmem_exit(broker_before_shmem_exit, (Datum) 0);
+        exit_callback_registered = true;
+    }
+
+    // the queues outlive the current transaction
+    oldCtx = MemoryContextSwitchTo(TopMemoryContext);
+    broker_seg = dsm_create(2 * PINECONE_BROKER_QUEUE_SIZE, 0);
+    dsm_pin_mapping(broker_seg);
+    addr = dsm_segment_address(broker_seg);
+    requests = shm_mq_create(addr, PINECONE_BROKER_QUEUE_SIZE);
+    responses = shm_mq_create(addr + PINECONE_BROKER_QUEUE_SIZE, PINECONE_BROKER_QUEUE_SIZE);
+    shm_mq_set_sender(requests, MyProc);
+    shm_mq_set_receiver(responses, MyProc);
+    broker_requests = shm_mq_attach(requests, broker_seg, NULL);
+    broker_responses = shm_mq_attach(responses, broker_seg, NULL);
+    MemoryContextSwitchTo(oldCtx);
+
+    // take a free slot
+    SpinLockAcquire(&broker_shared->mutex);
+    for (int i = 0; i < broker_shared->n_slots; i++) {
+        if (broker_shared->slots[i] == DSM_HANDLE_INVALID) {
+            broker_shared->slots[i] = dsm_segment_handle(broker_seg);
+            broker_slot = i;
+            break;
+        }
+    }
+    broker = broker_shared->broker;
+    SpinLockRelease(&broker_shared->mutex);
+    if (broker_slot < 0 || broker == NULL) {
+        elog(DEBUG1, "pinecone request broker has no free slot, sending requests directly");
+        broker_disconnect();
+        return false;
+    }
+    SetLatch(&broker->procLatch);
+
+    // the broker sets our latch when it attaches as the sender of our responses
+    while (shm_mq_get_sender(responses) == NULL) {
+        if (waited_ms >= PINECONE_BROKER_ATTACH_TIMEOUT_MS) {
+            elog(WARNING, "pinecone request broker did not respond, sending requests directly");
+            broker_disconnect();
+            return false;
+        }
+        (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 100, PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+        waited_ms += 100;
+    }
+    return true;
+}
+
+static void broker_lost(void) {
+    broker_disconnect();
+    ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE), errmsg("pinecone request broker exited")));
+}
+
+/*
+ * Send the requests of a call and read their responses. Responses to an earlier call are dropped.
+ */
+static void broker_exchange(uint64 call_no, const char *api_key, int n, CURL **handles, ResponseData **response_data, CURLcode *curl_codes) {
+    int n_sent = 0;
+    bool *answered = palloc0(sizeof(bool) * Max(n, 1));
+
+    for (int i = 0; i < n; i++) {
+        PineconeBrokerRequest request;
+        shm_mq_iovec iov[4];
+        shm_mq_result res;
+        char *url;
+        if (handles[i] == NULL) continue;
+        curl_easy_getinfo(handles[i], CURLINFO_EFFECTIVE_URL, &url);
+        memset(&request, 0, sizeof(request));
+        request.call_no = call_no;
+        request.request_no = i;
+        strlcpy(request.method, response_data[i]->method, sizeof(request.method));
+        request.gzipped = response_data[i]->request_gzipped;
+        request.url_length = strlen(url);
+        request.api_key_length = strlen(api_key);
+        request.body_length = response_data[i]->request_body == NULL ? 0 : response_data[i]->request_length;
+        iov[0].data = (const char *) &request; iov[0].len = sizeof(request);
+        iov[1].data = url; iov[1].len = request.url_length;
+        iov[2].data = api_key; iov[2].len = request.api_key_length;
+        iov[3].data = response_data[i]->request_body; iov[3].len = request.body_length;
+#if PG_VERSION_NUM >= 150000
+        res = shm_mq_sendv(broker_requests, iov, 4, false, true);
+#else
+        res = shm_mq_sendv(broker_requests, iov, 4, false);
+#endif
+        if (res != SHM_MQ_SUCCESS) broker_lost();
+        n_sent++;
+    }
+
+    for (int received = 0; received < n_sent;) {
+        PineconeBrokerResponse response;
+        ResponseData *rd;
+        Size nbytes;
+        void *data;
+        if (shm_mq_receive(broker_responses, &nbytes, &data, false) != SHM_MQ_SUCCESS) broker_lost();
+        if (nbytes < sizeof(response)) {
+            ereport(ERROR, (errcode(ERRCODE_PROTOCOL_VIOLATION), errmsg("pinecone request broker sent a truncated response")));
+        }
+        memcpy(&response, data, sizeof(response));
+        if (response.call_no != call_no) {
+            elog(DEBUG1, "dropping a pinecone broker response to an earlier call");
+            continue;
+        }
+        if (response.request_no >= (uint32) n || handles[response.request_no] == NULL || answered[response.request_no] ||
+            nbytes != sizeof(response) + response.body_length) {
+            ereport(ERROR, (errcode(ERRCODE_PROTOCOL_VIOLATION),
+                            errmsg("pinecone request broker sent an unexpected response to request %u", response.request_no)));
+        }
+        answered[response.request_no] = true;
+        received++;
+        rd = response_data[response.request_no];
+        rd->data = palloc(response.body_length + 1);
+        memcpy(rd->data, (char *) data + sizeof(response), response.body_length);
+        rd->data[response.body_length] = '\0';
+        rd->length = response.body_length;
+        rd->capacity = response.body_length + 1;
+        rd->status = response.status;
+        if (curl_codes != NULL) curl_codes[response.request_no] = (CURLcode) response.curl_code;
+        pinecone_network_counters.requests++;
+        pinecone_network_counters.response_bytes_received += response.received;
+        pinecone_network_counters.response_bytes += response.body_length;
+    }
+    pfree(answered);
+}
+
+/*
+ * Send the prepared requests through the broker and wait for their responses
+ * Entries of handles may be NULL. The responses are stored like write_callback would, together with the status and
+ * curl code of each request (curl_codes may be NULL). Returns false if the broker is unavailable, in which case the
+ * caller performs the requests itself.
+ * Each call is numbered so that the backend can tell the responses of an earlier call apart. An error or cancel in the
+ * middle of a call leaves a partial message or unread responses in the queues, so the backend then detaches from
+ * them, and its next call connects again with new ones.
+ */
+bool PineconeBrokerPerform(const char *api_key, int n, CURL **handles, ResponseData **response_data, CURLcode *curl_codes) {
+    if (!broker_connect()) return false;
+    broker_call_no++;
+    PG_TRY();
+    {
+        broker_exchange(broker_call_no, api_key, n, handles, response_data, curl_codes);
+    }
+    PG_CATCH();
+    {
+        broker_disconnect();
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    return true;
+}
+
+/*
+ * Broker side
+ */
+
+typedef struct BrokerClient
+{
+    dsm_handle handle; // DSM_HANDLE_INVALID when the slot is unused
+    dsm_segment *seg;
+    shm_mq_handle *requests;
+    shm_mq_handle *responses;
+    uint64 generation; // incremented whenever the slot's backend goes away, so its outstanding responses are dropped
+    List *pending; // responses that did not fit in the queue yet, as BrokerMessage
+} BrokerClient;
+
+typedef struct BrokerMessage
+{
+    Size length;
+    char *data;
+} BrokerMessage;
+
+typedef struct BrokerWaiter
+{
+    int client;
+    uint64 generation;
+    uint64 call_no;
+    uint32 request_no;
+} BrokerWaiter;
+
+typedef struct BrokerTransfer
+{
+    CURL *hnd;
+    struct curl_slist *headers;
+    char *body;
+    ResponseData response_data;
+    List *waiters; // every backend request answered by this transfer
+} BrokerTransfer;
+
+// upserts to the same url, api key and namespace that are merged into one request
+typedef struct BrokerUpsertGroup
+{
+    char *key;
+    char *url;
+    char *api_key;
+    char *pinecone_namespace;
+    cJSON *vectors;
+    List *waiters;
+} BrokerUpsertGroup;
+
+static BrokerClient *clients;
+static MemoryContext broker_ctx;
+
+static void broker_shmem_exit(int code, Datum arg) {
+    SpinLockAcquire(&broker_shared->mutex);
+    broker_shared->broker = NULL;
+    SpinLockRelease(&broker_shared->mutex);
+}
+
+static void broker_drop_client(BrokerClient *client) {
+    ListCell *lc;
+    if (client->seg != NULL) dsm_detach(client->seg);
+    foreach(lc, client->pending) {
+        pfree(((BrokerMessage *) lfirst(lc))->data);
+    }
+    list_free_deep(client->pending);
+    client->pending = NIL;
+    client->seg = NULL;
+    client->requests = NULL;
+    client->responses = NULL;
+    client->handle = DSM_HANDLE_INVALID;
+    client->generation++;
+}
+
+/*
+ * Attach to the queues of newly connected backends and forget those that went away
+ */
+static void broker_attach_clients(void) {
+    for (int i = 0; i < broker_shared->n_slots; i++) {
+        BrokerClient *client = &clients[i];
+        dsm_handle handle;
+        MemoryContext oldCtx;
+        char *addr;
+        SpinLockAcquire(&broker_shared->mutex);
+        handle = broker_shared->slots[i];
+        SpinLockRelease(&broker_shared->mutex);
+        if (handle == client->handle) continue;
+        if (client->handle != DSM_HANDLE_INVALID) broker_drop_client(client);
+        if (handle == DSM_HANDLE_INVALID) continue;
+
+        oldCtx = MemoryContextSwitchTo(TopMemoryContext);
+        client->seg = dsm_attach(handle);
+        if (client->seg == NULL) {
+            // the backend is already gone
+            MemoryContextSwitchTo(oldCtx);
+            continue;
+        }
+        dsm_pin_mapping(client->seg);
+        addr = dsm_segment_address(client->seg);
+        shm_mq_set_receiver((shm_mq *) addr, MyProc);
+        shm_mq_set_sender((shm_mq *) (addr + PINECONE_BROKER_QUEUE_SIZE), MyProc);
+        client->requests = shm_mq_attach((shm_mq *) addr, client->seg, NULL);
+        client->responses = shm_mq_attach((shm_mq *) (addr + PINECONE_BROKER_QUEUE_SIZE), client->seg, NULL);
+        client->handle = handle;
+        MemoryContextSwitchTo(oldCtx);
+    }
+}
+
+static void broker_start_transfer(CURLM *multi, const char *url, const char *api_key, const char *method, char *body, Size body_length, bool gzipped, List *waiters) {
+    BrokerTransfer *transfer = palloc0(sizeof(BrokerTransfer));
+    transfer->hnd = curl_easy_init();
+    if (transfer->hnd == NULL) elog(ERROR, "Failed to initialize CURL handle");
+    transfer->response_data = (ResponseData) {"", NULL, NULL, 0, 0, "", 0, false, 0, NULL};
+    strcpy(transfer->response_data.message, "brokered request");
+    strlcpy(transfer->response_data.method, method, sizeof(transfer->response_data.method));
+    transfer->body = body;
+    transfer->waiters = waiters;
+    transfer->headers = create_common_headers(api_key);
+    if (gzipped) transfer->headers = curl_slist_append(transfer->headers, "content-encoding: gzip");
+    curl_easy_setopt(transfer->hnd, CURLOPT_HTTPHEADER, transfer->headers);
+    curl_easy_setopt(transfer->hnd, CURLOPT_CUSTOMREQUEST, method);
+    curl_easy_setopt(transfer->hnd, CURLOPT_URL, url);
+    curl_easy_setopt(transfer->hnd, CURLOPT_WRITEDATA, &transfer->response_data);
+    curl_easy_setopt(transfer->hnd, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(transfer->hnd, CURLOPT_ACCEPT_ENCODING, "");
+    // share connections: multiplex over HTTP/2 instead of opening a connection per request
+    curl_easy_setopt(transfer->hnd, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(transfer->hnd, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(transfer->hnd, CURLOPT_PRIVATE, transfer);
+    if (body != NULL) {
+        curl_easy_setopt(transfer->hnd, CURLOPT_POSTFIELDS, body);
+        curl_easy_setopt(transfer->hnd, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) body_length);
+    }
+    curl_multi_add_handle(multi, transfer->hnd);
+}
+
+static BrokerWaiter* broker_waiter(int client, PineconeBrokerRequest *request) {
+    BrokerWaiter *waiter = palloc(sizeof(BrokerWaiter));
+    waiter->client = client;
+    waiter->generation = clients[client].generation;
+    waiter->call_no = request->call_no;
+    waiter->request_no = request->request_no;
+    return waiter;
+}
+
+/*
+ * Add an upsert to a group with the same destination and room for its vectors
+ * Returns false if the upsert cannot be merged
+ */
+static bool broker_group_upsert(List **groups, int client, PineconeBrokerRequest *request, const char *url, const char *api_key, const char *body) {
+    cJSON *parsed, *vectors, *vector, *next;
+    char *pinecone_namespace, *key;
+    BrokerUpsertGroup *group = NULL;
+    ListCell *lc;
+    int n_vectors;
+
+    if (request->gzipped || strcmp(request->method, "POST") != 0) return false;
+    if (strlen(url) < strlen("/vectors/upsert") || strcmp(url + strlen(url) - strlen("/vectors/upsert"), "/vectors/upsert") != 0) return false;
+    parsed = cJSON_ParseWithLength(body, request->body_length);
+    vectors = cJSON_GetObjectItemCaseSensitive(parsed, "vectors");
+    if (!cJSON_IsArray(vectors)) {
+        cJSON_Delete(parsed);
+        return false;
+    }
+    n_vectors = cJSON_GetArraySize(vectors);
+    pinecone_namespace = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(parsed, "namespace"));
+    key = psprintf("%s %s %s", url, api_key, pinecone_namespace != NULL ? pinecone_namespace : "");
+
+    foreach(lc, *groups) {
+        BrokerUpsertGroup *candidate = lfirst(lc);
+        if (strcmp(candidate->key, key) == 0 && cJSON_GetArraySize(candidate->vectors) + n_vectors <= pinecone_vectors_per_request) {
+            group = candidate;
+            break;
+        }
+    }
+    if (group == NULL) {
+        group = palloc0(sizeof(BrokerUpsertGroup));
+        group->key = key;
+        group->url = pstrdup(url);
+        group->api_key = pstrdup(api_key);
+        group->pinecone_namespace = pinecone_namespace != NULL ? pstrdup(pinecone_namespace) : NULL;
+        group->vectors = cJSON_CreateArray();
+        *groups = lappend(*groups, group);
+    }
+    for (vector = vectors->child; vector != NULL; vector = next) {
+        next = vector->next;
+        cJSON_AddItemToArray(group->vectors, cJSON_DetachItemViaPointer(vectors, vector));
+    }
+    cJSON_Delete(parsed);
+    group->waiters = lappend(group->waiters, broker_waiter(client, request));
+    return true;
+}
+
+/*
+ * Take every request that is waiting in the queues and start its transfer
+ */
+static void broker_receive_requests(CURLM *multi) {
+    List *groups = NIL;
+    ListCell *lc;
+    for (int i = 0; i < broker_shared->n_slots; i++) {
+        BrokerClient *client = &clients[i];
+        while (client->requests != NULL) {
+            PineconeBrokerRequest request;
+            shm_mq_result res;
+            Size nbytes;
+            void *data;
+            char *url, *api_key, *body = NULL;
+            res = shm_mq_receive(client->requests, &nbytes, &data, true);
+            if (res == SHM_MQ_WOULD_BLOCK) break;
+            if (res == SHM_MQ_DETACHED) {
+                broker_drop_client(client);
+                break;
+            }
+            // the message is only valid until the next receive
+            memcpy(&request, data, sizeof(request));
+            url = pnstrdup((char *) data + sizeof(request), request.url_length);
+            api_key = pnstrdup((char *) data + sizeof(request) + request.url_length, request.api_key_length);
+            if (request.body_length > 0) {
+                body = palloc(request.body_length + 1);
+                memcpy(body, (char *) data + sizeof(request) + request.url_length + request.api_key_length, request.body_length);
+                body[request.body_length] = '\0';
+            }
+            if (body != NULL && broker_group_upsert(&groups, i, &request, url, api_key, body)) {
+                pfree(body);
+            } else {
+                broker_start_transfer(multi, url, api_key, request.method, body, request.body_length, request.gzipped,
+                                      list_make1(broker_waiter(i, &request)));
+            }
+            pfree(url);
+            pfree(api_key);
+        }
+    }
+
+    foreach(lc, groups) {
+        BrokerUpsertGroup *group = lfirst(lc);
+        cJSON *merged = cJSON_CreateObject();
+        char *body;
+        cJSON_AddItemToObject(merged, "vectors", group->vectors);
+        if (group->pinecone_namespace != NULL) {
+            cJSON_AddItemToObject(merged, "namespace", cJSON_CreateString(group->pinecone_namespace));
+        }
+        body = cJSON_PrintUnformatted(merged);
+        cJSON_Delete(merged);
+        elog(DEBUG1, "pinecone broker merged %d upserts to %s", list_length(group->waiters), group->url);
+        broker_start_transfer(multi, group->url, group->api_key, "POST", body, strlen(body), false, group->waiters);
+        pfree(group->key);
+        pfree(group->url);
+        pfree(group->api_key);
+        if (group->pinecone_namespace != NULL) pfree(group->pinecone_namespace);
+    }
+    list_free_deep(groups);
+}
+
+/*
+ * Queue the responses of finished transfers for the backends that wait for them
+ */
+static void broker_finish_transfers(CURLM *multi) {
+    CURLMsg *msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+        BrokerTransfer *transfer;
+        PineconeBrokerResponse response;
+        curl_off_t received = 0;
+        ListCell *lc;
+        if (msg->msg != CURLMSG_DONE) continue;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &transfer);
+        memset(&response, 0, sizeof(response));
+        response.curl_code = msg->data.result;
+        curl_easy_getinfo(transfer->hnd, CURLINFO_RESPONSE_CODE, &response.status);
+        curl_easy_getinfo(transfer->hnd, CURLINFO_SIZE_DOWNLOAD_T, &received);
+        response.received = received;
+        response.body_length = transfer->response_data.length;
+
+        foreach(lc, transfer->waiters) {
+            BrokerWaiter *waiter = lfirst(lc);
+            BrokerClient *client = &clients[waiter->client];
+            BrokerMessage *message;
+            MemoryContext oldCtx;
+            if (client->generation != waiter->generation) continue; // the backend went away
+            oldCtx = MemoryContextSwitchTo(TopMemoryContext);
+            message = palloc(sizeof(BrokerMessage));
+            message->length = sizeof(response) + response.body_length;
+            message->data = palloc(message->length);
+            response.call_no = waiter->call_no;
+            response.request_no = waiter->request_no;
+            memcpy(message->data, &response, sizeof(response));
+            if (response.body_length > 0) memcpy(message->data + sizeof(response), transfer->response_data.data, response.body_length);
+            client->pending = lappend(client->pending, message);
+            MemoryContextSwitchTo(oldCtx);
+        }
+
+        curl_multi_remove_handle(multi, transfer->hnd);
+        curl_easy_cleanup(transfer->hnd);
+        curl_slist_free_all(transfer->headers);
+        if (transfer->response_data.data != NULL) pfree(transfer->response_data.data);
+        if (transfer->body != NULL) pfree(transfer->body);
+        list_free_deep(transfer->waiters);
+        pfree(transfer);
+    }
+}
+
+/*
+ * Hand queued responses to their backends without blocking; a full queue is retried on the next round
+ */
+static void broker_send_responses(void) {
+    for (int i = 0; i < broker_shared->n_slots; i++) {
+        BrokerClient *client = &clients[i];
+        while (client->pending != NIL) {
+            BrokerMessage *message = linitial(client->pending);
+            shm_mq_result res;
+#if PG_VERSION_NUM >= 150000
+            res = shm_mq_send(client->responses, message->length, message->data, true, true);
+#else
+            res = shm_mq_send(client->responses, message->length, message->data, true);
+#endif
+            if (res == SHM_MQ_WOULD_BLOCK) break;
+            if (res == SHM_MQ_DETACHED) {
+                broker_drop_client(client);
+                break;
+            }
+            client->pending = list_delete_first(client->pending);
+            pfree(message->data);
+            pfree(message);
+        }
+    }
+}
+
+void PineconeBrokerMain(Datum main_arg) {
+    CURLM *multi;
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    clients = MemoryContextAllocZero(TopMemoryContext, sizeof(BrokerClient) * broker_shared->n_slots);
+    broker_ctx = AllocSetContextCreate(TopMemoryContext, "Pinecone broker context", ALLOCSET_DEFAULT_SIZES);
+    MemoryContextSwitchTo(broker_ctx);
+
+    multi = curl_multi_init();
+    if (multi == NULL) elog(ERROR, "Failed to initialize CURL multi handle");
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) pinecone_broker_connections);
+
+    before_shmem_exit(broker_shmem_exit, (Datum) 0);
+    SpinLockAcquire(&broker_shared->mutex);
+    broker_shared->broker = MyProc;
+    SpinLockRelease(&broker_shared->mutex);
+    elog(LOG, "pinecone request broker started");
+
+    for (;;) {
+        int running = 0;
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+            curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) pinecone_broker_connections);
+        }
+
+        broker_attach_clients();
+        broker_receive_requests(multi);
+        curl_multi_perform(multi, &running);
+        broker_finish_transfers(multi);
+        broker_send_responses();
+
+        if (running > 0) {
+            int numfds;
+            // new requests only show up on our latch, so don't wait on the sockets for long
+            curl_multi_wait(multi, NULL, 0, 1, &numfds);
+            if (!PostmasterIsAlive()) proc_exit(1);
+        } else {
+            (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 1000, PG_WAIT_EXTENSION);
+        }
+    }
+}
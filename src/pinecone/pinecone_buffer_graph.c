@@ -0,0 +1,480 @@
+/*
+ * In-memory HNSW graph over the unready region of the pinecone buffer.
+ *
+ * The buffer is normally brute-forced by load_buffer_into_sort. When the
+ * remote index falls behind, the unready region can grow far past
+ * pinecone.max_buffer_scan. With pinecone.buffer_graph enabled, each backend
+ * keeps a small HNSW graph per checkpoint segment (the run of buffer pages
+ * between two consecutive checkpoints) and searches those graphs instead.
+ *
+ * - Graphs are maintained incrementally: each scan only reads the buffer
+ *   pages appended since the previous scan by this backend. The tids of the
+ *   tuples already read come from the segments for the bloom filter.
+ * - A segment's graph is discarded as soon as its checkpoint becomes ready,
+ *   i.e. once pinecone is serving those tuples itself.
+ * - A search returns up to ef_search candidates per segment. Once the scan
+ *   has consumed them, the rest of the buffer is sorted exhaustively.
+ *
+ * The graph reuses the in-memory code paths of the hnsw access method
+ * (HnswFindElementNeighbors, HnswUpdateConnection, HnswSearchLayer) with a
+ * NULL base and NULL index, exactly like a non-parallel in-memory hnsw build.
+ */
+#include "pinecone.h"
+#include "src/hnsw.h"
+
+#include <access/tableam.h>
+#include <catalog/index.h>
+#include <storage/bufmgr.h>
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+typedef struct PineconeBufferGraphSegment
+{
+    int checkpoint_no; // checkpoint that starts this segment
+    MemoryContext ctx; // holds the elements and their vectors
+    HnswElement entry_point;
+    int n_elements;
+    ItemPointerData* tids; // every buffer tuple of the segment, including those without an element
+    int n_tids;
+    int max_tids;
+    Size memory; // allocated in ctx
+} PineconeBufferGraphSegment;
+
+typedef struct PineconeBufferGraph
+{
+    Oid indexrelid; // hash key
+    Oid relfilenode; // detect REINDEX and TRUNCATE
+    List* segments; // oldest first
+    // position of the last buffer tuple that has been added to a segment
+    BlockNumber last_blkno;
+    OffsetNumber last_offno;
+    bool full; // stopped growing because pinecone.buffer_graph_mem was reached
+    Size memory; // of all segments
+} PineconeBufferGraph;
+
+static HTAB* buffer_graphs = NULL;
+static MemoryContext buffer_graph_ctx = NULL;
+
+static PineconeBufferGraph* get_buffer_graph(Relation index)
+{
+    PineconeBufferGraph* graph;
+    Oid indexrelid = RelationGetRelid(index);
+    bool found;
+
+    if (buffer_graphs == NULL) {
+        HASHCTL ctl;
+        buffer_graph_ctx = AllocSetContextCreate(TopMemoryContext, "Pinecone buffer graphs", ALLOCSET_DEFAULT_SIZES);
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(PineconeBufferGraph);
+        ctl.hcxt = buffer_graph_ctx;
+        buffer_graphs = hash_create("Pinecone buffer graphs", 16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+        // the graph's element locks need a registered tranche
+        HnswInitLockTranche();
+    }
+
+    graph = hash_search(buffer_graphs, &indexrelid, HASH_ENTER, &found);
+    if (found && graph->relfilenode != index->rd_rel->relfilenode) {
+        // the index was rebuilt underneath us; start over
+        ListCell* lc;
+        foreach(lc, graph->segments) {
+            MemoryContextDelete(((PineconeBufferGraphSegment*) lfirst(lc))->ctx);
+        }
+        list_free_deep(graph->segments);
+        found = false;
+    }
+    if (!found) {
+        graph->relfilenode = index->rd_rel->relfilenode;
+        graph->segments = NIL;
+        graph->last_blkno = InvalidBlockNumber;
+        graph->last_offno = InvalidOffsetNumber;
+        graph->full = false;
+        graph->memory = 0;
+    }
+    return graph;
+}
+
+/*
+ * Drop the graphs of segments whose checkpoints are now ready.
+ */
+static void discard_ready_segments(PineconeBufferGraph* graph, PineconeCheckpoint ready_checkpoint)
+{
+    while (graph->segments != NIL) {
+        PineconeBufferGraphSegment* segment = linitial(graph->segments);
+        if (segment->checkpoint_no >= ready_checkpoint.checkpoint_no) break;
+        elog(DEBUG1, "Discarding buffer graph for checkpoint %d (%d elements)", segment->checkpoint_no, segment->n_elements);
+        graph->memory -= segment->memory;
+        MemoryContextDelete(segment->ctx);
+        pfree(segment);
+        graph->segments = list_delete_first(graph->segments);
+        graph->full = false;
+    }
+}
+
+/*
+ * Segments are only created when a tuple is inserted, and tuples are inserted in buffer order,
+ * so appending keeps the list sorted by checkpoint number.
+ */
+static PineconeBufferGraphSegment* get_segment(PineconeBufferGraph* graph, int checkpoint_no)
+{
+    PineconeBufferGraphSegment* segment;
+    MemoryContext oldCtx;
+
+    if (graph->segments != NIL) {
+        segment = llast(graph->segments);
+        if (segment->checkpoint_no == checkpoint_no) return segment;
+    }
+    oldCtx = MemoryContextSwitchTo(buffer_graph_ctx);
+    segment = palloc(sizeof(PineconeBufferGraphSegment));
+    segment->checkpoint_no = checkpoint_no;
+    segment->ctx = AllocSetContextCreate(buffer_graph_ctx, "Pinecone buffer graph segment", ALLOCSET_DEFAULT_SIZES);
+    segment->entry_point = NULL;
+    segment->n_elements = 0;
+    segment->max_tids = 64;
+    segment->tids = MemoryContextAlloc(segment->ctx, sizeof(ItemPointerData) * segment->max_tids);
+    segment->n_tids = 0;
+    segment->memory = GetMemoryChunkSpace(segment->tids);
+    graph->memory += segment->memory;
+    graph->segments = lappend(graph->segments, segment);
+    MemoryContextSwitchTo(oldCtx);
+    return segment;
+}
+
+static void* segment_alloc(Size size, void* state)
+{
+    PineconeBufferGraphSegment* segment = (PineconeBufferGraphSegment*) state;
+    void* ptr = MemoryContextAlloc(segment->ctx, size);
+    segment->memory += GetMemoryChunkSpace(ptr);
+    return ptr;
+}
+
+/*
+ * Whether a segment holds the tid, which is the case for the copy of a tuple that a flush moved to the end of the buffer
+ * after the graph read it
+ */
+static bool graph_holds_tid(PineconeBufferGraph* graph, ItemPointerData tid)
+{
+    ListCell* lc;
+    foreach(lc, graph->segments) {
+        PineconeBufferGraphSegment* segment = (PineconeBufferGraphSegment*) lfirst(lc);
+        for (int i = 0; i < segment->n_tids; i++) {
+            if (ItemPointerEquals(&segment->tids[i], &tid)) return true;
+        }
+    }
+    return false;
+}
+
+static void segment_add_tid(PineconeBufferGraph* graph, PineconeBufferGraphSegment* segment, ItemPointerData tid)
+{
+    if (segment->n_tids == segment->max_tids) {
+        Size old_space = GetMemoryChunkSpace(segment->tids);
+        Size new_space;
+        segment->max_tids *= 2;
+        segment->tids = repalloc(segment->tids, sizeof(ItemPointerData) * segment->max_tids);
+        new_space = GetMemoryChunkSpace(segment->tids);
+        segment->memory += new_space - old_space;
+        graph->memory += new_space - old_space;
+    }
+    segment->tids[segment->n_tids++] = tid;
+}
+
+/*
+ * Insert one vector into a segment's graph (same steps as an in-memory hnsw build).
+ * The element lives in the segment's context; the search itself allocates in tmpCtx.
+ */
+static void segment_insert(PineconeBufferGraph* graph, PineconeBufferGraphSegment* segment, ItemPointer heap_tid, Datum value, FmgrInfo* procinfo, Oid collation, MemoryContext tmpCtx)
+{
+    int m = HNSW_DEFAULT_M;
+    HnswElement element;
+    HnswAllocator allocator;
+    Pointer value_ptr;
+    Size value_size;
+    Size memory_before = segment->memory;
+    MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+    allocator.alloc = segment_alloc;
+    allocator.state = segment;
+
+    value = PointerGetDatum(PG_DETOAST_DATUM(value));
+    value_size = VARSIZE_ANY(DatumGetPointer(value));
+    element = HnswInitElement(NULL, heap_tid, m, HnswGetMl(m), HnswGetMaxLevel(m), &allocator);
+    value_ptr = HnswAlloc(&allocator, value_size);
+    memcpy(value_ptr, DatumGetPointer(value), value_size);
+    HnswPtrStore((char*) NULL, element->value, value_ptr);
+    LWLockInitialize(&element->lock, hnsw_lock_tranche_id);
+
+    HnswFindElementNeighbors(NULL, element, segment->entry_point, NULL, procinfo, collation, m, HNSW_DEFAULT_EF_CONSTRUCTION, false);
+
+    // add reverse connections
+    for (int lc = element->level; lc >= 0; lc--) {
+        int lm = HnswGetLayerM(m, lc);
+        HnswNeighborArray* neighbors = HnswGetNeighbors((char*) NULL, element, lc);
+        for (int i = 0; i < neighbors->length; i++) {
+            HnswCandidate* hc = &neighbors->items[i];
+            HnswUpdateConnection(NULL, element, hc, lm, lc, NULL, NULL, procinfo, collation);
+        }
+    }
+
+    if (segment->entry_point == NULL || element->level > segment->entry_point->level) {
+        segment->entry_point = element;
+    }
+    segment->n_elements++;
+    graph->memory += segment->memory - memory_before;
+    MemoryContextSwitchTo(oldCtx);
+    MemoryContextReset(tmpCtx);
+}
+
+/*
+ * Put a buffer tuple into the scan's sortstate, remembering it for the fallback
+ */
+static void sort_buffer_tuple(PineconeScanOpaque so, TupleTableSlot* slot, double distance, ItemPointer tid)
+{
+    if (so->n_graph_tids == so->max_graph_tids) {
+        so->max_graph_tids = Max(so->max_graph_tids * 2, 64);
+        so->graph_tids = so->graph_tids == NULL ? palloc(sizeof(ItemPointerData) * so->max_graph_tids)
+                                                : repalloc(so->graph_tids, sizeof(ItemPointerData) * so->max_graph_tids);
+    }
+    so->graph_tids[so->n_graph_tids++] = *tid;
+    ExecClearTuple(slot);
+    slot->tts_values[0] = Float8GetDatum(distance);
+    slot->tts_isnull[0] = false;
+    slot->tts_values[1] = Int32GetDatum(ItemPointerGetBlockNumber(tid));
+    slot->tts_isnull[1] = false;
+    slot->tts_values[2] = Int16GetDatum(ItemPointerGetOffsetNumber(tid));
+    slot->tts_isnull[2] = false;
+    ExecStoreVirtualTuple(slot);
+    tuplesort_puttupleslot(so->sortstate, slot);
+}
+
+/*
+ * Add the ef_search nearest elements of a segment to the scan's sortstate
+ */
+static int segment_search(PineconeBufferGraphSegment* segment, PineconeScanOpaque so, Datum q, Oid collation, TupleTableSlot* slot)
+{
+    int m = HNSW_DEFAULT_M;
+    List* ep;
+    List* w;
+    ListCell* lc2;
+    int n_added = 0;
+
+    if (segment->entry_point == NULL) return 0;
+
+    ep = list_make1(HnswEntryCandidate(NULL, segment->entry_point, q, NULL, so->procinfo, collation, false));
+    for (int lc = segment->entry_point->level; lc >= 1; lc--) {
+        ep = HnswSearchLayer(NULL, q, ep, 1, lc, NULL, so->procinfo, collation, m, false, NULL);
+    }
+    w = HnswSearchLayer(NULL, q, ep, pinecone_buffer_graph_ef_search, 0, NULL, so->procinfo, collation, m, false, NULL);
+    // the elements past ef_search are left to the fallback
+    if (list_length(w) < segment->n_elements) so->graph_truncated = true;
+
+    foreach(lc2, w) {
+        HnswCandidate* hc = (HnswCandidate*) lfirst(lc2);
+        HnswElement element = HnswPtrAccess((char*) NULL, hc->element);
+        for (int i = 0; i < element->heaptidsLength; i++) {
+            sort_buffer_tuple(so, slot, hc->distance, &element->heaptids[i]);
+            n_added++;
+        }
+    }
+    return n_added;
+}
+
+/*
+ * Search the unready buffer through the per-segment graphs.
+ * Like load_buffer_into_sort, every buffer tid is added to the scan's bloom filter, but only the pages
+ * appended since the previous scan are read; the tids before them come from the segments.
+ */
+void PineconeBufferGraphSearch(Relation index, PineconeScanOpaque so, Datum query_datum, PineconeBufferMetaPageData buffer_meta)
+{
+    PineconeBufferGraph* graph = get_buffer_graph(index);
+    int checkpoint_no = buffer_meta.ready_checkpoint.checkpoint_no;
+    BlockNumber currentblkno = buffer_meta.ready_checkpoint.blkno;
+    TupleTableSlot* slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsVirtual);
+    Oid collation = index->rd_indcollation[0];
+    Datum q = PointerGetDatum(PG_DETOAST_DATUM(query_datum));
+    Size max_memory = (Size) pinecone_buffer_graph_mem * 1024L;
+    int max_buffer_scan = PineconeGetSettings(index).max_buffer_scan;
+    int n_inserted = 0, n_brute_forced = 0, n_sorted = 0;
+    ListCell* lc;
+    MemoryContext tmpCtx = AllocSetContextCreate(CurrentMemoryContext, "Pinecone buffer graph temporary context", ALLOCSET_DEFAULT_SIZES);
+
+    // index info
+    IndexInfo *indexInfo = BuildIndexInfo(index);
+    Datum* index_values = palloc(sizeof(Datum) * indexInfo->ii_NumIndexAttrs);
+    bool* index_isnull = palloc(sizeof(bool) * indexInfo->ii_NumIndexAttrs);
+    // get the base table
+    Relation baseTableRel = RelationIdGetRelation(index->rd_index->indrelid);
+    IndexFetchTableData *fetchData = baseTableRel->rd_tableam->index_fetch_begin(baseTableRel);
+    TupleTableSlot *base_table_slot = MakeSingleTupleTableSlot(baseTableRel->rd_att, &TTSOpsBufferHeapTuple);
+    Snapshot snapshot = GetActiveSnapshot();
+    bool call_again, all_dead;
+
+    // the fallback scans the same buffer with the same query
+    so->graph_start_blkno = buffer_meta.ready_checkpoint.blkno;
+    so->graph_query = q;
+
+    discard_ready_segments(graph, buffer_meta.ready_checkpoint);
+
+    // the tuples that the segments hold are not read again
+    foreach(lc, graph->segments) {
+        PineconeBufferGraphSegment* segment = (PineconeBufferGraphSegment*) lfirst(lc);
+        for (int i = 0; i < segment->n_tids; i++) {
+            pinecone_bloom_filter_add(so, segment->tids[i]);
+        }
+    }
+    if (graph->segments != NIL && BlockNumberIsValid(graph->last_blkno)) {
+        currentblkno = graph->last_blkno;
+        checkpoint_no = ((PineconeBufferGraphSegment*) llast(graph->segments))->checkpoint_no;
+    } else {
+        // the segments of the last position were discarded, so the ready checkpoint is past it
+        graph->last_blkno = InvalidBlockNumber;
+        graph->last_offno = InvalidOffsetNumber;
+    }
+
+    while (BlockNumberIsValid(currentblkno)) {
+        Buffer buf = ReadBuffer(index, currentblkno);
+        Page page;
+        PineconeBufferOpaque opaque;
+        OffsetNumber offno = FirstOffsetNumber;
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        opaque = PineconePageGetOpaque(page);
+
+        // every checkpoint page starts a new segment
+        if (opaque->checkpoint.is_checkpoint) {
+            checkpoint_no = opaque->checkpoint.checkpoint_no;
+        }
+        // resume after the last tuple in a segment
+        if (currentblkno == graph->last_blkno) {
+            offno = OffsetNumberNext(graph->last_offno);
+        }
+
+        for (; offno <= PageGetMaxOffsetNumber(page); offno = OffsetNumberNext(offno)) {
+            PineconeBufferTuple buffer_tup = *((PineconeBufferTuple*) PageGetItem(page, PageGetItemId(page, offno)));
+            PineconeBufferGraphSegment* segment;
+
+            // a moved tuple is read at its copy, unless the graph already holds it
+            if (buffer_tup.flags & PINECONE_BUFFER_TUPLE_MOVED) continue;
+            if (pinecone_bloom_filter_contains(so, buffer_tup.tid) && graph_holds_tid(graph, buffer_tup.tid)) continue;
+
+            // add the tuple to the bloom filter
+            pinecone_bloom_filter_add(so, buffer_tup.tid);
+
+            if (!graph->full && graph->memory >= max_memory) {
+                ereport(NOTICE, (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                                 errmsg("Pinecone buffer graph no longer fits into pinecone.buffer_graph_mem"),
+                                 errhint("The remaining buffer tuples are scanned exhaustively. Increase pinecone.buffer_graph_mem to index them.")));
+                graph->full = true;
+            }
+
+            if (graph->full) {
+                // fetch with the scan's snapshot and compute the distance directly
+                if (n_brute_forced >= max_buffer_scan) continue;
+                call_again = false;
+                if (!baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, snapshot, base_table_slot, &call_again, &all_dead)) continue;
+                FormIndexDatum(indexInfo, base_table_slot, NULL, index_values, index_isnull);
+                if (index_isnull[0]) elog(ERROR, "vector is null");
+                sort_buffer_tuple(so, slot, DatumGetFloat8(FunctionCall2(so->procinfo, index_values[0], query_datum)), &buffer_tup.tid);
+                n_brute_forced++;
+                continue;
+            }
+
+            // the graph outlives this scan, so fetch any version of the tuple and let the executor check visibility
+            segment = get_segment(graph, checkpoint_no);
+            segment_add_tid(graph, segment, buffer_tup.tid);
+            call_again = false;
+            if (baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, SnapshotAny, base_table_slot, &call_again, &all_dead)) {
+                FormIndexDatum(indexInfo, base_table_slot, NULL, index_values, index_isnull);
+                if (!index_isnull[0]) {
+                    segment_insert(graph, segment, &buffer_tup.tid, index_values[0], so->procinfo, collation, tmpCtx);
+                    n_inserted++;
+                }
+            }
+            graph->last_blkno = currentblkno;
+            graph->last_offno = offno;
+        }
+
+        currentblkno = opaque->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+
+    ExecDropSingleTupleTableSlot(base_table_slot);
+    baseTableRel->rd_tableam->index_fetch_end(fetchData);
+    RelationClose(baseTableRel);
+    MemoryContextDelete(tmpCtx);
+
+    foreach(lc, graph->segments) {
+        n_sorted += segment_search((PineconeBufferGraphSegment*) lfirst(lc), so, q, collation, slot);
+    }
+    ExecDropSingleTupleTableSlot(slot);
+    elog(DEBUG1, "Buffer graph: %d segments, inserted %d, brute forced %d, sorted %d", list_length(graph->segments), n_inserted, n_brute_forced, n_sorted);
+}
+
+static int compare_tids(const void* a, const void* b)
+{
+    return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+/*
+ * Once the scan has consumed the graph's candidates and a segment had more elements than it returned, sort the
+ * rest of the buffer exhaustively, leaving out the tuples that were already sorted. Returns whether the sortstate
+ * has more tuples.
+ */
+bool PineconeBufferGraphFallback(Relation index, PineconeScanOpaque so)
+{
+    MemoryContext oldCtx = MemoryContextSwitchTo(so->scan_ctx);
+    TupleTableSlot* slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsVirtual);
+    BlockNumber currentblkno = so->graph_start_blkno;
+    int max_buffer_scan = PineconeGetSettings(index).max_buffer_scan;
+    int n_sorted = 0;
+    int n_skipped = so->n_graph_tids;
+    bool more;
+
+    // index info
+    IndexInfo *indexInfo = BuildIndexInfo(index);
+    Datum* index_values = palloc(sizeof(Datum) * indexInfo->ii_NumIndexAttrs);
+    bool* index_isnull = palloc(sizeof(bool) * indexInfo->ii_NumIndexAttrs);
+    // get the base table
+    Relation baseTableRel = RelationIdGetRelation(index->rd_index->indrelid);
+    IndexFetchTableData *fetchData = baseTableRel->rd_tableam->index_fetch_begin(baseTableRel);
+    TupleTableSlot *base_table_slot = MakeSingleTupleTableSlot(baseTableRel->rd_att, &TTSOpsBufferHeapTuple);
+    Snapshot snapshot = GetActiveSnapshot();
+    bool call_again, all_dead;
+
+    so->graph_truncated = false;
+    qsort(so->graph_tids, so->n_graph_tids, sizeof(ItemPointerData), compare_tids);
+    tuplesort_reset(so->sortstate);
+
+    while (BlockNumberIsValid(currentblkno) && n_sorted < max_buffer_scan) {
+        Buffer buf = ReadBuffer(index, currentblkno);
+        Page page;
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+
+        for (OffsetNumber offno = FirstOffsetNumber; offno <= PageGetMaxOffsetNumber(page); offno = OffsetNumberNext(offno)) {
+            PineconeBufferTuple buffer_tup = *((PineconeBufferTuple*) PageGetItem(page, PageGetItemId(page, offno)));
+            if (buffer_tup.flags & PINECONE_BUFFER_TUPLE_MOVED) continue;
+            if (bsearch(&buffer_tup.tid, so->graph_tids, n_skipped, sizeof(ItemPointerData), compare_tids) != NULL) continue;
+            call_again = false;
+            if (!baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, snapshot, base_table_slot, &call_again, &all_dead)) continue;
+            FormIndexDatum(indexInfo, base_table_slot, NULL, index_values, index_isnull);
+            if (index_isnull[0]) elog(ERROR, "vector is null");
+            sort_buffer_tuple(so, slot, DatumGetFloat8(FunctionCall2(so->procinfo, index_values[0], so->graph_query)), &buffer_tup.tid);
+            n_sorted++;
+        }
+
+        currentblkno = PineconePageGetOpaque(page)->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+
+    ExecDropSingleTupleTableSlot(base_table_slot);
+    baseTableRel->rd_tableam->index_fetch_end(fetchData);
+    RelationClose(baseTableRel);
+    ExecDropSingleTupleTableSlot(slot);
+    elog(DEBUG1, "Buffer graph fallback: skipped %d, sorted %d", n_skipped, n_sorted);
+
+    tuplesort_performsort(so->sortstate);
+    more = tuplesort_gettupleslot(so->sortstate, true, false, so->slot, NULL);
+    MemoryContextSwitchTo(oldCtx);
+    return more;
+}
@@ -9,6 +9,36 @@
 #include <access/tableam.h>
 // LockRelationForExtension in lmgr.h
 #include <storage/lmgr.h>
+#include "utils/memutils.h"
+#include "access/parallel.h"
+#include "access/table.h"
+#include "access/xact.h"
+#include "catalog/index.h"
+#include "catalog/partition.h"
+#include "catalog/pg_inherits.h"
+#include "utils/lsyscache.h"
+#include "commands/defrem.h"
+#include "commands/progress.h"
+#include "miscadmin.h"
+#include "optimizer/optimizer.h"
+#include "pgstat.h"
+#include "storage/fd.h"
+#include "tcop/tcopprot.h"
+#include "utils/snapmgr.h"
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/backend_status.h"
+#include "utils/wait_event.h"
+#endif
+
+#define PARALLEL_KEY_PINECONE_SHARED	UINT64CONST(0xA000000000000001)
+#define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000002)
+
+static char* CreatePineconeIndex(cJSON* spec_json, VectorMetric metric, char* pinecone_index_name, int dimensions);
+static void BufferBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, IndexBuildResult *result);
+
+// build progress files, relative to the data directory
+#define PINECONE_PROGRESS_DIR "pg_pinecone"
 
 
 void generateRandomAlphanumeric(char *s, const int length) {
@@ -48,6 +78,125 @@ char* get_pinecone_index_name(Relation index) {
 }
 
 
+/*
+ * Split a comma-separated host reloption into its hosts
+ */
+static int parse_host_list(char* host_list, char** hosts) {
+    int n_hosts = 0;
+    char* saveptr;
+    for (char* host = strtok_r(pstrdup(host_list), ",", &saveptr); host != NULL; host = strtok_r(NULL, ",", &saveptr)) {
+        // trim whitespace
+        while (isspace((unsigned char) *host)) host++;
+        for (char* end = host + strlen(host) - 1; end >= host && isspace((unsigned char) *end); end--) *end = '\0';
+        if (*host == '\0') continue;
+        if (n_hosts == PINECONE_MAX_SHARDS) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Too many hosts"),
+                            errhint("A pinecone index can be sharded across at most %d hosts.", PINECONE_MAX_SHARDS)));
+        }
+        hosts[n_hosts++] = host;
+    }
+    if (n_hosts == 0) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Invalid host: %s", host_list)));
+    }
+    return n_hosts;
+}
+
+
+/*
+ * Read the progress of an earlier build of the same table and column
+ * Returns false if there is none
+ */
+static bool ReadBuildProgress(PineconeBuildProgress *progress) {
+    FILE *file = AllocateFile(progress->path, "r");
+    char line[64];
+    bool ok;
+    if (file == NULL) {
+        if (errno != ENOENT) ereport(WARNING, (errcode_for_file_access(), errmsg("could not open file \"%s\": %m", progress->path)));
+        return false;
+    }
+    ok = fgets(progress->host, sizeof(progress->host), file) != NULL &&
+         fgets(progress->pinecone_index_name, sizeof(progress->pinecone_index_name), file) != NULL &&
+         fgets(line, sizeof(line), file) != NULL &&
+         sscanf(line, "%u " INT64_FORMAT, &progress->next_blkno, &progress->indtuples) == 2;
+    FreeFile(file);
+    if (!ok) {
+        ereport(WARNING, (errmsg("ignoring corrupted pinecone build progress file \"%s\"", progress->path)));
+        return false;
+    }
+    progress->host[strcspn(progress->host, "\n")] = '\0';
+    progress->pinecone_index_name[strcspn(progress->pinecone_index_name, "\n")] = '\0';
+    return true;
+}
+
+/*
+ * Durably record the progress of the build; the file is replaced atomically so a crash leaves either version
+ */
+static void WriteBuildProgress(PineconeBuildProgress *progress) {
+    char tmp_path[MAXPGPATH];
+    FILE *file;
+    if (MakePGDirectory(PINECONE_PROGRESS_DIR) < 0 && errno != EEXIST) {
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not create directory \"%s\": %m", PINECONE_PROGRESS_DIR)));
+    }
+    snprintf(tmp_path, MAXPGPATH, "%s.tmp", progress->path);
+    file = AllocateFile(tmp_path, PG_BINARY_W);
+    if (file == NULL) {
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not create file \"%s\": %m", tmp_path)));
+    }
+    fprintf(file, "%s\n%s\n%u " INT64_FORMAT "\n", progress->host, progress->pinecone_index_name, progress->next_blkno, progress->indtuples);
+    if (FreeFile(file)) {
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not write file \"%s\": %m", tmp_path)));
+    }
+    durable_rename(tmp_path, progress->path, ERROR);
+}
+
+static void RemoveBuildProgress(PineconeBuildProgress *progress) {
+    if (unlink(progress->path) < 0 && errno != ENOENT) {
+        ereport(WARNING, (errcode_for_file_access(), errmsg("could not remove file \"%s\": %m", progress->path)));
+    }
+}
+
+
+/*
+ * The remote index shared by the partitions of the partitioned index that the index belongs to, as found in the
+ * static meta page of a partition that was built before, and whether it is still being created. Returns false if no
+ * partition has been built yet.
+ */
+static bool FindPartitionRemoteIndex(Relation index, char* host, char* pinecone_index_name, bool* provisioning) {
+    List *ancestors = get_partition_ancestors(RelationGetRelid(index));
+    Oid amoid = get_am_oid("pinecone", false);
+    ListCell *lc;
+    bool found = false;
+    foreach(lc, find_all_inheritors(llast_oid(ancestors), AccessShareLock, NULL)) {
+        Oid sibling_oid = lfirst_oid(lc);
+        Relation sibling;
+        if (sibling_oid == RelationGetRelid(index) || get_rel_relkind(sibling_oid) != RELKIND_INDEX) continue;
+        sibling = index_open(sibling_oid, AccessShareLock);
+        if (sibling->rd_rel->relam == amoid && RelationGetNumberOfBlocks(sibling) > 0) {
+            PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(sibling);
+            if (static_meta.partition_namespace[0] != '\0') {
+                strlcpy(host, static_meta.host, PINECONE_HOST_MAX_LENGTH + 1);
+                strlcpy(pinecone_index_name, static_meta.pinecone_index_name, PINECONE_NAME_MAX_LENGTH + 1);
+                *provisioning = static_meta.provisioning;
+                found = true;
+            }
+        }
+        index_close(sibling, AccessShareLock);
+        if (found) break;
+    }
+    return found;
+}
+
+/*
+ * Name of the remote index shared by the partitions, after the top-level partitioned index
+ */
+static char* get_partition_remote_index_name(Relation index) {
+    List *ancestors = get_partition_ancestors(RelationGetRelid(index));
+    Relation root = index_open(llast_oid(ancestors), AccessShareLock);
+    char* pinecone_index_name = get_pinecone_index_name(root);
+    index_close(root, AccessShareLock);
+    return pinecone_index_name;
+}
+
 IndexBuildResult *pinecone_build(Relation heap, Relation index, IndexInfo *indexInfo)
 {
     PineconeOptions *opts = (PineconeOptions *) index->rd_options;
@@ -55,44 +204,150 @@ IndexBuildResult *pinecone_build(Relation heap, Relation index, IndexInfo *index
     VectorMetric metric = get_opclass_metric(index);
     cJSON* spec_json = cJSON_Parse(GET_STRING_RELOPTION(opts, spec));
     int dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
-    char* pinecone_index_name = get_pinecone_index_name(index);
+    char* pinecone_index_name;
     char* host = GET_STRING_RELOPTION(opts, host);
+    char* hosts[PINECONE_MAX_SHARDS];
+    int n_hosts = 1, n_shards = opts->shards;
+    bool shard_by_namespace;
+    bool resuming = false;
+    PineconeBuildProgress progress;
     cJSON* describe_index_response;
+    char* partition_namespace = NULL;
+    char partition_host[PINECONE_HOST_MAX_LENGTH + 1];
+    char partition_index_name[PINECONE_NAME_MAX_LENGTH + 1];
+    bool provisioning = false;
 
     validate_api_key();
 
+    // pinecone only combines sparse and dense values with the dotproduct metric
+    if (pinecone_sparse_attno(index->rd_att) >= 0 && metric != INNER_PRODUCT_METRIC) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("Sparse values require the vector_ip_ops operator class")));
+    }
+
+    // vacuum lists the remote ids, which pod indexes cannot do
+    if (opts->track_updates && cJSON_GetObjectItemCaseSensitive(spec_json, "pod") != NULL) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("track_updates requires a serverless index")));
+    }
+
+    // a partition of a partitioned index goes into its own namespace of the remote index that its siblings share
+    if (opts->namespace_per_partition && index->rd_rel->relispartition) {
+        if (opts->shards > 1 || strchr(host, ',') != NULL) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                            errmsg("namespace_per_partition cannot be combined with shards")));
+        }
+        partition_namespace = psprintf("partition-%u", RelationGetRelid(heap));
+    }
+
+    // look for the progress of an earlier, failed build of this column; the index's oid changes between attempts
+    memset(&progress, 0, sizeof(progress));
+    snprintf(progress.path, MAXPGPATH, "%s/build-%u-%u-%d", PINECONE_PROGRESS_DIR, MyDatabaseId, RelationGetRelid(heap), indexInfo->ii_IndexAttrNumbers[0]);
+    if (opts->resume) {
+        resuming = ReadBuildProgress(&progress);
+        if (!resuming) {
+            ereport(NOTICE, (errmsg("No earlier build of this index to resume, building from the beginning")));
+        } else if (strcmp(host, DEFAULT_HOST) != 0 && strcmp(host, progress.host) != 0) {
+            ereport(NOTICE, (errmsg("The earlier build of this index uploaded to %s, not %s. Building from the beginning", progress.host, host)));
+            resuming = false;
+        }
+    }
+    if (resuming) {
+        // reuse the remote index of the earlier build instead of creating another one
+        ereport(NOTICE, (errmsg("Resuming the build of remote index %s at %s from heap block %u", progress.pinecone_index_name, progress.host, progress.next_blkno),
+                         errdetail("Rows written to the blocks before it since the failed build are not reconciled with the remote index."),
+                         errhint("Build without resume if the table was modified after the failed build.")));
+        host = progress.host;
+        pinecone_index_name = progress.pinecone_index_name;
+    } else if (partition_namespace != NULL && strcmp(host, DEFAULT_HOST) == 0 && FindPartitionRemoteIndex(index, partition_host, partition_index_name, &provisioning)) {
+        ereport(DEBUG1, (errmsg("Building into namespace %s of remote index %s", partition_namespace, partition_index_name)));
+        host = partition_host;
+        pinecone_index_name = partition_index_name;
+        progress.next_blkno = 0;
+        progress.indtuples = 0;
+    } else {
+        pinecone_index_name = partition_namespace != NULL ? get_partition_remote_index_name(index) : get_pinecone_index_name(index);
+        progress.next_blkno = 0;
+        progress.indtuples = 0;
+    }
+
     // if the host is not specified, create a remote index and get the host
     if (strcmp(host, DEFAULT_HOST) == 0) {
         elog(DEBUG1, "Host not specified in reloptions, creating remote index from spec...");
-        host = CreatePineconeIndexAndWait(index, spec_json, metric, pinecone_index_name, dimensions);
+        pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_PINECONE_PHASE_CREATE);
+        provisioning = opts->async_provisioning;
+        // nothing else checks on the remote index if no more rows are written to the table
+        if (provisioning && !PineconeFlusherServesDatabase()) {
+            ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                            errmsg("async_provisioning requires the background flusher"),
+                            errhint("Set pinecone.flusher_database to this database and add vector to shared_preload_libraries.")));
+        }
+        if (provisioning) {
+            hosts[0] = CreatePineconeIndex(spec_json, metric, pinecone_index_name, dimensions);
+        } else {
+            hosts[0] = CreatePineconeIndexAndWait(index, spec_json, metric, pinecone_index_name, dimensions);
+        }
+        // pass host = '...' to reuse this remote index, e.g. to resume a failed build
+        ereport(LOG, (errmsg("created remote index %s at %s", pinecone_index_name, hosts[0])));
+        strlcpy(progress.host, hosts[0], sizeof(progress.host));
+    } else if (provisioning) {
+        hosts[0] = host; // of a sibling partition whose remote index is not ready, and may not be known yet
+    } else {
+        n_hosts = parse_host_list(host, hosts);
+        if (!resuming) strlcpy(progress.host, host, sizeof(progress.host));
+    }
+    if (!resuming) strlcpy(progress.pinecone_index_name, pinecone_index_name, sizeof(progress.pinecone_index_name));
+    // record the remote index before anything else can fail, so that a failed build can find it again
+    if (!opts->skip_build && !provisioning) WriteBuildProgress(&progress);
+
+    // shard across the listed hosts, or across namespaces of a single host
+    if (n_hosts > 1 && n_shards == 1) n_shards = n_hosts;
+    if (n_hosts > 1 && n_shards != n_hosts) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("Number of shards (%d) does not match the number of hosts (%d)", n_shards, n_hosts),
+                        errhint("Either list one host per shard or a single host whose namespaces are used as shards.")));
+    }
+    shard_by_namespace = n_shards > 1 && n_hosts == 1;
+    if (shard_by_namespace) {
+        for (int i = 1; i < n_shards; i++) hosts[i] = hosts[0];
     }
-
 
     // Describe the index.
-    describe_index_response = pinecone_get_index_stats(pinecone_api_key, host);
-    // if the host is specified, check that it is empty
-    if (strcmp(host, DEFAULT_HOST) != 0) {
-        elog(DEBUG1, "Host specified in reloptions, checking if it is empty. Got response: %s", cJSON_Print(describe_index_response));
-        // todo: check if the index is empty, check that the dimensions and metric match
-        // todo: emit warning when pods fill up
+    for (int i = 0; i < n_hosts && !provisioning; i++) {
+        describe_index_response = pinecone_get_index_stats(pinecone_api_key, hosts[i]);
+        // if the host is specified, check that it is empty
+        if (strcmp(host, DEFAULT_HOST) != 0) {
+            elog(DEBUG1, "Host specified in reloptions, checking if it is empty. Got response: %s", cJSON_Print(describe_index_response));
+            // todo: check if the index is empty, check that the dimensions and metric match
+            // todo: emit warning when pods fill up
+        }
     }
 
-    // if overwrite is true, delete all vectors in the remote index
-    if (opts->overwrite) {
+    // init the index pages: static meta, buffer meta, and buffer head
+    InitIndexPages(index, metric, dimensions, pinecone_index_name, hosts, n_shards, shard_by_namespace, partition_namespace, provisioning, MAIN_FORKNUM);
+
+    // if overwrite is true, delete all vectors in the remote index (but keep those a resumed build already uploaded)
+    if (opts->overwrite && !resuming && !provisioning) {
+        PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(index);
+        PineconeShard* shards = PineconeGetShards(&static_meta, &n_shards);
         elog(DEBUG1, "Overwrite is true, deleting all vectors in remote index...");
-        pinecone_delete_all(pinecone_api_key, host);
+        for (int i = 0; i < n_shards; i++) {
+            pinecone_delete_all(pinecone_api_key, shards[i].host, shards[i].pinecone_namespace);
+        }
     }
 
-    // init the index pages: static meta, buffer meta, and buffer head
-    InitIndexPages(index, metric, dimensions, pinecone_index_name, host, MAIN_FORKNUM);
-
     // iterate through the base table and upsert the vectors to the remote index
     if (opts->skip_build) {
         elog(DEBUG1, "Skipping build");
         result->heap_tuples = 0;
         result->index_tuples = 0;
+    } else if (provisioning) {
+        // the remote index is not ready, so the table goes into the buffer, which the first flush after it is ready uploads
+        ereport(NOTICE, (errmsg("Remote index %s is being created, buffering the table until it is ready", pinecone_index_name)));
+        BufferBaseTable(heap, index, indexInfo, result);
     } else {
-        InsertBaseTable(heap, index, indexInfo, host, result);
+        InsertBaseTable(heap, index, indexInfo, &progress, result);
+        RemoveBuildProgress(&progress);
     }
     return result;
 }
@@ -105,11 +360,19 @@ const char* vector_metric_to_pinecone_metric[VECTOR_METRIC_COUNT] = {
     "dotproduct"
 };
 
-char* CreatePineconeIndexAndWait(Relation index, cJSON* spec_json, VectorMetric metric, char* pinecone_index_name, int dimensions) {
-    char* host = palloc(100);
+/*
+ * Ask for a remote index to be created, without waiting for it to be ready. Returns its host, which is empty if the
+ * response did not include it yet.
+ */
+static char* CreatePineconeIndex(cJSON* spec_json, VectorMetric metric, char* pinecone_index_name, int dimensions) {
     const char* pinecone_metric_name = vector_metric_to_pinecone_metric[metric];
     cJSON* create_response = pinecone_create_index(pinecone_api_key, pinecone_index_name, dimensions, pinecone_metric_name, spec_json);
-    host = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(create_response, "host"));
+    char* host = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(create_response, "host"));
+    return host != NULL ? host : "";
+}
+
+char* CreatePineconeIndexAndWait(Relation index, cJSON* spec_json, VectorMetric metric, char* pinecone_index_name, int dimensions) {
+    char* host = CreatePineconeIndex(spec_json, metric, pinecone_index_name, dimensions);
     // now we wait until the pinecone index is done initializing
     // todo: timeout and error handling
     while (true)
@@ -126,22 +389,372 @@ char* CreatePineconeIndexAndWait(Relation index, cJSON* spec_json, VectorMetric
     return host;
 }
 
-void InsertBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, char* host, IndexBuildResult *result) {
+/*
+ * Record that the remote index of an index built with async_provisioning is ready, once describe_index says so.
+ * Returns false while it is still being created, or while another backend checked it recently; flushes wait for
+ * it, and scans only search the buffer.
+ */
+bool PineconeFinishProvisioning(Relation index) {
+    PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(index);
+    cJSON *describe_index_response;
+    char *host;
+    GenericXLogState *state;
+    Buffer meta_buf;
+    PineconeStaticMetaPage meta;
+    if (!static_meta.provisioning) return true;
+    if (!PineconeClaimProvisioningCheck(index)) return false;
+
+    describe_index_response = describe_index(pinecone_api_key, static_meta.pinecone_index_name);
+    if (!cJSON_IsTrue(cJSON_GetObjectItem(cJSON_GetObjectItem(describe_index_response, "status"), "ready"))) {
+        elog(DEBUG1, "Remote index %s is not ready yet", static_meta.pinecone_index_name);
+        return false;
+    }
+    host = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(describe_index_response, "host"));
+    if (host == NULL || strlen(host) > PINECONE_HOST_MAX_LENGTH) host = static_meta.host;
+
+    state = GenericXLogStart(index);
+    meta_buf = ReadBuffer(index, PINECONE_STATIC_METAPAGE_BLKNO);
+    LockBuffer(meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    meta = PineconePageGetStaticMeta(GenericXLogRegisterBuffer(state, meta_buf, 0));
+    strlcpy(meta->host, host, PINECONE_HOST_MAX_LENGTH + 1);
+    meta->provisioning = false;
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(meta_buf);
+    ereport(LOG, (errmsg("remote index %s at %s is ready", static_meta.pinecone_index_name, host)));
+    return true;
+}
+
+/*
+ * Append every tuple of the table to the buffer, for an index whose remote index is not ready to take uploads
+ */
+static void pinecone_buffer_build_callback(Relation index, ItemPointer tid, Datum *values, bool *isnull, bool tupleIsAlive, void *state)
+{
+    PineconeBuildState *buildstate = (PineconeBuildState *) state;
+    buildstate->buffer_tuples[buildstate->n_buffer_tuples++] = PineconeMakeBufferTuple(tid);
+    buildstate->indtuples++;
+    // append a page at a time
+    if (buildstate->n_buffer_tuples == PINECONE_PAGE_TUPLES) {
+        AppendBufferTuples(index, buildstate->buffer_tuples, buildstate->n_buffer_tuples);
+        buildstate->n_buffer_tuples = 0;
+    }
+}
+
+static void BufferBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, IndexBuildResult *result) {
+    PineconeBuildState buildstate;
+    memset(&buildstate, 0, sizeof(buildstate));
+    buildstate.buffer_tuples = palloc(sizeof(PineconeBufferTuple) * PINECONE_PAGE_TUPLES);
+    result->heap_tuples = table_index_build_scan(heap, index, indexInfo, true, true, pinecone_buffer_build_callback, (void *) &buildstate, NULL);
+    AppendBufferTuples(index, buildstate.buffer_tuples, buildstate.n_buffer_tuples);
+    result->index_tuples = buildstate.indtuples;
+    pfree(buildstate.buffer_tuples);
+    // the remote index may be ready by the time the build commits, otherwise the background flusher uploads the buffer
+    FlushAtCommit(index);
+}
+
+/*
+ * Upsert the current batch, then record and report the progress of the build
+ */
+static void UploadBatch(PineconeBuildState *buildstate) {
+    int64 batch_tuples = cJSON_GetArraySize(buildstate->json_vectors);
+    int64 batch_bytes = pinecone_network_counters.request_bytes_sent;
+    int64 tuples_done, bytes_done;
+    pinecone_bulk_upsert(pinecone_api_key, buildstate->shards, buildstate->n_shards, buildstate->json_vectors, buildstate->settings.vectors_per_request);
+    batch_bytes = pinecone_network_counters.request_bytes_sent - batch_bytes;
+    buildstate->bytes_uploaded += batch_bytes;
+    // the batch is acknowledged, so every block before the current one is done; upserts are idempotent so the current block is simply resent
+    if (buildstate->progress != NULL) {
+        // count the vectors of the blocks before it only, or a resumed build counts the resent block twice
+        buildstate->progress->next_blkno = buildstate->current_blkno;
+        buildstate->progress->indtuples = buildstate->resumed_tuples + buildstate->indtuples - buildstate->current_block_tuples;
+        WriteBuildProgress(buildstate->progress);
+    }
+    // participants of a parallel build add to the totals that the leader reports
+    if (buildstate->pineconeshared != NULL) {
+        tuples_done = pg_atomic_add_fetch_u64(&buildstate->pineconeshared->tuplesdone, batch_tuples);
+        bytes_done = pg_atomic_add_fetch_u64(&buildstate->pineconeshared->bytesuploaded, batch_bytes);
+    } else {
+        tuples_done = buildstate->indtuples;
+        bytes_done = buildstate->bytes_uploaded;
+    }
+    if (buildstate->report_progress) {
+        const int progress_index[] = {PROGRESS_CREATEIDX_TUPLES_DONE, PROGRESS_PINECONE_BYTES_UPLOADED};
+        const int64 progress_vals[] = {tuples_done, bytes_done};
+        pgstat_progress_update_multi_param(2, progress_index, progress_vals);
+    }
+}
+
+/*
+ * Scan the heap (or this participant's share of it) and upsert every vector to the remote index
+ * Returns the number of heap tuples scanned and sets *indtuples to the number of vectors uploaded
+ * A serial scan with build_progress starts at its next_blkno and records each acknowledged batch in it
+ */
+static double ScanAndUpload(Relation heap, Relation index, IndexInfo *indexInfo, TableScanDesc scan, PineconeShared *pineconeshared, PineconeBuildProgress *build_progress, bool progress, int64 *indtuples) {
     PineconeBuildState buildstate;
-    int reltuples;
+    PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(index);
+    MemoryContext oldCtx;
+    double reltuples;
     // initialize the buildstate
     buildstate.indtuples = 0;
+    buildstate.progress = build_progress;
+    buildstate.current_blkno = InvalidBlockNumber;
+    buildstate.current_block_tuples = 0;
+    buildstate.resumed_tuples = build_progress != NULL ? build_progress->indtuples : 0;
+    buildstate.pineconeshared = pineconeshared;
+    buildstate.report_progress = progress;
+    buildstate.bytes_uploaded = 0;
+    buildstate.shards = PineconeGetShards(&static_meta, &buildstate.n_shards);
+    buildstate.settings = PineconeGetSettings(index);
+    buildstate.tmpCtx = AllocSetContextCreate(CurrentMemoryContext, "Pinecone build batch context", ALLOCSET_DEFAULT_SIZES);
+    oldCtx = MemoryContextSwitchTo(buildstate.tmpCtx);
     buildstate.json_vectors = cJSON_CreateArray();
-    strcpy(buildstate.host, host);
+    MemoryContextSwitchTo(oldCtx);
     // iterate through the base table and upsert the vectors to the remote index
-    reltuples = table_index_build_scan(heap, index, indexInfo, true, true, pinecone_build_callback, (void *) &buildstate, NULL);
+    if (progress) pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_PINECONE_PHASE_UPLOAD);
+    if (build_progress != NULL) {
+        // no synchronized scan: blocks must arrive in order for the progress to be a prefix of the heap
+        reltuples = table_index_build_range_scan(heap, index, indexInfo, false, false, progress,
+                                                 build_progress->next_blkno, InvalidBlockNumber,
+                                                 pinecone_build_callback, (void *) &buildstate, NULL);
+    } else {
+        reltuples = table_index_build_scan(heap, index, indexInfo, true, progress, pinecone_build_callback, (void *) &buildstate, scan);
+    }
     if (cJSON_GetArraySize(buildstate.json_vectors) > 0) {
-        pinecone_bulk_upsert(pinecone_api_key, host, buildstate.json_vectors, pinecone_vectors_per_request);
+        if (progress) pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_PINECONE_PHASE_FLUSH);
+        oldCtx = MemoryContextSwitchTo(buildstate.tmpCtx);
+        UploadBatch(&buildstate);
+        MemoryContextSwitchTo(oldCtx);
     }
-    cJSON_Delete(buildstate.json_vectors);
-    // stats
-    result->heap_tuples = reltuples;
-    result->index_tuples = buildstate.indtuples;
+    MemoryContextDelete(buildstate.tmpCtx);
+    *indtuples = buildstate.indtuples;
+    return reltuples;
+}
+
+/*
+ * Perform a participant's portion of a parallel build
+ */
+static void PineconeParallelScanAndUpload(Relation heap, Relation index, PineconeShared *pineconeshared, bool progress) {
+    IndexInfo *indexInfo;
+    TableScanDesc scan;
+    double reltuples;
+    int64 indtuples;
+
+    // join the parallel scan
+    indexInfo = BuildIndexInfo(index);
+    indexInfo->ii_Concurrent = pineconeshared->isconcurrent;
+    scan = table_beginscan_parallel(heap, ParallelTableScanFromPineconeShared(pineconeshared));
+    reltuples = ScanAndUpload(heap, index, indexInfo, scan, pineconeshared, NULL, progress, &indtuples);
+
+    // record statistics
+    SpinLockAcquire(&pineconeshared->mutex);
+    pineconeshared->nparticipantsdone++;
+    pineconeshared->reltuples += reltuples;
+    pineconeshared->indtuples += indtuples;
+    SpinLockRelease(&pineconeshared->mutex);
+
+    if (progress) elog(DEBUG1, "leader uploaded " INT64_FORMAT " vectors", indtuples);
+    else elog(DEBUG1, "worker uploaded " INT64_FORMAT " vectors", indtuples);
+
+    // notify the leader
+    ConditionVariableSignal(&pineconeshared->workersdonecv);
+}
+
+/*
+ * Perform work within a launched parallel process
+ * Each worker has its own curl handles, so the slices are uploaded concurrently
+ */
+void PineconeParallelBuildMain(dsm_segment *seg, shm_toc *toc) {
+    char *sharedquery;
+    PineconeShared *pineconeshared;
+    Relation heap, index;
+    LOCKMODE heapLockmode, indexLockmode;
+
+    // set debug_query_string for individual workers first
+    sharedquery = shm_toc_lookup(toc, PARALLEL_KEY_QUERY_TEXT, true);
+    debug_query_string = sharedquery;
+    pgstat_report_activity(STATE_RUNNING, debug_query_string);
+
+    pineconeshared = shm_toc_lookup(toc, PARALLEL_KEY_PINECONE_SHARED, false);
+
+    // open relations using the lock modes known to be obtained by index.c
+    if (!pineconeshared->isconcurrent) {
+        heapLockmode = ShareLock;
+        indexLockmode = AccessExclusiveLock;
+    } else {
+        heapLockmode = ShareUpdateExclusiveLock;
+        indexLockmode = RowExclusiveLock;
+    }
+    heap = table_open(pineconeshared->heaprelid, heapLockmode);
+    index = index_open(pineconeshared->indexrelid, indexLockmode);
+
+    PineconeParallelScanAndUpload(heap, index, pineconeshared, false);
+
+    index_close(index, indexLockmode);
+    table_close(heap, heapLockmode);
+}
+
+/*
+ * Within the leader, wait until every participant has finished its share of the heap
+ */
+static void PineconeParallelHeapScan(PineconeLeader *leader, double *reltuples, double *indtuples) {
+    PineconeShared *pineconeshared = leader->pineconeshared;
+    for (;;) {
+        SpinLockAcquire(&pineconeshared->mutex);
+        if (pineconeshared->nparticipantsdone == leader->nparticipants) {
+            *reltuples = pineconeshared->reltuples;
+            *indtuples = pineconeshared->indtuples;
+            SpinLockRelease(&pineconeshared->mutex);
+            break;
+        }
+        SpinLockRelease(&pineconeshared->mutex);
+        // wake up regularly to report the uploads of the workers
+        if (ConditionVariableTimedSleep(&pineconeshared->workersdonecv, 1000, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN)) {
+            const int progress_index[] = {PROGRESS_CREATEIDX_TUPLES_DONE, PROGRESS_PINECONE_BYTES_UPLOADED};
+            const int64 progress_vals[] = {pg_atomic_read_u64(&pineconeshared->tuplesdone), pg_atomic_read_u64(&pineconeshared->bytesuploaded)};
+            pgstat_progress_update_multi_param(2, progress_index, progress_vals);
+        }
+    }
+    ConditionVariableCancelSleep();
+}
+
+/*
+ * End parallel build
+ */
+static void PineconeEndParallel(PineconeLeader *leader) {
+    // shutdown worker processes
+    WaitForParallelWorkersToFinish(leader->pcxt);
+    // free last reference to MVCC snapshot, if one was used
+    if (IsMVCCSnapshot(leader->snapshot)) UnregisterSnapshot(leader->snapshot);
+    DestroyParallelContext(leader->pcxt);
+    ExitParallelMode();
+}
+
+/*
+ * Begin parallel build
+ * Returns NULL if no workers could be launched, in which case the caller does a serial build
+ */
+static PineconeLeader* PineconeBeginParallel(Relation heap, Relation index, bool isconcurrent, int request) {
+    ParallelContext *pcxt;
+    Snapshot snapshot;
+    Size estshared;
+    PineconeShared *pineconeshared;
+    PineconeLeader *leader = (PineconeLeader *) palloc0(sizeof(PineconeLeader));
+    int querylen;
+
+    // enter parallel mode and create context
+    EnterParallelMode();
+    Assert(request > 0);
+    pcxt = CreateParallelContext("vector", "PineconeParallelBuildMain", request);
+
+    // get snapshot for table scan
+    if (!isconcurrent) snapshot = SnapshotAny;
+    else snapshot = RegisterSnapshot(GetTransactionSnapshot());
+
+    // estimate size of the shared state and the query text
+    estshared = add_size(BUFFERALIGN(sizeof(PineconeShared)), table_parallelscan_estimate(heap, snapshot));
+    shm_toc_estimate_chunk(&pcxt->estimator, estshared);
+    shm_toc_estimate_keys(&pcxt->estimator, 1);
+    if (debug_query_string) {
+        querylen = strlen(debug_query_string);
+        shm_toc_estimate_chunk(&pcxt->estimator, querylen + 1);
+        shm_toc_estimate_keys(&pcxt->estimator, 1);
+    } else querylen = 0; // keep compiler quiet
+
+    InitializeParallelDSM(pcxt);
+
+    // if no DSM segment was available, back out (do serial build)
+    if (pcxt->seg == NULL) {
+        if (IsMVCCSnapshot(snapshot)) UnregisterSnapshot(snapshot);
+        DestroyParallelContext(pcxt);
+        ExitParallelMode();
+        return NULL;
+    }
+
+    // store the shared build state
+    pineconeshared = (PineconeShared *) shm_toc_allocate(pcxt->toc, estshared);
+    pineconeshared->heaprelid = RelationGetRelid(heap);
+    pineconeshared->indexrelid = RelationGetRelid(index);
+    pineconeshared->isconcurrent = isconcurrent;
+    ConditionVariableInit(&pineconeshared->workersdonecv);
+    SpinLockInit(&pineconeshared->mutex);
+    pineconeshared->nparticipantsdone = 0;
+    pineconeshared->reltuples = 0;
+    pineconeshared->indtuples = 0;
+    pg_atomic_init_u64(&pineconeshared->tuplesdone, 0);
+    pg_atomic_init_u64(&pineconeshared->bytesuploaded, 0);
+    table_parallelscan_initialize(heap, ParallelTableScanFromPineconeShared(pineconeshared), snapshot);
+    shm_toc_insert(pcxt->toc, PARALLEL_KEY_PINECONE_SHARED, pineconeshared);
+
+    // store query string for workers
+    if (debug_query_string) {
+        char *sharedquery = (char *) shm_toc_allocate(pcxt->toc, querylen + 1);
+        memcpy(sharedquery, debug_query_string, querylen + 1);
+        shm_toc_insert(pcxt->toc, PARALLEL_KEY_QUERY_TEXT, sharedquery);
+    }
+
+    // launch workers; the leader always participates
+    LaunchParallelWorkers(pcxt);
+    leader->pcxt = pcxt;
+    leader->nparticipants = pcxt->nworkers_launched + 1;
+    leader->pineconeshared = pineconeshared;
+    leader->snapshot = snapshot;
+
+    // if no workers were successfully launched, back out (do serial build)
+    if (pcxt->nworkers_launched == 0) {
+        PineconeEndParallel(leader);
+        return NULL;
+    }
+    elog(DEBUG1, "using %d parallel workers", pcxt->nworkers_launched);
+
+    // join heap scan ourselves
+    PineconeParallelScanAndUpload(heap, index, pineconeshared, true);
+
+    // wait for all launched workers
+    WaitForParallelWorkersToAttach(pcxt);
+    return leader;
+}
+
+/*
+ * Compute parallel workers
+ */
+static int ComputeParallelWorkers(Relation heap, Relation index) {
+    int parallel_workers;
+    // make sure it's safe to use parallel workers
+    parallel_workers = plan_create_index_workers(RelationGetRelid(heap), RelationGetRelid(index));
+    if (parallel_workers == 0) return 0;
+    // use parallel_workers storage parameter on table if set
+    parallel_workers = RelationGetParallelWorkers(heap, -1);
+    if (parallel_workers != -1) return Min(parallel_workers, max_parallel_maintenance_workers);
+    return max_parallel_maintenance_workers;
+}
+
+void InsertBaseTable(Relation heap, Relation index, IndexInfo *indexInfo, PineconeBuildProgress *progress, IndexBuildResult *result) {
+    int parallel_workers = 0;
+    PineconeLeader *leader = NULL;
+    double reltuples, indtuples;
+    int64 resumed_tuples = progress->indtuples;
+
+    // the remaining tuples, estimated from the statistics of the table
+    if (heap->rd_rel->reltuples > 0) {
+        pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_TOTAL, Max((int64) heap->rd_rel->reltuples - resumed_tuples, 0));
+    }
+
+    // participants of a parallel build finish their blocks out of order, so a resumed build continues serially
+    if (progress->next_blkno == 0) parallel_workers = ComputeParallelWorkers(heap, index);
+
+    // attempt to split the scan and the upload across parallel workers
+    if (parallel_workers > 0) leader = PineconeBeginParallel(heap, index, indexInfo->ii_Concurrent, parallel_workers);
+
+    if (leader != NULL) {
+        PineconeParallelHeapScan(leader, &reltuples, &indtuples);
+        PineconeEndParallel(leader);
+    } else {
+        int64 serial_indtuples;
+        reltuples = ScanAndUpload(heap, index, indexInfo, NULL, NULL, progress, true, &serial_indtuples);
+        indtuples = serial_indtuples;
+    }
+    // stats, including the vectors uploaded by the build we resumed
+    result->heap_tuples = reltuples + resumed_tuples;
+    result->index_tuples = indtuples + resumed_tuples;
 }
 
 void pinecone_build_callback(Relation index, ItemPointer tid, Datum *values, bool *isnull, bool tupleIsAlive, void *state)
@@ -149,15 +762,24 @@ void pinecone_build_callback(Relation index, ItemPointer tid, Datum *values, boo
     PineconeBuildState *buildstate = (PineconeBuildState *) state;
     TupleDesc itup_desc = index->rd_att;
     cJSON *json_vector;
-    char* pinecone_id = pinecone_id_from_heap_tid(*tid);
+    char pinecone_id[PINECONE_ID_BUFFER_SIZE];
+    MemoryContext oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+    pinecone_id_encode(*tid, buildstate->settings.compact_ids, pinecone_id);
     json_vector = tuple_get_pinecone_vector(itup_desc, values, isnull, pinecone_id);
     cJSON_AddItemToArray(buildstate->json_vectors, json_vector);
-    if (cJSON_GetArraySize(buildstate->json_vectors) >= PINECONE_BATCH_SIZE) {
-        pinecone_bulk_upsert(pinecone_api_key, buildstate->host, buildstate->json_vectors, pinecone_vectors_per_request);
-        cJSON_Delete(buildstate->json_vectors);
-        buildstate->json_vectors = cJSON_CreateArray();
+    if (ItemPointerGetBlockNumber(tid) != buildstate->current_blkno) {
+        buildstate->current_blkno = ItemPointerGetBlockNumber(tid);
+        buildstate->current_block_tuples = 0;
     }
+    buildstate->current_block_tuples++;
     buildstate->indtuples++;
+    if (cJSON_GetArraySize(buildstate->json_vectors) >= PINECONE_BATCH_SIZE(buildstate->settings)) {
+        UploadBatch(buildstate);
+        // release the batch, its requests and their responses
+        MemoryContextReset(buildstate->tmpCtx);
+        buildstate->json_vectors = cJSON_CreateArray();
+    }
+    MemoryContextSwitchTo(oldCtx);
 }
 
 
@@ -166,13 +788,14 @@ void pinecone_build_callback(Relation index, ItemPointer tid, Datum *values, boo
  * Create the buffer meta page
  * Create the buffer head
  */
-void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *pinecone_index_name, char *host, int forkNum) {
+void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *pinecone_index_name, char **hosts, int n_shards, bool shard_by_namespace, const char *partition_namespace, bool provisioning, int forkNum) {
     Buffer meta_buf, buffer_meta_buf, buffer_head_buf;
     Page meta_page, buffer_meta_page, buffer_head_page;
     PineconeStaticMetaPage pinecone_static_meta_page;
     PineconeBufferMetaPage pinecone_buffer_meta_page;
     PineconeBufferOpaque buffer_head_opaque;
     PineconeCheckpoint default_checkpoint;
+    PineconeOptions *opts = (PineconeOptions *) index->rd_options;
     GenericXLogState *state = GenericXLogStart(index);
 
     // init default checkpoint
@@ -197,12 +820,30 @@ void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *p
     // You must set pd_lower because GenericXLog ignores any changes in the free space between pd_lower and pd_upper
     ((PageHeader) meta_page)->pd_lower = ((char *) pinecone_static_meta_page - (char *) meta_page) + sizeof(PineconeStaticMetaPageData);
 
-    // copy host and pinecone_index_name, checking for length
-    if (strlcpy(pinecone_static_meta_page->host, host, PINECONE_HOST_MAX_LENGTH) > PINECONE_HOST_MAX_LENGTH) {
-        ereport(ERROR, (errcode(ERRCODE_NAME_TOO_LONG), errmsg("Host name too long"),
-                        errhint("The host name is %s... and is %d characters long. The maximum length is %d characters.",
-                                host, (int) strlen(host), PINECONE_HOST_MAX_LENGTH)));
+    // copy the hosts and pinecone_index_name, checking for length
+    for (int i = 0; i < n_shards; i++) {
+        char* host = hosts[i];
+        if (strlen(host) > PINECONE_HOST_MAX_LENGTH) {
+            ereport(ERROR, (errcode(ERRCODE_NAME_TOO_LONG), errmsg("Host name too long"),
+                            errhint("The host name is %s... and is %d characters long. The maximum length is %d characters.",
+                                    host, (int) strlen(host), PINECONE_HOST_MAX_LENGTH)));
+        }
+        if (n_shards > 1) strlcpy(pinecone_static_meta_page->shard_hosts[i], host, PINECONE_HOST_MAX_LENGTH + 1);
     }
+    strlcpy(pinecone_static_meta_page->host, hosts[0], PINECONE_HOST_MAX_LENGTH + 1);
+    pinecone_static_meta_page->n_shards = n_shards;
+    // settings: the reloptions, with the batch sizes of the building session when they are not given
+    pinecone_static_meta_page->has_settings = true;
+    pinecone_static_meta_page->settings.top_k = opts->top_k;
+    pinecone_static_meta_page->settings.vectors_per_request = opts->vectors_per_request > 0 ? opts->vectors_per_request : pinecone_vectors_per_request;
+    pinecone_static_meta_page->settings.requests_per_batch = opts->requests_per_batch > 0 ? opts->requests_per_batch : pinecone_requests_per_batch;
+    pinecone_static_meta_page->settings.max_buffer_scan = opts->max_buffer_scan;
+    pinecone_static_meta_page->settings.max_fetched_vectors_for_liveness_check = opts->max_fetched_vectors_for_liveness_check;
+    pinecone_static_meta_page->settings.compact_ids = opts->compact_ids;
+    pinecone_static_meta_page->settings.track_updates = opts->track_updates;
+    pinecone_static_meta_page->shard_by_namespace = shard_by_namespace;
+    strlcpy(pinecone_static_meta_page->partition_namespace, partition_namespace != NULL ? partition_namespace : "", NAMEDATALEN);
+    pinecone_static_meta_page->provisioning = provisioning;
     if (strlcpy(pinecone_static_meta_page->pinecone_index_name, pinecone_index_name, PINECONE_NAME_MAX_LENGTH) > PINECONE_NAME_MAX_LENGTH) {
         ereport(ERROR, (errcode(ERRCODE_NAME_TOO_LONG), errmsg("Pinecone index name too long"),
                         errhint("The pinecone index name is %s... and is %d characters long. The maximum length is %d characters.",
@@ -221,6 +862,8 @@ void InitIndexPages(Relation index, VectorMetric metric, int dimensions, char *p
     pinecone_buffer_meta_page->latest_checkpoint = default_checkpoint;
     pinecone_buffer_meta_page->insert_page = PINECONE_BUFFER_HEAD_BLKNO;
     pinecone_buffer_meta_page->n_tuples_since_last_checkpoint = 0;
+    pinecone_buffer_meta_page->uncheckpointed_since = 0;
+    pinecone_buffer_meta_page->upsert_rate = 0;
     // adjust pd_lower 
     ((PageHeader) buffer_meta_page)->pd_lower = ((char *) pinecone_buffer_meta_page - (char *) buffer_meta_page) + sizeof(PineconeBufferMetaPageData);
 
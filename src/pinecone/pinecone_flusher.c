@@ -0,0 +1,181 @@
+/*
+ * Background flusher
+ *
+ * With pinecone.flusher_database set (and the library in shared_preload_libraries) a background worker visits the
+ * pinecone indexes of that database every pinecone.flusher_naptime seconds. The worker is connected to that one
+ * database, so the indexes of other databases are only flushed at commits. It uploads the batches that commit-time
+ * flushes left behind, and for indexes with a flush_interval it closes and uploads a partial batch once its first
+ * tuple is older than the interval, so that the buffer that queries scan locally stays small on low-write tables.
+ * It also refreshes the cached statistics of the remote indexes, which the flushes read, and checks
+ * whether the remote indexes of async_provisioning builds are ready to take their buffered vectors.
+ */
+#include "pinecone.h"
+
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/pg_class.h"
+#include "commands/dbcommands.h"
+#include "commands/defrem.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/wait_event.h"
+#endif
+
+static bool flusher_registered = false;
+
+void PineconeFlusherInit(void) {
+    BackgroundWorker worker;
+    if (!process_shared_preload_libraries_in_progress) return;
+    if (pinecone_flusher_database == NULL || pinecone_flusher_database[0] == '\0') return;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 10;
+    strlcpy(worker.bgw_library_name, "vector", BGW_MAXLEN);
+    strlcpy(worker.bgw_function_name, "PineconeFlusherMain", BGW_MAXLEN);
+    strlcpy(worker.bgw_name, "pinecone flusher", BGW_MAXLEN);
+    strlcpy(worker.bgw_type, "pinecone flusher", BGW_MAXLEN);
+    RegisterBackgroundWorker(&worker);
+    flusher_registered = true;
+}
+
+/*
+ * Whether a background flusher visits the indexes of the current database
+ */
+bool PineconeFlusherServesDatabase(void) {
+    char *database;
+    if (!flusher_registered) return false;
+    database = get_database_name(MyDatabaseId);
+    return database != NULL && strcmp(database, pinecone_flusher_database) == 0;
+}
+
+/*
+ * List the pinecone indexes of the database
+ */
+static List* flusher_list_indexes(void) {
+    List *indexes = NIL;
+    Oid amoid = get_am_oid("pinecone", true);
+    Relation rel;
+    TableScanDesc scan;
+    HeapTuple tuple;
+    if (!OidIsValid(amoid)) return NIL; // the extension is not installed in this database
+
+    rel = table_open(RelationRelationId, AccessShareLock);
+    scan = table_beginscan_catalog(rel, 0, NULL);
+    while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+        Form_pg_class classForm = (Form_pg_class) GETSTRUCT(tuple);
+        if (classForm->relkind == RELKIND_INDEX && classForm->relam == amoid) {
+            indexes = lappend_oid(indexes, classForm->oid);
+        }
+    }
+    table_endscan(scan);
+    table_close(rel, AccessShareLock);
+    return indexes;
+}
+
+/*
+ * Force a checkpoint if the oldest unbatched tuple is older than the flush_interval, then flush any batch that is
+ * not yet uploaded and refresh the remote stats if they are stale
+ */
+static void flusher_flush_index(Relation index) {
+    PineconeOptions *opts = (PineconeOptions *) index->rd_options;
+    int flush_interval = opts != NULL ? opts->flush_interval : 0;
+    PineconeBufferMetaPageData buffer_meta = PineconeSnapshotBufferMeta(index);
+
+    if (!PineconeFinishProvisioning(index)) return;
+    if (flush_interval > 0 && buffer_meta.uncheckpointed_since != 0 &&
+        TimestampDifferenceExceeds(buffer_meta.uncheckpointed_since, GetCurrentTimestamp(), flush_interval * 1000)) {
+        if (PineconeForceCheckpoint(index)) buffer_meta = PineconeSnapshotBufferMeta(index);
+    }
+    if (buffer_meta.flush_checkpoint.checkpoint_no < buffer_meta.latest_checkpoint.checkpoint_no) {
+        elog(DEBUG1, "pinecone flusher: flushing %s", RelationGetRelationName(index));
+        FlushToPineconeInCtx(index, false);
+    }
+    if (!TimestampDifferenceExceeds(PineconeGetRemoteStats(RelationGetRelid(index)).refreshed_at, GetCurrentTimestamp(),
+                                    PINECONE_STATS_REFRESH_INTERVAL * 1000)) return;
+    elog(DEBUG1, "pinecone flusher: refreshing the stats of %s", RelationGetRelationName(index));
+    PineconeRefreshRemoteStats(index);
+}
+
+/*
+ * Visit every pinecone index. Each index is flushed in a subtransaction so that a remote failure only costs that
+ * index its round.
+ */
+static void flusher_run(void) {
+    List *indexes;
+    ListCell *lc;
+    MemoryContext ctx;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    ctx = CurrentMemoryContext;
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "flushing pinecone indexes");
+
+    indexes = flusher_list_indexes();
+    foreach(lc, indexes) {
+        Oid indexid = lfirst_oid(lc);
+        ResourceOwner owner = CurrentResourceOwner;
+        BeginInternalSubTransaction(NULL);
+        PG_TRY();
+        {
+            if (SearchSysCacheExists1(RELOID, ObjectIdGetDatum(indexid))) {
+                Relation index = index_open(indexid, RowExclusiveLock);
+                flusher_flush_index(index);
+                index_close(index, RowExclusiveLock);
+            }
+            ReleaseCurrentSubTransaction();
+        }
+        PG_CATCH();
+        {
+            ErrorData *edata;
+            MemoryContextSwitchTo(ctx);
+            edata = CopyErrorData();
+            FlushErrorState();
+            RollbackAndReleaseCurrentSubTransaction();
+            ereport(WARNING, (errmsg("pinecone flusher failed to flush index %u: %s", indexid, edata->message)));
+            FreeErrorData(edata);
+        }
+        PG_END_TRY();
+        MemoryContextSwitchTo(ctx);
+        CurrentResourceOwner = owner;
+    }
+
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+void PineconeFlusherMain(Datum main_arg) {
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    BackgroundWorkerInitializeConnection(pinecone_flusher_database, NULL, 0);
+    elog(LOG, "pinecone flusher started for database %s", pinecone_flusher_database);
+
+    for (;;) {
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+        flusher_run();
+        (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, pinecone_flusher_naptime * 1000L, PG_WAIT_EXTENSION);
+    }
+}
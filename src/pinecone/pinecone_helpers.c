@@ -9,6 +9,9 @@
 #include "src/cJSON.h"
 #include "utils/builtins.h"
 #include "executor/spi.h"
+#include "commands/defrem.h"
+#include "portability/instr_time.h"
+#include "utils/timestamp.h"
 #include "fmgr.h"
 
 
@@ -223,6 +226,185 @@ pinecone_print_index(PG_FUNCTION_ARGS) {
     PG_RETURN_VOID();
 }
 
+/*
+ * Traffic between this backend and pinecone since it started
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_network_stats);
+Datum
+pinecone_network_stats(PG_FUNCTION_ARGS) {
+    TupleDesc tupdesc;
+    Datum values[5];
+    bool nulls[5] = {false, false, false, false, false};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("function returning record called in context that cannot accept type record")));
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    values[0] = Int64GetDatum(pinecone_network_counters.requests);
+    values[1] = Int64GetDatum(pinecone_network_counters.request_bytes);
+    values[2] = Int64GetDatum(pinecone_network_counters.request_bytes_sent);
+    values[3] = Int64GetDatum(pinecone_network_counters.response_bytes_received);
+    values[4] = Int64GetDatum(pinecone_network_counters.response_bytes);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Appends and uploads of an index since this server started tracking it
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_index_activity);
+Datum
+pinecone_index_activity(PG_FUNCTION_ARGS) {
+    Oid index_oid = PG_GETARG_OID(0);
+    TupleDesc tupdesc;
+    Datum values[2];
+    bool nulls[2] = {false, false};
+    Relation index;
+    int64 tuples_appended, vectors_flushed;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("function returning record called in context that cannot accept type record")));
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    index = index_open(index_oid, AccessShareLock);
+    if (index->rd_rel->relam != get_am_oid("pinecone", false)) {
+        ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE), errmsg("\"%s\" is not a pinecone index", RelationGetRelationName(index))));
+    }
+    index_close(index, AccessShareLock);
+    PineconeGetIndexActivity(index_oid, &tuples_appended, &vectors_flushed);
+    values[0] = Int64GetDatum(tuples_appended);
+    values[1] = Int64GetDatum(vectors_flushed);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * The cached describe_index_stats of an index, fetched first if refresh is set. The columns are null if the stats
+ * were never fetched.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_remote_stats);
+Datum
+pinecone_remote_stats(PG_FUNCTION_ARGS) {
+    Oid index_oid = PG_GETARG_OID(0);
+    bool refresh = PG_GETARG_BOOL(1);
+    TupleDesc tupdesc;
+    Datum values[3];
+    bool nulls[3] = {false, false, false};
+    Relation index;
+    PineconeRemoteStats stats;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("function returning record called in context that cannot accept type record")));
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    index = index_open(index_oid, AccessShareLock);
+    if (index->rd_rel->relam != get_am_oid("pinecone", false)) {
+        ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE), errmsg("\"%s\" is not a pinecone index", RelationGetRelationName(index))));
+    }
+    stats = refresh ? PineconeRefreshRemoteStats(index) : PineconeGetRemoteStats(index_oid);
+    index_close(index, AccessShareLock);
+    if (stats.refreshed_at == 0) {
+        nulls[0] = nulls[1] = nulls[2] = true;
+    } else {
+        values[0] = Int64GetDatum(stats.vector_count);
+        values[1] = Float8GetDatum(stats.index_fullness);
+        values[2] = TimestampTzGetDatum(stats.refreshed_at);
+    }
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * The id of the vector of a heap tuple in pinecone, in either format
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_vector_id);
+Datum
+pinecone_vector_id(PG_FUNCTION_ARGS) {
+    ItemPointer tid = (ItemPointer) PG_GETARG_POINTER(0);
+    bool compact = PG_GETARG_BOOL(1);
+    char id[PINECONE_ID_BUFFER_SIZE];
+    pinecone_id_encode(*tid, compact, id);
+    PG_RETURN_TEXT_P(cstring_to_text(id));
+}
+
+/*
+ * The heap tuple of a vector id of either format
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_vector_tid);
+Datum
+pinecone_vector_tid(PG_FUNCTION_ARGS) {
+    ItemPointer tid = palloc(sizeof(ItemPointerData));
+    *tid = pinecone_id_get_heap_tid(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+    PG_RETURN_POINTER(tid);
+}
+
+/*
+ * Per-id cost in nanoseconds of encoding and decoding vector ids, next to the sprintf/sscanf formatting they replace.
+ * Not part of the extension; test/bench/t/002_pinecone_ids.pl creates it.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_id_benchmark);
+Datum
+pinecone_id_benchmark(PG_FUNCTION_ARGS) {
+    int32 iterations = PG_GETARG_INT32(0);
+    bool compact = PG_GETARG_BOOL(1);
+    TupleDesc tupdesc;
+    Datum values[4];
+    bool nulls[4] = {false, false, false, false};
+    char id[PINECONE_ID_BUFFER_SIZE];
+    instr_time start, duration;
+    volatile uint32 checksum = 0; // keeps the loops from being optimized away
+    ItemPointerData tid;
+
+    if (iterations <= 0) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("iterations must be positive")));
+    }
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        elog(ERROR, "return type must be a row type");
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    INSTR_TIME_SET_CURRENT(start);
+    for (int32 i = 0; i < iterations; i++) {
+        ItemPointerSet(&tid, (BlockNumber) i, (OffsetNumber) (i % MaxOffsetNumber + 1));
+        pinecone_id_encode(tid, compact, id);
+        checksum += (uint8) id[0];
+    }
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    values[0] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations);
+
+    INSTR_TIME_SET_CURRENT(start);
+    for (int32 i = 0; i < iterations; i++) {
+        id[0] = compact ? "ABCDEFGH"[i & 7] : "01234567"[i & 7];
+        if (pinecone_id_decode(id, &tid)) checksum += tid.ip_posid;
+    }
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    values[1] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations);
+
+    INSTR_TIME_SET_CURRENT(start);
+    for (int32 i = 0; i < iterations; i++) {
+        char *legacy_id = palloc(PINECONE_ID_BUFFER_SIZE);
+        ItemPointerSet(&tid, (BlockNumber) i, (OffsetNumber) (i % MaxOffsetNumber + 1));
+        snprintf(legacy_id, PINECONE_ID_BUFFER_SIZE, "%04hx%04hx%04hx", tid.ip_blkid.bi_hi, tid.ip_blkid.bi_lo, tid.ip_posid);
+        checksum += (uint8) legacy_id[0];
+        pfree(legacy_id);
+    }
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    values[2] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations);
+
+    pinecone_id_encode(tid, false, id);
+    INSTR_TIME_SET_CURRENT(start);
+    for (int32 i = 0; i < iterations; i++) {
+        id[0] = "01234567"[i & 7];
+        if (sscanf(id, "%04hx%04hx%04hx", &tid.ip_blkid.bi_hi, &tid.ip_blkid.bi_lo, &tid.ip_posid) == 3) checksum += tid.ip_posid;
+    }
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    values[3] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations);
+
+    elog(DEBUG1, "pinecone_id_benchmark checksum: %u", checksum);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
 // pinecone_get_index_stats
 PGDLLEXPORT PG_FUNCTION_INFO_V1(pinecone_print_index_stats);
 Datum
@@ -270,6 +452,7 @@ void lookup_mock_response(CURL* hnd, ResponseData* response_data, CURLcode* curl
     char query[1024]; // todo: doesn't accomodate large bodies
     int ret;
     char* response = NULL;
+    MemoryContext callerCtx = CurrentMemoryContext; // SPI_finish releases everything allocated in SPI's own context
     // recover the url from the handle
     char* url;
     curl_easy_getinfo(hnd, CURLINFO_EFFECTIVE_URL, &url);
@@ -290,8 +473,8 @@ void lookup_mock_response(CURL* hnd, ResponseData* response_data, CURLcode* curl
         datum = heap_getattr(tuple, 1, tupdesc, &isnull);
         if (!isnull) {
             response = TextDatumGetCString(datum); 
-            response_data->data = palloc(strlen(response) + 1);
-            strcpy(response_data->data, response);
+            response_data->data = MemoryContextStrdup(callerCtx, response);
+            response_data->length = strlen(response);
 
         }
         datum = heap_getattr(tuple, 2, tupdesc, &isnull);
@@ -8,13 +8,54 @@
 #include <catalog/index.h>
 
 #include <access/heapam.h>
+#include <access/htup_details.h>
 #include <access/tableam.h>
+#include <access/transam.h>
+#include <access/xact.h>
+#include <executor/tuptable.h>
+#include <storage/procarray.h>
+#include <utils/hsearch.h>
+#include <utils/resowner.h>
+#include <utils/syscache.h>
+#include <utils/timestamp.h>
+
+// indexes whose buffer reached a checkpoint in the current transaction; they are flushed once, when it commits
+static List *pending_flush_indexes = NIL;
 
-#define PINECONE_FLUSH_LOCK_IDENTIFIER 1969841813 // random number, uniquely identifies the pinecone insertion lock
-#define PINECONE_APPEND_LOCK_IDENTIFIER 1969841814 // random number, uniquely identifies the pinecone append lock
+/*
+ * The tuples that the current transaction inserted into an index but has not appended to its buffer yet. They are
+ * appended a page at a time, so that a bulk load takes the append lock and writes a WAL record once per page.
+ */
+typedef struct PineconePendingTuples
+{
+    Oid indexid;
+    Oid relfilenode; // detect REINDEX and TRUNCATE
+    int n_appended; // appended to the buffer; no flush uploads them before the transaction commits
+    int n_tuples;
+    PineconeBufferTuple tuples[PINECONE_PAGE_TUPLES];
+} PineconePendingTuples;
+
+static List *pending_tuples = NIL; // in TopTransactionContext
+
+/*
+ * The index columns of the tuples that the current transaction inserted, so that the flush at its commit uploads them
+ * without fetching them from the heap. Bounded by maintenance_work_mem; tuples past it are fetched as usual.
+ */
+typedef struct PineconeCachedVectorKey
+{
+    Oid relfilenode; // of the index, so that a REINDEX or TRUNCATE leaves the cached tuples behind
+    ItemPointerData tid;
+} PineconeCachedVectorKey;
+
+typedef struct PineconeCachedVector
+{
+    PineconeCachedVectorKey key;
+    TransactionId xid; // the (sub)transaction that inserted the tuple
+    HeapTuple values; // formed with the tuple descriptor of the index
+} PineconeCachedVector;
 
-#define SET_LOCKTAG_FLUSH(lock, index)  SET_LOCKTAG_ADVISORY(lock, MyDatabaseId, (uint32) index->rd_id, PINECONE_FLUSH_LOCK_IDENTIFIER, 0)
-#define SET_LOCKTAG_APPEND(lock, index) SET_LOCKTAG_ADVISORY(lock, MyDatabaseId, (uint32) index->rd_id, PINECONE_APPEND_LOCK_IDENTIFIER, 0)
+static HTAB *cached_vectors = NULL; // in TopTransactionContext
+static Size cached_vectors_size = 0;
 
 void PineconePageInit(Page page, Size pageSize)
 {
@@ -28,147 +69,404 @@ void PineconePageInit(Page page, Size pageSize)
     // ItemPointerSetInvalid
 }
 
-/* 
- * add a tuple to the end of the buffer
- * return true if a new page was created
+/*
+ * Make newpage the latest checkpoint. tid is the first tuple on the page, or invalid if the page is empty; the first
+ * tuple appended to an empty checkpoint page fills it in.
  */
-bool AppendBufferTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel)
+static void PineconeInitCheckpoint(PineconeBufferMetaPage buffer_meta, Page newpage, BlockNumber newblkno, ItemPointer tid)
+{
+    PineconeBufferOpaque new_opaque = PineconePageGetOpaque(newpage);
+    new_opaque->prev_checkpoint_blkno = buffer_meta->latest_checkpoint.blkno;
+    new_opaque->checkpoint = buffer_meta->latest_checkpoint;
+    if (tid != NULL) new_opaque->checkpoint.tid = *tid; // we will assume we have inserted up to this point if we see this in pinecone
+    else ItemPointerSetInvalid(&new_opaque->checkpoint.tid);
+    new_opaque->checkpoint.blkno = newblkno;
+    new_opaque->checkpoint.checkpoint_no += 1;
+    new_opaque->checkpoint.n_preceding_tuples += buffer_meta->n_tuples_since_last_checkpoint;
+    // set this page as the latest head checkpoint
+    buffer_meta->latest_checkpoint = new_opaque->checkpoint;
+    buffer_meta->n_tuples_since_last_checkpoint = 0;
+}
+
+/*
+ * Make the buffer tuple of a heap tuple
+ */
+PineconeBufferTuple PineconeMakeBufferTuple(ItemPointer heap_tid)
 {
-    // IndexTuple itup;
-    GenericXLogState *state;
-    Buffer buffer_meta_buf, insert_buf, newbuf = InvalidBuffer;
-    Page buffer_meta_page, insert_page, newpage;
-    PineconeBufferOpaque  new_opaque;
-    PineconeBufferMetaPage buffer_meta;
-    BlockNumber newblkno;
-    LOCKTAG pinecone_append_lock;
-    Size itemsz;
-    PineconeBufferMetaPageData meta_snapshot;
-    bool full;
-    bool create_checkpoint = false;
-    
-    // prepare the index tuple
-    // itup = index_form_tuple(RelationGetDescr(index), values, isnull);
-    // itup->t_tid = *heap_tid;
-    // itemsz = MAXALIGN(IndexTupleSize(itup));
-    
-    //
     PineconeBufferTuple buffer_tid;
+    memset(&buffer_tid, 0, sizeof(buffer_tid));
     buffer_tid.tid = *heap_tid;
-    itemsz = MAXALIGN(sizeof(PineconeBufferTuple));
+    buffer_tid.flags = 0;
+    return buffer_tid;
+}
+
+/*
+ * Add tuples to a buffer page until it is full or holds enough tuples to start a new checkpoint. Returns the number added.
+ */
+static int fill_buffer_page(Page page, int n_tuples_since_last_checkpoint, int batch_size, PineconeBufferTuple *tuples, int n_tuples)
+{
+    int n = 0;
+    while (n < n_tuples && PageGetFreeSpace(page) >= sizeof(PineconeBufferTuple) &&
+           n_tuples_since_last_checkpoint + PageGetMaxOffsetNumber(page) < batch_size) {
+        PageAddItem(page, (Item) &tuples[n], sizeof(PineconeBufferTuple), InvalidOffsetNumber, false, false);
+        n++;
+    }
+    return n;
+}
+
+/* 
+ * add tuples to the end of the buffer, with one WAL record for each page they go to
+ * return true if a new checkpoint was created
+ */
+bool AppendBufferTuples(Relation index, PineconeBufferTuple *tuples, int n_tuples)
+{
+    PineconeIndexSlot *index_slot;
+    int batch_size = PINECONE_BATCH_SIZE(PineconeGetSettings(index));
+    bool checkpoint_created = false;
+    int next = 0;
+    if (n_tuples == 0) return false;
 
     /* LOCKING STRATEGY FOR INSERTION
      * acquire append lock
-     * read a snapshot of meta
-     * acquire meta.insert_page
-     * if insert_page is not full:
-     *   add item to insert_page:
-     * if insert_page is full:
-     *   acquire meta
-     *   acquire & create newpage
-     *   add item to newpage:
+     * for each page the tuples go to:
+     *   read a snapshot of meta
+     *   acquire meta.insert_page
+     *   add items to insert_page until it is full or this qualifies as a checkpoint
+     *   if items are left:
+     *     acquire meta
+     *     acquire & create newpage
      *     insert_page.nextblkno = newpage.blkno
      *     meta.n_unflushed_tuples += (tuples on old page)
      *     meta.insert_page = newpage.blkno
-     *   if this qualifies as a checkpoint:
-     *     newpage.prev_checkpoint = meta.latest_checkpoint
-     *     meta.latest_checkpoint = newpage.blkno
-     *     newpage.representative_vector_heap_tid = itup.t_tid
-     *   release newpage, meta
-     * release insert_page, newpage, meta
+     *     if this qualifies as a checkpoint:
+     *       newpage.prev_checkpoint = meta.latest_checkpoint
+     *       meta.latest_checkpoint = newpage.blkno
+     *       newpage.representative_vector_heap_tid = first item on newpage
+     *     add items to newpage
+     *   release insert_page, newpage, meta
      * release append lock
-     * (if it was full and threshold met, we will next try to advance pinecone head)
+     * (if a checkpoint was created, we will next try to advance pinecone head)
      */
 
     // acquire append lock
-    SET_LOCKTAG_APPEND(pinecone_append_lock, index); LockAcquire(&pinecone_append_lock, ExclusiveLock, false, false);
-    // start WAL logging
+    index_slot = PineconeLockAppend(index);
+    while (next < n_tuples) {
+        GenericXLogState *state;
+        Buffer buffer_meta_buf = InvalidBuffer, insert_buf, newbuf = InvalidBuffer;
+        Page buffer_meta_page, insert_page, newpage;
+        PineconeBufferOpaque insert_opaque;
+        PineconeBufferMetaPage buffer_meta = NULL;
+        PineconeBufferMetaPageData meta_snapshot;
+        BlockNumber newblkno;
+        bool first_tuple;
+        int added;
+
+        // start WAL logging
+        state = GenericXLogStart(index);
+        // read a snapshot of the buffer meta
+        meta_snapshot = PineconeSnapshotBufferMeta(index);
+        // acquire the insert page
+        insert_buf = ReadBuffer(index, meta_snapshot.insert_page); LockBuffer(insert_buf, BUFFER_LOCK_EXCLUSIVE);
+        insert_page = GenericXLogRegisterBuffer(state, insert_buf, 0);
+        // the first tuple after a checkpoint starts the clock of the flush_interval
+        first_tuple = meta_snapshot.n_tuples_since_last_checkpoint == 0 && PageGetMaxOffsetNumber(insert_page) == 0;
+
+        // add items to insert page
+        added = fill_buffer_page(insert_page, meta_snapshot.n_tuples_since_last_checkpoint, batch_size, tuples + next, n_tuples - next);
+        first_tuple = first_tuple && added > 0;
+        if (first_tuple) {
+            // a checkpoint forced on an empty page takes the first tuple appended to it
+            insert_opaque = PineconePageGetOpaque(insert_page);
+            if (insert_opaque->checkpoint.is_checkpoint && !ItemPointerIsValid(&insert_opaque->checkpoint.tid)) {
+                insert_opaque->checkpoint.tid = tuples[next].tid;
+            }
+        }
+        next += added;
+        elog(DEBUG1, "Added %d tuples to the insert page, which has %lu items", added, (unsigned long)PageGetMaxOffsetNumber(insert_page));
+
+        // acquire the meta
+        if (first_tuple || next < n_tuples) {
+            buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO); LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
+            buffer_meta_page = GenericXLogRegisterBuffer(state, buffer_meta_buf, 0);
+            buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
+            if (first_tuple) buffer_meta->uncheckpointed_since = GetCurrentTimestamp();
+        }
+
+        // the insert page is full or the batch is complete: continue on a new page
+        if (next < n_tuples) {
+            bool create_checkpoint = buffer_meta->n_tuples_since_last_checkpoint + PageGetMaxOffsetNumber(insert_page) >= batch_size;
+            // acquire and create a new page
+            LockRelationForExtension(index, ExclusiveLock); // acquire a lock to let us add pages to the relation (this isn't really necessary since we will always have the append lock anyway)
+            newbuf = ReadBufferExtended(index, MAIN_FORKNUM, P_NEW, RBM_NORMAL, NULL);
+            LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
+            UnlockRelationForExtension(index, ExclusiveLock);
+            newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+            PineconePageInit(newpage, BufferGetPageSize(newbuf));
+            // update insert_page nextblkno
+            newblkno = BufferGetBlockNumber(newbuf);
+            PineconePageGetOpaque(insert_page)->nextblkno = newblkno;
+            // update meta
+            buffer_meta->insert_page = newblkno;
+            buffer_meta->n_tuples_since_last_checkpoint += PageGetMaxOffsetNumber(insert_page);
+            // if this qualifies as a checkpoint, set this page as the latest head checkpoint
+            if (create_checkpoint) {
+                // create a checkpoint on the opaque of the new page
+                PineconeInitCheckpoint(buffer_meta, newpage, newblkno, &tuples[next].tid);
+                buffer_meta->uncheckpointed_since = GetCurrentTimestamp(); // the new page holds the first tuple after it
+                checkpoint_created = true;
+            }
+            // add items to new page
+            added = fill_buffer_page(newpage, buffer_meta->n_tuples_since_last_checkpoint, batch_size, tuples + next, n_tuples - next);
+            if (added == 0) elog(ERROR, "A new page was created, but it doesn't have enough space for the new tuple");
+            next += added;
+        }
+
+        // release insert_page, newpage, meta
+        GenericXLogFinish(state);
+        UnlockReleaseBuffer(insert_buf);
+        if (BufferIsValid(newbuf)) UnlockReleaseBuffer(newbuf);
+        if (BufferIsValid(buffer_meta_buf)) UnlockReleaseBuffer(buffer_meta_buf);
+    }
+    pg_atomic_fetch_add_u64(&index_slot->tuples_appended, n_tuples);
+    // release append lock
+    PineconeUnlockAppend(index_slot);
+    return checkpoint_created;
+}
+
+/*
+ * Close the current batch at the end of the buffer so that a flush uploads it even though it is not full. Tuples
+ * appended afterwards go to a new, empty checkpoint page. Returns false if there are no tuples after the latest checkpoint.
+ * The new checkpoint's tid is invalid until AppendBufferTuples sets it to the first tuple of the page, so the liveness
+ * check cannot confirm the closed batch before the batch after it is uploaded; until then scans search it locally.
+ */
+bool PineconeForceCheckpoint(Relation index)
+{
+    GenericXLogState *state;
+    Buffer buffer_meta_buf, insert_buf, newbuf;
+    Page buffer_meta_page, insert_page, newpage;
+    PineconeBufferMetaPage buffer_meta;
+    PineconeBufferMetaPageData meta_snapshot;
+    BlockNumber newblkno;
+    PineconeIndexSlot *index_slot;
+
+    // same locking order as AppendBufferTuples
+    index_slot = PineconeLockAppend(index);
     state = GenericXLogStart(index);
-    // read a snapshot of the buffer meta
     meta_snapshot = PineconeSnapshotBufferMeta(index);
-    // acquire the insert page
     insert_buf = ReadBuffer(index, meta_snapshot.insert_page); LockBuffer(insert_buf, BUFFER_LOCK_EXCLUSIVE);
     insert_page = GenericXLogRegisterBuffer(state, insert_buf, 0);
-    // check if the page is full and if we want to create a new checkpoint
-    full = PageGetFreeSpace(insert_page) < itemsz;
-    create_checkpoint = meta_snapshot.n_tuples_since_last_checkpoint + PageGetMaxOffsetNumber(insert_page) >= PINECONE_BATCH_SIZE;
 
-    // add item to insert page
-    if (!full && !create_checkpoint) {
-        // PageAddItem(insert_page, (Item) itup, itemsz, InvalidOffsetNumber, false, false);
-        PageAddItem(insert_page, (Item) &buffer_tid, itemsz, InvalidOffsetNumber, false, false);
+    // only an empty checkpoint page can be empty, so there is nothing to close
+    if (PageGetMaxOffsetNumber(insert_page) == 0) {
+        GenericXLogAbort(state);
+        UnlockReleaseBuffer(insert_buf);
+        PineconeUnlockAppend(index_slot);
+        return false;
+    }
 
-        // log the number of items on this page MaxOffsetNumber
-        elog(DEBUG1, "No new page! Page has %lu items", (unsigned long)PageGetMaxOffsetNumber(insert_page));
+    // acquire the meta
+    buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO); LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    buffer_meta_page = GenericXLogRegisterBuffer(state, buffer_meta_buf, 0);
+    buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
+    // acquire and create a new page
+    LockRelationForExtension(index, ExclusiveLock);
+    newbuf = ReadBufferExtended(index, MAIN_FORKNUM, P_NEW, RBM_NORMAL, NULL);
+    LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
+    UnlockRelationForExtension(index, ExclusiveLock);
+    newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+    PineconePageInit(newpage, BufferGetPageSize(newbuf));
+    // link it and make it the latest checkpoint
+    newblkno = BufferGetBlockNumber(newbuf);
+    PineconePageGetOpaque(insert_page)->nextblkno = newblkno;
+    buffer_meta->insert_page = newblkno;
+    buffer_meta->n_tuples_since_last_checkpoint += PageGetMaxOffsetNumber(insert_page);
+    PineconeInitCheckpoint(buffer_meta, newpage, newblkno, NULL);
+    buffer_meta->uncheckpointed_since = 0;
+    elog(DEBUG1, "Forced checkpoint %d", buffer_meta->latest_checkpoint.checkpoint_no);
+    // release insert_page, newpage, meta
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(insert_buf); UnlockReleaseBuffer(newbuf); UnlockReleaseBuffer(buffer_meta_buf);
+    PineconeUnlockAppend(index_slot);
+    return true;
+}
 
-        // release insert_page
-        GenericXLogFinish(state);
-        UnlockReleaseBuffer(insert_buf);
-    } else {
-        // acquire the meta
-        buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO); LockBuffer(buffer_meta_buf, BUFFER_LOCK_EXCLUSIVE);
-        buffer_meta_page = GenericXLogRegisterBuffer(state, buffer_meta_buf, 0);
-        buffer_meta = PineconePageGetBufferMeta(buffer_meta_page);
-        // acquire and create a new page
-        LockRelationForExtension(index, ExclusiveLock); // acquire a lock to let us add pages to the relation (this isn't really necessary since we will always have the append lock anyway)
-        newbuf = ReadBufferExtended(index, MAIN_FORKNUM, P_NEW, RBM_NORMAL, NULL);
-        LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
-        UnlockRelationForExtension(index, ExclusiveLock);
-        newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
-        PineconePageInit(newpage, BufferGetPageSize(newbuf));
-        // check that there is room on the new page
-        if (PageGetFreeSpace(newpage) < itemsz) elog(ERROR, "A new page was created, but it doesn't have enough space for the new tuple");
-        // add item to new page
-        // PageAddItem(newpage, (Item) itup, itemsz, InvalidOffsetNumber, false, false);
-        PageAddItem(newpage, (Item) &buffer_tid, itemsz, InvalidOffsetNumber, false, false);
-        // update insert_page nextblkno
-        newblkno = BufferGetBlockNumber(newbuf);
-        PineconePageGetOpaque(insert_page)->nextblkno = newblkno;
-        // update meta
-        buffer_meta->insert_page = newblkno;
-        buffer_meta->n_tuples_since_last_checkpoint += PageGetMaxOffsetNumber(insert_page);
-        // if this qualifies as a checkpoint, set this page as the latest head checkpoint
-        if (create_checkpoint) {
-            // create a checkpoint on the opaque of the new page
-            new_opaque = PineconePageGetOpaque(newpage);
-            new_opaque->prev_checkpoint_blkno = buffer_meta->latest_checkpoint.blkno;
-            new_opaque->checkpoint = buffer_meta->latest_checkpoint;
-            new_opaque->checkpoint.tid = *heap_tid; // we will assume we have inserted up to this point if we see this in pinecone
-            new_opaque->checkpoint.blkno = newblkno;
-            new_opaque->checkpoint.checkpoint_no += 1;
-            new_opaque->checkpoint.n_preceding_tuples += buffer_meta->n_tuples_since_last_checkpoint;
-            // set this page as the latest head checkpoint
-            buffer_meta->latest_checkpoint = new_opaque->checkpoint;
-            buffer_meta->n_tuples_since_last_checkpoint = 0;
+/*
+ * Slow down or reject an insert when the part of the buffer that a flush could upload now is past
+ * pinecone.buffer_soft_limit. That is everything after the flush checkpoint, less the tuples the inserting
+ * transaction appended itself: they wait for its commit whatever the remote index does, so counting them
+ * would make a large INSERT or COPY throttle itself and fail at the hard limit. The ready checkpoint is not used, as
+ * only scans advance it. Between the soft and the hard limit the delay grows linearly up to the time the remote index
+ * takes to acknowledge one vector, so that at the hard limit inserts arrive no faster than they drain.
+ */
+static void PineconeApplyBackpressure(Relation index, PineconePendingTuples *pending)
+{
+    PineconeBufferMetaPageData buffer_meta;
+    int n_tuples, unflushed_tuples;
+    double delay_us;
+    if (pinecone_backpressure == PINECONE_BACKPRESSURE_OFF) return;
+    if (PineconeSnapshotStaticMeta(index).provisioning) return; // nothing drains the buffer until the remote index is ready
+
+    buffer_meta = PineconeSnapshotBufferMeta(index);
+    n_tuples = buffer_meta.latest_checkpoint.n_preceding_tuples + buffer_meta.n_tuples_since_last_checkpoint;
+    unflushed_tuples = n_tuples - buffer_meta.flush_checkpoint.n_preceding_tuples - pending->n_appended;
+    if (unflushed_tuples < pinecone_buffer_soft_limit) return;
+
+    if (unflushed_tuples >= pinecone_buffer_hard_limit && pinecone_backpressure == PINECONE_BACKPRESSURE_REJECT) {
+        ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                        errmsg("Pinecone index \"%s\" is %d vectors behind", RelationGetRelationName(index), unflushed_tuples),
+                        errhint("The remote index is not keeping up with inserts (about %.0f vectors per second). Retry later, or raise pinecone.buffer_hard_limit.", buffer_meta.upsert_rate)));
+    }
 
-        }
-        // release insert_page, newpage, meta
-        GenericXLogFinish(state);
-        UnlockReleaseBuffer(insert_buf); UnlockReleaseBuffer(newbuf); UnlockReleaseBuffer(buffer_meta_buf);
+    // without an observed rate, wait as long as allowed
+    if (buffer_meta.upsert_rate <= 0) delay_us = pinecone_backpressure_max_delay * 1000.0;
+    else {
+        double pressure = pinecone_buffer_hard_limit > pinecone_buffer_soft_limit ?
+            (double) (unflushed_tuples - pinecone_buffer_soft_limit) / (pinecone_buffer_hard_limit - pinecone_buffer_soft_limit) : 1.0;
+        delay_us = Min(pressure, 1.0) * 1000000.0 / buffer_meta.upsert_rate;
+        delay_us = Min(delay_us, pinecone_backpressure_max_delay * 1000.0);
+    }
+    elog(DEBUG1, "Pinecone backpressure: %d unflushed tuples, delaying insert by %.0f us", unflushed_tuples, delay_us);
+    if (delay_us >= 1) {
+        pg_usleep((long) delay_us);
+        CHECK_FOR_INTERRUPTS();
     }
-    // release append lock
-    LockRelease(&pinecone_append_lock, ExclusiveLock, false);
-    return create_checkpoint;
 }
 
-bool AppendBufferTupleInCtx(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heapRel, IndexUniqueCheck checkUnique, IndexInfo *indexInfo)
+// advance the pinecone tail when the transaction commits
+void FlushAtCommit(Relation index)
+{
+    MemoryContext oldCtx = MemoryContextSwitchTo(TopTransactionContext);
+    elog(DEBUG1, "Checkpoint created. Flushing to Pinecone at commit");
+    pending_flush_indexes = list_append_unique_oid(pending_flush_indexes, RelationGetRelid(index));
+    MemoryContextSwitchTo(oldCtx);
+}
+
+static PineconePendingTuples *get_pending_tuples(Relation index, bool create)
+{
+    ListCell *lc;
+    PineconePendingTuples *pending = NULL;
+    foreach(lc, pending_tuples) {
+        if (((PineconePendingTuples *) lfirst(lc))->indexid == RelationGetRelid(index)) pending = lfirst(lc);
+    }
+    if (pending == NULL && create) {
+        MemoryContext oldCtx = MemoryContextSwitchTo(TopTransactionContext);
+        pending = palloc(sizeof(PineconePendingTuples));
+        pending->indexid = RelationGetRelid(index);
+        pending->relfilenode = index->rd_rel->relfilenode;
+        pending->n_appended = 0;
+        pending->n_tuples = 0;
+        pending_tuples = lappend(pending_tuples, pending);
+        MemoryContextSwitchTo(oldCtx);
+    }
+    // a REINDEX or TRUNCATE of this transaction rebuilt the index from the heap, so the queued tuples are stale
+    if (pending != NULL && pending->relfilenode != index->rd_rel->relfilenode) {
+        pending->relfilenode = index->rd_rel->relfilenode;
+        pending->n_appended = 0;
+        pending->n_tuples = 0;
+    }
+    return pending;
+}
+
+static void append_pending_tuples(Relation index, PineconePendingTuples *pending)
 {
-    MemoryContext oldCtx;
-    MemoryContext insertCtx;
     bool checkpoint_created;
-    // use a memory context because index_form_tuple can allocate 
-    insertCtx = AllocSetContextCreate(CurrentMemoryContext,
-                                      "Pinecone insert tuple temporary context",
-                                      ALLOCSET_DEFAULT_SIZES);
-    oldCtx = MemoryContextSwitchTo(insertCtx);
-    checkpoint_created = AppendBufferTuple(index, values, isnull, heap_tid, heapRel);
+    checkpoint_created = AppendBufferTuples(index, pending->tuples, pending->n_tuples);
+    pending->n_appended += pending->n_tuples;
+    pending->n_tuples = 0;
+    // if there are enough tuples in the buffer, advance the pinecone tail when the transaction commits
+    if (checkpoint_created) FlushAtCommit(index);
+}
+
+/*
+ * Append the tuples that the current transaction queued for the index, so that a scan of its buffer finds them
+ */
+void PineconeAppendPendingTuples(Relation index)
+{
+    PineconePendingTuples *pending = get_pending_tuples(index, false);
+    if (pending != NULL && pending->n_tuples > 0) append_pending_tuples(index, pending);
+}
+
+static void append_all_pending_tuples(void)
+{
+    ListCell *lc;
+    foreach(lc, pending_tuples) {
+        Oid indexid = ((PineconePendingTuples *) lfirst(lc))->indexid;
+        Relation index;
+        if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(indexid))) continue; // dropped by this transaction
+        index = index_open(indexid, RowExclusiveLock);
+        PineconeAppendPendingTuples(index);
+        index_close(index, RowExclusiveLock);
+    }
+}
+
+static void cached_vector_key(Relation index, ItemPointer heap_tid, PineconeCachedVectorKey *key)
+{
+    memset(key, 0, sizeof(PineconeCachedVectorKey)); // the key is hashed with its padding
+    key->relfilenode = index->rd_rel->relfilenode;
+    key->tid = *heap_tid;
+}
+
+/*
+ * Keep the index columns of a tuple for the flush at commit
+ */
+static void cache_vector(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
+{
+    PineconeCachedVectorKey key;
+    PineconeCachedVector *entry;
+    MemoryContext oldCtx;
+    bool found;
+    if (cached_vectors_size >= (Size) maintenance_work_mem * 1024) return;
+
+    oldCtx = MemoryContextSwitchTo(TopTransactionContext);
+    if (cached_vectors == NULL) {
+        HASHCTL ctl;
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(PineconeCachedVectorKey);
+        ctl.entrysize = sizeof(PineconeCachedVector);
+        ctl.hcxt = TopTransactionContext;
+        cached_vectors = hash_create("Pinecone cached vectors", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+    cached_vector_key(index, heap_tid, &key);
+    entry = hash_search(cached_vectors, &key, HASH_ENTER, &found);
+    if (found) {
+        // the tid of a tuple that an aborted subtransaction inserted was reused
+        cached_vectors_size -= HEAPTUPLESIZE + entry->values->t_len;
+        heap_freetuple(entry->values);
+    }
+    entry->xid = GetCurrentTransactionId();
+    entry->values = heap_form_tuple(RelationGetDescr(index), values, isnull);
+    cached_vectors_size += HEAPTUPLESIZE + entry->values->t_len;
     MemoryContextSwitchTo(oldCtx);
-    MemoryContextDelete(insertCtx); // delete the temporary context
-    return checkpoint_created;
 }
 
 /*
- * Insert a tuple into the index
+ * Take the index columns that were cached for a buffer tuple, or NULL if the flush has to fetch it from the heap
+ */
+static HeapTuple take_cached_vector(Relation index, ItemPointer heap_tid)
+{
+    PineconeCachedVectorKey key;
+    PineconeCachedVector *entry;
+    HeapTuple values;
+    bool live;
+    if (cached_vectors == NULL) return NULL;
+    cached_vector_key(index, heap_tid, &key);
+    entry = hash_search(cached_vectors, &key, HASH_FIND, NULL);
+    if (entry == NULL) return NULL;
+    values = entry->values;
+    // the heap fetch skips the tuples of a subtransaction that aborted
+    live = TransactionIdIsCurrentTransactionId(entry->xid);
+    hash_search(cached_vectors, &key, HASH_REMOVE, NULL);
+    cached_vectors_size -= HEAPTUPLESIZE + values->t_len;
+    if (!live) {
+        heap_freetuple(values);
+        return NULL;
+    }
+    return values;
+}
+
+/*
+ * Insert a tuple into the index. The tuple is queued and appended to the buffer with the tuples that the transaction
+ * inserts after it, a page at a time, or before the transaction commits or scans the index.
  */
 bool pinecone_insert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
                      Relation heap, IndexUniqueCheck checkUnique, 
@@ -177,40 +475,220 @@ bool pinecone_insert(Relation index, Datum *values, bool *isnull, ItemPointer he
 #endif
                      IndexInfo *indexInfo)
 {
-    bool checkpoint_created;
+    PineconePendingTuples *pending = get_pending_tuples(index, true);
 
-    // add a tuple to the buffer
-    checkpoint_created = AppendBufferTupleInCtx(index, values, isnull, heap_tid, heap, checkUnique, indexInfo);
+    PineconeApplyBackpressure(index, pending);
 
-    // if there are enough tuples in the buffer, advance the pinecone tail
-    if (checkpoint_created) {
-        elog(DEBUG1, "Checkpoint created. Flushing to Pinecone");
-        FlushToPinecone(index);
-    }
-
-    // log the state of the relation for debugging
+    // queue the tuple, and append the queue once it fills a page
+    pending->tuples[pending->n_tuples++] = PineconeMakeBufferTuple(heap_tid);
+    cache_vector(index, values, isnull, heap_tid);
+    if (pending->n_tuples == PINECONE_PAGE_TUPLES) append_pending_tuples(index, pending);
 
     return false;
 }
 
 // todo: it will make debugging a lot easier to have a way to pretty print the state of the relation e.g. how many tups per page
 
+/*
+ * Flush an index as its transaction commits. The rows are already written, so a failure only leaves the batches in
+ * the buffer for a later flush: the flush runs in a subtransaction and its errors are reported as warnings, like the
+ * background flusher does.
+ */
+static void flush_at_commit(Oid indexid)
+{
+    MemoryContext ctx = CurrentMemoryContext;
+    ResourceOwner owner = CurrentResourceOwner;
+    BeginInternalSubTransaction(NULL);
+    PG_TRY();
+    {
+        Relation index = index_open(indexid, RowExclusiveLock);
+        FlushToPineconeInCtx(index, true);
+        index_close(index, RowExclusiveLock);
+        ReleaseCurrentSubTransaction();
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+        MemoryContextSwitchTo(ctx);
+        edata = CopyErrorData();
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+        ereport(WARNING, (errmsg("Failed to flush index %u to pinecone at commit: %s", indexid, edata->message),
+                          errhint("The batches stay in the buffer, where queries find them, until a later flush uploads them.")));
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+    MemoryContextSwitchTo(ctx);
+    CurrentResourceOwner = owner;
+}
 
 /*
- * Upload batches of vectors to pinecone.
+ * Append the queued tuples and flush the indexes that reached a checkpoint once the transaction is about to commit, so
+ * that a statement never waits on the network and a transaction's checkpoints are uploaded in a single pass. Nothing is
+ * flushed for a transaction that aborts or is prepared; the next flush of the index picks up its tuples once they are
+ * committed.
  */
-void FlushToPinecone(Relation index)
+void pinecone_xact_callback(XactEvent event, void *arg)
+{
+    ListCell *lc;
+    List *indexes;
+    switch (event) {
+        case XACT_EVENT_PRE_COMMIT:
+            append_all_pending_tuples();
+            indexes = pending_flush_indexes;
+            pending_flush_indexes = NIL;
+            foreach(lc, indexes) {
+                Oid indexid = lfirst_oid(lc);
+                if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(indexid))) continue; // dropped by this transaction
+                flush_at_commit(indexid);
+            }
+            break;
+        case XACT_EVENT_PRE_PREPARE:
+            append_all_pending_tuples();
+            break;
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PREPARE:
+            // the lists and the cache live in TopTransactionContext
+            pending_flush_indexes = NIL;
+            pending_tuples = NIL;
+            cached_vectors = NULL;
+            cached_vectors_size = 0;
+            break;
+        default:
+            break;
+    }
+}
+
+typedef enum PineconeFlushTupleStatus
+{
+    PINECONE_FLUSH_UPLOAD, // committed, or inserted by the committing transaction
+    PINECONE_FLUSH_SKIP, // aborted or already pruned
+    PINECONE_FLUSH_DEFER // inserted by a transaction that is still running
+} PineconeFlushTupleStatus;
+
+/*
+ * Decide whether a buffered tuple can be uploaded by looking at the transaction that inserted it, which is returned in xmin
+ */
+static PineconeFlushTupleStatus flush_tuple_status(TupleTableSlot *slot, bool found, TransactionId *xmin)
+{
+    bool should_free;
+    HeapTuple tuple;
+    if (!found) return PINECONE_FLUSH_SKIP;
+    tuple = ExecFetchSlotHeapTuple(slot, false, &should_free);
+    *xmin = HeapTupleHeaderGetXmin(tuple->t_data);
+    if (should_free) heap_freetuple(tuple);
+    if (TransactionIdIsCurrentTransactionId(*xmin)) return PINECONE_FLUSH_UPLOAD;
+    if (TransactionIdIsInProgress(*xmin)) return PINECONE_FLUSH_DEFER;
+    if (TransactionIdDidCommit(*xmin)) return PINECONE_FLUSH_UPLOAD;
+    return PINECONE_FLUSH_SKIP;
+}
+
+/*
+ * Move the tuples of running transactions that an uploaded batch left out to the end of the buffer, so that the flush
+ * after their transaction commits uploads them; the flush at its commit waits for this one. locs are the positions of
+ * the tuples, in buffer order. They are marked as moved before the copies are appended, so that scans never return a
+ * row twice; a crash in between loses the tuples, which only matters for a prepared transaction.
+ */
+static void MoveDeferredTuples(Relation index, PineconeBufferTuple *tuples, ItemPointerData *locs, int n_tuples)
+{
+    int i = 0;
+    while (i < n_tuples) {
+        BlockNumber blkno = ItemPointerGetBlockNumber(&locs[i]);
+        GenericXLogState *state = GenericXLogStart(index);
+        Buffer buf = ReadBuffer(index, blkno);
+        Page page;
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        page = GenericXLogRegisterBuffer(state, buf, 0);
+        for (; i < n_tuples && ItemPointerGetBlockNumber(&locs[i]) == blkno; i++) {
+            ItemId itemid = PageGetItemId(page, ItemPointerGetOffsetNumber(&locs[i]));
+            ((PineconeBufferTuple*) PageGetItem(page, itemid))->flags |= PINECONE_BUFFER_TUPLE_MOVED;
+        }
+        GenericXLogFinish(state);
+        UnlockReleaseBuffer(buf);
+    }
+    elog(DEBUG1, "Moving %d tuples of running transactions to the end of the buffer", n_tuples);
+    AppendBufferTuples(index, tuples, n_tuples);
+}
+
+/*
+ * Claim the flush of the index and flush in a temporary memory context so that the heap tuples, json vectors and
+ * responses are released together. Nothing is flushed while the remote index is being created, or while its stats
+ * say it is full. Without a background flusher to refresh them, stats older than PINECONE_STATS_REFRESH_INTERVAL are
+ * refreshed first; otherwise commits never wait on describe_index_stats. With wait, a flush claimed by
+ * another backend is waited for; a committing transaction does so because the other flush moves its tuples past the
+ * flush checkpoint, where nobody else uploads them until the next commit or flusher round.
+ */
+void FlushToPineconeInCtx(Relation index, bool wait)
+{
+    MemoryContext oldCtx;
+    MemoryContext flushCtx;
+    PineconeIndexSlot *index_slot;
+    PineconeRemoteStats stats;
+    // the batches of an index whose remote index is still being created wait in the buffer
+    if (!PineconeFinishProvisioning(index)) return;
+    stats = PineconeGetRemoteStats(RelationGetRelid(index));
+    if (!PineconeFlusherServesDatabase() &&
+        TimestampDifferenceExceeds(stats.refreshed_at, GetCurrentTimestamp(), PINECONE_STATS_REFRESH_INTERVAL * 1000)) {
+        stats = PineconeRefreshRemoteStats(index);
+    }
+    // a full pod index rejects upserts; the batches stay buffered until a refresh of the stats shows room
+    if (stats.index_fullness >= 1.0) {
+        ereport(WARNING, (errcode(ERRCODE_DISK_FULL),
+                          errmsg("Not flushing \"%s\" because the remote index is full", RelationGetRelationName(index)),
+                          errhint("Scale the pods of the remote index. Queries still find the buffered vectors.")));
+        return;
+    }
+    index_slot = PineconeTryClaimFlush(index);
+    while (index_slot == NULL && wait) {
+        pg_usleep(10000L);
+        CHECK_FOR_INTERRUPTS();
+        index_slot = PineconeTryClaimFlush(index);
+    }
+    if (index_slot == NULL) {
+        ereport(NOTICE, (errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+                        errmsg("Pinecone insertion lock not available"),
+                        errhint("The pinecone insertion lock is currently held by another transaction. This is likely because the buffer is being advanced by another transaction. This is not an error, but it may cause a delay in the insertion of new vectors.")));
+        return;
+    }
+    flushCtx = AllocSetContextCreate(CurrentMemoryContext,
+                                     "Pinecone flush temporary context",
+                                     ALLOCSET_DEFAULT_SIZES);
+    oldCtx = MemoryContextSwitchTo(flushCtx);
+    PG_TRY();
+    {
+        pg_atomic_fetch_add_u64(&index_slot->vectors_flushed, FlushToPinecone(index));
+    }
+    PG_FINALLY();
+    {
+        PineconeReleaseFlush(index_slot);
+    }
+    PG_END_TRY();
+    MemoryContextSwitchTo(oldCtx);
+    MemoryContextDelete(flushCtx);
+}
+
+/*
+ * Upload batches of vectors to pinecone. The caller holds the flush claim of the index. Returns the number of vectors uploaded.
+ * The tuples of running transactions are left out of the batches and moved to the end of the buffer, up to a batch of
+ * them per flush; past that the flush stops at the next one and warns, as moving every tuple of a long bulk load again
+ * at each flush would cost more than it waits for.
+ */
+int FlushToPinecone(Relation index)
 {
     Buffer buf, buffer_meta_buf;
     Page page, buffer_meta_page;
     BlockNumber currentblkno = PINECONE_BUFFER_HEAD_BLKNO;
     cJSON* json_vectors = cJSON_CreateArray();
-    bool success;
+    int n_flushed = 0;
 
     // take a snapshot of the buffer meta
-    // we don't need to worry about another transaction advancing the pinecone tail because we have the pinecone insertion lock
+    // we don't need to worry about another transaction advancing the pinecone tail because we have the flush claim
     PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(index);
     PineconeBufferMetaPageData buffer_meta = PineconeSnapshotBufferMeta(index);
+    PineconeSettings settings = PineconeGetSettings(index);
+    int n_shards;
+    PineconeShard* shards = PineconeGetShards(&static_meta, &n_shards);
 
 
     // index info
@@ -220,24 +698,20 @@ void FlushToPinecone(Relation index)
     // get the base table
     Oid baseTableOid = index->rd_index->indrelid;
     Relation baseTableRel = RelationIdGetRelation(baseTableOid);
-    Snapshot snapshot = GetActiveSnapshot();
+    // every version is fetched; flush_tuple_status decides from its inserting transaction
+    Snapshot snapshot = SnapshotAny;
     // begin the index fetch (this the preferred way for an index to request tuples from its base table)
     IndexFetchTableData *fetchData = baseTableRel->rd_tableam->index_fetch_begin(baseTableRel);
     TupleTableSlot *slot = MakeSingleTupleTableSlot(baseTableRel->rd_att, &TTSOpsBufferHeapTuple);
     bool call_again, all_dead, found;
-    char* vector_id; // todo: free
-
-    // acquire the pinecone insertion lock
-    LOCKTAG pinecone_flush_lock;
-    SET_LOCKTAG_FLUSH(pinecone_flush_lock, index);
-    success = LockAcquire(&pinecone_flush_lock, ExclusiveLock, false, true);
-    if (!success) {
-        ereport(NOTICE, (errcode(ERRCODE_LOCK_NOT_AVAILABLE),
-                        errmsg("Pinecone insertion lock not available"),
-                        errhint("The pinecone insertion lock is currently held by another transaction. This is likely because the buffer is being advanced by another transaction. This is not an error, but it may cause a delay in the insertion of new vectors.")));
-        return;
-    }
-
+    bool blocked = false; // a tuple of a running transaction keeps the flush from passing its checkpoint
+    int max_deferred = PINECONE_BATCH_SIZE(settings); // tuples of running transactions moved by this flush
+    int n_deferred = 0, n_moved = 0;
+    PineconeBufferTuple *deferred = palloc(sizeof(PineconeBufferTuple) * max_deferred);
+    ItemPointerData *deferred_locs = palloc(sizeof(ItemPointerData) * max_deferred);
+    PineconeFlushTupleStatus status;
+    TransactionId xmin = InvalidTransactionId;
+    char vector_id[PINECONE_ID_BUFFER_SIZE];
 
     // get the first page
     buf = ReadBuffer(index, buffer_meta.flush_checkpoint.blkno);
@@ -255,6 +729,7 @@ void FlushToPinecone(Relation index)
         for (int i = 1; i <= PageGetMaxOffsetNumber(page); i++)
         {
             cJSON* json_vector;
+            HeapTuple cached;
             ItemId itemid = PageGetItemId(page, i);
             Item item = PageGetItem(page, itemid);
             PineconeBufferTuple buffer_tup = *((PineconeBufferTuple*) item);
@@ -262,40 +737,49 @@ void FlushToPinecone(Relation index)
                                                       errmsg("Item is not used")));
             if (item == NULL) ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
                                               errmsg("Item is null")));
+            if (buffer_tup.flags & PINECONE_BUFFER_TUPLE_MOVED) continue; // uploaded from its copy
 
             // log the tid of the index tuple
             elog(DEBUG1, "Flushing tuple with tid %d:%d", ItemPointerGetBlockNumber(&buffer_tup.tid), ItemPointerGetOffsetNumber(&buffer_tup.tid));
 
-            // fetch the tuple from the base table
-            found = baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, snapshot, slot, &call_again, &all_dead);
-
-            // print the tuple
-            if (!found) {
-                ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
-                                errmsg("Tuple not found in heap")));
+            // the tuples this transaction inserted are uploaded from the cache, without fetching them from the base table
+            cached = take_cached_vector(index, &buffer_tup.tid);
+            if (cached != NULL) {
+                heap_deform_tuple(cached, RelationGetDescr(index), index_values, index_isnull);
+            } else {
+                // fetch the tuple from the base table
+                call_again = false;
+                found = baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, snapshot, slot, &call_again, &all_dead);
+                status = flush_tuple_status(slot, found, &xmin);
+                if (status == PINECONE_FLUSH_SKIP) {
+                    elog(DEBUG1, "Skipping aborted tuple with tid %d:%d", ItemPointerGetBlockNumber(&buffer_tup.tid), ItemPointerGetOffsetNumber(&buffer_tup.tid));
+                    continue;
+                }
+                if (status == PINECONE_FLUSH_DEFER) {
+                    if (n_moved + n_deferred == max_deferred) {
+                        blocked = true;
+                        break;
+                    }
+                    deferred[n_deferred] = buffer_tup;
+                    ItemPointerSet(&deferred_locs[n_deferred], BufferGetBlockNumber(buf), i);
+                    n_deferred++;
+                    continue;
+                }
+
+                // extract the indexed columns
+                FormIndexDatum(indexInfo, slot, NULL, index_values, index_isnull);
             }
-            // else {
-                // // todo: cut this else block
-                // elog(NOTICE, "Fetched tuple from heap");
-                // for (int k = 0; k < baseTableRel->rd_att->natts; k++) {
-                    // bool isnull;
-                    // FormData_pg_attribute attr = baseTableRel->rd_att->attrs[k];
-                    // Datum datum = slot_getattr(slot, k + 1, &isnull);
-                    // if (!isnull) {
-                        // int datum_str = DatumGetInt32(datum);
-                        // elog(NOTICE, "Attribute %s: %d", NameStr(attr.attname), datum_str);
-                    // }
-                // }
-                // elog(NOTICE, "That tuple had n attributes where n = %d", baseTableRel->rd_att->natts);
-            // }
-
-            // extract the indexed columns
-            FormIndexDatum(indexInfo, slot, NULL, index_values, index_isnull);
-
-            vector_id = pinecone_id_from_heap_tid(buffer_tup.tid);
+
+            pinecone_id_encode(buffer_tup.tid, settings.compact_ids, vector_id);
             json_vector = tuple_get_pinecone_vector(index->rd_att, index_values, index_isnull, vector_id);
             cJSON_AddItemToArray(json_vectors, json_vector);
-
+            if (cached != NULL) heap_freetuple(cached);
+        }
+        if (blocked) {
+            ereport(WARNING, (errmsg("Flush of \"%s\" stopped at a vector of running transaction %u", RelationGetRelationName(index), xmin),
+                              errdetail("This flush already moved %d vectors of running transactions to the end of the buffer.", n_moved),
+                              errhint("The batches after it are uploaded once it ends. Until then queries scan them in the buffer, up to max_buffer_scan.")));
+            break;
         }
 
         // Move to the next page. Stop if there are no more pages.
@@ -311,9 +795,27 @@ void FlushToPinecone(Relation index)
 
         // If we have reached a checkpoint, push them to the remote index and update the pinecone checkpoint with a representative vector heap tid
         if (PineconePageGetOpaque(page)->checkpoint.is_checkpoint) {
-            GenericXLogState *state = GenericXLogStart(index); // start a new WAL record
- 
-            pinecone_bulk_upsert(pinecone_api_key, static_meta.host, json_vectors, pinecone_vectors_per_request);
+            GenericXLogState *state;
+            int n_vectors = cJSON_GetArraySize(json_vectors);
+            TimestampTz upsert_start = GetCurrentTimestamp();
+            long secs;
+            int usecs;
+
+            pinecone_bulk_upsert(pinecone_api_key, shards, n_shards, json_vectors, settings.vectors_per_request);
+            TimestampDifference(upsert_start, GetCurrentTimestamp(), &secs, &usecs);
+            n_flushed += n_vectors;
+
+            // the batch is uploaded without the tuples of running transactions, which go to the end of the buffer
+            if (n_deferred > 0) {
+                LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+                MoveDeferredTuples(index, deferred, deferred_locs, n_deferred);
+                LockBuffer(buf, BUFFER_LOCK_SHARE);
+                page = BufferGetPage(buf);
+                n_moved += n_deferred;
+                n_deferred = 0;
+            }
+
+            state = GenericXLogStart(index); // start a new WAL record
 
             // lock the buffer meta page
             buffer_meta_buf = ReadBuffer(index, PINECONE_BUFFER_METAPAGE_BLKNO);
@@ -322,6 +824,12 @@ void FlushToPinecone(Relation index)
 
             // update the buffer meta page
             PineconePageGetBufferMeta(buffer_meta_page)->flush_checkpoint = PineconePageGetOpaque(page)->checkpoint;
+            // fold this batch into the upsert rate that drives backpressure
+            if (n_vectors > 0 && (secs > 0 || usecs > 0)) {
+                float4 sample = n_vectors / (secs + usecs / 1000000.0);
+                float4 *rate = &PineconePageGetBufferMeta(buffer_meta_page)->upsert_rate;
+                *rate = *rate <= 0 ? sample : PINECONE_UPSERT_RATE_WEIGHT * sample + (1 - PINECONE_UPSERT_RATE_WEIGHT) * *rate;
+            }
 
             // save and release
             GenericXLogFinish(state);
@@ -341,7 +849,5 @@ void FlushToPinecone(Relation index)
     baseTableRel->rd_tableam->index_fetch_end(fetchData);
     // close the base table
     RelationClose(baseTableRel);
-
-    // release the lock
-    LockRelease(&pinecone_flush_lock, ExclusiveLock, false);
+    return n_flushed;
 }
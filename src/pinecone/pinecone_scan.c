@@ -2,93 +2,749 @@
 #include "pinecone.h"
 
 #include <storage/bufmgr.h>
+#include <storage/dsm.h>
 #include "catalog/pg_operator_d.h"
 #include "utils/rel.h"
+#include "utils/memutils.h"
 #include "utils/builtins.h"
 #include <time.h>
 #include "common/hashfn.h"
+#include "pgstat.h"
 
 #include <catalog/index.h>
 #include <access/heapam.h>
 #include <access/tableam.h>
+#include <access/xlog.h>
+#include <catalog/partition.h>
+#include <catalog/pg_inherits.h>
+#include <commands/defrem.h>
+#include <executor/executor.h>
+#include <nodes/nodeFuncs.h>
+#include <storage/lmgr.h>
+#include <storage/proc.h>
+#include <utils/lsyscache.h>
 
 #include <math.h>
 
-PineconeCheckpoint* get_checkpoints_to_fetch(Relation index) {
-    // starting at the current pinecone page, create a list of each checkpoint page's checkpoint (blkno, tid, checkpt_no)
+#define PINECONE_PARALLEL_CLAIMING MaxBlockNumber // next_blkno while a participant reads the link of the page it claimed
+
+/*
+ * State of a parallel scan in the DSM. The first participant to start queries the remote index, and every
+ * participant claims pages of the buffer chain one at a time, so that each sorts a disjoint part of the buffer and
+ * Gather Merge merges their ordered results. The tids of every claimed page go into the shared bloom filter, which
+ * the remote owner waits for before it skips remote matches that are also in the buffer. The size of this state is
+ * fixed before the index is known, so the remote owner puts the bloom filter into a segment of its own, sized for the
+ * buffer it is about to scan, and the others attach to it with their first page.
+ */
+typedef struct PineconeParallelScanData
+{
+    slock_t mutex;
+    ConditionVariable cv;
+    bool started; // the remote owner has published the first page of the buffer
+    BlockNumber next_blkno; // next page to claim
+    int pages_in_progress; // claimed pages whose tids are not yet in the bloom filter
+    int n_scanned; // buffer tuples on the claimed pages
+    dsm_handle bloom_handle; // segment of the bloom filter, an array of pg_atomic_uint32
+    size_t bloom_size; // bytes of the bloom filter
+} PineconeParallelScanData;
+typedef PineconeParallelScanData *PineconeParallelScan;
+
+static bool advance_shard(PineconeScanOpaque so, int shard);
+static int compare_shard_distances(Datum a, Datum b, void *arg);
+
+typedef struct PineconeSparseEntry
+{
+    int32 index;
+    float4 value;
+} PineconeSparseEntry;
+
+/*
+ * The buffer graphs only know dense distances, so hybrid queries scan the buffer
+ */
+static bool use_buffer_graph(PineconeScanOpaque so)
+{
+    return pinecone_buffer_graph && !so->hybrid;
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+    int32 x = *(const int32*) a;
+    int32 y = *(const int32*) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_sparse_entries(const void *a, const void *b)
+{
+    return compare_int32(&((const PineconeSparseEntry*) a)->index, &((const PineconeSparseEntry*) b)->index);
+}
+
+/*
+ * Parse pinecone.sparse_query into the scan, sorted by index to score the buffer tuples. Returns it as the sparse
+ * vector of the remote query.
+ */
+static cJSON* parse_sparse_query(Relation index, PineconeScanOpaque so)
+{
+    cJSON *sparse_vector = cJSON_Parse(pinecone_sparse_query);
+    cJSON *indices = cJSON_GetObjectItemCaseSensitive(sparse_vector, "indices");
+    cJSON *values = cJSON_GetObjectItemCaseSensitive(sparse_vector, "values");
+    PineconeSparseEntry *entries;
+    int n;
+
+    so->sparse_attno = pinecone_sparse_attno(index->rd_att);
+    if (so->sparse_attno < 0) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("pinecone.sparse_query requires an index with sparse values"),
+                        errhint("Index an int4[] column of sparse indices followed by a float4[] column of their values.")));
+    }
+    if (!cJSON_IsArray(indices) || !cJSON_IsArray(values) || cJSON_GetArraySize(indices) != cJSON_GetArraySize(values)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("Invalid pinecone.sparse_query"),
+                        errhint("Set it to equally long arrays of indices and values, such as {\"indices\": [1, 7], \"values\": [0.5, 0.2]}.")));
+    }
+
+    n = cJSON_GetArraySize(indices);
+    entries = palloc(sizeof(PineconeSparseEntry) * Max(n, 1));
+    for (int i = 0; i < n; i++) {
+        cJSON *index_item = cJSON_GetArrayItem(indices, i);
+        cJSON *value_item = cJSON_GetArrayItem(values, i);
+        if (!cJSON_IsNumber(index_item) || !cJSON_IsNumber(value_item) || cJSON_GetNumberValue(index_item) < 0) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                            errmsg("Invalid pinecone.sparse_query"),
+                            errdetail("Indices must be non-negative numbers and values must be numbers.")));
+        }
+        entries[i].index = (int32) cJSON_GetNumberValue(index_item);
+        entries[i].value = (float4) cJSON_GetNumberValue(value_item);
+    }
+    qsort(entries, n, sizeof(PineconeSparseEntry), compare_sparse_entries);
+
+    so->n_sparse = n;
+    so->sparse_indices = palloc(sizeof(int32) * Max(n, 1));
+    so->sparse_values = palloc(sizeof(float4) * Max(n, 1));
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && entries[i].index == entries[i - 1].index) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                            errmsg("Invalid pinecone.sparse_query"),
+                            errdetail("Index %d appears more than once.", entries[i].index)));
+        }
+        so->sparse_indices[i] = entries[i].index;
+        so->sparse_values[i] = entries[i].value;
+    }
+    return sparse_vector;
+}
+
+/*
+ * Dot product of the sparse values of a buffer tuple with the sparse query
+ */
+static double sparse_dot(PineconeScanOpaque so, Datum indices_datum, Datum values_datum)
+{
+    int32 *indices;
+    float4 *values;
+    int n;
+    double dot = 0;
+    pinecone_sparse_values(indices_datum, values_datum, &indices, &values, &n);
+    for (int i = 0; i < n; i++) {
+        int32 *match = bsearch(&indices[i], so->sparse_indices, so->n_sparse, sizeof(int32), compare_int32);
+        if (match != NULL) dot += (double) values[i] * so->sparse_values[match - so->sparse_indices];
+    }
+    return dot;
+}
+
+/*
+ * Snapshot the buffer meta page for a scan. During recovery its ready checkpoint is the one replayed from the
+ * primary, which the scans of this standby may have overtaken; the newer of the two is used.
+ */
+static PineconeBufferMetaPageData snapshot_buffer_meta_for_scan(Relation index)
+{
     PineconeBufferMetaPageData buffer_meta = PineconeSnapshotBufferMeta(index);
-    int n_checkpoints = buffer_meta.flush_checkpoint.checkpoint_no - buffer_meta.ready_checkpoint.checkpoint_no;
+    PineconeCheckpoint standby_ready, on_page;
+    if (!RecoveryInProgress()) return buffer_meta;
+
+    standby_ready = PineconeGetStandbyReadyCheckpoint(index);
+    if (standby_ready.checkpoint_no <= buffer_meta.ready_checkpoint.checkpoint_no) return buffer_meta;
+    // the index may have been rebuilt since the checkpoint was found, so check that it is still on its page
+    if (standby_ready.checkpoint_no > buffer_meta.flush_checkpoint.checkpoint_no) return buffer_meta;
+    if (standby_ready.blkno >= RelationGetNumberOfBlocks(index)) return buffer_meta;
+    on_page = PineconeSnapshotBufferOpaque(index, standby_ready.blkno).checkpoint;
+    // a rebuilt index numbers its checkpoints from scratch, so the number alone may match a different checkpoint
+    if (on_page.checkpoint_no != standby_ready.checkpoint_no) return buffer_meta;
+    if (!ItemPointerEquals(&on_page.tid, &standby_ready.tid)) return buffer_meta;
+    buffer_meta.ready_checkpoint = standby_ready;
+    return buffer_meta;
+}
+
+/*
+ * Bytes of a bloom filter for n_tuples buffer tuples, 1.44 being the optimal bloom filter expansion factor
+ */
+static size_t bloom_filter_bytes(int n_tuples)
+{
+    return (((size_t) (1.44 * BUFFER_BLOOM_K * Max(n_tuples, 0))) >> 3) + 1;
+}
+
+/*
+ * Size of the shared state of a parallel scan
+ */
+Size pinecone_estimateparallelscan(void)
+{
+    return sizeof(PineconeParallelScanData);
+}
+
+static void reset_parallel_scan(PineconeParallelScan pscan)
+{
+    pscan->started = false;
+    pscan->next_blkno = InvalidBlockNumber;
+    pscan->pages_in_progress = 0;
+    pscan->n_scanned = 0;
+    pscan->bloom_handle = DSM_HANDLE_INVALID;
+    pscan->bloom_size = 0;
+}
+
+/*
+ * Initialize the shared state of a parallel scan
+ */
+void pinecone_initparallelscan(void *target)
+{
+    PineconeParallelScan pscan = (PineconeParallelScan) target;
+    SpinLockInit(&pscan->mutex);
+    ConditionVariableInit(&pscan->cv);
+    reset_parallel_scan(pscan);
+}
+
+/*
+ * Reset the shared state for a rescan, which the leader does before the workers start again
+ */
+void pinecone_parallelrescan(IndexScanDesc scan)
+{
+    reset_parallel_scan((PineconeParallelScan) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset));
+}
+
+/*
+ * Join a parallel scan. Returns true for the first participant, which queries the remote index and publishes the
+ * first page of the buffer. With pinecone.buffer_graph, and for hybrid queries, it searches the whole buffer on its own.
+ */
+static bool parallel_scan_start(Relation index, PineconeScanOpaque so, PineconeParallelScan pscan)
+{
+    PineconeBufferMetaPageData buffer_meta = snapshot_buffer_meta_for_scan(index);
+    BlockNumber start = use_buffer_graph(so) || so->hybrid ? InvalidBlockNumber : buffer_meta.ready_checkpoint.blkno;
+    int unready_tuples = buffer_meta.latest_checkpoint.n_preceding_tuples + buffer_meta.n_tuples_since_last_checkpoint - buffer_meta.ready_checkpoint.n_preceding_tuples;
+    size_t bloom_size;
+    pg_atomic_uint32 *bloom_filter;
+    bool first;
+    SpinLockAcquire(&pscan->mutex);
+    first = !pscan->started;
+    if (first) {
+        pscan->started = true;
+        pscan->next_blkno = PINECONE_PARALLEL_CLAIMING; // the others wait for the bloom filter
+    }
+    SpinLockRelease(&pscan->mutex);
+    if (!first) return false;
+
+    // the chain ends once max_buffer_scan tuples are claimed, whereas the buffer graph holds every unready tuple
+    if (!use_buffer_graph(so)) unready_tuples = Min(unready_tuples, PineconeGetSettings(index).max_buffer_scan);
+    bloom_size = TYPEALIGN(sizeof(uint32), bloom_filter_bytes(unready_tuples));
+    // a hybrid scan is not shared, so it keeps its bloom filter in local memory
+    if (!so->hybrid) {
+        so->bloom_segment = dsm_create(bloom_size, 0);
+        bloom_filter = (pg_atomic_uint32 *) dsm_segment_address(so->bloom_segment);
+        for (int i = 0; i < (int) (bloom_size / sizeof(uint32)); i++) {
+            pg_atomic_init_u32(&bloom_filter[i], 0);
+        }
+    }
+
+    SpinLockAcquire(&pscan->mutex);
+    if (so->bloom_segment != NULL) {
+        pscan->bloom_handle = dsm_segment_handle(so->bloom_segment);
+        pscan->bloom_size = bloom_size;
+    }
+    pscan->next_blkno = start;
+    SpinLockRelease(&pscan->mutex);
+    ConditionVariableBroadcast(&pscan->cv);
+    return true;
+}
+
+/*
+ * Use the bloom filter that the remote owner created before it published the first page, attaching to its segment
+ * unless this participant created it
+ */
+static void parallel_scan_attach_bloom_filter(PineconeScanOpaque so)
+{
+    if (so->bloom_segment == NULL) {
+        so->bloom_segment = dsm_attach(so->pscan->bloom_handle);
+        if (so->bloom_segment == NULL) elog(ERROR, "could not attach to the bloom filter of the parallel scan");
+    }
+    so->bloom_filter = dsm_segment_address(so->bloom_segment);
+    so->bloom_filter_size = so->pscan->bloom_size;
+}
+
+/*
+ * Claim the next page of the buffer chain. Returns InvalidBlockNumber once the chain is exhausted; until then the
+ * caller passes the link of the page on through parallel_scan_pass_link.
+ */
+static BlockNumber parallel_scan_claim_page(PineconeParallelScan pscan)
+{
+    BlockNumber blkno;
+    for (;;) {
+        SpinLockAcquire(&pscan->mutex);
+        blkno = pscan->next_blkno;
+        if (blkno != PINECONE_PARALLEL_CLAIMING) {
+            if (BlockNumberIsValid(blkno)) {
+                pscan->next_blkno = PINECONE_PARALLEL_CLAIMING;
+                pscan->pages_in_progress++;
+            }
+            SpinLockRelease(&pscan->mutex);
+            break;
+        }
+        SpinLockRelease(&pscan->mutex);
+        ConditionVariableSleep(&pscan->cv, PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+    return blkno;
+}
+
+/*
+ * Publish the link of the claimed page, ending the chain once max_buffer_scan tuples have been claimed
+ */
+static void parallel_scan_pass_link(PineconeParallelScan pscan, BlockNumber nextblkno, int n_tuples, int max_buffer_scan)
+{
+    bool reached_max;
+    SpinLockAcquire(&pscan->mutex);
+    pscan->n_scanned += n_tuples;
+    reached_max = pscan->n_scanned >= max_buffer_scan && BlockNumberIsValid(nextblkno);
+    pscan->next_blkno = reached_max ? InvalidBlockNumber : nextblkno;
+    SpinLockRelease(&pscan->mutex);
+    ConditionVariableBroadcast(&pscan->cv);
+    if (reached_max) elog(NOTICE, "Reached max local scan");
+}
+
+static void parallel_scan_page_done(PineconeParallelScan pscan)
+{
+    SpinLockAcquire(&pscan->mutex);
+    pscan->pages_in_progress--;
+    SpinLockRelease(&pscan->mutex);
+    ConditionVariableBroadcast(&pscan->cv);
+}
+
+/*
+ * Wait until the tids of every claimed page are in the bloom filter
+ */
+static void parallel_scan_wait_for_bloom_filter(PineconeParallelScan pscan)
+{
+    for (;;) {
+        bool done;
+        SpinLockAcquire(&pscan->mutex);
+        done = !BlockNumberIsValid(pscan->next_blkno) && pscan->pages_in_progress == 0;
+        SpinLockRelease(&pscan->mutex);
+        if (done) break;
+        ConditionVariableSleep(&pscan->cv, PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+}
+
+/*
+ * Add a buffer tid to the bloom filter of the scan, which a parallel scan shares through a DSM segment
+ */
+void pinecone_bloom_filter_add(PineconeScanOpaque so, ItemPointerData tid)
+{
+    for (int i = 0; i < BUFFER_BLOOM_K; i++) {
+        uint32 hash = hash_tid(tid, i); // i is the seed
+        size_t byte = (hash >> 3) % so->bloom_filter_size;
+        if (so->pscan == NULL) {
+            so->bloom_filter[byte] |= (1 << (hash & 7));
+        } else {
+            // the other participants set bits in the same words
+            union { uint32 word; uint8 bytes[sizeof(uint32)]; } mask = {0};
+            mask.bytes[byte % sizeof(uint32)] = 1 << (hash & 7);
+            pg_atomic_fetch_or_u32(&((pg_atomic_uint32 *) so->bloom_filter)[byte / sizeof(uint32)], mask.word);
+        }
+    }
+}
+
+bool pinecone_bloom_filter_contains(PineconeScanOpaque so, ItemPointerData tid)
+{
+    for (int i = 0; i < BUFFER_BLOOM_K; i++) {
+        uint32 hash = hash_tid(tid, i); // i is the seed
+        size_t byte = (hash >> 3) % so->bloom_filter_size;
+        if (so->pscan == NULL) {
+            if (!(so->bloom_filter[byte] & (1 << (hash & 7)))) return false;
+        } else {
+            union { uint32 word; uint8 bytes[sizeof(uint32)]; } word;
+            word.word = pg_atomic_read_u32(&((pg_atomic_uint32 *) so->bloom_filter)[byte / sizeof(uint32)]);
+            if (!(word.bytes[byte % sizeof(uint32)] & (1 << (hash & 7)))) return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * List the checkpoints between the flush checkpoint and the ready checkpoint, newest first and followed by a
+ * sentinel, and count them
+ */
+PineconeCheckpoint* get_checkpoints_to_fetch(Relation index, int* n_checkpoints) {
+    // starting at the current pinecone page, create a list of each checkpoint page's checkpoint (blkno, tid, checkpt_no)
+    PineconeBufferMetaPageData buffer_meta = snapshot_buffer_meta_for_scan(index);
+    int max_fetched_vectors = PineconeGetSettings(index).max_fetched_vectors_for_liveness_check;
+    int max_checkpoints = buffer_meta.flush_checkpoint.checkpoint_no - buffer_meta.ready_checkpoint.checkpoint_no;
     PineconeCheckpoint* checkpoints;
     BlockNumber currentblkno = buffer_meta.flush_checkpoint.blkno;
     PineconeBufferOpaqueData opaque = PineconeSnapshotBufferOpaque(index, currentblkno);
+    int n = 0;
 
-    // don't fetch more than pinecone_max_fetched_vectors_for_liveness_check vectors
-    if (n_checkpoints > pinecone_max_fetched_vectors_for_liveness_check) {
-        elog(WARNING, "Pinecone's internal indexing is more than %d batches behind what you have send to pinecone (flushed). This means pinecone is not keeping up with the rate of insertion.", n_checkpoints);
-        n_checkpoints = pinecone_max_fetched_vectors_for_liveness_check;
+    if (max_checkpoints > max_fetched_vectors) {
+        elog(WARNING, "Pinecone's internal indexing is more than %d batches behind what you have send to pinecone (flushed). This means pinecone is not keeping up with the rate of insertion.", max_checkpoints);
     }
-    checkpoints = palloc((n_checkpoints+1) * sizeof(PineconeCheckpoint));
+    checkpoints = palloc((Max(max_checkpoints, 0) + 1) * sizeof(PineconeCheckpoint));
 
     // traverse from the flushed checkpoint back to the live checkpoint and append each checkpoint to the list
-    for (int i = 0; i < n_checkpoints; i++) {
-        // move to the previous checkpoint
+    while (n < max_checkpoints) {
+        // move to the previous checkpoint; we don't want to fetch the checkpoint we are already at
         currentblkno = opaque.prev_checkpoint_blkno;
+        if (!BlockNumberIsValid(currentblkno) || currentblkno == buffer_meta.ready_checkpoint.blkno) break;
         opaque = PineconeSnapshotBufferOpaque(index, currentblkno);
-        checkpoints[i] = opaque.checkpoint;
-        // we don't want to fetch the checkpoint we are already at (this will be the last checkpoint in the list if we don't exceed the max_fetched_vectors_for_liveness_check limit)
-        if (currentblkno == buffer_meta.ready_checkpoint.blkno) {
-            checkpoints[i].is_checkpoint = false;
-        }
+        checkpoints[n++] = opaque.checkpoint;
     }
     // append a sentinel value
-    checkpoints[n_checkpoints].is_checkpoint = false;
+    checkpoints[n].is_checkpoint = false;
+    *n_checkpoints = n;
     return checkpoints;
 }
 
-cJSON* fetch_ids_from_checkpoints(PineconeCheckpoint* checkpoints) {
+/*
+ * Find the newest checkpoint that the remote index has made searchable. A shard only makes a batch searchable after
+ * the batches before it, and a checkpoint is live once every shard returned its marker, so the checkpoints that are
+ * live form a suffix of the list, and each round fetches the markers of up to
+ * max_fetched_vectors_for_liveness_check checkpoints spread evenly over the part of the list that is still unknown,
+ * narrowing it to the gap below the newest live one. The first round's fetch goes out with the query, and a ready
+ * pointer that is far behind converges within a few more rounds.
+ */
+void liveness_search_begin(Relation index, PineconeLivenessSearch* search)
+{
+    search->checkpoints = get_checkpoints_to_fetch(index, &search->n_checkpoints);
+    search->lo = 0;
+    search->hi = search->n_checkpoints;
+    search->max_probes = PineconeGetSettings(index).max_fetched_vectors_for_liveness_check;
+    search->probes = palloc(sizeof(int) * Max(search->max_probes, 1));
+    search->n_probes = 0;
+    search->rounds = 0;
+    search->n_shards = Max(PineconeSnapshotStaticMeta(index).n_shards, 1);
+    search->markers = palloc(sizeof(ItemPointerData) * Max(search->max_probes, 1) * search->n_shards);
+}
+
+bool liveness_search_done(PineconeLivenessSearch* search)
+{
+    return search->lo >= search->hi || search->max_probes == 0 || search->rounds >= PINECONE_LIVENESS_MAX_ROUNDS;
+}
+
+/*
+ * Ids of the markers of the checkpoints to fetch in the next round, starting with the newest unknown one. Each id is
+ * fetched from the shard it belongs to.
+ */
+cJSON* liveness_search_next_ids(Relation index, PineconeLivenessSearch* search)
+{
+    int width = search->hi - search->lo;
     cJSON* fetch_ids = cJSON_CreateArray();
-    for (int i = 0; checkpoints[i].is_checkpoint; i++) {
-        cJSON_AddItemToArray(fetch_ids, cJSON_CreateString(pinecone_id_from_heap_tid(checkpoints[i].tid)));
+    bool compact = PineconeGetSettings(index).compact_ids;
+    char id[PINECONE_ID_BUFFER_SIZE];
+    search->n_probes = liveness_search_done(search) ? 0 : Min(width, search->max_probes);
+    for (int k = 0; k < search->n_probes; k++) {
+        ItemPointerData* markers = &search->markers[k * search->n_shards];
+        search->probes[k] = search->lo + (int) ((int64) k * width / search->n_probes);
+        PineconeGetCheckpointMarkers(index, search->checkpoints[search->probes[k]], search->n_shards, markers);
+        for (int s = 0; s < search->n_shards; s++) {
+            if (!ItemPointerIsValid(&markers[s])) continue;
+            pinecone_id_encode(markers[s], compact, id);
+            cJSON_AddItemToArray(fetch_ids, cJSON_CreateString(id));
+        }
     }
     return fetch_ids;
 }
 
-PineconeCheckpoint get_best_fetched_checkpoint(Relation index, PineconeCheckpoint* checkpoints, cJSON* fetch_results) {
-    // find the latest checkpoint that has was fetched (i.e. is in fetch_results)
-    // todo: add timestamping so that we can assume that if the pinecone page is sufficiently old, we can assume it is live. (simple)
-
-    // preprocess the results from a json object to a list of ItemPointerData
-    PineconeCheckpoint best_checkpoint = {INVALID_CHECKPOINT_NUMBER, InvalidBlockNumber, {{0, 0},0}, 0, true};
+/*
+ * Narrow the search down with the vectors fetched for the probes of the round
+ */
+void liveness_search_update(PineconeLivenessSearch* search, cJSON* fetch_results)
+{
     cJSON* vectors = cJSON_GetObjectItemCaseSensitive(fetch_results, "vectors");
     cJSON* vector;
-    clock_t start, end;
     int n_fetched = cJSON_GetArraySize(vectors);
-    ItemPointerData* fetched_tids = palloc(sizeof(ItemPointerData) * n_fetched);
+    ItemPointerData* fetched_tids = palloc(sizeof(ItemPointerData) * Max(n_fetched, 1));
     int k = 0;
+    search->rounds++;
 
-    start = clock();
-    cJSON_Print(vectors);
-    end = clock();
-    elog(DEBUG1, "time to print fetched vectors: %f", (double)(end - start) / CLOCKS_PER_SEC);
+    // a failed fetch ends the search with what is known so far
+    if (search->n_probes == 0 || vectors == NULL) {
+        search->lo = search->hi;
+        return;
+    }
     cJSON_ArrayForEach(vector, vectors) {
-        char* id_str = vector->string;
-        fetched_tids[k++] = pinecone_id_get_heap_tid(id_str);
+        fetched_tids[k++] = pinecone_id_get_heap_tid(vector->string);
+        elog(DEBUG1, "fetched checkpoint: %s", vector->string);
     }
-    // log fetched tids
-    for (int i = 0; i < n_fetched; i++) {
-        elog(DEBUG1, "fetched tid: %s", pinecone_id_from_heap_tid(fetched_tids[i]));
+
+    // the probes are listed newest first, so the first one that every shard returned bounds the search from above
+    for (int p = 0; p < search->n_probes; p++) {
+        int i = search->probes[p];
+        ItemPointerData* markers = &search->markers[p * search->n_shards];
+        int n_markers = 0, n_live = 0;
+        for (int s = 0; s < search->n_shards; s++) {
+            bool fetched = false;
+            if (!ItemPointerIsValid(&markers[s])) continue;
+            n_markers++;
+            for (int j = 0; j < n_fetched && !fetched; j++) fetched = ItemPointerEquals(&markers[s], &fetched_tids[j]);
+            if (fetched) n_live++;
+        }
+        // a shard that is still indexing its part of the batch holds the checkpoint back
+        if (n_markers > 0 && n_live == n_markers) {
+            search->hi = i;
+            return;
+        }
+        search->lo = i + 1;
     }
+}
+
+/*
+ * The newest checkpoint found to be live; is_checkpoint is false if there is none
+ */
+PineconeCheckpoint liveness_search_result(PineconeLivenessSearch* search)
+{
+    return search->checkpoints[search->hi]; // the sentinel if hi is n_checkpoints
+}
 
-    // the checkpoints are listed in reverse chronological order, so we can return the first checkpoint that is in fetch_results
-    for (int i = 0; checkpoints[i].is_checkpoint; i++) {
-        // search for the checkpoint in the fetched tids
-        for (int j = 0; j < n_fetched; j++) {
-            if (ItemPointerEquals(&checkpoints[i].tid, &fetched_tids[j])) {
-                return checkpoints[i];
+/*
+ * Partitions that share a remote index are queried together. The first partition that a statement scans also
+ * queries the namespaces of the sibling partitions whose indexes the statement's plan scans, which are the ones that
+ * partition pruning kept, and sends the first round of each one's liveness check, all in one concurrent round trip.
+ * The siblings' responses are kept for their own scans and dropped when the statement ends. A sibling uses its
+ * responses once, and only if it makes the same requests.
+ */
+typedef struct PineconePrefetchedQuery
+{
+    QueryDesc* query; // the statement that the responses were prefetched for
+    Oid indexid;
+    char* key; // the request
+    cJSON* response;
+    char* fetch_key; // the ids of the first liveness round, NULL if it fetched nothing
+    cJSON* fetch_response;
+} PineconePrefetchedQuery;
+
+static List* prefetched_queries = NIL; // in TopTransactionContext
+static LocalTransactionId prefetched_lxid = InvalidLocalTransactionId;
+static QueryDesc* running_query = NULL; // the innermost statement that is running
+static ExecutorRun_hook_type prev_ExecutorRun_hook = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd_hook = NULL;
+
+static char* partition_query_key(int top_k, cJSON* query_vector_values, cJSON* sparse_vector, cJSON* filter) {
+    return psprintf("%d %s %s %s", top_k, cJSON_PrintUnformatted(query_vector_values),
+                    sparse_vector != NULL ? cJSON_PrintUnformatted(sparse_vector) : "", cJSON_PrintUnformatted(filter));
+}
+
+static void partition_prefetch_free(PineconePrefetchedQuery* prefetched) {
+    cJSON_Delete(prefetched->response);
+    cJSON_Delete(prefetched->fetch_response);
+    pfree(prefetched->key);
+    if (prefetched->fetch_key != NULL) pfree(prefetched->fetch_key);
+    pfree(prefetched);
+}
+
+/*
+ * Drop the responses prefetched for a statement and an index; a NULL query or an invalid index matches any
+ */
+static void partition_prefetch_drop(QueryDesc* query, Oid indexid) {
+    ListCell* lc;
+    if (prefetched_lxid != MyProc->lxid) {
+        // the list went away with the context of an earlier transaction
+        prefetched_queries = NIL;
+        prefetched_lxid = MyProc->lxid;
+        return;
+    }
+    foreach(lc, prefetched_queries) {
+        PineconePrefetchedQuery* prefetched = lfirst(lc);
+        if (query != NULL && prefetched->query != query) continue;
+        if (OidIsValid(indexid) && prefetched->indexid != indexid) continue;
+        prefetched_queries = foreach_delete_current(prefetched_queries, lc);
+        partition_prefetch_free(prefetched);
+    }
+}
+
+/*
+ * Take the responses that a sibling prefetched for the index in this statement. Sets *other_key if they were for
+ * another request. *fetch_response is NULL unless the liveness fetch was for the same fetch_ids.
+ */
+static cJSON* partition_prefetch_take(Relation index, const char* key, cJSON* fetch_ids, bool* other_key, cJSON** fetch_response) {
+    ListCell* lc;
+    *other_key = false;
+    *fetch_response = NULL;
+    if (prefetched_lxid != MyProc->lxid) {
+        partition_prefetch_drop(NULL, InvalidOid);
+        return NULL;
+    }
+    foreach(lc, prefetched_queries) {
+        PineconePrefetchedQuery* prefetched = lfirst(lc);
+        cJSON* response = NULL;
+        if (prefetched->query != running_query || prefetched->indexid != RelationGetRelid(index)) continue;
+        prefetched_queries = foreach_delete_current(prefetched_queries, lc);
+        if (strcmp(prefetched->key, key) == 0) {
+            char* fetch_key = fetch_ids != NULL ? cJSON_PrintUnformatted(fetch_ids) : NULL;
+            response = cJSON_Duplicate(prefetched->response, true);
+            if (fetch_key != NULL && prefetched->fetch_key != NULL && strcmp(prefetched->fetch_key, fetch_key) == 0) {
+                *fetch_response = cJSON_Duplicate(prefetched->fetch_response, true);
             }
+        } else {
+            *other_key = true;
         }
+        partition_prefetch_free(prefetched);
+        return response;
+    }
+    return NULL;
+}
+
+/*
+ * Collect the indexes that a plan scans, past the subplans that run-time partition pruning removed at startup
+ */
+static bool collect_scanned_indexes(PlanState* planstate, void* context) {
+    List** indexids = (List**) context;
+    if (planstate == NULL) return false;
+    if (IsA(planstate, IndexScanState)) {
+        *indexids = lappend_oid(*indexids, ((IndexScan*) planstate->plan)->indexid);
     }
-    return best_checkpoint;
+    return planstate_tree_walker(planstate, collect_scanned_indexes, context);
+}
+
+/*
+ * Query the namespace of the index together with those of the siblings on the same remote index that the running
+ * statement scans, along with their first liveness rounds, keeping the siblings' responses. Returns NULL if there
+ * are no such siblings.
+ */
+static cJSON* partition_prefetch_fill(Relation index, PineconeShard shard, int top_k, cJSON* query_vector_values, cJSON* sparse_vector, cJSON* filter, const char* key,
+                                      cJSON* fetch_ids, cJSON** fetch_response) {
+    List* ancestors = get_partition_ancestors(RelationGetRelid(index));
+    Oid amoid = get_am_oid("pinecone", false);
+    List* scanned_oids = NIL;
+    List* sibling_oids = NIL;
+    List* partitions;
+    PineconeShard* shards;
+    cJSON** shard_fetch_ids;
+    char** fetch_keys;
+    cJSON** responses;
+    ListCell* lc;
+    MemoryContext oldCtx;
+    int n = 1;
+    *fetch_response = NULL;
+    if (ancestors == NIL || running_query == NULL || running_query->planstate == NULL) return NULL;
+
+    collect_scanned_indexes(running_query->planstate, &scanned_oids);
+    partitions = find_all_inheritors(llast_oid(ancestors), NoLock, NULL);
+    shards = palloc(sizeof(PineconeShard) * (list_length(partitions) + 1));
+    shard_fetch_ids = palloc(sizeof(cJSON*) * (list_length(partitions) + 1));
+    fetch_keys = palloc(sizeof(char*) * (list_length(partitions) + 1));
+    shards[0] = shard;
+    foreach(lc, partitions) {
+        Oid sibling_oid = lfirst_oid(lc);
+        Relation sibling;
+        // the executor locked the indexes that the plan scans
+        if (sibling_oid == RelationGetRelid(index) || !list_member_oid(scanned_oids, sibling_oid)) continue;
+        sibling = index_open(sibling_oid, NoLock);
+        if (sibling->rd_rel->relam == amoid && RelationGetNumberOfBlocks(sibling) > 0) {
+            PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(sibling);
+            if (static_meta.partition_namespace[0] != '\0' && strcmp(static_meta.host, shard.host) == 0) {
+                PineconeLivenessSearch liveness;
+                cJSON* sibling_fetch_ids;
+                shards[n].host = shard.host;
+                shards[n].pinecone_namespace = pstrdup(static_meta.partition_namespace);
+                liveness_search_begin(sibling, &liveness);
+                sibling_fetch_ids = liveness_search_next_ids(sibling, &liveness);
+                if (liveness.n_probes == 0) {
+                    cJSON_Delete(sibling_fetch_ids);
+                    sibling_fetch_ids = NULL;
+                }
+                shard_fetch_ids[n] = sibling_fetch_ids;
+                fetch_keys[n] = sibling_fetch_ids != NULL ? cJSON_PrintUnformatted(sibling_fetch_ids) : NULL;
+                sibling_oids = lappend_oid(sibling_oids, sibling_oid);
+                n++;
+            }
+        }
+        index_close(sibling, NoLock);
+    }
+    if (n == 1) return NULL;
+    shard_fetch_ids[0] = fetch_ids != NULL ? cJSON_Duplicate(fetch_ids, true) : NULL;
+
+    elog(DEBUG1, "Querying %d partitions of remote index %s", n, shard.host);
+    responses = pinecone_query_namespaces(pinecone_api_key, shards, n, top_k, cJSON_Duplicate(query_vector_values, true),
+                                          sparse_vector != NULL ? cJSON_Duplicate(sparse_vector, true) : NULL,
+                                          cJSON_Duplicate(filter, true), shard_fetch_ids);
+
+    // replace the siblings' responses of an earlier scan in the statement
+    oldCtx = MemoryContextSwitchTo(TopTransactionContext);
+    for (int i = 1; i < n; i++) {
+        PineconePrefetchedQuery* prefetched = palloc(sizeof(PineconePrefetchedQuery));
+        partition_prefetch_drop(running_query, list_nth_oid(sibling_oids, i - 1));
+        prefetched->query = running_query;
+        prefetched->indexid = list_nth_oid(sibling_oids, i - 1);
+        prefetched->key = pstrdup(key);
+        prefetched->response = cJSON_Duplicate(responses[i], true);
+        prefetched->fetch_key = responses[n + i] != NULL ? pstrdup(fetch_keys[i]) : NULL;
+        prefetched->fetch_response = responses[n + i] != NULL ? cJSON_Duplicate(responses[n + i], true) : NULL;
+        prefetched_queries = lappend(prefetched_queries, prefetched);
+    }
+    MemoryContextSwitchTo(oldCtx);
+    *fetch_response = responses[n];
+    return responses[0];
+}
+
+/*
+ * The response to the query of a partition's namespace, prefetched by a sibling or queried together with the
+ * siblings, and the response to the first liveness round if it went out with it. Returns NULL if the partition has
+ * to query alone.
+ */
+static cJSON* partition_query(Relation index, PineconeShard shard, int top_k, cJSON* query_vector_values, cJSON* sparse_vector, cJSON* filter,
+                              cJSON* fetch_ids, cJSON** fetch_response) {
+    char* key = partition_query_key(top_k, query_vector_values, sparse_vector, filter);
+    bool other_key;
+    cJSON* response = partition_prefetch_take(index, key, fetch_ids, &other_key, fetch_response);
+    // when the siblings made another request, they would not use the responses either
+    if (response != NULL || other_key) return response;
+    return partition_prefetch_fill(index, shard, top_k, query_vector_values, sparse_vector, filter, key, fetch_ids, fetch_response);
+}
+
+/*
+ * Track the running statement, whose plan decides the siblings to prefetch for
+ */
+static void pinecone_ExecutorRun(QueryDesc* queryDesc, ScanDirection direction, uint64 count, bool execute_once)
+{
+    QueryDesc* outer_query = running_query;
+    running_query = queryDesc;
+    PG_TRY();
+    {
+        if (prev_ExecutorRun_hook) prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+        else standard_ExecutorRun(queryDesc, direction, count, execute_once);
+    }
+    PG_FINALLY();
+    {
+        running_query = outer_query;
+    }
+    PG_END_TRY();
+}
+
+static void pinecone_ExecutorEnd(QueryDesc* queryDesc)
+{
+    partition_prefetch_drop(queryDesc, InvalidOid);
+    if (prev_ExecutorEnd_hook) prev_ExecutorEnd_hook(queryDesc);
+    else standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * A statement that failed in a subtransaction does not reach ExecutorEnd
+ */
+static void pinecone_subxact_callback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg)
+{
+    if (event == SUBXACT_EVENT_ABORT_SUB) partition_prefetch_drop(NULL, InvalidOid);
+}
+
+void PineconeScanInit(void)
+{
+    prev_ExecutorRun_hook = ExecutorRun_hook;
+    ExecutorRun_hook = pinecone_ExecutorRun;
+    prev_ExecutorEnd_hook = ExecutorEnd_hook;
+    ExecutorEnd_hook = pinecone_ExecutorEnd;
+    RegisterSubXactCallback(pinecone_subxact_callback, NULL);
 }
 
 /*
@@ -105,6 +761,9 @@ IndexScanDesc pinecone_beginscan(Relation index, int nkeys, int norderbys)
 	scan = RelationGetIndexScan(index, nkeys, norderbys);
     so = (PineconeScanOpaque) palloc(sizeof(PineconeScanOpaqueData));
 
+    // the buffer has to hold the tuples that this transaction queued, for the scan to find them
+    PineconeAppendPendingTuples(index);
+
     // set support functions
     so->procinfo = index_getprocinfo(index, 1, 1); // lookup the first support function in the opclass for the first attribute
 
@@ -118,6 +777,18 @@ IndexScanDesc pinecone_beginscan(Relation index, int nkeys, int norderbys)
     // allocate 6MB for the heapsort
     so->sortstate = tuplesort_begin_heap(so->tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, 6000, NULL, false);
     so->slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsMinimalTuple);
+    so->scan_ctx = AllocSetContextCreate(CurrentMemoryContext, "Pinecone scan context", ALLOCSET_DEFAULT_SIZES);
+    so->pscan = NULL;
+    so->remote_owner = true;
+    so->bloom_segment = NULL;
+    so->hybrid = false;
+
+    // the distances returned with each tuple, reused by every rescan
+    if (norderbys > 0) {
+        scan->xs_orderbyvals = palloc0(sizeof(Datum) * norderbys);
+        scan->xs_orderbynulls = palloc(sizeof(bool) * norderbys);
+        memset(scan->xs_orderbynulls, true, sizeof(bool) * norderbys);
+    }
     
     scan->opaque = so;
     return scan;
@@ -170,16 +841,22 @@ void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderb
 	cJSON *query_vector_values;
 	// cJSON *pinecone_response;
     cJSON* fetch_ids;
-    PineconeCheckpoint* fetch_checkpoints;
-    cJSON** responses;
-    cJSON *query_response, *fetch_response;
-	cJSON *matches;
+    PineconeLivenessSearch liveness;
+    cJSON** responses = NULL;
+    cJSON* partition_response = NULL;
+    cJSON* partition_fetch_response = NULL;
+    cJSON* sparse_vector;
+    cJSON *fetch_response;
     Datum query_datum; // query vector
     PineconeStaticMetaPageData pinecone_metadata = PineconeSnapshotStaticMeta(scan->indexRelation);
+    int n_shards;
+    PineconeShard* shards;
+    bool any_matches = false;
     PineconeScanOpaque so = (PineconeScanOpaque) scan->opaque;
     TupleDesc tupdesc = RelationGetDescr(scan->indexRelation); // used for accessing
     cJSON* filter;
     PineconeCheckpoint best_checkpoint;
+    MemoryContext oldCtx;
 
     // check that the ORDER BY is on the first column (which is assumed to be a column on vectors)
     if (scan->numberOfOrderBys == 0 || orderbys[0].sk_attno != 1) {
@@ -187,6 +864,17 @@ void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderb
                 (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
                  errmsg("Index must be ordered by the first column")));
     }
+
+    // everything from the previous rescan, including its cJSON responses and shared bloom filter, is released here
+    MemoryContextReset(so->scan_ctx);
+    if (so->bloom_segment != NULL) dsm_detach(so->bloom_segment);
+    so->bloom_segment = NULL;
+    oldCtx = MemoryContextSwitchTo(so->scan_ctx);
+    so->graph_tids = NULL;
+    so->n_graph_tids = 0;
+    so->max_graph_tids = 0;
+    so->graph_truncated = false;
+    shards = PineconeGetShards(&pinecone_metadata, &n_shards);
     
     // build the filter
     filter = pinecone_build_filter(scan->indexRelation, keys, nkeys);
@@ -197,29 +885,74 @@ void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderb
     vec = DatumGetVector(query_datum);
     query_vector_values = cJSON_CreateFloatArray(vec->x, vec->dim);
 
+    // hybrid queries add the sparse dot product to the dense inner product
+    so->hybrid = pinecone_sparse_query != NULL && pinecone_sparse_query[0] != '\0';
+    if (so->hybrid && pinecone_metadata.metric != INNER_PRODUCT_METRIC) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("pinecone.sparse_query requires the vector_ip_ops operator class")));
+    }
+    sparse_vector = so->hybrid ? parse_sparse_query(scan->indexRelation, so) : NULL;
+
+    // in a parallel scan, only the first participant queries pinecone; the others just scan their part of the buffer
+    so->pscan = (scan->parallel_scan != NULL) ? (PineconeParallelScan) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset) : NULL;
+    so->remote_owner = so->pscan == NULL || parallel_scan_start(scan->indexRelation, so, so->pscan);
+    // gather merge compares the dense distances, not the hybrid scores, so the remote owner returns every row alone
+    if (so->hybrid) so->pscan = NULL;
+    // until the remote index is ready, the buffer holds every vector
+    if (!so->remote_owner || pinecone_metadata.provisioning) n_shards = 0;
+
     // query pinecone top-k
-    fetch_checkpoints = get_checkpoints_to_fetch(scan->indexRelation);
-    fetch_ids = fetch_ids_from_checkpoints(fetch_checkpoints);
-    responses = pinecone_query_with_fetch(pinecone_api_key, pinecone_metadata.host, pinecone_top_k, query_vector_values, filter, true, fetch_ids);
-    query_response = responses[0];
-    fetch_response = responses[1];
-    elog(DEBUG1, "query_response: %s", cJSON_Print(query_response));
-    elog(DEBUG1, "fetch_response: %s", cJSON_Print(fetch_response));
-    best_checkpoint = get_best_fetched_checkpoint(scan->indexRelation, fetch_checkpoints, fetch_response);
+    if (so->remote_owner && n_shards > 0) {
+        liveness_search_begin(scan->indexRelation, &liveness);
+        fetch_ids = liveness_search_next_ids(scan->indexRelation, &liveness);
+        if (pinecone_metadata.partition_namespace[0] != '\0' && scan->parallel_scan == NULL) {
+            partition_response = partition_query(scan->indexRelation, shards[0], PineconeGetSettings(scan->indexRelation).top_k, query_vector_values, sparse_vector, filter,
+                                                 liveness.n_probes > 0 ? fetch_ids : NULL, &partition_fetch_response);
+        }
+        if (partition_response != NULL) {
+            // the query was shared with the sibling partitions; the liveness fetch went with it unless the checkpoints moved since
+            responses = palloc(sizeof(cJSON*) * 2);
+            responses[0] = partition_response;
+            responses[1] = partition_fetch_response;
+            if (liveness.n_probes > 0 && responses[1] == NULL) responses[1] = pinecone_fetch_from_shards(pinecone_api_key, shards, n_shards, fetch_ids);
+        } else {
+            responses = pinecone_query_with_fetch(pinecone_api_key, shards, n_shards, PineconeGetSettings(scan->indexRelation).top_k, query_vector_values, sparse_vector, filter, liveness.n_probes > 0, fetch_ids);
+        }
+        fetch_response = responses[n_shards];
+        for (int i = 0; i < n_shards; i++) {
+            elog(DEBUG1, "query_response (shard %d): %s", i, cJSON_Print(responses[i]));
+        }
+        elog(DEBUG1, "fetch_response: %s", cJSON_Print(fetch_response));
+        liveness_search_update(&liveness, fetch_response);
+        // the remaining rounds only fetch
+        while (!liveness_search_done(&liveness)) {
+            fetch_ids = liveness_search_next_ids(scan->indexRelation, &liveness);
+            liveness_search_update(&liveness, pinecone_fetch_from_shards(pinecone_api_key, shards, n_shards, fetch_ids));
+        }
+        best_checkpoint = liveness_search_result(&liveness);
 
-    // set the pinecone_ready_page to the best checkpoint
-    if (best_checkpoint.is_checkpoint) {
-        set_buffer_meta_page(scan->indexRelation, &best_checkpoint, NULL, NULL, NULL, NULL);
+        // set the pinecone_ready_page to the best checkpoint; a standby cannot write the page and keeps it in memory
+        if (best_checkpoint.is_checkpoint && RecoveryInProgress()) {
+            PineconeSetStandbyReadyCheckpoint(scan->indexRelation, best_checkpoint);
+        } else if (best_checkpoint.is_checkpoint) {
+            set_buffer_meta_page(scan->indexRelation, &best_checkpoint, NULL, NULL, NULL, NULL);
+        }
     }
 
     // copy metric
     so->metric = pinecone_metadata.metric;
 
-    // copy pinecone_response to scan opaque
-    // response has a matches array, set opaque to the child of matches aka first match
-    matches = cJSON_GetObjectItemCaseSensitive(query_response, "matches");
-    so->pinecone_results = matches->child;
-    if (matches->child == NULL) {
+    // copy each shard's response to scan opaque
+    // response has a matches array, set the shard's cursor to the child of matches aka first match
+    so->n_shards = n_shards;
+    so->shard_results = palloc(sizeof(cJSON*) * n_shards);
+    so->shard_distances = palloc(sizeof(double) * n_shards);
+    for (int i = 0; i < n_shards; i++) {
+        cJSON* matches = cJSON_GetObjectItemCaseSensitive(responses[i], "matches");
+        so->shard_results[i] = (matches != NULL) ? matches->child : NULL;
+        any_matches |= so->shard_results[i] != NULL;
+    }
+    if (!any_matches && so->remote_owner) {
         // todo: hint the user that the buffer might not be flushed
         ereport(DEBUG1, (errcode(ERRCODE_NO_DATA),
                          errmsg("No matches found")));
@@ -232,11 +965,14 @@ void pinecone_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderb
 
     // locally scan the buffer and add them to the sort state
     load_buffer_into_sort(scan->indexRelation, so, query_datum, tupdesc);
-    
-    // allocate for xs_orderbyvals (*Datum)
-    scan->xs_orderbyvals = palloc(sizeof(Datum)); // assumes only one ORDER BY
-    scan->xs_orderbynulls = palloc(sizeof(bool)); // TODO: assumes only one ORDER BY
 
+    // order the shards by their best match; this has to wait for the bloom filter so that matches also in the buffer are skipped
+    so->shard_heap = binaryheap_allocate(n_shards, compare_shard_distances, so);
+    for (int i = 0; i < n_shards; i++) {
+        if (advance_shard(so, i)) binaryheap_add_unordered(so->shard_heap, Int32GetDatum(i));
+    }
+    binaryheap_build(so->shard_heap);
+    MemoryContextSwitchTo(oldCtx);
 }
 
 // todo: save stats from inserting from base table into the meta
@@ -245,13 +981,14 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
 {
     // todo: make sure that this is just as fast as pgvector's flatscan e.g. using vectorized operations
     TupleTableSlot *slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsVirtual);
-    PineconeBufferMetaPageData buffer_meta = PineconeSnapshotBufferMeta(index);
+    PineconeBufferMetaPageData buffer_meta = snapshot_buffer_meta_for_scan(index);
+    int max_buffer_scan = PineconeGetSettings(index).max_buffer_scan;
     BlockNumber currentblkno = buffer_meta.ready_checkpoint.blkno;
     int n_sortedtuple = 0;
     int n_tuples = buffer_meta.latest_checkpoint.n_preceding_tuples + buffer_meta.n_tuples_since_last_checkpoint;
     int unflushed_tuples = n_tuples - buffer_meta.flush_checkpoint.n_preceding_tuples;
     int unready_tuples = n_tuples - buffer_meta.ready_checkpoint.n_preceding_tuples;
-    size_t bloom_filter_size = (((int) (1.44 * BUFFER_BLOOM_K * unready_tuples))>>3) + 1; // bloom filter size in bytes, 1.44 is the optimal bloom filter expansion factor
+    size_t bloom_filter_size = bloom_filter_bytes(unready_tuples);
 
     // index info
     IndexInfo *indexInfo = BuildIndexInfo(index);
@@ -265,9 +1002,12 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
     IndexFetchTableData *fetchData = baseTableRel->rd_tableam->index_fetch_begin(baseTableRel);
     TupleTableSlot *base_table_slot = MakeSingleTupleTableSlot(baseTableRel->rd_att, &TTSOpsBufferHeapTuple);
     bool call_again, all_dead, found;
+
+    // until the remote index is ready, the buffer is the only copy of the vectors
+    if (PineconeSnapshotStaticMeta(index).provisioning) max_buffer_scan = INT_MAX;
     
     // check H - T > max_local_scan
-    if (unready_tuples > pinecone_max_buffer_scan) {
+    if (unready_tuples > max_buffer_scan && !use_buffer_graph(so) && so->remote_owner) {
         ereport(NOTICE, (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
                          errmsg("Buffer is too large"),
                          errhint("There are %d tuples in the buffer that have not yet been flushed to pinecone and %d tuples in pinecone that are not yet live. You may want to consider flushing the buffer.", unflushed_tuples, unready_tuples - unflushed_tuples)));
@@ -275,23 +1015,55 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
 
     // initialize the bloom filter
     // so->bloom_filter = bloom_create(BUFFER_BLOOM_K, buffer_meta.n_tuples_since_last_checkpoint);
-    so->bloom_filter = palloc0(bloom_filter_size);
-    so->bloom_filter_size = bloom_filter_size;
+    if (so->pscan != NULL) {
+        // the other participants attach once they claim a page
+        so->bloom_filter = NULL;
+        so->bloom_filter_size = 0;
+        if (so->remote_owner) parallel_scan_attach_bloom_filter(so);
+    } else {
+        so->bloom_filter = palloc0(bloom_filter_size);
+        so->bloom_filter_size = bloom_filter_size;
+    }
 
+    // search the buffer through the per-backend graphs instead of scanning it
+    if (use_buffer_graph(so)) {
+        if (so->remote_owner) PineconeBufferGraphSearch(index, so, query_datum, buffer_meta);
+        currentblkno = InvalidBlockNumber;
+    }
+    else if (so->pscan != NULL) {
+        currentblkno = parallel_scan_claim_page(so->pscan);
+    }
+    else if (!so->remote_owner) {
+        currentblkno = InvalidBlockNumber; // the remote owner of a parallel hybrid scan returns the whole buffer
+    }
 
     // add tuples to the sortstate
     while (BlockNumberIsValid(currentblkno)) {
         Buffer buf;
         Page page;
+        OffsetNumber maxoffno;
 
+        if (so->pscan != NULL) parallel_scan_attach_bloom_filter(so);
 
         // access the page
         buf = ReadBuffer(index, currentblkno); // todo bulkread access method
         LockBuffer(buf, BUFFER_LOCK_SHARE);
         page = BufferGetPage(buf);
+        maxoffno = PageGetMaxOffsetNumber(page);
+
+        // let the other participants claim the rest of the chain while this page is scanned
+        if (so->pscan != NULL) {
+            parallel_scan_pass_link(so->pscan, PineconePageGetOpaque(page)->nextblkno, maxoffno, max_buffer_scan);
+        }
+
+        // add all tuples on the page to the bloom filter, which is all the remote owner of a parallel scan waits for
+        for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno)) {
+            pinecone_bloom_filter_add(so, ((PineconeBufferTuple*) PageGetItem(page, PageGetItemId(page, offno)))->tid);
+        }
+        if (so->pscan != NULL) parallel_scan_page_done(so->pscan);
 
         // add all tuples on the page to the sortstate
-        for (OffsetNumber offno = FirstOffsetNumber; offno <= PageGetMaxOffsetNumber(page); offno = OffsetNumberNext(offno)) {
+        for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno)) {
             // get the tid and the vector from the heap tuple
             ItemId itemid;
             Item item;
@@ -299,14 +1071,10 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
             itemid = PageGetItemId(page, offno);
             item = PageGetItem(page, itemid);
             buffer_tup = *((PineconeBufferTuple*) item);
- 
-            // add the tuple to the bloom filter
-            for (int i = 0; i < BUFFER_BLOOM_K; i++) {
-                uint32 hash = hash_tid(buffer_tup.tid, i); // i is the seed
-                so->bloom_filter[(hash >> 3) % so->bloom_filter_size] |= (1 << (hash & 7));
-            }
+            if (buffer_tup.flags & PINECONE_BUFFER_TUPLE_MOVED) continue; // its copy is further down the buffer
 
             // fetch the vector from the base table
+            call_again = false;
             found = baseTableRel->rd_tableam->index_fetch_tuple(fetchData, &buffer_tup.tid, snapshot, base_table_slot, &call_again, &all_dead);
             if (!found) {
                 elog(DEBUG2, "could not find tuple in base table");
@@ -322,6 +1090,10 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
             // add the tuples
             ExecClearTuple(slot);
             slot->tts_values[0] = FunctionCall2(so->procinfo, index_values[0], query_datum); // compute distance between entry and query
+            if (so->hybrid && !index_isnull[so->sparse_attno] && !index_isnull[so->sparse_attno + 1]) {
+                // the negative inner product, less the sparse dot product, is the negative of pinecone's hybrid score
+                slot->tts_values[0] = Float8GetDatum(DatumGetFloat8(slot->tts_values[0]) - sparse_dot(so, index_values[so->sparse_attno], index_values[so->sparse_attno + 1]));
+            }
             slot->tts_isnull[0] = false;
             slot->tts_values[1] = Int32GetDatum(ItemPointerGetBlockNumber(&buffer_tup.tid));
             slot->tts_isnull[1] = false;
@@ -336,13 +1108,18 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
         // move to the next page
         currentblkno = PineconePageGetOpaque(page)->nextblkno;
         UnlockReleaseBuffer(buf);
+        if (so->pscan != NULL) {
+            currentblkno = parallel_scan_claim_page(so->pscan);
+            continue;
+        }
 
         // stop if we have added enough tuples to the sortstate
-        if (n_sortedtuple >= pinecone_max_buffer_scan) {
+        if (n_sortedtuple >= max_buffer_scan) {
             elog(NOTICE, "Reached max local scan");
             break;
         }
     }
+    if (so->pscan != NULL && so->remote_owner) parallel_scan_wait_for_bloom_filter(so->pscan);
     // end the index fetch
     ExecDropSingleTupleTableSlot(base_table_slot);
     baseTableRel->rd_tableam->index_fetch_end(fetchData);
@@ -353,6 +1130,63 @@ void load_buffer_into_sort(Relation index, PineconeScanOpaque so, Datum query_da
     
     // get the first tuple from the sortstate
     so->more_buffer_tuples = tuplesort_gettupleslot(so->sortstate, true, false, so->slot, NULL);
+    if (!so->more_buffer_tuples && so->graph_truncated) so->more_buffer_tuples = PineconeBufferGraphFallback(index, so);
+}
+
+/*
+ * Convert a pinecone score to the distance used for sorting
+ */
+static double pinecone_match_distance(VectorMetric metric, cJSON* match)
+{
+    switch (metric)
+    {
+    case EUCLIDEAN_METRIC:
+        // pinecone returns the square of the euclidean distance, which is what we want
+        return cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
+    case COSINE_METRIC:
+        // pinecone returns the cosine similarity, but we want "cosine distance" which is 1 - cosine similarity
+        return 1 - cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
+    case INNER_PRODUCT_METRIC:
+        // pinecone returns the dot product, but we want "dot product distance" which is - dot product
+        return - cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
+    default:
+        elog(ERROR, "unsupported metric");
+    }
+    return 0; // unreachable
+}
+
+/*
+ * Skip the shard's matches that were also found in the local buffer and cache the distance of its next match.
+ * Returns false once the shard has run out of matches.
+ */
+static bool advance_shard(PineconeScanOpaque so, int shard)
+{
+    cJSON* match = so->shard_results[shard];
+
+    // while the match is in the bloom filter, get the next match
+    while (match != NULL) {
+        char* id_str = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(match, "id"));
+        if (!pinecone_bloom_filter_contains(so, pinecone_id_get_heap_tid(id_str))) break;
+        elog(DEBUG1, "skipping duplicate match %s. this was returned by pinecone, but was also found in the local buffer", id_str);
+        match = match->next;
+    }
+    so->shard_results[shard] = match;
+    if (match == NULL) return false;
+    so->shard_distances[shard] = pinecone_match_distance(so->metric, match);
+    return true;
+}
+
+/*
+ * binaryheap keeps the largest element on top, so the shard with the smallest distance compares as the largest
+ */
+static int compare_shard_distances(Datum a, Datum b, void *arg)
+{
+    PineconeScanOpaque so = (PineconeScanOpaque) arg;
+    double dist_a = so->shard_distances[DatumGetInt32(a)];
+    double dist_b = so->shard_distances[DatumGetInt32(b)];
+    if (dist_a < dist_b) return 1;
+    if (dist_a > dist_b) return -1;
+    return 0;
 }
 
 /*
@@ -364,53 +1198,19 @@ bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir)
 	char *id_str;
 	ItemPointerData match_heaptid;
     PineconeScanOpaque so = (PineconeScanOpaque) scan->opaque;
-    cJSON *match = so->pinecone_results;
+    cJSON *match = NULL;
+    int shard = -1;
     double pinecone_best_dist, buffer_best_dist, dist, dist_lower_bound;
     bool isnull;
     float rel_tol = 0.05; // relative tolerance for distance recheck; TODO: this should depend on the metric; the inaccuracy arises from pinecone using half precision floats
 
-    // while the match is in the bloom filter, get the next match
-    while (match != NULL) {
-        bool duplicate = true;
-        id_str = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(match, "id"));
-        match_heaptid = pinecone_id_get_heap_tid(id_str);
-        for (int i = 0; i < BUFFER_BLOOM_K; i++) {
-            uint32 hash = hash_tid(match_heaptid, i); // i is the seed
-            if (!(so->bloom_filter[(hash >> 3) % so->bloom_filter_size] & (1 << (hash & 7)))) {
-                duplicate = false;
-                break;
-            }
-        }
-        if (duplicate) {
-            elog(DEBUG1, "skipping duplicate match %s. this was returned by pinecone, but was also found in the local buffer", id_str);
-            match = match->next;
-            so->pinecone_results = match;
-        } else {
-            break;
-        }
-    }
-
-    // use a case statement to determine the best distance
-    if (match == NULL) {
+    // the best remote match is the next match of the shard on top of the heap
+    if (binaryheap_empty(so->shard_heap)) {
         pinecone_best_dist = __DBL_MAX__;
     } else {
-        switch (so->metric)
-        {
-        case EUCLIDEAN_METRIC:
-            // pinecone returns the square of the euclidean distance, which is what we want
-            pinecone_best_dist = cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
-            break;
-        case COSINE_METRIC:
-            // pinecone returns the cosine similarity, but we want "cosine distance" which is 1 - cosine similarity
-            pinecone_best_dist = 1 - cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
-            break;
-        case INNER_PRODUCT_METRIC:
-            // pinecone returns the dot product, but we want "dot product distance" which is - dot product
-            pinecone_best_dist = - cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(match, "score"));
-            break;
-        default:
-            elog(ERROR, "unsupported metric");
-        }
+        shard = DatumGetInt32(binaryheap_first(so->shard_heap));
+        match = so->shard_results[shard];
+        pinecone_best_dist = so->shard_distances[shard];
     }
                           
     buffer_best_dist = (so->more_buffer_tuples) ? DatumGetFloat8(slot_getattr(so->slot, 1, &isnull)) : __DBL_MAX__;
@@ -430,8 +1230,9 @@ bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir)
         ItemPointerSetOffsetNumber(&match_heaptid, offset_datum);
         scan->xs_heaptid = match_heaptid;
         scan->xs_recheck = true;
-        // get the next tuple from the sortstate
+        // get the next tuple from the sortstate, and the rest of the buffer once the graph's candidates run out
         so->more_buffer_tuples = tuplesort_gettupleslot(so->sortstate, true, false, so->slot, NULL);
+        if (!so->more_buffer_tuples && so->graph_truncated) so->more_buffer_tuples = PineconeBufferGraphFallback(scan->indexRelation, so);
     }
     else {
         dist = pinecone_best_dist;
@@ -441,7 +1242,12 @@ bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir)
         scan->xs_heaptid = match_heaptid;
         // TODO: create a datum out of the distance and retrun it to xs_orderbyvals
         // NEXT
-        so->pinecone_results = so->pinecone_results->next;
+        so->shard_results[shard] = match->next;
+        if (advance_shard(so, shard)) {
+            binaryheap_replace_first(so->shard_heap, Int32GetDatum(shard));
+        } else {
+            binaryheap_remove_first(so->shard_heap);
+        }
     }
     // The recheck is going to compute vector<->query i.e. l2_distance, whereas for sorting we have been using l2_squared_distance
     // we need to provide xs_recheck a lower bound on the l2_distance
@@ -449,9 +1255,26 @@ bool pinecone_gettuple(IndexScanDesc scan, ScanDirection dir)
     dist_lower_bound = sqrt(dist_lower_bound);
     scan->xs_recheckorderby = true; // pinecone returns an approximate distance which we need to recheck.
     scan->xs_orderbyvals[0] = Float8GetDatum((float8) dist_lower_bound);
+    if (so->hybrid) {
+        // the ORDER BY operator only knows the dense distance, so hybrid results keep the order of their score
+        scan->xs_recheckorderby = false;
+        scan->xs_orderbyvals[0] = Float8GetDatum(dist);
+    }
     scan->xs_orderbynulls[0] = false;
     elog(DEBUG1, "dist: %f, dist_lower_bound: %f", dist, dist_lower_bound);
     return true;
 }
 
-void no_endscan(IndexScanDesc scan) {};
+/*
+ * End a scan and release resources
+ */
+void pinecone_endscan(IndexScanDesc scan)
+{
+    PineconeScanOpaque so = (PineconeScanOpaque) scan->opaque;
+    ExecDropSingleTupleTableSlot(so->slot);
+    tuplesort_end(so->sortstate);
+    MemoryContextDelete(so->scan_ctx);
+    if (so->bloom_segment != NULL) dsm_detach(so->bloom_segment);
+    pfree(so);
+    scan->opaque = NULL;
+}
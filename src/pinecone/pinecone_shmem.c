@@ -0,0 +1,309 @@
+/*
+ * Shared state of pinecone indexes
+ *
+ * An array of pinecone.index_slots slots in shared memory holds a slot per recently used index, keyed by database
+ * and index oid. The slot's LWLock serializes appends to the buffer, and an atomic claim lets a single backend flush
+ * the index at a time. Slots are reused for other indexes when the array is full, so everyone who looks a slot up
+ * checks its key again once they hold its lock or claim. When every slot is locked or claimed, lookups wait for one.
+ * Readers of the counters and stats never take a slot. On a standby, the slot also remembers which batches its scans found searchable.
+ * The slot caches the statistics of the remote index too, which the background flusher refreshes.
+ */
+#include "pinecone.h"
+
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+
+#define PINECONE_SLOT_EVICTING PG_UINT32_MAX // flush_owner of a slot that is being handed to another index
+#define PINECONE_SLOT_WAIT_US 10000L // between two attempts to take a slot when every slot is in use
+
+static const PineconeCheckpoint no_checkpoint = {INVALID_CHECKPOINT_NUMBER, InvalidBlockNumber, {{0, 0}, 0}, 0, false};
+static const PineconeRemoteStats no_stats = {0, 0, 0};
+
+typedef struct PineconeShmem
+{
+    int slots_tranche_id;
+    int append_tranche_id;
+    LWLock lock; // protects the keys of the slots
+    int clock_hand; // next eviction candidate
+    int n_slots;
+    PineconeIndexSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} PineconeShmem;
+
+static PineconeShmem *pinecone_shmem = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static Size PineconeShmemSize(void) {
+    return add_size(offsetof(PineconeShmem, slots), mul_size(sizeof(PineconeIndexSlot), pinecone_index_slots));
+}
+
+#if PG_VERSION_NUM >= 150000
+static void pinecone_shmem_request(void) {
+    if (prev_shmem_request_hook) prev_shmem_request_hook();
+    RequestAddinShmemSpace(PineconeShmemSize());
+}
+#endif
+
+/*
+ * Reserve shared memory for the slots when the library is preloaded; called from _PG_init. Otherwise the slots come
+ * out of the spare shared memory when they are first used.
+ */
+void PineconeShmemInit(void) {
+    if (!process_shared_preload_libraries_in_progress) return;
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = pinecone_shmem_request;
+#else
+    RequestAddinShmemSpace(PineconeShmemSize());
+#endif
+}
+
+/*
+ * Attach to the shared state, creating it on first use
+ */
+static void PineconeShmemAttach(void) {
+    bool found;
+    if (pinecone_shmem != NULL) return;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    pinecone_shmem = ShmemInitStruct("pinecone index slots", PineconeShmemSize(), &found);
+    if (!found) {
+        pinecone_shmem->slots_tranche_id = LWLockNewTrancheId();
+        pinecone_shmem->append_tranche_id = LWLockNewTrancheId();
+        LWLockInitialize(&pinecone_shmem->lock, pinecone_shmem->slots_tranche_id);
+        pinecone_shmem->clock_hand = 0;
+        pinecone_shmem->n_slots = pinecone_index_slots;
+        for (int i = 0; i < pinecone_shmem->n_slots; i++) {
+            PineconeIndexSlot *slot = &pinecone_shmem->slots[i];
+            slot->dbid = InvalidOid;
+            slot->indexid = InvalidOid;
+            LWLockInitialize(&slot->append_lock, pinecone_shmem->append_tranche_id);
+            pg_atomic_init_u32(&slot->flush_owner, 0);
+            pg_atomic_init_u64(&slot->tuples_appended, 0);
+            pg_atomic_init_u64(&slot->vectors_flushed, 0);
+            SpinLockInit(&slot->mutex);
+            slot->standby_ready_checkpoint = no_checkpoint;
+            slot->remote_stats = no_stats;
+            slot->provisioning_checked_at = 0;
+        }
+    }
+    LWLockRelease(AddinShmemInitLock);
+
+    // per-backend registration of the tranche names, which name the wait events
+    LWLockRegisterTranche(pinecone_shmem->slots_tranche_id, "PineconeSlots");
+    LWLockRegisterTranche(pinecone_shmem->append_tranche_id, "PineconeAppend");
+}
+
+static bool SlotIsFor(PineconeIndexSlot *slot, Relation index) {
+    return slot->dbid == MyDatabaseId && slot->indexid == RelationGetRelid(index);
+}
+
+/*
+ * Hand a slot that nobody appends to or flushes over to the index. Called with the slot array locked exclusively.
+ * Returns NULL if every slot is in use.
+ */
+static PineconeIndexSlot* EvictSlot(Relation index) {
+    for (int n = 0; n < pinecone_shmem->n_slots; n++) {
+        PineconeIndexSlot *slot = &pinecone_shmem->slots[pinecone_shmem->clock_hand];
+        uint32 expected = 0;
+        pinecone_shmem->clock_hand = (pinecone_shmem->clock_hand + 1) % pinecone_shmem->n_slots;
+        if (!LWLockConditionalAcquire(&slot->append_lock, LW_EXCLUSIVE)) continue;
+        if (!pg_atomic_compare_exchange_u32(&slot->flush_owner, &expected, PINECONE_SLOT_EVICTING)) {
+            LWLockRelease(&slot->append_lock);
+            continue;
+        }
+        SpinLockAcquire(&slot->mutex);
+        slot->dbid = MyDatabaseId;
+        slot->indexid = RelationGetRelid(index);
+        slot->standby_ready_checkpoint = no_checkpoint;
+        slot->remote_stats = no_stats;
+        slot->provisioning_checked_at = 0;
+        SpinLockRelease(&slot->mutex);
+        pg_atomic_write_u64(&slot->tuples_appended, 0);
+        pg_atomic_write_u64(&slot->vectors_flushed, 0);
+        pg_atomic_write_u32(&slot->flush_owner, 0);
+        LWLockRelease(&slot->append_lock);
+        return slot;
+    }
+    return NULL;
+}
+
+/*
+ * The slot of an index, or NULL if it has none. Called with the slot array locked.
+ */
+static PineconeIndexSlot* FindSlot(Oid indexid) {
+    for (int i = 0; i < pinecone_shmem->n_slots; i++) {
+        PineconeIndexSlot *slot = &pinecone_shmem->slots[i];
+        if (slot->dbid == MyDatabaseId && slot->indexid == indexid) return slot;
+    }
+    return NULL;
+}
+
+/*
+ * Look up the slot of the index, taking a free or evictable slot if it has none. If every slot is locked or claimed
+ * by a flush, wait until one of them is released: the flushes of other indexes do not need this one's slot.
+ */
+PineconeIndexSlot* PineconeGetIndexSlot(Relation index) {
+    PineconeIndexSlot *slot;
+    bool waited = false;
+    PineconeShmemAttach();
+
+    LWLockAcquire(&pinecone_shmem->lock, LW_SHARED);
+    slot = FindSlot(RelationGetRelid(index));
+    LWLockRelease(&pinecone_shmem->lock);
+    while (slot == NULL) {
+        LWLockAcquire(&pinecone_shmem->lock, LW_EXCLUSIVE);
+        // another backend may have taken a slot for the index in the meantime
+        slot = FindSlot(RelationGetRelid(index));
+        for (int i = 0; i < pinecone_shmem->n_slots && slot == NULL; i++) {
+            PineconeIndexSlot *free_slot = &pinecone_shmem->slots[i];
+            if (!OidIsValid(free_slot->indexid)) {
+                free_slot->dbid = MyDatabaseId;
+                free_slot->indexid = RelationGetRelid(index);
+                slot = free_slot;
+            }
+        }
+        if (slot == NULL) slot = EvictSlot(index);
+        LWLockRelease(&pinecone_shmem->lock);
+        if (slot != NULL) break;
+        if (!waited) {
+            elog(DEBUG1, "All %d pinecone index slots are in use, waiting for one", pinecone_shmem->n_slots);
+            waited = true;
+        }
+        pg_usleep(PINECONE_SLOT_WAIT_US);
+        CHECK_FOR_INTERRUPTS();
+    }
+    return slot;
+}
+
+/*
+ * Acquire the append lock of the index
+ */
+PineconeIndexSlot* PineconeLockAppend(Relation index) {
+    for (;;) {
+        PineconeIndexSlot *slot = PineconeGetIndexSlot(index);
+        LWLockAcquire(&slot->append_lock, LW_EXCLUSIVE);
+        if (SlotIsFor(slot, index)) return slot;
+        LWLockRelease(&slot->append_lock); // the slot was handed to another index before we got the lock
+    }
+}
+
+void PineconeUnlockAppend(PineconeIndexSlot *slot) {
+    LWLockRelease(&slot->append_lock);
+}
+
+/*
+ * Claim the right to flush the index. Returns NULL if another backend is flushing it. The claim is not released on
+ * error by itself, so callers release it in a PG_FINALLY block; the claim of a backend that exited is taken over.
+ */
+PineconeIndexSlot* PineconeTryClaimFlush(Relation index) {
+    for (;;) {
+        PineconeIndexSlot *slot = PineconeGetIndexSlot(index);
+        uint32 owner = 0;
+        if (!pg_atomic_compare_exchange_u32(&slot->flush_owner, &owner, (uint32) MyProcPid)) {
+            if (owner == PINECONE_SLOT_EVICTING) continue;
+            if (BackendPidGetProc((int) owner) != NULL) return NULL;
+            elog(DEBUG1, "Taking over the pinecone flush claim of exited backend %u", owner);
+            if (!pg_atomic_compare_exchange_u32(&slot->flush_owner, &owner, (uint32) MyProcPid)) return NULL;
+        }
+        if (SlotIsFor(slot, index)) return slot;
+        pg_atomic_write_u32(&slot->flush_owner, 0);
+    }
+}
+
+void PineconeReleaseFlush(PineconeIndexSlot *slot) {
+    pg_atomic_write_u32(&slot->flush_owner, 0);
+}
+
+/*
+ * The newest checkpoint that the scans of this standby found searchable remotely. Its checkpoint_no is
+ * INVALID_CHECKPOINT_NUMBER if there is none.
+ */
+PineconeCheckpoint PineconeGetStandbyReadyCheckpoint(Relation index) {
+    PineconeIndexSlot *slot = PineconeGetIndexSlot(index);
+    PineconeCheckpoint checkpoint;
+    SpinLockAcquire(&slot->mutex);
+    checkpoint = SlotIsFor(slot, index) ? slot->standby_ready_checkpoint : no_checkpoint;
+    SpinLockRelease(&slot->mutex);
+    return checkpoint;
+}
+
+/*
+ * Remember a checkpoint that a scan during recovery found searchable, unless a newer one is known
+ */
+void PineconeSetStandbyReadyCheckpoint(Relation index, PineconeCheckpoint checkpoint) {
+    PineconeIndexSlot *slot = PineconeGetIndexSlot(index);
+    SpinLockAcquire(&slot->mutex);
+    if (SlotIsFor(slot, index) && checkpoint.checkpoint_no > slot->standby_ready_checkpoint.checkpoint_no) {
+        slot->standby_ready_checkpoint = checkpoint;
+    }
+    SpinLockRelease(&slot->mutex);
+}
+
+/*
+ * The cached statistics of the remote index, whose refreshed_at is 0 if there are none. Unlike the other lookups this
+ * never takes a slot for the index, as pinecone_remote_stats() calls it for indexes that may never be written to.
+ */
+PineconeRemoteStats PineconeGetRemoteStats(Oid indexid) {
+    PineconeRemoteStats stats = no_stats;
+    PineconeIndexSlot *slot;
+    PineconeShmemAttach();
+    LWLockAcquire(&pinecone_shmem->lock, LW_SHARED);
+    slot = FindSlot(indexid);
+    if (slot != NULL) {
+        SpinLockAcquire(&slot->mutex);
+        stats = slot->remote_stats;
+        SpinLockRelease(&slot->mutex);
+    }
+    LWLockRelease(&pinecone_shmem->lock);
+    return stats;
+}
+
+/*
+ * The vectors appended and flushed since the index took its slot, or 0 if it has none. Like PineconeGetRemoteStats,
+ * this never takes a slot, so monitoring does not evict the slots of the indexes being written to.
+ */
+void PineconeGetIndexActivity(Oid indexid, int64 *tuples_appended, int64 *vectors_flushed) {
+    PineconeIndexSlot *slot;
+    PineconeShmemAttach();
+    *tuples_appended = 0;
+    *vectors_flushed = 0;
+    // eviction resets the counters with the array locked exclusively
+    LWLockAcquire(&pinecone_shmem->lock, LW_SHARED);
+    slot = FindSlot(indexid);
+    if (slot != NULL) {
+        *tuples_appended = (int64) pg_atomic_read_u64(&slot->tuples_appended);
+        *vectors_flushed = (int64) pg_atomic_read_u64(&slot->vectors_flushed);
+    }
+    LWLockRelease(&pinecone_shmem->lock);
+}
+
+void PineconeSetRemoteStats(Relation index, PineconeRemoteStats stats) {
+    PineconeIndexSlot *slot = PineconeGetIndexSlot(index);
+    SpinLockAcquire(&slot->mutex);
+    if (SlotIsFor(slot, index)) slot->remote_stats = stats;
+    SpinLockRelease(&slot->mutex);
+}
+
+/*
+ * Whether it is time to ask describe_index again if the remote index is ready. Every commit that appends to an
+ * async_provisioning index flushes it, so the backends take turns at most every PINECONE_PROVISIONING_CHECK_INTERVAL.
+ */
+bool PineconeClaimProvisioningCheck(Relation index) {
+    PineconeIndexSlot *slot = PineconeGetIndexSlot(index);
+    TimestampTz now = GetCurrentTimestamp();
+    bool claimed = false;
+    SpinLockAcquire(&slot->mutex);
+    if (SlotIsFor(slot, index) &&
+        TimestampDifferenceExceeds(slot->provisioning_checked_at, now, PINECONE_PROVISIONING_CHECK_INTERVAL * 1000)) {
+        slot->provisioning_checked_at = now;
+        claimed = true;
+    }
+    SpinLockRelease(&slot->mutex);
+    return claimed;
+}
@@ -4,6 +4,62 @@
 #include "access/generic_xlog.h"
 #include "access/relscan.h"
 #include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+/*
+ * Position of the int4[] column that holds the indices of the sparse values of an index, followed by the float4[]
+ * column of their values. Returns -1 if the index has no sparse values.
+ */
+int pinecone_sparse_attno(TupleDesc tup_desc)
+{
+    for (int i = 1; i < tup_desc->natts; i++) {
+        if (TupleDescAttr(tup_desc, i)->atttypid != INT4ARRAYOID) continue;
+        if (i + 1 >= tup_desc->natts || TupleDescAttr(tup_desc, i + 1)->atttypid != FLOAT4ARRAYOID) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                            errmsg("The int4[] column of sparse indices must be followed by a float4[] column of their values")));
+        }
+        return i;
+    }
+    return -1;
+}
+
+/*
+ * Read the sparse values of a tuple from its int4[] indices and float4[] values
+ */
+void pinecone_sparse_values(Datum indices_datum, Datum values_datum, int32 **indices, float4 **values, int *n)
+{
+    ArrayType *indices_array = DatumGetArrayTypeP(indices_datum);
+    ArrayType *values_array = DatumGetArrayTypeP(values_datum);
+    if (ARR_NDIM(indices_array) > 1 || ARR_NDIM(values_array) > 1 || ARR_HASNULL(indices_array) || ARR_HASNULL(values_array)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("Sparse indices and values must be one-dimensional arrays without nulls")));
+    }
+    *n = ArrayGetNItems(ARR_NDIM(indices_array), ARR_DIMS(indices_array));
+    if (*n != ArrayGetNItems(ARR_NDIM(values_array), ARR_DIMS(values_array))) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("Sparse indices and values must have the same length")));
+    }
+    *indices = (int32 *) ARR_DATA_PTR(indices_array);
+    *values = (float4 *) ARR_DATA_PTR(values_array);
+    for (int i = 0; i < *n; i++) {
+        if ((*indices)[i] < 0) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                            errmsg("Sparse indices must not be negative")));
+        }
+    }
+}
+
+static cJSON* sparse_values_to_json(Datum indices_datum, Datum values_datum)
+{
+    cJSON *sparse = cJSON_CreateObject();
+    int32 *indices;
+    float4 *values;
+    int n;
+    pinecone_sparse_values(indices_datum, values_datum, &indices, &values, &n);
+    cJSON_AddItemToObject(sparse, "indices", cJSON_CreateIntArray((const int *) indices, n));
+    cJSON_AddItemToObject(sparse, "values", cJSON_CreateFloatArray(values, n));
+    return sparse;
+}
 
 cJSON* tuple_get_pinecone_vector(TupleDesc tup_desc, Datum *values, bool *isnull, char *vector_id)
 {
@@ -14,6 +70,8 @@ cJSON* tuple_get_pinecone_vector(TupleDesc tup_desc, Datum *values, bool *isnull
     vector = DatumGetVector(values[0]);
     validate_vector_nonzero(vector);
     json_values = cJSON_CreateFloatArray(vector->x, vector->dim);
+    cJSON_AddItemToObject(json_vector, "id", cJSON_CreateString(vector_id));
+    cJSON_AddItemToObject(json_vector, "values", json_values);
     // prepare metadata
     for (int i = 1; i < tup_desc->natts; i++) // skip the first column which is the vector
     {
@@ -29,15 +87,24 @@ cJSON* tuple_get_pinecone_vector(TupleDesc tup_desc, Datum *values, bool *isnull
             case TEXTOID:
                 cJSON_AddItemToObject(metadata, NameStr(td->attname), cJSON_CreateString(text_to_cstring(DatumGetTextP(values[i]))));
                 break;
+            case INT4ARRAYOID:
+                // sparse indices, whose values are in the next column
+                if (i + 1 >= tup_desc->natts || TupleDescAttr(tup_desc, i + 1)->atttypid != FLOAT4ARRAYOID) {
+                    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                                    errmsg("The int4[] column of sparse indices must be followed by a float4[] column of their values")));
+                }
+                if (!isnull[i] && !isnull[i + 1]) {
+                    cJSON_AddItemToObject(json_vector, "sparseValues", sparse_values_to_json(values[i], values[i + 1]));
+                }
+                i++;
+                break;
             default:
                 ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                                 errmsg("Invalid column type when decoding tuple."),
-                                errhint("Pinecone index only supports boolean, float8 and text columns")));
+                                errhint("Pinecone index only supports boolean, float8 and text columns, and an int4[] column of sparse indices followed by a float4[] column of their values")));
         }
     }
     // add to vector object
-    cJSON_AddItemToObject(json_vector, "id", cJSON_CreateString(vector_id));
-    cJSON_AddItemToObject(json_vector, "values", json_values);
     cJSON_AddItemToObject(json_vector, "metadata", metadata);
     return json_vector;
 }
@@ -64,23 +131,111 @@ cJSON* heap_tuple_get_pinecone_vector(Relation heap, HeapTuple htup) {
     return tuple_get_pinecone_vector(htup_desc, htup_values, htup_isnull, vector_id);
 }
 
+/*
+ * Vector ids are the six bytes of the heap tid (block hi, block lo, offset, each big-endian) as 12 lowercase hex
+ * digits, or as 8 base64url characters for indexes built with compact_ids. Both are decoded through lookup tables
+ * whose entries are the digit's value plus one, so that 0 marks characters outside the alphabet.
+ */
+static const char hex_digits[] = "0123456789abcdef";
+static const char base64url_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static const uint8 hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static const uint8 base64url_values[256] = {
+    ['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6, ['G'] = 7, ['H'] = 8, ['I'] = 9, ['J'] = 10,
+    ['K'] = 11, ['L'] = 12, ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18, ['S'] = 19,
+    ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24, ['Y'] = 25, ['Z'] = 26,
+    ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30, ['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35,
+    ['j'] = 36, ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42, ['q'] = 43, ['r'] = 44,
+    ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48, ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52,
+    ['0'] = 53, ['1'] = 54, ['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60, ['8'] = 61,
+    ['9'] = 62, ['-'] = 63, ['_'] = 64,
+};
+
+/*
+ * Write the id of heap_tid into buf, which has room for PINECONE_ID_BUFFER_SIZE bytes
+ */
+void pinecone_id_encode(ItemPointerData heap_tid, bool compact, char *buf)
+{
+    uint8 bytes[6] = {
+        heap_tid.ip_blkid.bi_hi >> 8, heap_tid.ip_blkid.bi_hi & 0xff,
+        heap_tid.ip_blkid.bi_lo >> 8, heap_tid.ip_blkid.bi_lo & 0xff,
+        heap_tid.ip_posid >> 8, heap_tid.ip_posid & 0xff
+    };
+    if (compact) {
+        for (int i = 0; i < 2; i++) {
+            uint32 group = (bytes[3 * i] << 16) | (bytes[3 * i + 1] << 8) | bytes[3 * i + 2];
+            *buf++ = base64url_digits[(group >> 18) & 0x3f];
+            *buf++ = base64url_digits[(group >> 12) & 0x3f];
+            *buf++ = base64url_digits[(group >> 6) & 0x3f];
+            *buf++ = base64url_digits[group & 0x3f];
+        }
+    } else {
+        for (int i = 0; i < 6; i++) {
+            *buf++ = hex_digits[bytes[i] >> 4];
+            *buf++ = hex_digits[bytes[i] & 0xf];
+        }
+    }
+    *buf = '\0';
+}
+
+/*
+ * Parse an id of either format, telling them apart by their length. Returns false if id is not a valid id.
+ */
+bool pinecone_id_decode(const char *id, ItemPointer heap_tid)
+{
+    uint8 bytes[6];
+    const uint8 *s = (const uint8 *) id;
+    if (id == NULL) return false;
+    if (strnlen(id, PINECONE_HEX_ID_LENGTH + 1) == PINECONE_HEX_ID_LENGTH) {
+        for (int i = 0; i < 6; i++) {
+            uint8 hi = hex_values[s[2 * i]], lo = hex_values[s[2 * i + 1]];
+            if (hi == 0 || lo == 0) return false;
+            bytes[i] = ((hi - 1) << 4) | (lo - 1);
+        }
+    } else if (strnlen(id, PINECONE_HEX_ID_LENGTH + 1) == PINECONE_COMPACT_ID_LENGTH) {
+        for (int i = 0; i < 2; i++) {
+            uint32 group = 0;
+            for (int j = 0; j < 4; j++) {
+                uint8 v = base64url_values[s[4 * i + j]];
+                if (v == 0) return false;
+                group = (group << 6) | (v - 1);
+            }
+            bytes[3 * i] = group >> 16;
+            bytes[3 * i + 1] = (group >> 8) & 0xff;
+            bytes[3 * i + 2] = group & 0xff;
+        }
+    } else {
+        return false;
+    }
+    heap_tid->ip_blkid.bi_hi = (bytes[0] << 8) | bytes[1];
+    heap_tid->ip_blkid.bi_lo = (bytes[2] << 8) | bytes[3];
+    heap_tid->ip_posid = (bytes[4] << 8) | bytes[5];
+    return true;
+}
+
 ItemPointerData pinecone_id_get_heap_tid(char *id)
 {
     ItemPointerData heap_tid;
-    int n_matched;
-    n_matched = sscanf(id, "%04hx%04hx%04hx", &heap_tid.ip_blkid.bi_hi, &heap_tid.ip_blkid.bi_lo, &heap_tid.ip_posid);
-    if (n_matched != 3) {
+    if (!pinecone_id_decode(id, &heap_tid)) {
         ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                         errmsg("Invalid vector id"),
-                        errhint("Vector id should be a 12-character hexadecimal string")));
+                        errhint("Vector id should be a 12-character hexadecimal string or an 8-character base64url string")));
     }
     return heap_tid;
 }
 
+/*
+ * Allocating variant of pinecone_id_encode in the hex format, for messages
+ */
 char* pinecone_id_from_heap_tid(ItemPointerData heap_tid)
 {
-    char* id = palloc(12 + 1);
-    snprintf(id, 12 + 1, "%04hx%04hx%04hx", heap_tid.ip_blkid.bi_hi, heap_tid.ip_blkid.bi_lo, heap_tid.ip_posid);
+    char* id = palloc(PINECONE_ID_BUFFER_SIZE);
+    pinecone_id_encode(heap_tid, false, id);
     return id;
 }
 
@@ -99,6 +254,54 @@ PineconeStaticMetaPageData PineconeSnapshotStaticMeta(Relation index)
     return *metap;
 }
 
+/*
+ * The settings of the index with the session's overrides of the query-side ones. The static meta page never changes
+ * after the build, so its settings are cached in the relcache entry. The reloptions are reloaded when ALTER INDEX SET
+ * changes them, so the tuning is read from them and takes effect at once; the -1 defaults of vectors_per_request and
+ * requests_per_batch keep the values resolved at the build. The vector ids cannot change under an index, so a changed
+ * compact_ids is an error until the index is rebuilt.
+ */
+PineconeSettings PineconeGetSettings(Relation index)
+{
+    PineconeSettings settings;
+    if (index->rd_amcache == NULL) {
+        PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(index);
+        PineconeSettings *cached = MemoryContextAlloc(index->rd_indexcxt, sizeof(PineconeSettings));
+        if (static_meta.has_settings) {
+            *cached = static_meta.settings;
+        } else {
+            cached->top_k = PINECONE_DEFAULT_TOP_K;
+            cached->vectors_per_request = PINECONE_DEFAULT_VECTORS_PER_REQUEST;
+            cached->requests_per_batch = PINECONE_DEFAULT_REQUESTS_PER_BATCH;
+            cached->max_buffer_scan = PINECONE_DEFAULT_MAX_BUFFER_SCAN;
+            cached->max_fetched_vectors_for_liveness_check = PINECONE_DEFAULT_MAX_FETCHED_VECTORS_FOR_LIVENESS_CHECK;
+            cached->compact_ids = false;
+            cached->track_updates = false;
+        }
+        index->rd_amcache = cached;
+    }
+    settings = *(PineconeSettings *) index->rd_amcache;
+    if (index->rd_options != NULL) {
+        PineconeOptions *opts = (PineconeOptions *) index->rd_options;
+        if (opts->compact_ids != settings.compact_ids) {
+            ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                            errmsg("compact_ids of index \"%s\" was changed after it was built", RelationGetRelationName(index)),
+                            errhint("REINDEX the index to upload its vectors with the new ids, or set compact_ids back to %s.", settings.compact_ids ? "true" : "false")));
+        }
+        settings.top_k = opts->top_k;
+        if (opts->vectors_per_request > 0) settings.vectors_per_request = opts->vectors_per_request;
+        if (opts->requests_per_batch > 0) settings.requests_per_batch = opts->requests_per_batch;
+        settings.max_buffer_scan = opts->max_buffer_scan;
+        settings.max_fetched_vectors_for_liveness_check = opts->max_fetched_vectors_for_liveness_check;
+        settings.track_updates = opts->track_updates;
+    }
+    // -1 keeps the index's setting
+    if (pinecone_top_k >= 0) settings.top_k = pinecone_top_k;
+    if (pinecone_max_buffer_scan >= 0) settings.max_buffer_scan = pinecone_max_buffer_scan;
+    if (pinecone_max_fetched_vectors_for_liveness_check >= 0) settings.max_fetched_vectors_for_liveness_check = pinecone_max_fetched_vectors_for_liveness_check;
+    return settings;
+}
+
 PineconeBufferMetaPageData PineconeSnapshotBufferMeta(Relation index)
 {
     Buffer buf;
@@ -241,4 +444,108 @@ hash_tid(ItemPointerData tid, int seed)
 	x.tid = tid;
 
 	return murmurhash64(x.i + seed);
-}
\ No newline at end of file
+}
+
+/*
+ * The shards of the remote index. Indexes built before sharding have a single shard on host.
+ */
+PineconeShard* PineconeGetShards(PineconeStaticMetaPageData* static_meta, int* n_shards)
+{
+    PineconeShard* shards;
+    *n_shards = Max(static_meta->n_shards, 1);
+    shards = palloc(sizeof(PineconeShard) * (*n_shards));
+    if (*n_shards == 1) {
+        shards[0].host = pstrdup(static_meta->host);
+        shards[0].pinecone_namespace = static_meta->partition_namespace[0] != '\0' ? pstrdup(static_meta->partition_namespace) : NULL;
+        return shards;
+    }
+    for (int i = 0; i < *n_shards; i++) {
+        shards[i].host = pstrdup(static_meta->shard_hosts[i]);
+        shards[i].pinecone_namespace = static_meta->shard_by_namespace ? psprintf("shard-%d", i) : NULL;
+    }
+    return shards;
+}
+
+/*
+ * The shard a vector is routed to. This must never change for an existing index.
+ */
+int pinecone_shard_for_tid(ItemPointerData tid, int n_shards)
+{
+    if (n_shards <= 1) return 0;
+    return hash_tid(tid, 0) % n_shards;
+}
+
+int pinecone_shard_for_id(const char* id, int n_shards)
+{
+    return pinecone_shard_for_tid(pinecone_id_get_heap_tid((char*) id), n_shards);
+}
+
+/*
+ * The vectors whose presence in the remote index shows that the batch starting at a checkpoint is searchable: the
+ * first vector of the batch on each shard, or an invalid tid for the shards that the batch has no vector on. The
+ * shards index their upserts independently, so each of them needs its own marker. With a single shard the marker is
+ * the checkpoint's tid, and no page is read.
+ */
+void PineconeGetCheckpointMarkers(Relation index, PineconeCheckpoint checkpoint, int n_shards, ItemPointerData* markers)
+{
+    BlockNumber blkno = checkpoint.blkno;
+    int n_found = 0;
+    if (n_shards <= 1) {
+        markers[0] = checkpoint.tid;
+        return;
+    }
+    for (int i = 0; i < n_shards; i++) ItemPointerSetInvalid(&markers[i]);
+    while (n_found < n_shards && BlockNumberIsValid(blkno)) {
+        Buffer buf = ReadBuffer(index, blkno);
+        Page page;
+        PineconeBufferOpaque opaque;
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        opaque = PineconePageGetOpaque(page);
+        // the batch ends where the next one starts
+        if (blkno != checkpoint.blkno && opaque->checkpoint.is_checkpoint) {
+            UnlockReleaseBuffer(buf);
+            break;
+        }
+        for (OffsetNumber offno = FirstOffsetNumber; offno <= PageGetMaxOffsetNumber(page) && n_found < n_shards; offno = OffsetNumberNext(offno)) {
+            PineconeBufferTuple* buffer_tup = (PineconeBufferTuple*) PageGetItem(page, PageGetItemId(page, offno));
+            ItemPointerData tid = buffer_tup->tid;
+            int shard = pinecone_shard_for_tid(tid, n_shards);
+            if (buffer_tup->flags & PINECONE_BUFFER_TUPLE_MOVED) continue; // not uploaded with the batch
+            if (!ItemPointerIsValid(&markers[shard])) {
+                markers[shard] = tid;
+                n_found++;
+            }
+        }
+        blkno = opaque->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+/*
+ * Fetch describe_index_stats from every shard of the index and cache the result in its slot
+ */
+PineconeRemoteStats PineconeRefreshRemoteStats(Relation index)
+{
+    PineconeStaticMetaPageData static_meta = PineconeSnapshotStaticMeta(index);
+    PineconeRemoteStats stats = {0, 0, 0};
+    int n_shards;
+    PineconeShard* shards = PineconeGetShards(&static_meta, &n_shards);
+    for (int i = 0; i < n_shards; i++) {
+        cJSON* response = pinecone_get_index_stats(pinecone_api_key, shards[i].host);
+        cJSON* count;
+        cJSON* fullness = cJSON_GetObjectItemCaseSensitive(response, "indexFullness");
+        if (shards[i].pinecone_namespace != NULL) {
+            cJSON* ns = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(response, "namespaces"), shards[i].pinecone_namespace);
+            count = cJSON_GetObjectItemCaseSensitive(ns, "vectorCount");
+        } else {
+            count = cJSON_GetObjectItemCaseSensitive(response, "totalVectorCount");
+        }
+        if (cJSON_IsNumber(count)) stats.vector_count += (int64) cJSON_GetNumberValue(count);
+        if (cJSON_IsNumber(fullness)) stats.index_fullness = Max(stats.index_fullness, fullness->valuedouble);
+        cJSON_Delete(response);
+    }
+    stats.refreshed_at = GetCurrentTimestamp();
+    PineconeSetRemoteStats(index, stats);
+    return stats;
+}
@@ -1,28 +1,79 @@
 #include "pinecone.h"
 
+#include "commands/vacuum.h"
 
+/*
+ * Whether a tid is the marker of a checkpoint that scans still fetch to find out which batches are searchable
+ */
+static bool is_unconfirmed_marker(ItemPointerData *markers, int n_markers, ItemPointer tid)
+{
+    for (int i = 0; i < n_markers; i++) {
+        if (ItemPointerIsValid(&markers[i]) && ItemPointerEquals(&markers[i], tid)) return true;
+    }
+    return false;
+}
+
+/*
+ * Delete the remote vectors of dead rows, deleted ones and the versions that updates replaced. Vector ids are heap
+ * tids, so this has to happen before VACUUM lets the heap reuse them. Only indexes with track_updates are vacuumed:
+ * pinecone lists ids a page of PINECONE_LIST_MAX_IDS at a time, and only for serverless indexes. The markers of the
+ * checkpoints between the ready and the flush checkpoint are kept until a later vacuum, as scans fetch them to confirm
+ * their batches; their rows are dead, so no scan returns them.
+ */
 IndexBulkDeleteResult *pinecone_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
                                      IndexBulkDeleteCallback callback, void *callback_state)
 {
-    return NULL;
-    // char* host = ReadMetaPage(info->index).host;
-    // cJSON* ids_to_delete = cJSON_CreateArray();
-    // yikes! pinecone makes you read your ids sequentially in pages of 100, so vacuuming a large index is going to be impossible
-    // todo: and list isn't even supported on pod-based indexes, so actually it would make sense simply to 
-    // use /query to ask for 10K random ids and wait for them to be deleted.
-    // but this doesn't quite work either since we need to iterate thru the whole thing.
-    // the new plan of just keeping a-T is a lot less hacky. We care about their memory, not their disk space.
-    // cJSON* json_vectors = pinecone_list_vectors(pinecone_api_key, ReadMetaPage(info->index).host, 100, NULL);
-    // cJSON* json_vector; // todo: do I need to be freeing all my cJSON objects?
-    // elog(DEBUG1, "vacuuming json_vectors: %s", cJSON_Print(json_vectors));
-    // cJSON_ArrayForEach(json_vector, json_vectors) {
-        // char* id = cJSON_GetStringValue(cJSON_GetObjectItem(json_vector, "id"));
-        // ItemPointerData heap_tid = pinecone_id_get_heap_tid(id);
-        // if (callback(&heap_tid, callback_state)) cJSON_AddItemToArray(ids_to_delete, cJSON_CreateString(id));
-    // }
-    // elog(DEBUG1, "deleting ids: %s", cJSON_Print(ids_to_delete));
-    // pinecone_delete_vectors(pinecone_api_key, host, ids_to_delete);
-    // return NULL;
+    Relation index = info->index;
+    PineconeStaticMetaPageData static_meta;
+    PineconeShard *shards;
+    PineconeCheckpoint *checkpoints;
+    ItemPointerData *markers;
+    int n_shards, n_checkpoints, n_markers;
+
+    if (!PineconeGetSettings(index).track_updates) return stats;
+    static_meta = PineconeSnapshotStaticMeta(index);
+    if (static_meta.provisioning) return stats; // nothing is uploaded yet
+    if (stats == NULL) stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+    shards = PineconeGetShards(&static_meta, &n_shards);
+
+    checkpoints = get_checkpoints_to_fetch(index, &n_checkpoints);
+    n_markers = (n_checkpoints + 1) * n_shards;
+    markers = palloc(sizeof(ItemPointerData) * n_markers);
+    PineconeGetCheckpointMarkers(index, PineconeSnapshotBufferMeta(index).flush_checkpoint, n_shards, markers);
+    for (int k = 0; k < n_checkpoints; k++) {
+        PineconeGetCheckpointMarkers(index, checkpoints[k], n_shards, &markers[(k + 1) * n_shards]);
+    }
+
+    for (int s = 0; s < n_shards; s++) {
+        cJSON *dead_ids = cJSON_CreateArray();
+        char *pagination_token = NULL;
+        do {
+            cJSON *response = pinecone_list_vectors(pinecone_api_key, shards[s], PINECONE_LIST_MAX_IDS, pagination_token);
+            cJSON *next = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(response, "pagination"), "next");
+            cJSON *vector;
+            cJSON_ArrayForEach(vector, cJSON_GetObjectItemCaseSensitive(response, "vectors")) {
+                char *id = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(vector, "id"));
+                ItemPointerData tid;
+                // vectors that another client put into an index given by host are left alone
+                if (id == NULL || !pinecone_id_decode(id, &tid)) continue;
+                stats->num_index_tuples++;
+                if (!callback(&tid, callback_state) || is_unconfirmed_marker(markers, n_markers, &tid)) continue;
+                cJSON_AddItemToArray(dead_ids, cJSON_CreateString(id));
+                stats->tuples_removed++;
+                stats->num_index_tuples--;
+            }
+            if (pagination_token != NULL) pfree(pagination_token);
+            pagination_token = cJSON_IsString(next) && strlen(cJSON_GetStringValue(next)) > 0 ? pstrdup(cJSON_GetStringValue(next)) : NULL;
+            cJSON_Delete(response);
+            vacuum_delay_point();
+        } while (pagination_token != NULL);
+
+        elog(DEBUG1, "Deleting %d vectors of dead rows from shard %d", cJSON_GetArraySize(dead_ids), s);
+        if (cJSON_GetArraySize(dead_ids) > 0) pinecone_delete_from_shards(pinecone_api_key, &shards[s], 1, dead_ids);
+        cJSON_Delete(dead_ids);
+    }
+    pfree(markers);
+    return stats;
 }
 
-IndexBulkDeleteResult *no_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats) { return NULL; }
+IndexBulkDeleteResult *no_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats) { return stats; }
@@ -0,0 +1,3 @@
+-- the :k nearest neighbors of a random vector of :dim dimensions among the rows of a random tag
+\set tag random(0, 9)
+SELECT id FROM bench_items WHERE tag = :tag ORDER BY v <-> (SELECT array_agg(random())::vector FROM generate_series(1, :dim)) LIMIT :k;
@@ -0,0 +1,3 @@
+-- one row with a random vector of :dim dimensions and a random tag
+\set tag random(0, 9)
+INSERT INTO bench_items (v, tag) VALUES ((SELECT array_agg(random())::vector FROM generate_series(1, :dim)), :tag);
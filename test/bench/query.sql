@@ -0,0 +1,2 @@
+-- the :k nearest neighbors of a random vector of :dim dimensions
+SELECT id FROM bench_items ORDER BY v <-> (SELECT array_agg(random())::vector FROM generate_series(1, :dim)) LIMIT :k;
@@ -0,0 +1,159 @@
+use strict;
+use warnings;
+use IPC::Run;
+use PineconeServer;
+use PostgresNode;
+use TestLib;
+use Test::More;
+use Time::HiRes qw(time);
+
+# Throughput and latency of the pinecone access method against the local stand-in server. Every run reports its
+# transactions per second, p50 and p99 latency, and the requests and bytes the stand-in received. Set BENCH_OUTPUT
+# to append one csv line per run, to compare two builds of the extension.
+if (!PineconeServer::available())
+{
+	plan skip_all => "python3 is required for the pinecone stand-in server";
+}
+
+my $dim = $ENV{BENCH_DIM} // 128;
+my $rows = $ENV{BENCH_ROWS} // 10000; # rows of the table that is queried
+my $build_rows = $ENV{BENCH_BUILD_ROWS} // 1000000;
+my $duration = $ENV{BENCH_DURATION} // 10; # seconds per run
+my @clients = split(' ', $ENV{BENCH_CLIENTS} // '1 4 16');
+my @top_ks = split(' ', $ENV{BENCH_TOP_K} // '10 100 1000');
+my @depths = split(' ', $ENV{BENCH_BUFFER_DEPTHS} // '0 1000 5000');
+my $query_clients = $ENV{BENCH_QUERY_CLIENTS} // 4;
+my $index_options = $ENV{BENCH_INDEX_OPTIONS} // 'vectors_per_request = 100, requests_per_batch = 10';
+my @server_flags = split(' ', $ENV{BENCH_SERVER_FLAGS} // '--latency-ms 5 --jitter-ms 2');
+my $spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}';
+
+my $server = PineconeServer->new(@server_flags);
+my $base_url = $server->base_url;
+
+my $node = get_new_node('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(
+pinecone.base_url = '$base_url'
+pinecone.api_key = 'local'
+max_connections = 100
+));
+$node->start;
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+
+my $logdir = $node->basedir . "/bench";
+mkdir($logdir);
+
+sub report
+{
+	my ($run, $tps, $latencies, $stats) = @_;
+	my @sorted = sort { $a <=> $b } @$latencies;
+	my $p50 = @sorted ? $sorted[int(0.50 * $#sorted)] / 1000 : 0;
+	my $p99 = @sorted ? $sorted[int(0.99 * $#sorted)] / 1000 : 0;
+	diag(sprintf("%-40s tps %10.1f  p50 %8.2f ms  p99 %8.2f ms  requests %8d  request bytes %12d",
+		$run, $tps, $p50, $p99, $stats->{requests}, $stats->{request_bytes}));
+	if ($ENV{BENCH_OUTPUT})
+	{
+		open(my $fh, '>>', $ENV{BENCH_OUTPUT}) or die "could not open $ENV{BENCH_OUTPUT}: $!";
+		printf $fh "%s,%.1f,%.2f,%.2f,%d,%d\n", $run, $tps, $p50, $p99, $stats->{requests}, $stats->{request_bytes};
+		close($fh);
+	}
+}
+
+# Run pgbench scripts (file@weight) and report the latencies of its per-transaction log
+sub bench
+{
+	my ($run, $clients, $scripts, $pgoptions) = @_;
+	my $prefix = "$logdir/" . ($run =~ s/\W+/_/gr);
+	my ($stdout, $stderr);
+	my @cmd = ('pgbench', '--no-vacuum', '--client', $clients, '--jobs', $clients, '--time', $duration,
+		'--log', "--log-prefix=$prefix", '-D', "dim=$dim", '-D', "k=10",
+		'-h', $node->host, '-p', $node->port);
+	push(@cmd, '-f', "test/bench/$_") for @$scripts;
+	push(@cmd, 'postgres');
+
+	$server->reset_stats;
+	local $ENV{PGOPTIONS} = $pgoptions // '';
+	my $result = IPC::Run::run(\@cmd, '>', \$stdout, '2>', \$stderr);
+	ok($result, "$run") or diag($stderr);
+
+	my @latencies;
+	for my $log (glob("$prefix.*"))
+	{
+		open(my $fh, '<', $log) or die "could not open $log: $!";
+		while (<$fh>)
+		{
+			my @fields = split(' ');
+			push(@latencies, $fields[2]) if @fields >= 3;
+		}
+		close($fh);
+	}
+	my ($tps) = $stdout =~ /tps = ([\d.]+)/;
+	report($run, $tps // 0, \@latencies, $server->stats);
+}
+
+sub create_table
+{
+	my ($table, $n, $options) = @_;
+	$node->safe_psql("postgres", qq(
+		DROP TABLE IF EXISTS $table;
+		SELECT pinecone_delete_unused_indexes();
+		CREATE TABLE $table (id bigserial PRIMARY KEY, v vector($dim), tag float8);
+		INSERT INTO $table (v, tag)
+			SELECT (SELECT array_agg(random())::vector FROM generate_series(1, $dim) WHERE i > 0), i % 10
+			FROM generate_series(1, $n) i;
+	));
+	my $start = time();
+	$server->reset_stats;
+	$node->safe_psql("postgres", qq(
+		CREATE INDEX ON $table USING pinecone (v vector_l2_ops, tag) WITH (spec = '$spec', $options);
+	));
+	return (time() - $start, $server->stats);
+}
+
+# Build
+{
+	my ($seconds, $stats) = create_table("bench_build", $build_rows, $index_options);
+	# reported as rows per second, with the build time as its latency
+	report("build $build_rows rows", $build_rows / $seconds, [$seconds * 1e6], $stats);
+	$node->safe_psql("postgres", "DROP TABLE bench_build; SELECT pinecone_delete_unused_indexes();");
+}
+
+# Queries with increasingly deep buffers. A batch of 10000 keeps the rows inserted after the build in the buffer
+# that each query scans locally.
+create_table("bench_items", $rows, "vectors_per_request = 100, requests_per_batch = 100");
+my $depth = 0;
+for my $target (sort { $a <=> $b } @depths)
+{
+	if ($target >= 10000)
+	{
+		diag("skipping buffer depth $target, which would reach a checkpoint");
+		next;
+	}
+	$node->safe_psql("postgres", qq(
+		INSERT INTO bench_items (v, tag)
+			SELECT (SELECT array_agg(random())::vector FROM generate_series(1, $dim) WHERE i > 0), i % 10
+			FROM generate_series(1, @{[$target - $depth]}) i;
+	)) if $target > $depth;
+	$depth = $target;
+	for my $k (@top_ks)
+	{
+		bench("query depth $depth top_k $k", $query_clients, ['query.sql'], "-c pinecone.top_k=$k");
+	}
+	bench("filtered query depth $depth", $query_clients, ['filtered_query.sql']);
+}
+
+# Concurrent inserts, which flush a batch at commit whenever they reach a checkpoint
+for my $c (@clients)
+{
+	create_table("bench_items", $rows, $index_options);
+	bench("insert clients $c", $c, ['insert.sql']);
+}
+
+# Mixed reads and writes
+for my $c (@clients)
+{
+	create_table("bench_items", $rows, $index_options);
+	bench("mixed 10% writes clients $c", $c, ['insert.sql@1', 'query.sql@9']);
+}
+
+done_testing();
@@ -0,0 +1,34 @@
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+# Per-id cost of encoding and decoding vector ids in either format, next to the sprintf/sscanf formatting they
+# replaced. The benchmark function is in the library but not in the extension, so it is created here.
+my $iterations = $ENV{BENCH_ID_ITERATIONS} // 1000000;
+
+my $node = get_new_node('node');
+$node->init;
+$node->start;
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", qq(
+	CREATE FUNCTION pinecone_id_benchmark(iterations int4, compact bool DEFAULT false, OUT encode_ns float8, OUT decode_ns float8,
+		OUT legacy_encode_ns float8, OUT legacy_decode_ns float8) RETURNS record
+		AS 'vector' LANGUAGE C VOLATILE STRICT;
+));
+
+for my $compact ('false', 'true')
+{
+	my $result = $node->safe_psql("postgres", qq(
+		SELECT format('%s %s %s %s', round(encode_ns::numeric, 1), round(decode_ns::numeric, 1),
+			round(legacy_encode_ns::numeric, 1), round(legacy_decode_ns::numeric, 1))
+		FROM pinecone_id_benchmark($iterations, $compact);
+	));
+	my ($encode, $decode, $legacy_encode, $legacy_decode) = split(' ', $result);
+	ok(defined $legacy_decode, "id benchmark compact $compact");
+	diag(sprintf("%-40s encode %6.1f ns  decode %6.1f ns  legacy encode %6.1f ns  legacy decode %6.1f ns",
+		"ids compact $compact", $encode, $decode, $legacy_encode, $legacy_decode));
+}
+
+done_testing();
@@ -0,0 +1,98 @@
+package PineconeServer;
+
+# Runs test/pinecone_server.py, the local stand-in for the pinecone api, for the lifetime of the object
+
+use strict;
+use warnings;
+use HTTP::Tiny;
+use IO::Socket::INET;
+use JSON::PP;
+use POSIX ();
+
+sub available
+{
+	return system("python3 -c 'import http.server' >/dev/null 2>&1") == 0;
+}
+
+sub new
+{
+	my ($class, @flags) = @_;
+
+	# Pick a free port
+	my $socket = IO::Socket::INET->new(Listen => 1, LocalAddr => '127.0.0.1', LocalPort => 0) or die "no free port";
+	my $port = $socket->sockport;
+	$socket->close;
+
+	my $pid = fork();
+	die "fork failed: $!" unless defined $pid;
+	if ($pid == 0)
+	{
+		exec("python3", "test/pinecone_server.py", "--port", $port, @flags)
+		  or print STDERR "could not start the pinecone stand-in server: $!\n";
+		POSIX::_exit(1);
+	}
+
+	my $self = bless { port => $port, pid => $pid }, $class;
+	for (1 .. 50)
+	{
+		return $self if IO::Socket::INET->new(PeerAddr => '127.0.0.1', PeerPort => $port);
+		select(undef, undef, undef, 0.1);
+	}
+	die "the pinecone stand-in server did not start";
+}
+
+sub base_url
+{
+	my ($self) = @_;
+	return "http://127.0.0.1:$self->{port}";
+}
+
+# Request and byte counters since the last reset
+sub stats
+{
+	my ($self) = @_;
+	my $response = HTTP::Tiny->new->get($self->base_url . "/_stats");
+	die "could not read the stand-in server stats" unless $response->{success};
+	return decode_json($response->{content});
+}
+
+sub reset_stats
+{
+	my ($self) = @_;
+	HTTP::Tiny->new->post($self->base_url . "/_stats");
+}
+
+# Names of the remote indexes
+sub index_names
+{
+	my ($self) = @_;
+	my $response = HTTP::Tiny->new->get($self->base_url . "/indexes");
+	die "could not list the stand-in server indexes" unless $response->{success};
+	return map { $_->{name} } @{ decode_json($response->{content})->{indexes} };
+}
+
+# Delete a remote index behind the extension's back, so that its requests fail
+sub delete_index
+{
+	my ($self, $name) = @_;
+	HTTP::Tiny->new->request('DELETE', $self->base_url . "/indexes/$name");
+}
+
+# Ids of the vectors of a remote index, in its default namespace
+sub vector_ids
+{
+	my ($self, $name) = @_;
+	my $response = HTTP::Tiny->new->get($self->base_url . "/index/$name/vectors/list?limit=100000");
+	die "could not list the vectors of $name" unless $response->{success};
+	return map { $_->{id} } @{ decode_json($response->{content})->{vectors} };
+}
+
+sub DESTROY
+{
+	my ($self) = @_;
+	return unless $self->{pid};
+	kill 'TERM', $self->{pid};
+	waitpid($self->{pid}, 0);
+}
+
+1;
@@ -0,0 +1,307 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the Pinecone API
+
+Serves the control plane and the data plane of every index it creates on a single port, with exact kNN in memory,
+so that the pinecone access method can be tested and benchmarked end to end without a Pinecone account:
+
+    python3 test/pinecone_server.py --port 8765 --latency-ms 20 --jitter-ms 5
+
+    SET pinecone.base_url = 'http://127.0.0.1:8765';
+    SET pinecone.api_key = 'local';
+    CREATE INDEX ON items USING pinecone (embedding) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+
+The host of an index is 127.0.0.1:<port>/index/<name>, so the extension reaches its data plane through the same
+server. Every request waits --latency-ms plus up to --jitter-ms, and fails with HTTP 503 with probability
+--failure-rate. Upserted vectors become visible to queries and fetches after --index-lag-ms, which mimics the delay
+before Pinecone makes a batch searchable, and a new index reports that it is ready after --provisioning-ms. GET /_stats reports request and byte counters, and POST /_stats resets them.
+"""
+
+import argparse
+import array
+import gzip
+import json
+import math
+import random
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+
+class Index:
+    def __init__(self, name, dimension, metric, spec):
+        self.name = name
+        self.dimension = dimension
+        self.metric = metric
+        self.spec = spec
+        self.created_at = time.time()
+        self.namespaces = {}  # namespace -> id -> (values as an array of floats, metadata, visible_at, sparse values)
+        self.lock = threading.Lock()
+
+    def namespace(self, name):
+        return self.namespaces.setdefault(name or "", {})
+
+
+class State:
+    def __init__(self, args):
+        self.args = args
+        self.indexes = {}
+        self.lock = threading.Lock()
+        self.random = random.Random(args.seed)
+        self.reset_stats()
+
+    def reset_stats(self):
+        with self.lock:
+            self.stats = {"requests": 0, "failures": 0, "request_bytes": 0, "response_bytes": 0, "by_endpoint": {}}
+
+    def count(self, endpoint, request_bytes, response_bytes, failed):
+        with self.lock:
+            self.stats["requests"] += 1
+            self.stats["failures"] += int(failed)
+            self.stats["request_bytes"] += request_bytes
+            self.stats["response_bytes"] += response_bytes
+            by_endpoint = self.stats["by_endpoint"].setdefault(endpoint, {"requests": 0, "request_bytes": 0})
+            by_endpoint["requests"] += 1
+            by_endpoint["request_bytes"] += request_bytes
+
+
+def score(metric, a, b):
+    if metric == "euclidean":
+        return sum((x - y) * (x - y) for x, y in zip(a, b))  # pinecone reports the squared distance
+    dot = sum(x * y for x, y in zip(a, b))
+    if metric == "cosine":
+        norm = math.sqrt(sum(x * x for x in a)) * math.sqrt(sum(y * y for y in b))
+        return dot / norm if norm > 0 else 0.0
+    return dot
+
+
+def sparse_dot(query, sparse):
+    if not query or not sparse:
+        return 0.0
+    return sum(v * sparse.get(i, 0.0) for i, v in zip(query["indices"], query["values"]))
+
+
+def matches_filter(metadata, flt):
+    """The subset of the Pinecone metadata filter language that the extension generates"""
+    if not flt:
+        return True
+    for key, cond in flt.items():
+        if key == "$and":
+            if not all(matches_filter(metadata, c) for c in cond):
+                return False
+        elif key == "$or":
+            if not any(matches_filter(metadata, c) for c in cond):
+                return False
+        else:
+            value = metadata.get(key)
+            if not isinstance(cond, dict):
+                cond = {"$eq": cond}
+            for op, operand in cond.items():
+                if op == "$eq" and not value == operand:
+                    return False
+                if op == "$ne" and not value != operand:
+                    return False
+                if op == "$in" and value not in operand:
+                    return False
+                if op == "$nin" and value in operand:
+                    return False
+                if op in ("$gt", "$gte", "$lt", "$lte"):
+                    if value is None or isinstance(value, (str, bool)):
+                        return False
+                    if op == "$gt" and not value > operand:
+                        return False
+                    if op == "$gte" and not value >= operand:
+                        return False
+                    if op == "$lt" and not value < operand:
+                        return False
+                    if op == "$lte" and not value <= operand:
+                        return False
+    return True
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # keep connections alive like the pinecone endpoints do
+    state = None
+
+    def log_message(self, format, *args):
+        if self.state.args.verbose:
+            super().log_message(format, *args)
+
+    def read_body(self):
+        length = int(self.headers.get("Content-Length") or 0)
+        raw = self.rfile.read(length) if length else b""
+        self.request_bytes = len(raw)
+        if self.headers.get("Content-Encoding") == "gzip":
+            raw = gzip.decompress(raw)
+        return json.loads(raw) if raw else {}
+
+    def reply(self, status, body):
+        data = json.dumps(body).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+        self.response_bytes = len(data)
+
+    def handle_any(self, method):
+        args = self.state.args
+        url = urlparse(self.path)
+        parts = [p for p in url.path.split("/") if p]
+        self.request_bytes = 0
+        self.response_bytes = 0
+        failed = False
+        if parts == ["_stats"]:
+            if method == "POST":
+                self.read_body()
+                self.state.reset_stats()
+            with self.state.lock:
+                stats = json.loads(json.dumps(self.state.stats))
+            return self.reply(200, stats)
+        try:
+            body = self.read_body() if method in ("POST", "PATCH") else {}
+            delay = args.latency_ms + self.state.random.uniform(0, args.jitter_ms)
+            if delay > 0:
+                time.sleep(delay / 1000.0)
+            if self.state.random.random() < args.failure_rate:
+                failed = True
+                return self.reply(503, {"error": {"code": "UNAVAILABLE", "message": "injected failure"}})
+            if parts[:1] == ["indexes"]:
+                return self.control_plane(method, parts[1:], body)
+            if parts[:1] == ["index"] and len(parts) >= 3:
+                return self.data_plane(method, parts[1], "/".join(parts[2:]), parse_qs(url.query), body)
+            return self.reply(404, {"error": {"code": "NOT_FOUND", "message": url.path}})
+        finally:
+            endpoint = "/".join(parts[2:]) if parts[:1] == ["index"] else "/".join(parts[:1])
+            self.state.count(endpoint, self.request_bytes, self.response_bytes, failed)
+
+    def describe(self, index):
+        host = "%s:%d/index/%s" % (self.state.args.host, self.state.args.port, index.name)
+        ready = time.time() >= index.created_at + self.state.args.provisioning_ms / 1000.0
+        return {"name": index.name, "dimension": index.dimension, "metric": index.metric, "host": host,
+                "spec": index.spec, "status": {"ready": ready, "state": "Ready" if ready else "Initializing"}}
+
+    def control_plane(self, method, parts, body):
+        with self.state.lock:
+            return self.control_plane_locked(method, parts, body)
+
+    def control_plane_locked(self, method, parts, body):
+        indexes = self.state.indexes
+        if not parts and method == "GET":
+            return self.reply(200, {"indexes": [self.describe(i) for i in indexes.values()]})
+        if not parts and method == "POST":
+            name = body["name"]
+            if name in indexes:
+                return self.reply(409, {"error": {"code": "ALREADY_EXISTS", "message": name}})
+            indexes[name] = Index(name, body["dimension"], body.get("metric", "cosine"), body.get("spec", {}))
+            return self.reply(201, self.describe(indexes[name]))
+        if len(parts) == 1 and parts[0] in indexes:
+            if method == "GET":
+                return self.reply(200, self.describe(indexes[parts[0]]))
+            if method == "DELETE":
+                del indexes[parts[0]]
+                return self.reply(202, {})
+        return self.reply(404, {"error": {"code": "NOT_FOUND", "message": "/".join(parts)}})
+
+    def data_plane(self, method, name, endpoint, query, body):
+        index = self.state.indexes.get(name)
+        if index is None:
+            return self.reply(404, {"error": {"code": "NOT_FOUND", "message": name}})
+        now = time.monotonic()
+        with index.lock:
+            if endpoint == "vectors/upsert":
+                ns = index.namespace(body.get("namespace"))
+                visible_at = now + self.state.args.index_lag_ms / 1000.0
+                for v in body["vectors"]:
+                    if len(v["values"]) != index.dimension:
+                        return self.reply(400, {"error": {"code": "INVALID_ARGUMENT", "message": "dimension mismatch"}})
+                    sparse = v.get("sparseValues")
+                    if sparse is not None and index.metric != "dotproduct":
+                        return self.reply(400, {"error": {"code": "INVALID_ARGUMENT", "message": "sparse values require dotproduct"}})
+                    sparse = dict(zip(sparse["indices"], sparse["values"])) if sparse else None
+                    ns[v["id"]] = (array.array("f", v["values"]), v.get("metadata", {}), visible_at, sparse)
+                return self.reply(200, {"upsertedCount": len(body["vectors"])})
+            if endpoint == "vectors/update":
+                ns = index.namespace(body.get("namespace"))
+                if body["id"] in ns:
+                    values, metadata, visible_at, sparse = ns[body["id"]]
+                    metadata = dict(metadata, **body.get("setMetadata", {}))
+                    if "values" in body:
+                        values = array.array("f", body["values"])
+                    ns[body["id"]] = (values, metadata, visible_at, sparse)
+                return self.reply(200, {})
+            if endpoint == "vectors/delete":
+                ns = index.namespace(body.get("namespace"))
+                if body.get("deleteAll"):
+                    ns.clear()
+                for id in body.get("ids", []):
+                    ns.pop(id, None)
+                return self.reply(200, {})
+            if endpoint == "vectors/fetch":
+                namespace = query.get("namespace", [""])[0]
+                ns = index.namespace(namespace)
+                vectors = {id: {"id": id, "values": ns[id][0].tolist()} for id in query.get("ids", [])
+                           if id in ns and ns[id][2] <= now}
+                return self.reply(200, {"vectors": vectors, "namespace": namespace})
+            if endpoint == "query":
+                ns = index.namespace(body.get("namespace"))
+                sparse_query = body.get("sparseVector")
+                if sparse_query and index.metric != "dotproduct":
+                    return self.reply(400, {"error": {"code": "INVALID_ARGUMENT", "message": "sparse queries require dotproduct"}})
+                candidates = [(score(index.metric, body["vector"], values) + sparse_dot(sparse_query, sparse), id)
+                              for id, (values, metadata, visible_at, sparse) in ns.items()
+                              if visible_at <= now and matches_filter(metadata, body.get("filter"))]
+                candidates.sort(reverse=index.metric != "euclidean")
+                matches = [{"id": id, "score": s} for s, id in candidates[:body.get("topK", 10)]]
+                return self.reply(200, {"matches": matches, "namespace": body.get("namespace", "")})
+            if endpoint == "describe_index_stats":
+                namespaces = {ns: {"vectorCount": len(v)} for ns, v in index.namespaces.items()}
+                return self.reply(200, {"namespaces": namespaces, "dimension": index.dimension, "indexFullness": 0,
+                                        "totalVectorCount": sum(len(v) for v in index.namespaces.values())})
+            if endpoint == "vectors/list":
+                ids = sorted(index.namespace(query.get("namespace", [""])[0]))
+                limit = int(query.get("limit", ["100"])[0])
+                token = query.get("paginationToken", [""])[0]
+                ids = [id for id in ids if id > token]
+                page = {"vectors": [{"id": id} for id in ids[:limit]]}
+                if len(ids) > limit:
+                    page["pagination"] = {"next": ids[limit - 1]}
+                return self.reply(200, page)
+        return self.reply(404, {"error": {"code": "NOT_FOUND", "message": endpoint}})
+
+    def do_GET(self):
+        self.handle_any("GET")
+
+    def do_POST(self):
+        self.handle_any("POST")
+
+    def do_DELETE(self):
+        self.handle_any("DELETE")
+
+    def do_PATCH(self):
+        self.handle_any("PATCH")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8765)
+    parser.add_argument("--latency-ms", type=float, default=0)
+    parser.add_argument("--jitter-ms", type=float, default=0)
+    parser.add_argument("--failure-rate", type=float, default=0)
+    parser.add_argument("--index-lag-ms", type=float, default=0)
+    parser.add_argument("--provisioning-ms", type=float, default=0)
+    parser.add_argument("--seed", type=int, default=None)
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    Handler.state = State(args)
+    server = ThreadingHTTPServer((args.host, args.port), Handler)
+    server.daemon_threads = True
+    print("pinecone stand-in listening on http://%s:%d" % (args.host, args.port), flush=True)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -10,4 +10,10 @@ SHOW pinecone.requests_per_batch;
 SET pinecone.max_buffer_scan = 1000;
 SHOW pinecone.max_buffer_scan;
 SET pinecone.max_fetched_vectors_for_liveness_check = 5;
-SHOW pinecone.max_fetched_vectors_for_liveness_check;
\ No newline at end of file
+SHOW pinecone.max_fetched_vectors_for_liveness_check;
+SET pinecone.buffer_graph = on;
+SHOW pinecone.buffer_graph;
+SET pinecone.buffer_graph_mem = 2048;
+SHOW pinecone.buffer_graph_mem;
+SET pinecone.compress_requests = on;
+SHOW pinecone.compress_requests;
\ No newline at end of file
@@ -0,0 +1,8 @@
+-- vector ids round trip in both formats, including the extreme block and offset numbers
+SELECT t, pinecone_vector_id(t) AS hex, pinecone_vector_id(t, true) AS compact,
+	pinecone_vector_tid(pinecone_vector_id(t)) = t AS hex_ok, pinecone_vector_tid(pinecone_vector_id(t, true)) = t AS compact_ok
+	FROM unnest('{"(0,0)","(0,1)","(1,1)","(65535,65535)","(65536,1)","(4294967294,291)","(4294967295,65535)"}'::tid[]) t;
+-- ids of neither format
+SELECT pinecone_vector_tid('00000000000g');
+SELECT pinecone_vector_tid('AAAAAAA*');
+SELECT pinecone_vector_tid('0000000001');
@@ -6,4 +6,6 @@ CREATE INDEX i2 ON t USING pinecone (val) WITH (spec = '{"serverless":{"cloud":"
 ALTER SYSTEM SET pinecone.api_key = '5b2c1031-ba58-4acc-a634-9f943d68822c';
 SELECT pg_reload_conf();
 CREATE INDEX i2 ON t USING pinecone (val);
+CREATE INDEX i2 ON t USING pinecone (val) WITH (host = 'fakehost1,fakehost2', shards = 3);
+CREATE INDEX i2 ON t USING pinecone (val) WITH (host = 'fakehost', top_k = 0);
 DROP TABLE t;
\ No newline at end of file
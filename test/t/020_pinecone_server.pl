@@ -0,0 +1,409 @@
+use strict;
+use warnings;
+use IPC::Run;
+use PineconeServer;
+use PostgresNode;
+use TestLib;
+use Test::More;
+use Time::HiRes qw(time);
+
+# End-to-end test of the pinecone access method against the local stand-in server
+if (!PineconeServer::available())
+{
+	plan skip_all => "python3 is required for the pinecone stand-in server";
+}
+
+my $dim = 3;
+my $limit = 10;
+
+# new remote indexes take a while to be ready, like pinecone's
+my $server = PineconeServer->new("--provisioning-ms", 2000);
+my $base_url = $server->base_url;
+
+# Initialize node
+my $node = get_new_node('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(
+shared_preload_libraries = 'vector'
+pinecone.base_url = '$base_url'
+pinecone.api_key = 'local'
+pinecone.flusher_database = 'postgres'
+));
+$node->start;
+
+my $array_sql = join(",", ('random()') x $dim);
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim), c float8);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql], i % 5 FROM generate_series(1, 500) i;"
+);
+$node->safe_psql("postgres", qq(
+	CREATE INDEX idx ON tst USING pinecone (v vector_l2_ops, c)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+));
+
+# The build uploads every row
+is($node->safe_psql("postgres", "SELECT vector_count FROM pinecone_remote_stats('idx', true);"), '500', "remote vector count");
+is($node->safe_psql("postgres", "SELECT vector_count FROM pinecone_remote_stats('idx');"), '500', "cached remote vector count");
+
+# Rows inserted after the build are buffered, and uploaded batch by batch
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql], i % 5 FROM generate_series(501, 750) i;"
+);
+
+# The index returns the exact neighbors, from the remote index and the buffer
+for my $k (1 .. 5)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "neighbors of query $k");
+
+	$expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst WHERE c = 2 ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	$actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT i FROM tst WHERE c = 2 ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "filtered neighbors of query $k");
+}
+
+# A forced parallel plan returns the same neighbors as a sequential scan
+my $parallel = qq(
+	SET enable_seqscan = off;
+	SET parallel_setup_cost = 0;
+	SET parallel_tuple_cost = 0;
+	SET min_parallel_index_scan_size = 0;
+	SET min_parallel_table_scan_size = 0;
+	SET max_parallel_workers_per_gather = 2;
+);
+like($node->safe_psql("postgres", qq(
+	$parallel
+	EXPLAIN (COSTS OFF) SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT $limit;
+)), qr/Gather Merge.*Parallel Index Scan using idx/s, "parallel plan");
+for my $k (1 .. 3)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		$parallel
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "parallel neighbors of query $k");
+}
+
+# A transaction's scans find the rows it has queued but not yet appended to the buffer
+is($node->safe_psql("postgres", qq(
+	BEGIN;
+	INSERT INTO tst VALUES (0, '[0,0,0]', 0);
+	SET LOCAL enable_seqscan = off;
+	SELECT i FROM tst ORDER BY v <-> '[0,0,0]' LIMIT 1;
+	ROLLBACK;
+)), '0', "own inserts before commit");
+
+# A single statement that fills several buffer pages and several batches, appended a page at a time
+$node->safe_psql("postgres", qq(
+	CREATE TABLE bulk (i int4, v vector($dim));
+	INSERT INTO bulk SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10) i;
+	CREATE INDEX bidx ON bulk USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+	INSERT INTO bulk SELECT i, ARRAY[$array_sql] FROM generate_series(11, 1260) i;
+));
+ok($node->poll_query_until("postgres", "SELECT vector_count >= 1200 FROM pinecone_remote_stats('bidx', true);"), "bulk insert uploaded");
+for my $k (1 .. 3)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM bulk ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT i FROM bulk ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "neighbors after a bulk insert $k");
+}
+
+# Hybrid queries order by the sum of the dense inner product and the sparse dot product
+$node->safe_psql("postgres", "CREATE TABLE hyb (i int4, v vector($dim), si int4[], sv float4[]);");
+$node->safe_psql("postgres", qq(
+	INSERT INTO hyb SELECT i, ARRAY[$array_sql], ARRAY[i % 7, 7 + i % 5], ARRAY[random(), random()] FROM generate_series(1, 500) i;
+	CREATE INDEX ON hyb USING pinecone (v vector_ip_ops, si, sv)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+	INSERT INTO hyb SELECT i, ARRAY[$array_sql], ARRAY[i % 7, 7 + i % 5], ARRAY[random(), random()] FROM generate_series(501, 750) i;
+));
+for my $k (1 .. 3)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my @weights = map { rand() } (1 .. 3);
+	my $sparse_query = qq({"indices": [1, 3, 8], "values": [$weights[0], $weights[1], $weights[2]]});
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM hyb ORDER BY (v <#> '$query') - (
+			SELECT coalesce(sum(val::float8 * qv), 0) FROM unnest(si, sv) s(idx, val)
+			JOIN unnest(ARRAY[1, 3, 8], ARRAY[$weights[0], $weights[1], $weights[2]]::float8[]) q(qi, qv) ON idx = qi
+		) LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET pinecone.sparse_query = '$sparse_query';
+		SELECT i FROM hyb ORDER BY v <#> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "hybrid neighbors of query $k");
+
+	# gather merge compares the dense distances, so one participant returns every row
+	$actual = $node->safe_psql("postgres", qq(
+		$parallel
+		SET pinecone.sparse_query = '$sparse_query';
+		SELECT i FROM hyb ORDER BY v <#> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "hybrid neighbors of query $k in a parallel scan");
+}
+like($node->safe_psql("postgres", qq(
+	$parallel
+	SET pinecone.sparse_query = '{"indices": [1], "values": [0.5]}';
+	EXPLAIN (COSTS OFF) SELECT i FROM hyb ORDER BY v <#> '[1,1,1]' LIMIT $limit;
+)), qr/Gather Merge.*Parallel Index Scan using hyb_v_si_sv_idx/s, "parallel hybrid plan");
+
+# merge append would compare the dense distances of the partitions' hybrid results
+$node->safe_psql("postgres", qq(
+	CREATE TABLE hybp (i int4, v vector($dim), si int4[], sv float4[]) PARTITION BY RANGE (i);
+	CREATE TABLE hybp1 PARTITION OF hybp FOR VALUES FROM (1) TO (51);
+	CREATE TABLE hybp2 PARTITION OF hybp FOR VALUES FROM (51) TO (101);
+	INSERT INTO hybp SELECT i, ARRAY[$array_sql], ARRAY[i % 7], ARRAY[random()] FROM generate_series(1, 100) i;
+	CREATE INDEX ON hybp1 USING pinecone (v vector_ip_ops, si, sv)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+	CREATE INDEX ON hybp2 USING pinecone (v vector_ip_ops, si, sv)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+));
+unlike($node->safe_psql("postgres", qq(
+	SET pinecone.sparse_query = '{"indices": [1], "values": [0.5]}';
+	EXPLAIN (COSTS OFF) SELECT i FROM hybp ORDER BY v <#> '[1,1,1]' LIMIT $limit;
+)), qr/Index Scan/, "hybrid query of a partitioned table does not use the index");
+my $dense_order = $node->safe_psql("postgres", qq(
+	SET enable_indexscan = off;
+	SELECT i FROM hybp ORDER BY v <#> '[1,1,1]' LIMIT $limit;
+));
+is($node->safe_psql("postgres", qq(
+	SET pinecone.sparse_query = '{"indices": [1], "values": [0.5]}';
+	SELECT i FROM hybp ORDER BY v <#> '[1,1,1]' LIMIT $limit;
+)), $dense_order, "hybrid query of a partitioned table orders by the dense distance");
+is($node->safe_psql("postgres", qq(
+	SET pinecone.sparse_query = '{"indices": [1], "values": [0.5]}';
+	SELECT i FROM (SELECT i, v FROM hybp1 UNION ALL SELECT i, v FROM hybp2) t ORDER BY v <#> '[1,1,1]' LIMIT $limit;
+)), $dense_order, "hybrid query of a UNION ALL orders by the dense distance");
+is($node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET pinecone.sparse_query = '{"indices": [1], "values": [0.5]}';
+	SELECT count(*) FROM (SELECT i FROM hybp1 ORDER BY v <#> '[1,1,1]' LIMIT $limit) t;
+)), $limit, "hybrid query of a partition on its own");
+
+# The background flusher uploads a partial batch once it is older than the flush_interval
+$node->safe_psql("postgres", qq(
+	CREATE TABLE fi (i int4, v vector($dim));
+	CREATE INDEX fidx ON fi USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2, flush_interval = 1);
+	INSERT INTO fi SELECT i, ARRAY[$array_sql] FROM generate_series(1, 30) i;
+));
+ok($node->poll_query_until("postgres", "SELECT vector_count = 30 FROM pinecone_remote_stats('fidx', true);"), "partial batch uploaded after flush_interval");
+my $fi_query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+is($node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT i FROM fi ORDER BY v <-> '$fi_query' LIMIT $limit;
+)), $node->safe_psql("postgres", qq(
+	SET enable_indexscan = off;
+	SELECT i FROM fi ORDER BY v <-> '$fi_query' LIMIT $limit;
+)), "neighbors after a flush_interval upload");
+
+# A flush that fails at commit leaves the batch in the buffer without failing the commit
+my %existing = map { $_ => 1 } $server->index_names;
+$node->safe_psql("postgres", qq(
+	CREATE TABLE cf (i int4, v vector($dim));
+	CREATE INDEX cfidx ON cf USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 5, requests_per_batch = 1);
+));
+$server->delete_index($_) for grep { !$existing{$_} } $server->index_names;
+my ($cf_ret, $cf_stdout, $cf_stderr) = $node->psql("postgres", "INSERT INTO cf SELECT i, ARRAY[$array_sql] FROM generate_series(1, 20) i;");
+is($cf_ret, 0, "commit succeeds when its flush fails");
+like($cf_stderr, qr/WARNING:  Failed to flush index \d+ to pinecone at commit/, "failed flush reported as a warning");
+is($node->safe_psql("postgres", "SELECT count(*) FROM cf;"), '20', "rows of the failed flush are committed");
+$node->safe_psql("postgres", "DROP TABLE cf;");
+
+# ALTER INDEX SET changes the tuning of a built index at once, but not the ids of its vectors
+$node->safe_psql("postgres", qq(
+	CREATE TABLE ak (i int4, v vector($dim));
+	INSERT INTO ak SELECT i, ARRAY[$array_sql] FROM generate_series(1, 20) i;
+	CREATE INDEX akidx ON ak USING pinecone (v vector_l2_ops) WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}');
+));
+my $ak_count = "SET enable_seqscan = off; SELECT count(*) FROM (SELECT i FROM ak ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT $limit) s;";
+is($node->safe_psql("postgres", $ak_count), $limit, "matches before ALTER INDEX");
+$node->safe_psql("postgres", "ALTER INDEX akidx SET (top_k = 3);");
+is($node->safe_psql("postgres", $ak_count), '3', "ALTER INDEX SET top_k takes effect");
+$node->safe_psql("postgres", "ALTER INDEX akidx SET (compact_ids = true);");
+my ($ak_ret, $ak_stdout, $ak_stderr) = $node->psql("postgres", $ak_count);
+like($ak_stderr, qr/compact_ids of index "akidx" was changed after it was built/, "ALTER INDEX SET compact_ids raises an error");
+$node->safe_psql("postgres", "REINDEX INDEX akidx;");
+is($node->safe_psql("postgres", $ak_count), '3', "REINDEX applies compact_ids");
+$node->safe_psql("postgres", "DROP TABLE ak;");
+
+# With track_updates, vacuum deletes the vectors of deleted rows and of the versions that updates replaced, on any
+# heap page
+%existing = map { $_ => 1 } $server->index_names;
+$node->safe_psql("postgres", qq(
+	CREATE TABLE tu (i int4, v vector($dim)) WITH (autovacuum_enabled = false);
+	INSERT INTO tu SELECT i, ARRAY[$array_sql] FROM generate_series(1, 250) i;
+	CREATE INDEX tuidx ON tu USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', track_updates = true, vectors_per_request = 5, requests_per_batch = 1, flush_interval = 1);
+));
+my ($tu_name) = grep { !$existing{$_} } $server->index_names;
+my $old_ids = $node->safe_psql("postgres", "SELECT string_agg(pinecone_vector_id(ctid), ' ' ORDER BY i) FROM tu WHERE i <= 12 OR i > 240;");
+$node->safe_psql("postgres", "UPDATE tu SET v = ARRAY[$array_sql] WHERE i <= 12;");
+$node->safe_psql("postgres", "DELETE FROM tu WHERE i > 240;");
+cmp_ok($node->safe_psql("postgres", "SELECT count(*) FROM tu WHERE i <= 12 AND (ctid::text::point)[0] > 0;"), '>', 0, "updated rows move to another heap page");
+my $new_ids = join(" ", sort split(/\n/, $node->safe_psql("postgres", "SELECT pinecone_vector_id(ctid) FROM tu;")));
+my $remote_ids = "";
+for (1 .. 300)
+{
+	$node->safe_psql("postgres", "VACUUM tu;");
+	$remote_ids = join(" ", sort $server->vector_ids($tu_name));
+	last if $remote_ids eq $new_ids;
+	select(undef, undef, undef, 0.1);
+}
+is($remote_ids, $new_ids, "the remote index holds the current versions only");
+my %remote = map { $_ => 1 } split(/ /, $remote_ids);
+is(scalar(grep { $remote{$_} } split(/ /, $old_ids)), 0, "the vectors of the replaced and deleted versions are deleted");
+
+# Backpressure counts the buffered rows that are not uploaded yet: past the soft limit inserts are delayed, without
+# an observed upsert rate by the maximum delay, and past the hard limit reject raises an error
+$node->safe_psql("postgres", qq(
+	CREATE TABLE bp (i int4, v vector($dim));
+	CREATE INDEX bpidx ON bp USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 100, requests_per_batch = 10);
+	INSERT INTO bp SELECT i, ARRAY[$array_sql] FROM generate_series(1, 30) i;
+));
+my $bp_settings = "SET pinecone.buffer_soft_limit = 10; SET pinecone.buffer_hard_limit = 40; SET pinecone.backpressure_max_delay = 100;";
+my $bp_start = time();
+$node->safe_psql("postgres", "$bp_settings SET pinecone.backpressure = throttle; INSERT INTO bp SELECT i, ARRAY[$array_sql] FROM generate_series(31, 35) i;");
+cmp_ok(time() - $bp_start, '>=', 0.5, "inserts past the soft limit are delayed");
+my ($bp_ret, $bp_stdout, $bp_stderr) = $node->psql("postgres", "$bp_settings SET pinecone.buffer_hard_limit = 35; SET pinecone.backpressure = reject; INSERT INTO bp VALUES (36, '[0,0,0]');");
+isnt($bp_ret, 0, "inserts past the hard limit are rejected");
+like($bp_stderr, qr/is 35 vectors behind/, "rejected insert reports the backlog");
+$bp_start = time();
+$node->safe_psql("postgres", "$bp_settings SET pinecone.backpressure = reject; SET pinecone.buffer_soft_limit = 100; INSERT INTO bp SELECT i, ARRAY[$array_sql] FROM generate_series(36, 40) i;");
+cmp_ok(time() - $bp_start, '<', 0.5, "inserts below the soft limit are not delayed");
+# a transaction's own rows wait for its commit, so they do not count against it
+$bp_start = time();
+($bp_ret, $bp_stdout, $bp_stderr) = $node->psql("postgres", "$bp_settings SET pinecone.backpressure = reject; SET pinecone.buffer_soft_limit = 100; SET pinecone.buffer_hard_limit = 1000; INSERT INTO bp SELECT i, ARRAY[$array_sql] FROM generate_series(41, 2040) i;");
+is($bp_ret, 0, "a bulk insert larger than the hard limit is not rejected by its own rows");
+cmp_ok(time() - $bp_start, '<', 5, "a bulk insert is not delayed by its own rows");
+
+# A flush uploads the batches around the rows of a running transaction, whose rows are moved to the end of the buffer
+# and uploaded after it commits
+$node->safe_psql("postgres", qq(
+	CREATE TABLE rt (i int4, v vector($dim));
+	CREATE INDEX rtidx ON rt USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 5, requests_per_batch = 2, flush_interval = 1);
+));
+my $rt_count_sql = "SET enable_seqscan = off; SELECT count(*) FROM (SELECT i FROM rt ORDER BY v <-> '[0,0,0]' LIMIT 100) t;";
+# the scan appends the open transaction's rows to the buffer
+my ($rt_in, $rt_out, $rt_err) = ("BEGIN; INSERT INTO rt SELECT i, ARRAY[$array_sql] FROM generate_series(1, 3) i; $rt_count_sql\n", "", "");
+my $rt = IPC::Run::start([ 'psql', '-XAtq', '-d', $node->connstr('postgres') ], '<', \$rt_in, '>', \$rt_out, '2>', \$rt_err);
+$rt->pump while length $rt_in;
+$node->poll_query_until("postgres", "SELECT count(*) = 1 FROM pg_stat_activity WHERE state = 'idle in transaction' AND query LIKE 'SELECT count(*) FROM (SELECT i FROM rt %';");
+$node->safe_psql("postgres", "INSERT INTO rt SELECT i, ARRAY[$array_sql] FROM generate_series(4, 28) i;");
+ok($node->poll_query_until("postgres", "SELECT vector_count = 25 FROM pinecone_remote_stats('rtidx', true);"), "the rows around a running transaction are uploaded");
+is($node->safe_psql("postgres", $rt_count_sql), '25', "queries return the committed rows once");
+$rt_in = "COMMIT;\n";
+$rt->finish;
+is($rt_err, "", "the running transaction commits");
+ok($node->poll_query_until("postgres", "SELECT vector_count = 28 FROM pinecone_remote_stats('rtidx', true);"), "the moved rows are uploaded after their transaction commits");
+is($node->safe_psql("postgres", $rt_count_sql), '28', "queries return the moved rows once");
+
+# With async_provisioning the build buffers the table, and the first flush uploads it once the remote index is ready.
+# Until then scans search the whole buffer, past max_buffer_scan.
+$node->safe_psql("postgres", qq(
+	CREATE TABLE asy (i int4, v vector($dim));
+	INSERT INTO asy SELECT i, ARRAY[$array_sql] FROM generate_series(1, 500) i;
+	CREATE INDEX aidx ON asy USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', async_provisioning = true, vectors_per_request = 50, requests_per_batch = 2, max_buffer_scan = 100);
+));
+is($node->safe_psql("postgres", "SELECT vector_count FROM pinecone_remote_stats('aidx', true);"), '0', "nothing uploaded while provisioning");
+for my $round ("buffered", "flushed")
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM asy ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT i FROM asy ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "neighbors of the $round async index");
+	next if $round eq "flushed";
+	# the background flusher uploads the 7 full batches once the remote index is ready
+	$node->safe_psql("postgres", "INSERT INTO asy SELECT i, ARRAY[$array_sql] FROM generate_series(501, 750) i;");
+	ok($node->poll_query_until("postgres", "SELECT vector_count >= 700 FROM pinecone_remote_stats('aidx', true);"), "uploaded once ready");
+}
+
+# The partitions of a partitioned table share one remote index, in a namespace each
+my $n_remote = $node->safe_psql("postgres", "SELECT count(*) FROM pinecone_indexes();");
+$node->safe_psql("postgres", qq(
+	CREATE TABLE part (i int4, v vector($dim)) PARTITION BY RANGE (i);
+	CREATE TABLE part_1 PARTITION OF part FOR VALUES FROM (1) TO (300);
+	CREATE TABLE part_2 PARTITION OF part FOR VALUES FROM (300) TO (600);
+	CREATE TABLE part_3 PARTITION OF part FOR VALUES FROM (600) TO (1000);
+	INSERT INTO part SELECT i, ARRAY[$array_sql] FROM generate_series(1, 750) i;
+	CREATE INDEX ON part USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', namespace_per_partition = true, vectors_per_request = 50, requests_per_batch = 2);
+	INSERT INTO part SELECT i, ARRAY[$array_sql] FROM generate_series(751, 999) i;
+));
+is($node->safe_psql("postgres", "SELECT count(*) FROM pinecone_indexes();"), $n_remote + 1, "one remote index for the partitions");
+for my $k (1 .. 3)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	for my $where ("", "WHERE i >= 300")
+	{
+		my $expected = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM part $where ORDER BY v <-> '$query' LIMIT $limit;
+		));
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM part $where ORDER BY v <-> '$query' LIMIT $limit;
+		));
+		is($actual, $expected, "partitioned neighbors of query $k $where");
+	}
+}
+
+# A statement only queries together the partitions that its own plan scans, even after an earlier statement of the
+# transaction scanned the others
+my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+my $expected = $node->safe_psql("postgres", qq(
+	SET enable_indexscan = off;
+	SELECT i FROM part WHERE i >= 600 ORDER BY v <-> '$query' LIMIT $limit;
+));
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	BEGIN;
+	SET LOCAL enable_seqscan = off;
+	SET LOCAL client_min_messages = debug1;
+	SELECT count(*) FROM (SELECT i FROM part ORDER BY v <-> '$query' LIMIT $limit) t;
+	SELECT i FROM part WHERE i >= 600 ORDER BY v <-> '$query' LIMIT $limit;
+	COMMIT;
+));
+is(() = $stderr =~ /Querying \d+ partitions/g, 1, "one shared round trip per statement that scans several partitions");
+like($stderr, qr/Querying 3 partitions/, "the partitions of the first statement");
+is($stdout, "$limit\n$expected", "neighbors of a pruned statement after a shared round trip");
+
+done_testing();
@@ -0,0 +1,69 @@
+use strict;
+use warnings;
+use PineconeServer;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+# Queries of a pinecone index on a hot standby, which cannot write the buffer meta page
+if (!PineconeServer::available())
+{
+	plan skip_all => "python3 is required for the pinecone stand-in server";
+}
+
+my $dim = 3;
+my $limit = 10;
+
+my $server = PineconeServer->new;
+my $base_url = $server->base_url;
+
+# Initialize primary and replica
+my $node_primary = get_new_node('primary');
+$node_primary->init(allows_streaming => 1);
+$node_primary->append_conf('postgresql.conf', qq(
+pinecone.base_url = '$base_url'
+pinecone.api_key = 'local'
+));
+$node_primary->start;
+$node_primary->backup('my_backup');
+
+my $node_replica = get_new_node('replica');
+$node_replica->init_from_backup($node_primary, 'my_backup', has_streaming => 1);
+$node_replica->start;
+
+my $array_sql = join(",", ('random()') x $dim);
+$node_primary->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node_primary->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node_primary->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 500) i;"
+);
+$node_primary->safe_psql("postgres", qq(
+	CREATE INDEX idx ON tst USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+));
+
+# Uploaded batches whose liveness only the replica's scans find out, and a buffer that is not yet uploaded
+$node_primary->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(501, 750) i;"
+);
+
+my $applname = $node_replica->name;
+$node_primary->poll_query_until('postgres',
+	"SELECT pg_current_wal_lsn() <= replay_lsn FROM pg_stat_replication WHERE application_name = '$applname';")
+  or die "Timed out while waiting for replica to catch up";
+
+for my $k (1 .. 5)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my $expected = $node_replica->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node_replica->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "neighbors of query $k on the replica");
+}
+
+done_testing();
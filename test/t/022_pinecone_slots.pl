@@ -0,0 +1,84 @@
+use strict;
+use warnings;
+use IPC::Run;
+use PineconeServer;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+# More pinecone indexes than shared memory slots: indexes take over the slots of idle ones, and wait while the only
+# slot is claimed by a flush
+if (!PineconeServer::available())
+{
+	plan skip_all => "python3 is required for the pinecone stand-in server";
+}
+
+my $dim = 3;
+my $limit = 10;
+
+# slow requests keep a flush's claim on the slot for a while
+my $server = PineconeServer->new("--latency-ms", 300);
+my $base_url = $server->base_url;
+
+my $node = get_new_node('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(
+pinecone.base_url = '$base_url'
+pinecone.api_key = 'local'
+pinecone.index_slots = 1
+));
+$node->start;
+
+my $array_sql = join(",", ('random()') x $dim);
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+for my $t ("s1", "s2", "s3")
+{
+	$node->safe_psql("postgres", qq(
+		CREATE TABLE $t (i int4, v vector($dim));
+		INSERT INTO $t SELECT i, ARRAY[$array_sql] FROM generate_series(1, 20) i;
+		CREATE INDEX ${t}_idx ON $t USING pinecone (v vector_l2_ops)
+		WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 5, requests_per_batch = 1);
+	));
+}
+
+# Inserts into the indexes in turn hand the append lock of the single slot from one index to the next
+for my $round (1 .. 2)
+{
+	for my $t ("s1", "s2", "s3")
+	{
+		$node->safe_psql("postgres", "INSERT INTO $t SELECT i, ARRAY[$array_sql] FROM generate_series(1, 3) i;");
+	}
+}
+for my $t ("s1", "s2", "s3")
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM $t ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT i FROM $t ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected, "neighbors of $t after sharing the slot");
+}
+
+# Monitoring reads the slot without taking it over
+is($node->safe_psql("postgres", "SELECT tuples_appended FROM pinecone_index_activity('s3_idx');"), '3', "activity of the index holding the slot");
+is($node->safe_psql("postgres", "SELECT tuples_appended, vectors_flushed FROM pinecone_index_activity('s1_idx');"), '0|0', "activity of an index without a slot");
+is($node->safe_psql("postgres", "SELECT tuples_appended FROM pinecone_index_activity('s3_idx');"), '3', "reading activity keeps the slot");
+
+# An insert that needs the slot while a commit flush of another index holds its claim waits for the flush
+my ($flush_out, $flush_err) = ("", "");
+my $flush = IPC::Run::start(
+	[ 'psql', '-XAtq', '-d', $node->connstr('postgres'), '-c', "INSERT INTO s1 SELECT i, ARRAY[$array_sql] FROM generate_series(1, 12) i;" ],
+	'>', \$flush_out, '2>', \$flush_err);
+$node->poll_query_until("postgres", "SELECT count(*) = 1 FROM pg_stat_activity WHERE query LIKE 'INSERT INTO s1%';");
+$node->safe_psql("postgres", "INSERT INTO s2 SELECT i, ARRAY[$array_sql] FROM generate_series(1, 4) i;");
+$flush->finish;
+is($flush_err, "", "the flush holding the slot completes");
+is($node->safe_psql("postgres", "SELECT tuples_appended FROM pinecone_index_activity('s2_idx');"), '4', "the waiting insert took the slot");
+cmp_ok($node->safe_psql("postgres", "SELECT vector_count FROM pinecone_remote_stats('s1_idx', true);"), '>=', 30, "the flush uploaded its batches");
+is($node->safe_psql("postgres", "SELECT count(*) FROM s2;"), '30', "rows of the waiting insert");
+
+done_testing();
@@ -0,0 +1,71 @@
+use strict;
+use warnings;
+use PineconeServer;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+# Remote requests sent through the request broker, including a call that is canceled while its responses are pending
+if (!PineconeServer::available())
+{
+	plan skip_all => "python3 is required for the pinecone stand-in server";
+}
+
+my $dim = 3;
+my $limit = 10;
+
+# slow enough for a statement timeout to cancel a query in the middle of its call
+my $server = PineconeServer->new("--latency-ms", 300);
+my $base_url = $server->base_url;
+
+my $node = get_new_node('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(
+shared_preload_libraries = 'vector'
+pinecone.base_url = '$base_url'
+pinecone.api_key = 'local'
+pinecone.broker = on
+));
+$node->start;
+
+my $array_sql = join(",", ('random()') x $dim);
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", qq(
+	CREATE TABLE tst (i int4, v vector($dim));
+	INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 500) i;
+	CREATE INDEX idx ON tst USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+	INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(501, 750) i;
+));
+is($node->safe_psql("postgres", "SELECT vector_count >= 700 FROM pinecone_remote_stats('idx', true);"), 't', "uploads through the broker");
+
+# The broker answers the queries of a session
+my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+my $expected = $node->safe_psql("postgres", qq(
+	SET enable_indexscan = off;
+	SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+));
+is($node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+)), $expected, "neighbors through the broker");
+
+# A query canceled while waiting for the broker leaves its responses behind; the next query of the session must not
+# take them for its own
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET statement_timeout = 100;
+	SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT $limit;
+	RESET statement_timeout;
+	SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+), on_error_stop => 0);
+like($stderr, qr/canceling statement due to statement timeout/, "query canceled in the middle of a broker call");
+is($stdout, $expected, "the next query gets its own responses");
+
+# The broker keeps serving other sessions
+is($node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+)), $expected, "neighbors after the cancel");
+
+done_testing();
@@ -0,0 +1,100 @@
+use strict;
+use warnings;
+use PineconeServer;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+# Queries that search the unready buffer through the buffer graph, including ones that need more buffer tuples than
+# ef_search, before and after the graph grows
+if (!PineconeServer::available())
+{
+	plan skip_all => "python3 is required for the pinecone stand-in server";
+}
+
+my $dim = 3;
+my $limit = 10;
+
+# uploaded vectors never become searchable during the test, so every query is answered from the buffer
+my $server = PineconeServer->new("--index-lag-ms", 600000);
+my $base_url = $server->base_url;
+
+my $node = get_new_node('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(
+pinecone.base_url = '$base_url'
+pinecone.api_key = 'local'
+));
+$node->start;
+
+my $array_sql = join(",", ('random()') x $dim);
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", qq(
+	CREATE TABLE tst (i int4, v vector($dim));
+	CREATE INDEX idx ON tst USING pinecone (v vector_l2_ops)
+	WITH (spec = '{"serverless":{"cloud":"aws","region":"us-west-2"}}', vectors_per_request = 50, requests_per_batch = 2);
+));
+for my $i (0 .. 2)
+{
+	$node->safe_psql("postgres", "INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series($i * 100 + 1, $i * 100 + 100) i;");
+}
+
+sub recall
+{
+	my ($expected, $actual) = @_;
+	my %expected_ids = map { $_ => 1 } split("\n", $expected);
+	my $correct = grep { $expected_ids{$_} } split("\n", $actual);
+	return $correct / scalar(keys %expected_ids);
+}
+
+sub exact_neighbors
+{
+	my ($query, $n) = @_;
+	return $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $n;
+	));
+}
+
+for my $k (1 .. 3)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+	my $expected = exact_neighbors($query, $limit);
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET pinecone.buffer_graph = on;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	cmp_ok(recall($expected, $actual), '>=', 0.9, "buffer graph neighbors of query $k");
+
+	# past ef_search, the rest of the buffer is scanned exhaustively
+	my $n = 60;
+	$expected = exact_neighbors($query, $n);
+	$actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET pinecone.buffer_graph = on;
+		SET pinecone.buffer_graph_ef_search = 5;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $n;
+	));
+	my @rows = split("\n", $actual);
+	is(scalar(@rows), $n, "as many rows as the limit past ef_search for query $k");
+	cmp_ok(recall($expected, $actual), '>=', 0.9, "neighbors past ef_search of query $k");
+}
+
+# A session's graph grows by the tuples inserted since its previous scan
+my $query = "[" . join(",", map { rand() } (1 .. $dim)) . "]";
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET pinecone.buffer_graph = on;
+	SET client_min_messages = debug1;
+	SELECT count(*) FROM (SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit) t;
+	INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(301, 400) i;
+	SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+));
+like($stderr, qr/Buffer graph: \d+ segments, inserted 300,/, "the first scan builds the graph");
+like($stderr, qr/Buffer graph: \d+ segments, inserted 100,/, "the next scan only inserts the new tuples");
+my ($count, @actual) = split("\n", $stdout);
+is($count, $limit, "rows of the first scan");
+cmp_ok(recall(exact_neighbors($query, $limit), join("\n", @actual)), '>=', 0.9, "neighbors after the graph grew");
+
+done_testing();